@@ -1658,6 +1658,8 @@ int app_rhizome_clean(const struct cli_parsed *parsed, struct cli_context *conte
   cli_put_long(context, report.deleted_orphan_files, "\n");
   cli_field_name(context, "deleted_orphan_fileblobs", ":");
   cli_put_long(context, report.deleted_orphan_fileblobs, "\n");
+  cli_field_name(context, "deleted_expired_partials", ":");
+  cli_put_long(context, report.deleted_expired_partials, "\n");
   return 0;
 }
 
@@ -2113,6 +2115,67 @@ int app_id_pin(const struct cli_parsed *parsed, struct cli_context *context)
   return handle_pins(parsed, context, 0);
 }
 
+int app_stats(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  int ret=1;
+  struct mdp_header header={
+    .remote.port=MDP_STATS,
+  };
+  int mdp_sock = mdp_socket();
+  if (mdp_sock == -1)
+    return WHY("Cannot create MDP socket");
+  set_nonblock(mdp_sock);
+  unsigned char *payload = NULL;
+
+  if (mdp_send(mdp_sock, &header, NULL, 0) == -1){
+    WHY_perror("mdp_send");
+    goto end;
+  }
+  if ((payload = emalloc(FD_STATS_JSON_MAX + 1)) == NULL)
+    goto end;
+
+  time_ms_t timeout=gettime_ms()+1000;
+  while(1){
+    time_ms_t now = gettime_ms();
+    if (now>timeout){
+      WHYF("Timeout while waiting for response");
+      break;
+    }
+    int p=mdp_poll(mdp_sock, timeout - now);
+    if (p<0){
+      WHY_perror("mdp_poll");
+      break;
+    }
+    if (p==0){
+      WHYF("Timeout while waiting for response");
+      break;
+    }
+    struct mdp_header rev_header;
+    ssize_t len = mdp_recv(mdp_sock, &rev_header, payload, FD_STATS_JSON_MAX);
+    if (len<0){
+      WHY_perror("mdp_recv");
+      continue;
+    }
+    if (rev_header.flags & MDP_FLAG_ERROR){
+      WHY("Operation failed, check the log for more information");
+      break;
+    }
+    if (rev_header.flags & MDP_FLAG_OK){
+      payload[len]='\0';
+      cli_puts(context, (const char *)payload);
+      cli_delim(context, "\n");
+      ret=0;
+    }
+    break;
+  }
+end:
+  free(payload);
+  mdp_close(mdp_sock);
+  return ret;
+}
+
 int app_id_self(const struct cli_parsed *parsed, struct cli_context *context)
 {
   int mdp_sockfd;
@@ -2674,6 +2737,8 @@ struct cli_schema command_line_options[]={
    "Unload any identities protected by this pin and drop all routes to them"},
   {app_revoke_pin, {"id", "relinquish", "sid", "<sid>", NULL}, 0,
    "Unload a specific identity and drop all routes to it"},
+  {app_stats, {"stats",NULL}, 0,
+   "Print the daemon's profiling counters and queue state as JSON"},
   {app_route_print, {"route","print",NULL}, 0,
   "Print the routing table"},
   {app_network_scan, {"scan","[<address>]",NULL}, 0,
@@ -2694,6 +2759,14 @@ struct cli_schema command_line_options[]={
    "Run byte order handling test"},
   {app_slip_test,{"test","slip","[--seed=<N>]","[--duration=<seconds>|--iterations=<N>]",NULL}, 0,
    "Run serial encapsulation test"},
+  {app_scheduler_test,{"test","scheduler","[--seed=<N>]","[--count=<N>]",NULL}, 0,
+   "Run alarm scheduler speed test"},
+  {app_rhizome_db_test,{"test","rhizomedb","[--count=<N>]",NULL}, 0,
+   "Run Rhizome database insert and list speed test with a concurrent reader"},
+  {app_overlay_pool_test,{"test","overlaypool","[--count=<N>]",NULL}, 0,
+   "Run overlay frame and buffer allocation speed test"},
+  {app_overlay_queue_test,{"test","overlayqueue","[--count=<N>]",NULL}, 0,
+   "Run overlay transmit queue speed test with many neighbours"},
 #ifdef HAVE_VOIPTEST
   {app_pa_phone,{"phone",NULL}, 0,
    "Run phone test application"},
@@ -690,6 +690,9 @@ int cf_fmt_socket_type(const char **, const short *typep);
 int cf_opt_encapsulation(short *encapp, const char *text);
 int cf_fmt_encapsulation(const char **, const short *encapp);
 
+int cf_opt_sqlite_synchronous(short *syncp, const char *text);
+int cf_fmt_sqlite_synchronous(const char **, const short *syncp);
+
 extern int cf_limbo;
 extern struct config_main config;
 
@@ -758,6 +758,47 @@ int cf_cmp_encapsulation(const short *a, const short *b)
   return cf_cmp_short(a, b);
 }
 
+int cf_opt_sqlite_synchronous(short *syncp, const char *text)
+{
+  if (strcasecmp(text, "default") == 0) {
+    *syncp = RHIZOME_DB_SYNC_DEFAULT;
+    return CFOK;
+  }
+  if (strcasecmp(text, "off") == 0) {
+    *syncp = RHIZOME_DB_SYNC_OFF;
+    return CFOK;
+  }
+  if (strcasecmp(text, "normal") == 0) {
+    *syncp = RHIZOME_DB_SYNC_NORMAL;
+    return CFOK;
+  }
+  if (strcasecmp(text, "full") == 0) {
+    *syncp = RHIZOME_DB_SYNC_FULL;
+    return CFOK;
+  }
+  return CFINVALID;
+}
+
+int cf_fmt_sqlite_synchronous(const char **textp, const short *syncp)
+{
+  const char *t = NULL;
+  switch (*syncp) {
+    case RHIZOME_DB_SYNC_DEFAULT: t = "default"; break;
+    case RHIZOME_DB_SYNC_OFF:     t = "off"; break;
+    case RHIZOME_DB_SYNC_NORMAL:  t = "normal"; break;
+    case RHIZOME_DB_SYNC_FULL:    t = "full"; break;
+  }
+  if (!t)
+    return CFINVALID;
+  *textp = str_edup(t);
+  return CFOK;
+}
+
+int cf_cmp_sqlite_synchronous(const short *a, const short *b)
+{
+  return cf_cmp_short(a, b);
+}
+
 int cf_opt_pattern_list(struct pattern_list *listp, const char *text)
 {
   struct pattern_list list;
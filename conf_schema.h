@@ -322,6 +322,7 @@ STRUCT(server)
 STRING(256,                 chdir,      "/", absolute_path,, "Absolute path of chdir(2) for server process")
 STRING(256,                 interface_path, "", str_nonempty,, "Path of directory containing interface files, either absolute or relative to instance directory")
 ATOM(bool_t,                respawn_on_crash, 0, boolean,, "If true, server will exec(2) itself on fatal signals, eg SEGV")
+ATOM(int32_t,               batch_budget_ms, 0, int32_nonneg,, "If non-zero, each main loop iteration runs every overdue alarm (for up to this many milliseconds) and every ready file descriptor")
 END_STRUCT
 
 STRUCT(monitor)
@@ -410,6 +411,8 @@ END_STRUCT
 
 STRUCT(rhizome_mdp)
 ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome MDP server is started")
+ATOM(uint64_t,              block_cache_size, 262144, uint64_scaled,, "Bytes of decrypted payload pages kept for answering MDP block requests, zero to disable")
+ATOM(bool_t,                merkle,     1, boolean,, "If true, requests for payload hash trees are answered, otherwise receivers fetch blocks unverified")
 END_STRUCT
 
 STRUCT(rhizome_advertise)
@@ -417,6 +420,17 @@ ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome advertise
 ATOM(uint32_t,              interval,   500, uint32_nonzero,, "Interval between Rhizome advertisements")
 END_STRUCT
 
+STRUCT(rhizome_fetch_queue)
+ATOM(int32_t,               log_size_threshold, -1, int32_nonneg,, "Only payloads smaller than two to this power are queued")
+ATOM(int32_t,               candidates,     -1, int32_nonneg,, "Maximum number of fetches waiting in the queue")
+ATOM(int32_t,               slots,          -1, int32_nonneg,, "Number of fetches from the queue that run at once")
+END_STRUCT
+
+ARRAY(rhizome_fetch_queuelist, NO_DUPLICATES)
+KEY_ATOM(unsigned short, ushort)
+VALUE_SUB_STRUCT(rhizome_fetch_queue)
+END_ARRAY(8)
+
 STRUCT(rhizome)
 ATOM(bool_t,                enable,         1, boolean,, "If true, server opens Rhizome database when starting")
 ATOM(bool_t,                fetch,          1, boolean,, "If false, no new bundles will be fetched from peers")
@@ -425,10 +439,19 @@ ATOM(bool_t,                clean_on_start, 1, boolean,, "If true, Rhizome datab
 STRING(256,                 datastore_path, "", absolute_path,, "Path of rhizome storage directory, absolute or relative to instance directory")
 ATOM(uint64_t,              database_size,  1000000, uint64_scaled,, "Size of database in bytes")
 ATOM(bool_t,                external_blobs, 0, boolean,, "Store rhizome bundles as separate files.")
+ATOM(bool_t,                merkle_hash,    0, boolean,, "If true, added payloads get a hash tree so receivers can verify each block as it arrives")
+ATOM(bool_t,                database_wal,   0, boolean,, "If true, Rhizome database uses write-ahead logging so readers do not block the server")
+ATOM(short,                 database_synchronous, RHIZOME_DB_SYNC_DEFAULT, sqlite_synchronous,, "Rhizome database sync level; default, off, normal or full")
+ATOM(uint64_t,              database_mmap_size, 0, uint64_scaled,, "Bytes of Rhizome database to memory-map, zero to disable (needs SQLite 3.7.17 or later)")
+ATOM(uint64_t,              database_cache_size, 0, uint64_scaled,, "Bytes of SQLite page cache per Rhizome database connection, zero for the SQLite default")
+ATOM(uint32_t,              database_checkpoint_ms, 10000, uint32_nonzero,, "Interval between server checkpoints of the Rhizome write-ahead log")
 
 ATOM(uint64_t,              rhizome_mdp_block_size, 512, uint64_scaled,, "Rhizome MDP block size.")
 ATOM(uint64_t,              idle_timeout,           RHIZOME_IDLE_TIMEOUT, uint64_scaled,, "Rhizome transfer timeout if no data received.")
 ATOM(uint32_t,              fetch_delay_ms,         50, uint32_nonzero,, "Delay from receiving first bundle advert to initiating fetch")
+ATOM(bool_t,                reconcile,              1, boolean,, "If true, BARs are synced by set reconciliation with peers that support it")
+ATOM(uint64_t,              partial_persist_ms,     RHIZOME_PARTIAL_PERSIST_MS, uint64_scaled,, "How long to keep a partly fetched payload to resume from, zero to discard it")
+SUB_STRUCT(rhizome_fetch_queuelist, fetch_queue,)
 SUB_STRUCT(rhizome_direct,  direct,)
 SUB_STRUCT(rhizome_api,     api,)
 SUB_STRUCT(rhizome_http,    http,)
@@ -475,6 +498,7 @@ ATOM(bool_t,                ctsrts,          0, boolean,, "If true, enable CTS/R
 ATOM(int32_t,               uartbps,         57600, int32_rs232baudrate,, "Speed of serial UART link speed (which may be different to serial device link speed)")
 ATOM(int32_t,               throttle,        0, int32_nonneg,, "Limit transmit speed of serial interface (bytes per second)") 
 ATOM(int32_t,               burst_size,      0, int32_nonneg,, "Write no more than this many bytes at a time to a serial interface") 
+ATOM(uint16_t,              batch,           16, uint16_nonzero,, "Read or write up to this many UDP packets per system call, where supported")
 END_STRUCT
 
 ARRAY(interface_list, NO_DUPLICATES)
@@ -215,6 +215,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define ENCAP_OVERLAY 1
 #define ENCAP_SINGLE 2
 
+// values of PRAGMA synchronous; DEFAULT leaves the SQLite setting alone
+#define RHIZOME_DB_SYNC_DEFAULT (-1)
+#define RHIZOME_DB_SYNC_OFF 0
+#define RHIZOME_DB_SYNC_NORMAL 1
+#define RHIZOME_DB_SYNC_FULL 2
+
 // numbers chosen to not conflict with KEYTYPE flags
 #define UNLOCK_REQUEST (0xF0)
 #define UNLOCK_CHALLENGE (0xF1)
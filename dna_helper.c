@@ -112,15 +112,19 @@ static char *reply_bufend = NULL;
 static void
 dna_helper_close_pipes()
 {
+  if (sched_requests.poll.fd != -1) {
+    unwatch(&sched_requests);
+    sched_requests.poll.fd = -1;
+  }
   if (dna_helper_stdin != -1) {
     if (config.debug.dnahelper)
       DEBUGF("DNAHELPER closing stdin pipe fd=%d", dna_helper_stdin);
     close(dna_helper_stdin);
     dna_helper_stdin = -1;
   }
-  if (sched_requests.poll.fd != -1) {
-    unwatch(&sched_requests);
-    sched_requests.poll.fd = -1;
+  if (sched_replies.poll.fd != -1) {
+    unwatch(&sched_replies);
+    sched_replies.poll.fd = -1;
   }
   if (dna_helper_stdout != -1) {
     if (config.debug.dnahelper)
@@ -128,9 +132,9 @@ dna_helper_close_pipes()
     close(dna_helper_stdout);
     dna_helper_stdout = -1;
   }
-  if (sched_replies.poll.fd != -1) {
-    unwatch(&sched_replies);
-    sched_replies.poll.fd = -1;
+  if (sched_errors.poll.fd != -1) {
+    unwatch(&sched_errors);
+    sched_errors.poll.fd = -1;
   }
   if (dna_helper_stderr != -1) {
     if (config.debug.dnahelper)
@@ -138,10 +142,6 @@ dna_helper_close_pipes()
     close(dna_helper_stderr);
     dna_helper_stderr = -1;
   }
-  if (sched_errors.poll.fd != -1) {
-    unwatch(&sched_errors);
-    sched_errors.poll.fd = -1;
-  }
 }
 
 int
@@ -330,10 +330,10 @@ static void monitor_requests(struct sched_ent *alarm)
   if (sched_requests.poll.revents & (POLLHUP | POLLERR | POLLNVAL)) {
     if (config.debug.dnahelper)
       DEBUGF("DNAHELPER closing stdin fd=%d", dna_helper_stdin);
-    close(dna_helper_stdin);
-    dna_helper_stdin = -1;
     unwatch(&sched_requests);
     sched_requests.poll.fd = -1;
+    close(dna_helper_stdin);
+    dna_helper_stdin = -1;
     dna_helper_kill();
   }
   else if (sched_requests.poll.revents & POLLOUT) {
@@ -486,10 +486,10 @@ static void monitor_replies(struct sched_ent *alarm)
   if (sched_replies.poll.revents & (POLLHUP | POLLERR | POLLNVAL)) {
     if (config.debug.dnahelper)
       DEBUGF("DNAHELPER closing stdout fd=%d", dna_helper_stdout);
-    close(dna_helper_stdout);
-    dna_helper_stdout = -1;
     unwatch(&sched_replies);
     sched_replies.poll.fd = -1;
+    close(dna_helper_stdout);
+    dna_helper_stdout = -1;
     dna_helper_kill();
   }
 }
@@ -511,10 +511,10 @@ static void monitor_errors(struct sched_ent *alarm)
   if (sched_errors.poll.revents & (POLLHUP | POLLERR | POLLNVAL)) {
     if (config.debug.dnahelper)
       DEBUGF("DNAHELPER closing stderr fd=%d", dna_helper_stderr);
-    close(dna_helper_stderr);
-    dna_helper_stderr = -1;
     unwatch(&sched_errors);
     sched_errors.poll.fd = -1;
+    close(dna_helper_stderr);
+    dna_helper_stderr = -1;
   }
 }
 
@@ -19,65 +19,157 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "fdqueue.h"
 #include "conf.h"
+#include "mem.h"
+#include "cli.h"
 #include "str.h"
 #include "strbuf.h"
 #include "strbuf_helpers.h"
+#include "net.h"
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #define MAX_WATCHED_FDS 128
 struct pollfd fds[MAX_WATCHED_FDS];
 int fdcount=0;
 struct sched_ent *fd_callbacks[MAX_WATCHED_FDS];
-struct sched_ent *next_alarm=NULL;
-struct sched_ent *next_deadline=NULL;
-struct profile_total poll_stats={NULL,0,"Idle (in poll)",0,0,0};
+struct profile_total poll_stats={.name="Idle (in poll)"};
+struct fd_loop_stats fd_loop_stats;
+
+/* Pending alarms are kept in two binary min-heaps; alarms that are waiting for their .alarm time
+ * are ordered by .alarm, alarms whose .alarm time has passed are ordered by .deadline.
+ * Insertion and removal are O(log n), finding the next alarm to run is O(1).
+ */
+struct sched_heap{
+  const char *name;
+  int by_deadline;
+  struct sched_ent **entries;
+  unsigned count;
+  unsigned size;
+};
+
+static struct sched_heap alarm_heap={.name="alarm", .by_deadline=0};
+static struct sched_heap deadline_heap={.name="deadline", .by_deadline=1};
+static unsigned heap_sequence=0;
 
 #define alloca_alarm_name(alarm) ((alarm)->stats ? alloca_str_toprint((alarm)->stats->name) : "Unnamed")
 
+static inline struct sched_ent *heap_peek(const struct sched_heap *heap)
+{
+  return heap->count ? heap->entries[0] : NULL;
+}
+
+static inline int heap_before(const struct sched_heap *heap, const struct sched_ent *a, const struct sched_ent *b)
+{
+  time_ms_t ta = heap->by_deadline ? a->deadline : a->alarm;
+  time_ms_t tb = heap->by_deadline ? b->deadline : b->alarm;
+  if (ta != tb)
+    return ta < tb;
+  return (int)(a->_heap_seq - b->_heap_seq) < 0;
+}
+
+static inline void heap_set(struct sched_heap *heap, unsigned i, struct sched_ent *alarm)
+{
+  heap->entries[i] = alarm;
+  alarm->_heap_index = i + 1;
+}
+
+static void heap_sift_up(struct sched_heap *heap, unsigned i)
+{
+  struct sched_ent *alarm = heap->entries[i];
+  while (i > 0) {
+    unsigned parent = (i - 1) / 2;
+    if (!heap_before(heap, alarm, heap->entries[parent]))
+      break;
+    heap_set(heap, i, heap->entries[parent]);
+    i = parent;
+  }
+  heap_set(heap, i, alarm);
+}
+
+static void heap_sift_down(struct sched_heap *heap, unsigned i)
+{
+  struct sched_ent *alarm = heap->entries[i];
+  while (1) {
+    unsigned child = i * 2 + 1;
+    if (child >= heap->count)
+      break;
+    if (child + 1 < heap->count && heap_before(heap, heap->entries[child + 1], heap->entries[child]))
+      child++;
+    if (!heap_before(heap, heap->entries[child], alarm))
+      break;
+    heap_set(heap, i, heap->entries[child]);
+    i = child;
+  }
+  heap_set(heap, i, alarm);
+}
+
+static int heap_insert(struct sched_heap *heap, struct sched_ent *alarm)
+{
+  if (heap->count >= heap->size) {
+    unsigned size = heap->size ? heap->size * 2 : 64;
+    struct sched_ent **entries = erealloc(heap->entries, size * sizeof(struct sched_ent *));
+    if (!entries)
+      return WHYF("Failed to grow %s heap to %u entries", heap->name, size);
+    heap->entries = entries;
+    heap->size = size;
+  }
+  alarm->_heap = heap;
+  alarm->_heap_seq = heap_sequence++;
+  heap->entries[heap->count] = alarm;
+  heap_sift_up(heap, heap->count++);
+  return 0;
+}
+
+static void heap_remove(struct sched_heap *heap, struct sched_ent *alarm)
+{
+  unsigned i = alarm->_heap_index - 1;
+  if (i >= heap->count || heap->entries[i] != alarm)
+    FATALF("Alarm %s is not in the %s heap", alloca_alarm_name(alarm), heap->name);
+  struct sched_ent *last = heap->entries[--heap->count];
+  if (last != alarm) {
+    heap_set(heap, i, last);
+    if (i > 0 && heap_before(heap, last, heap->entries[(i - 1) / 2]))
+      heap_sift_up(heap, i);
+    else
+      heap_sift_down(heap, i);
+  }
+  alarm->_heap = NULL;
+  alarm->_heap_index = 0;
+}
+
 void list_alarms()
 {
   DEBUG("Alarms;");
   time_ms_t now = gettime_ms();
-  struct sched_ent *alarm;
+  unsigned i;
   
-  for (alarm = next_deadline; alarm; alarm = alarm->_next)
+  for (i = 0; i < deadline_heap.count; ++i) {
+    struct sched_ent *alarm = deadline_heap.entries[i];
     DEBUGF("%p %s deadline in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->deadline - now);
+  }
   
-  for (alarm = next_alarm; alarm; alarm = alarm->_next)
+  for (i = 0; i < alarm_heap.count; ++i) {
+    struct sched_ent *alarm = alarm_heap.entries[i];
     DEBUGF("%p %s in %"PRId64"ms, deadline in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->alarm - now, alarm->deadline - now);
+  }
   
   DEBUG("File handles;");
-  int i;
-  for (i = 0; i < fdcount; ++i)
-    DEBUGF("%s watching #%d", alloca_alarm_name(fd_callbacks[i]), fds[i].fd);
+  int j;
+  for (j = 0; j < fdcount; ++j)
+    DEBUGF("%s watching #%d", alloca_alarm_name(fd_callbacks[j]), fds[j].fd);
 }
 
 int deadline(struct sched_ent *alarm)
 {
-  struct sched_ent *node = next_deadline, *last = NULL;
   if (alarm->deadline < alarm->alarm)
     alarm->deadline = alarm->alarm;
-  
-  while(node!=NULL){
-    if (node->deadline > alarm->deadline)
-      break;
-    last = node;
-    node = node->_next;
-  }
-  if (last == NULL){
-    next_deadline = alarm;
-  }else{
-    last->_next = alarm;
-  }
-  alarm->_prev = last;
-  if(node!=NULL)
-    node->_prev = alarm;
-  alarm->_next = node;
-  return 0;
+  return heap_insert(&deadline_heap, alarm);
 }
 
 int is_scheduled(const struct sched_ent *alarm)
 {
-  return alarm->_next || alarm->_prev || alarm == next_alarm || alarm == next_deadline;
+  return alarm->_heap != NULL;
 }
 
 // add an alarm to the list of scheduled function calls.
@@ -93,8 +185,6 @@ int _schedule(struct __sourceloc __whence, struct sched_ent *alarm)
     WARNF("schedule() called from %s() %s:%d without supplying an alarm name", 
 	  __whence.function,__whence.file,__whence.line);
 
-  struct sched_ent *node = next_alarm, *last = NULL;
-  
   if (is_scheduled(alarm))
     FATAL("Scheduling an alarm that is already scheduled");
   
@@ -118,23 +208,7 @@ int _schedule(struct __sourceloc __whence, struct sched_ent *alarm)
   if (alarm->alarm <= now)
     return deadline(alarm);
   
-  while(node!=NULL){
-    if (node->alarm > alarm->alarm)
-      break;
-    last = node;
-    node = node->_next;
-  }
-  if (last == NULL){
-    next_alarm = alarm;
-  }else{
-    last->_next=alarm;
-  }
-  alarm->_prev = last;
-  if(node!=NULL)
-    node->_prev = alarm;
-  alarm->_next = node;
-  
-  return 0;
+  return heap_insert(&alarm_heap, alarm);
 }
 
 // remove a function from the schedule before it has fired
@@ -144,24 +218,123 @@ int _unschedule(struct __sourceloc __whence, struct sched_ent *alarm)
   if (config.debug.io)
     DEBUGF("unschedule(alarm=%s)", alloca_alarm_name(alarm));
 
-  struct sched_ent *prev = alarm->_prev;
-  struct sched_ent *next = alarm->_next;
-  
-  if (prev)
-    prev->_next = next;
-  else if(next_alarm==alarm)
-    next_alarm = next;
-  else if(next_deadline==alarm)
-    next_deadline = next;
-  
-  if (next)
-    next->_prev = prev;
-  
-  alarm->_prev = NULL;
-  alarm->_next = NULL;
+  if (alarm->_heap)
+    heap_remove(alarm->_heap, alarm);
+  return 0;
+}
+
+#ifdef USE_EPOLL
+/* The epoll(7) backend keeps the watched descriptors registered with the kernel between calls to
+ * fd_poll(), so each iteration only has to look at the descriptors that are ready.  Watched
+ * descriptors are left in non-blocking mode for as long as they are watched.  Descriptors that
+ * epoll refuses (regular files, eg, dummy interfaces or redirected stdin) are treated the way poll()
+ * treats them: always ready for whatever events were requested.
+ */
+static int epoll_fd=-1;
+static char fd_unpollable[MAX_WATCHED_FDS];
+static int fd_unpollable_count=0;
+
+static uint32_t poll_to_epoll(short events)
+{
+  uint32_t ev=0;
+  if (events & POLLIN) ev|=EPOLLIN;
+  if (events & POLLOUT) ev|=EPOLLOUT;
+  if (events & POLLPRI) ev|=EPOLLPRI;
+  return ev;
+}
+
+/* Each registration records the alarm's position in fds[] and its descriptor, rather than a pointer
+ * to the alarm, so that an event for a descriptor that is no longer watched there can be recognised
+ * without following a pointer to an alarm that may have been freed.
+ */
+static uint64_t epoll_data(int index, int fd)
+{
+  return ((uint64_t)(uint32_t)fd << 32) | (uint32_t)index;
+}
+
+static short epoll_to_poll(uint32_t ev)
+{
+  short events=0;
+  if (ev & EPOLLIN) events|=POLLIN;
+  if (ev & EPOLLOUT) events|=POLLOUT;
+  if (ev & EPOLLPRI) events|=POLLPRI;
+  if (ev & EPOLLERR) events|=POLLERR;
+  if (ev & EPOLLHUP) events|=POLLHUP;
+  return events;
+}
+
+static int fd_backend_add(int index, struct sched_ent *alarm)
+{
+  if (epoll_fd==-1){
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd==-1)
+      return WHY_perror("epoll_create1");
+  }
+  fd_unpollable[index]=0;
+  set_nonblock(alarm->poll.fd);
+  struct epoll_event ev={.events=poll_to_epoll(alarm->poll.events), .data.u64=epoll_data(index, alarm->poll.fd)};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, alarm->poll.fd, &ev)==-1){
+    if (errno!=EPERM)
+      return WHYF_perror("epoll_ctl(%d,EPOLL_CTL_ADD,%d)", epoll_fd, alarm->poll.fd);
+    fd_unpollable[index]=1;
+    fd_unpollable_count++;
+  }
+  return 0;
+}
+
+static int fd_backend_update(int index, struct sched_ent *alarm)
+{
+  if (fds[index].fd!=alarm->poll.fd){
+    // the alarm has been given a new descriptor while it was being watched
+    if (fd_unpollable[index])
+      fd_unpollable_count--;
+    else if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fds[index].fd, NULL)==-1 && errno!=EBADF && errno!=ENOENT)
+      WHYF_perror("epoll_ctl(%d,EPOLL_CTL_DEL,%d)", epoll_fd, fds[index].fd);
+    return fd_backend_add(index, alarm);
+  }
+  if (fd_unpollable[index])
+    return 0;
+  struct epoll_event ev={.events=poll_to_epoll(alarm->poll.events), .data.u64=epoll_data(index, alarm->poll.fd)};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, alarm->poll.fd, &ev)==-1)
+    return WHYF_perror("epoll_ctl(%d,EPOLL_CTL_MOD,%d)", epoll_fd, alarm->poll.fd);
   return 0;
 }
 
+static void fd_backend_remove(int index)
+{
+  if (fd_unpollable[index]){
+    fd_unpollable_count--;
+    fd_unpollable[index]=0;
+  // a descriptor that has already been closed has already left the epoll set
+  }else if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fds[index].fd, NULL)==-1 && errno!=EBADF && errno!=ENOENT)
+    WHYF_perror("epoll_ctl(%d,EPOLL_CTL_DEL,%d)", epoll_fd, fds[index].fd);
+}
+
+// fds[from] has already been copied to fds[to]
+static void fd_backend_move(int to, int from)
+{
+  fd_unpollable[to]=fd_unpollable[from];
+  fd_unpollable[from]=0;
+  if (fd_unpollable[to])
+    return;
+  struct epoll_event ev={.events=poll_to_epoll(fds[to].events), .data.u64=epoll_data(to, fds[to].fd)};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fds[to].fd, &ev)==-1)
+    WHYF_perror("epoll_ctl(%d,EPOLL_CTL_MOD,%d)", epoll_fd, fds[to].fd);
+}
+#endif
+
+/* Descriptors reported ready by the last poll, in the order their callbacks will be called.  If a
+ * callback unwatches an alarm that is still waiting in this list, its entry is cleared so that the
+ * (possibly freed) alarm is not called.
+ */
+struct fd_ready{
+  struct sched_ent *alarm;
+  int fd;
+  short revents;
+};
+static struct fd_ready fd_ready[MAX_WATCHED_FDS];
+static int fd_ready_count=0;
+
 // start watching a file handle, call this function again if you wish to change the event mask
 int _watch(struct __sourceloc __whence, struct sched_ent *alarm)
 {
@@ -178,11 +351,19 @@ int _watch(struct __sourceloc __whence, struct sched_ent *alarm)
     // updating event flags
     if (config.debug.io)
       DEBUGF("Updating watch %s, #%d for %d", alloca_alarm_name(alarm), alarm->poll.fd, alarm->poll.events);
+#ifdef USE_EPOLL
+    if (fd_backend_update(alarm->_poll_index, alarm)==-1)
+      return -1;
+#endif
   }else{
     if (config.debug.io)
       DEBUGF("Adding watch %s, #%d for %d", alloca_alarm_name(alarm), alarm->poll.fd, alarm->poll.events);
     if (fdcount>=MAX_WATCHED_FDS)
       return WHY("Too many file handles to watch");
+#ifdef USE_EPOLL
+    if (fd_backend_add(fdcount, alarm)==-1)
+      return -1;
+#endif
     fd_callbacks[fdcount]=alarm;
     alarm->poll.revents = 0;
     alarm->_poll_index=fdcount;
@@ -202,16 +383,28 @@ int _unwatch(struct __sourceloc __whence, struct sched_ent *alarm)
   if (index <0 || fds[index].fd!=alarm->poll.fd)
     return WHY("Attempted to unwatch a handle that is not being watched");
   
+#ifdef USE_EPOLL
+  fd_backend_remove(index);
+#endif
   fdcount--;
   if (index!=fdcount){
     // squash fds
     fds[index] = fds[fdcount];
     fd_callbacks[index] = fd_callbacks[fdcount];
     fd_callbacks[index]->_poll_index=index;
+#ifdef USE_EPOLL
+    fd_backend_move(index, fdcount);
+#endif
   }
   fds[fdcount].fd=-1;
   fd_callbacks[fdcount]=NULL;
   alarm->_poll_index=-1;
+  
+  int i;
+  for (i = 0; i < fd_ready_count; ++i)
+    if (fd_ready[i].alarm == alarm)
+      fd_ready[i].alarm = NULL;
+  
   if (config.debug.io)
     DEBUGF("%s stopped watching #%d for %d", alloca_alarm_name(alarm), alarm->poll.fd, alarm->poll.events);
   return 0;
@@ -242,22 +435,135 @@ static void call_alarm(struct sched_ent *alarm, int revents)
   OUT();
 }
 
+static void fd_ready_add(struct sched_ent *alarm, int fd, short revents)
+{
+  struct fd_ready *ready = &fd_ready[fd_ready_count++];
+  ready->alarm = alarm;
+  ready->fd = fd;
+  ready->revents = revents;
+}
+
+// wait up to ms milliseconds for watched file handles to become ready, and fill fd_ready[]
+static int fd_wait(int ms)
+{
+  int i, r;
+  fd_ready_count=0;
+#ifdef USE_EPOLL
+  struct epoll_event events[MAX_WATCHED_FDS];
+  if (fd_unpollable_count)
+    ms = 0;
+  r = epoll_wait(epoll_fd, events, MAX_WATCHED_FDS, ms);
+  if (r==-1){
+    if (errno!=EINTR)
+      WHY_perror("epoll_wait");
+    r=0;
+  }
+  for (i = 0; i < r; ++i){
+    int index = (uint32_t)events[i].data.u64;
+    int fd = events[i].data.u64 >> 32;
+    // ignore events for descriptors that are no longer watched in that slot
+    if (index>=fdcount || fds[index].fd!=fd || !fd_callbacks[index])
+      continue;
+    fd_ready_add(fd_callbacks[index], fd, epoll_to_poll(events[i].events));
+  }
+  if (fd_unpollable_count){
+    for (i = 0; i < fdcount; ++i)
+      if (fd_unpollable[i] && (fds[i].events & (POLLIN|POLLOUT)))
+	fd_ready_add(fd_callbacks[i], fds[i].fd, fds[i].events & (POLLIN|POLLOUT));
+  }
+  if (config.debug.io) {
+    strbuf b = strbuf_alloca(1024);
+    for (i = 0; i < fd_ready_count; ++i) {
+      if (i)
+	strbuf_puts(b, ", ");
+      strbuf_sprintf(b, "%d:", fd_ready[i].fd);
+      strbuf_append_poll_events(b, fd_ready[i].revents);
+    }
+    DEBUGF("epoll_wait(fdcount=%d, ms=%d) -> %d (%s)", fdcount, ms, r, strbuf_str(b));
+  }
+#else
+  r = poll(fds, fdcount, ms);
+  if (config.debug.io) {
+    strbuf b = strbuf_alloca(1024);
+    for (i = 0; i < fdcount; ++i) {
+      if (i)
+	strbuf_puts(b, ", ");
+      strbuf_sprintf(b, "%d:", fds[i].fd);
+      strbuf_append_poll_events(b, fds[i].events);
+      strbuf_puts(b, "->");
+      strbuf_append_poll_events(b, fds[i].revents);
+    }
+    DEBUGF("poll(fds=(%s), fdcount=%d, ms=%d) -> %d", strbuf_str(b), fdcount, ms, r);
+  }
+  if (r>0){
+    for (i = fdcount - 1; i >= 0; i--)
+      if (fds[i].revents)
+	fd_ready_add(fd_callbacks[i], fds[i].fd, fds[i].revents);
+  }
+#endif
+  return fd_ready_count;
+}
+
+static void fd_dispatch(struct fd_ready *ready)
+{
+#ifdef USE_EPOLL
+  // an earlier callback may have unwatched this alarm, or replaced its descriptor
+  struct sched_ent *alarm = ready->alarm;
+  if (!alarm || alarm->_poll_index<0 || fd_callbacks[alarm->_poll_index]!=alarm || alarm->poll.fd!=ready->fd)
+    return;
+  call_alarm(alarm, ready->revents);
+#else
+  struct sched_ent *alarm = ready->alarm;
+  /* Call the alarm callback with the socket in non-blocking mode */
+  errno=0;
+  set_nonblock(ready->fd);
+  // Work around OSX behaviour that doesn't set POLLERR on 
+  // devices that have been deconfigured, e.g., a USB serial adapter
+  // that has been removed.
+  if (errno == ENXIO) ready->revents|=POLLERR;
+  call_alarm(alarm, ready->revents);
+  /* The alarm may have closed and unwatched the descriptor, make sure this descriptor still matches */
+  if (ready->alarm && alarm->poll.fd == ready->fd){
+    if (set_block(ready->fd))
+      FATALF("Alarm %p %s has a bad descriptor that wasn't closed!", alarm, alloca_alarm_name(alarm));
+  }
+#endif
+}
+
+static void fd_loop_tally(unsigned alarm_calls, unsigned io_calls)
+{
+  unsigned calls = alarm_calls + io_calls;
+  unsigned bucket = 0;
+  while (calls >> bucket && bucket < FD_LOOP_HISTOGRAM_BUCKETS - 1)
+    bucket++;
+  fd_loop_stats.loops++;
+  fd_loop_stats.alarm_calls += alarm_calls;
+  fd_loop_stats.io_calls += io_calls;
+  if (calls > fd_loop_stats.max_calls)
+    fd_loop_stats.max_calls = calls;
+  fd_loop_stats.histogram[bucket]++;
+}
+
 int fd_poll()
 {
   IN();
-  int i, r=0;
+  int i;
   int ms=60000;
   time_ms_t now = gettime_ms();
   
+  struct sched_ent *next_alarm = heap_peek(&alarm_heap);
+  struct sched_ent *next_deadline = heap_peek(&deadline_heap);
+  
   if (!next_alarm && !next_deadline && fdcount==0)
     RETURN(0);
   
   /* move alarms that have elapsed to the deadline queue */
   while (next_alarm!=NULL&&next_alarm->alarm <=now){
-    struct sched_ent *alarm = next_alarm;
-    unschedule(alarm);
-    deadline(alarm);
+    heap_remove(&alarm_heap, next_alarm);
+    deadline(next_alarm);
+    next_alarm = heap_peek(&alarm_heap);
   }
+  next_deadline = heap_peek(&deadline_heap);
   
   /* work out how long we can block in poll */
   if (next_deadline)
@@ -274,23 +580,11 @@ int fd_poll()
     struct call_stats call_stats;
     call_stats.totals=&poll_stats;
     fd_func_enter(__HERE__, &call_stats);
+    fd_ready_count=0;
     if (fdcount==0){
       sleep_ms(ms);
     }else{
-      r = poll(fds, fdcount, ms);
-      if (config.debug.io) {
-	strbuf b = strbuf_alloca(1024);
-	int i;
-	for (i = 0; i < fdcount; ++i) {
-	  if (i)
-	    strbuf_puts(b, ", ");
-	  strbuf_sprintf(b, "%d:", fds[i].fd);
-	  strbuf_append_poll_events(b, fds[i].events);
-	  strbuf_puts(b, "->");
-	  strbuf_append_poll_events(b, fds[i].revents);
-	}
-	DEBUGF("poll(fds=(%s), fdcount=%d, ms=%d) -> %d", strbuf_str(b), fdcount, ms, r);
-      }
+      fd_wait(ms);
     }
     fd_func_exit(__HERE__, &call_stats);
     now=gettime_ms();
@@ -299,49 +593,161 @@ int fd_poll()
   // Reading new data takes priority over everything else
   // Are any handles marked with POLLIN?
   int in_count=0;
-  if (r>0){
-    for (i=0;i<fdcount;i++)
-      if (fds[i].revents & POLLIN)
-        in_count++;
+  for (i=0;i<fd_ready_count;i++)
+    if (fd_ready[i].revents & POLLIN)
+      in_count++;
+
+  unsigned alarm_calls=0, io_calls=0;
+  
+  if (config.server.batch_budget_ms > 0){
+    /* run every alarm that was already due when we started, until we run out of time; alarms
+       that are scheduled again while we run have a later insertion sequence, and once one of them
+       reaches the front of the heap the rest of the batch waits for the next iteration */
+    time_ms_t stop = now + config.server.batch_budget_ms;
+    unsigned batch_seq = heap_sequence;
+    while ((next_deadline = heap_peek(&deadline_heap))
+	&& (int)(next_deadline->_heap_seq - batch_seq) < 0){
+      unschedule(next_deadline);
+      call_alarm(next_deadline, 0);
+      alarm_calls++;
+      if (gettime_ms() >= stop)
+	break;
+    }
+    /* then every ready descriptor, reads first */
+    for (i=0;i<fd_ready_count;i++){
+      if (fd_ready[i].alarm && (fd_ready[i].revents&POLLIN)){
+	fd_dispatch(&fd_ready[i]);
+	io_calls++;
+      }
+    }
+    for (i=0;i<fd_ready_count;i++){
+      if (fd_ready[i].alarm && !(fd_ready[i].revents&POLLIN)){
+	fd_dispatch(&fd_ready[i]);
+	io_calls++;
+      }
+    }
+    fd_ready_count=0;
+    fd_loop_tally(alarm_calls, io_calls);
+    RETURN(1);
   }
 
   /* call one alarm function, but only if its deadline time has elapsed OR there is no incoming file activity */
+  next_deadline = heap_peek(&deadline_heap);
   if (next_deadline && (next_deadline->deadline <=now || (in_count==0))){
     struct sched_ent *alarm = next_deadline;
     unschedule(alarm);
     call_alarm(alarm, 0);
+    alarm_calls++;
     now=gettime_ms();
 
     // after running a timed alarm, unless we already know there is data to read we want to check for more incoming IO before we send more outgoing.
-    if (in_count==0)
+    if (in_count==0){
+      fd_ready_count=0;
+      fd_loop_tally(alarm_calls, io_calls);
       RETURN(1);
+    }
   }
   
   /* If file descriptors are ready, then call the appropriate functions */
-  if (r>0) {
-    for(i=fdcount -1;i>=0;i--){
-      if (fds[i].revents) {
-        // if any handles have POLLIN set, don't process any other handles
-        if (!(fds[i].revents&POLLIN || in_count==0))
-          continue;
-
-	int fd = fds[i].fd;
-	/* Call the alarm callback with the socket in non-blocking mode */
-	errno=0;
-	set_nonblock(fd);
-	// Work around OSX behaviour that doesn't set POLLERR on 
-	// devices that have been deconfigured, e.g., a USB serial adapter
-	// that has been removed.
-	if (errno == ENXIO) fds[i].revents|=POLLERR;
-	call_alarm(fd_callbacks[i], fds[i].revents);
-	/* The alarm may have closed and unwatched the descriptor, make sure this descriptor still matches */
-	if (i<fdcount && fds[i].fd == fd){
-	  if (set_block(fds[i].fd))
-	    FATALF("Alarm %p %s has a bad descriptor that wasn't closed!", fd_callbacks[i], alloca_alarm_name(fd_callbacks[i]));
-	}
-      }
-    }
+  for (i=0;i<fd_ready_count;i++){
+    // the alarm may have been unwatched by an earlier callback
+    if (!fd_ready[i].alarm)
+      continue;
+    // if any handles have POLLIN set, don't process any other handles
+    if (!(fd_ready[i].revents&POLLIN || in_count==0))
+      continue;
+    fd_dispatch(&fd_ready[i]);
+    io_calls++;
   }
+  fd_ready_count=0;
+  fd_loop_tally(alarm_calls, io_calls);
   RETURN(1);
   OUT();
 }
+
+static struct profile_total scheduler_test_stats={.name="scheduler_test"};
+static time_ms_t scheduler_test_last;
+static int scheduler_test_disorder;
+
+static void scheduler_test_alarm(struct sched_ent *alarm)
+{
+  if (alarm->deadline < scheduler_test_last)
+    scheduler_test_disorder++;
+  scheduler_test_last = alarm->deadline;
+}
+
+int app_scheduler_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *seed = NULL;
+  const char *count_arg = NULL;
+  if (   cli_arg(parsed, "--seed", &seed, cli_uint, NULL) == -1
+      || cli_arg(parsed, "--count", &count_arg, cli_uint, NULL) == -1)
+    return -1;
+  if (seed)
+    srandom(atoi(seed));
+  unsigned count = count_arg ? atoi(count_arg) : 100000;
+  if (count == 0)
+    return WHY("--count must be greater than zero");
+  struct sched_ent *alarms = emalloc_zero(count * sizeof(struct sched_ent));
+  struct sched_ent **order = emalloc(count * sizeof(struct sched_ent *));
+  if (!alarms || !order) {
+    if (alarms) free(alarms);
+    if (order) free(order);
+    return -1;
+  }
+  unsigned i;
+  for (i = 0; i < count; ++i) {
+    alarms[i].function = scheduler_test_alarm;
+    alarms[i].stats = &scheduler_test_stats;
+    order[i] = &alarms[i];
+  }
+  // unschedule in a random order, so removals come from all over the heap
+  for (i = count - 1; i > 0; --i) {
+    unsigned j = random() % (i + 1);
+    struct sched_ent *t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+  
+  time_ms_t now = gettime_ms();
+  time_ms_t start = gettime_ms();
+  for (i = 0; i < count; ++i) {
+    alarms[i].alarm = now + 60000 + random() % 3600000;
+    alarms[i].deadline = alarms[i].alarm + random() % 1000;
+    schedule(&alarms[i]);
+  }
+  time_ms_t end = gettime_ms();
+  cli_printf(context, "schedule %u alarms took %"PRId64"ms\n", count, (int64_t)(end - start));
+  
+  start = gettime_ms();
+  for (i = 0; i < count; ++i)
+    unschedule(order[i]);
+  end = gettime_ms();
+  cli_printf(context, "unschedule %u alarms took %"PRId64"ms\n", count, (int64_t)(end - start));
+  
+  // alarms that are already due are run by fd_poll() in deadline order
+  now = gettime_ms();
+  for (i = 0; i < count; ++i) {
+    alarms[i].alarm = now - random() % 500;
+    alarms[i].deadline = alarms[i].alarm + random() % 500;
+    schedule(&alarms[i]);
+  }
+  scheduler_test_last = 0;
+  scheduler_test_disorder = 0;
+  start = gettime_ms();
+  for (i = 0; i < count && heap_peek(&deadline_heap); ++i)
+    fd_poll();
+  end = gettime_ms();
+  cli_printf(context, "dispatch %u alarms took %"PRId64"ms\n", i, (int64_t)(end - start));
+  
+  int ret = 0;
+  if (heap_peek(&deadline_heap) || heap_peek(&alarm_heap))
+    ret = WHY("Alarms remain scheduled after dispatch");
+  else if (scheduler_test_disorder)
+    ret = WHYF("%d alarms were called out of deadline order", scheduler_test_disorder);
+  else
+    cli_printf(context, "Test passed.\n");
+  free(alarms);
+  free(order);
+  return ret;
+}
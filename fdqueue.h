@@ -26,30 +26,43 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "os.h"
 #include "log.h"
 
+/* Each call's own time (excluding children) is counted in histogram[b], where
+ * b is the number of significant bits in the time in nanoseconds, ie, bucket b
+ * holds times from 2^(b-1) up to 2^b - 1 ns.  The last bucket holds everything
+ * longer.
+ */
+#define PROFILE_HISTOGRAM_BUCKETS 40
+
 struct profile_total {
   struct profile_total *_next;
   int _initialised;
   const char *name;
-  time_ms_t max_time;
-  time_ms_t total_time;
-  time_ms_t child_time;
+  time_ns_t max_time;
+  time_ns_t total_time;
+  time_ns_t child_time;
   int calls;
+  unsigned histogram[PROFILE_HISTOGRAM_BUCKETS];
 };
 
 struct call_stats{
-  time_ms_t enter_time;
-  time_ms_t child_time;
+  time_ns_t enter_time;
+  time_ns_t child_time;
   struct profile_total *totals;
   struct call_stats *prev;
 };
 
 struct sched_ent;
+struct sched_heap;
 
 typedef void (*ALARM_FUNCP) (struct sched_ent *alarm);
 
 struct sched_ent{
-  struct sched_ent *_next;
-  struct sched_ent *_prev;
+  // the scheduler heap that currently holds this alarm (NULL if not scheduled),
+  // the alarm's 1-based position in that heap and its insertion order, used to
+  // keep alarms with identical times in first-come first-served order
+  struct sched_heap *_heap;
+  unsigned _heap_index;
+  unsigned _heap_seq;
   
   ALARM_FUNCP function;
   void *context;
@@ -62,6 +75,18 @@ struct sched_ent{
   int _poll_index;
 };
 
+// counts of callbacks made by fd_poll(), cleared by fd_clearstats()
+#define FD_LOOP_HISTOGRAM_BUCKETS 8
+struct fd_loop_stats {
+  unsigned loops;
+  unsigned alarm_calls;
+  unsigned io_calls;
+  unsigned max_calls;
+  // loops that made 0, 1, 2-3, 4-7, ... 64+ callbacks
+  unsigned histogram[FD_LOOP_HISTOGRAM_BUCKETS];
+};
+extern struct fd_loop_stats fd_loop_stats;
+
 int is_scheduled(const struct sched_ent *alarm);
 int _schedule(struct __sourceloc, struct sched_ent *alarm);
 int _unschedule(struct __sourceloc, struct sched_ent *alarm);
@@ -76,12 +101,17 @@ int fd_poll();
 /* function timing routines */
 int fd_clearstats();
 int fd_showstats();
+// large enough for the JSON statistics of a busy daemon, small enough for one local datagram
+#define FD_STATS_JSON_MAX 65000
+struct strbuf;
+int fd_stats_json(struct strbuf *b);
 int fd_checkalarms();
 int fd_func_enter(struct __sourceloc, struct call_stats *this_call);
 int fd_func_exit(struct __sourceloc, struct call_stats *this_call);
+time_ns_t fd_profile_percentile(const struct profile_total *stats, unsigned permille);
 void dump_stack(int log_level);
 
-#define IN() static struct profile_total _aggregate_stats={NULL,0,__FUNCTION__,0,0,0}; \
+#define IN() static struct profile_total _aggregate_stats={.name=__FUNCTION__}; \
     struct call_stats _this_call={.totals=&_aggregate_stats}; \
     fd_func_enter(__HERE__, &_this_call);
 
@@ -20,6 +20,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <assert.h>
 #include <inttypes.h>
 #include <time.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #include "serval.h"
 #include "conf.h"
 #include "http_server.h"
@@ -100,6 +103,7 @@ void http_request_init(struct http_request *r, int sockfd)
   r->request_content_remaining = CONTENT_LENGTH_UNKNOWN;
   r->response.header.content_length = CONTENT_LENGTH_UNKNOWN;
   r->response.header.resource_length = CONTENT_LENGTH_UNKNOWN;
+  r->response.content_fd = -1;
   r->alarm.stats = &http_server_stats;
   r->alarm.function = http_server_poll;
   if (r->idle_timeout == 0)
@@ -1633,6 +1637,37 @@ static void http_request_receive(struct http_request *r)
   http_request_start_response(r);
 }
 
+/* Send up to 'bytes' of response content from the response's file descriptor to the HTTP socket,
+ * advancing the file offset.  Returns the number of bytes sent, zero if the socket cannot take any
+ * more for now, or -1 on error.
+ */
+static ssize_t http_request_sendfile(struct http_request *r, size_t bytes)
+{
+#ifdef HAVE_SYS_SENDFILE_H
+  sigPipeFlag = 0;
+  off_t offset = r->response.content_fd_offset;
+  ssize_t sent = sendfile(r->alarm.poll.fd, r->response.content_fd, &offset, bytes);
+  if (sent == -1) {
+    switch (errno) {
+      case EINTR:
+      case EAGAIN:
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+      case EWOULDBLOCK:
+#endif
+	return 0;
+    }
+    return WHYF_perror("sendfile(%d,%d,%"PRId64",%zu)", r->alarm.poll.fd, r->response.content_fd, (int64_t) r->response.content_fd_offset, bytes);
+  }
+  if (sent == 0)
+    return WHYF("HTTP response file is short of total length (%"PRIhttp_size_t") by %"PRIhttp_size_t" bytes",
+	r->response_length, r->response_length - r->response_sent);
+  r->response.content_fd_offset = offset;
+  return sent;
+#else
+  return WHY("sendfile(2) not supported");
+#endif
+}
+
 /* Write the current contents of the response buffer to the HTTP socket.  When no more bytes can be
  * written, return so that socket polling can continue.  Once all bytes are sent, if there is a
  * content generator function, invoke it to put more content in the response buffer, and write that
@@ -1645,6 +1680,27 @@ static void http_request_send_response(struct http_request *r)
   assert(r->response_sent <= r->response_length);
   while (r->response_sent < r->response_length) {
     assert(r->response_buffer_sent <= r->response_buffer_length);
+    if (r->response_buffer_sent == r->response_buffer_length && r->response.content_fd != -1) {
+      // The headers are all sent, so the kernel copies the rest straight from the file.
+      ssize_t sent = http_request_sendfile(r, r->response_length - r->response_sent);
+      if (sent == -1 || sigPipeFlag) {
+	if (r->debug_flag && *r->debug_flag)
+	  DEBUG("HTTP socket sendfile error, closing connection");
+	http_request_finalise(r);
+	return;
+      }
+      if (sent == 0)
+	return;
+      r->response_sent += (size_t) sent;
+      if (r->debug_flag && *r->debug_flag)
+	DEBUGF("Sent %zu bytes from file to HTTP socket, total %"PRIhttp_size_t", remaining=%"PRIhttp_size_t,
+	    (size_t) sent, r->response_sent, r->response_length - r->response_sent);
+      r->alarm.alarm = gettime_ms() + r->idle_timeout;
+      r->alarm.deadline = r->alarm.alarm + r->idle_timeout;
+      unschedule(&r->alarm);
+      schedule(&r->alarm);
+      continue;
+    }
     if (r->response_buffer_sent == r->response_buffer_length) {
       if (r->response.content_generator) {
 	// Content generator must fill or partly fill response_buffer and set response_buffer_sent
@@ -1829,7 +1885,7 @@ static int _render_response(struct http_request *r)
     assert(hr.header.www_authenticate.scheme != NOAUTH);
   const char *result_string = httpResultString(hr.result_code);
   strbuf sb = strbuf_local(r->response_buffer, r->response_buffer_size);
-  if (hr.content == NULL && hr.content_generator == NULL) {
+  if (hr.content == NULL && hr.content_generator == NULL && hr.content_fd == -1) {
     assert(hr.header.content_length == CONTENT_LENGTH_UNKNOWN);
     assert(hr.header.resource_length == CONTENT_LENGTH_UNKNOWN);
     assert(hr.header.content_range_start == 0);
@@ -1939,7 +1995,7 @@ static size_t http_request_drain(struct http_request *r)
 static void http_request_start_response(struct http_request *r)
 {
   assert(r->phase == RECEIVE);
-  if (r->response.content || r->response.content_generator) {
+  if (r->response.content || r->response.content_generator || r->response.content_fd != -1) {
     assert(r->response.header.content_type != NULL);
     assert(r->response.header.content_type[0]);
   }
@@ -1962,6 +2018,7 @@ static void http_request_start_response(struct http_request *r)
     r->response.result_code = 500;
     r->response.content = NULL;
     r->response.content_generator = NULL;
+    r->response.content_fd = -1;
   }
   // If the response cannot be rendered, then render a 500 Server Error instead.  If that fails,
   // then just close the connection.
@@ -1971,6 +2028,7 @@ static void http_request_start_response(struct http_request *r)
     r->response.result_code = 500;
     r->response.content = NULL;
     r->response.content_generator = NULL;
+    r->response.content_fd = -1;
     http_request_render_response(r);
     if (r->response_buffer == NULL) {
       WHY("Cannot render HTTP 500 Server Error response, closing connection");
@@ -2004,6 +2062,7 @@ void http_request_response_static(struct http_request *r, int result, const char
   r->response.header.content_length = r->response.header.resource_length = bytes;
   r->response.content = body;
   r->response.content_generator = NULL;
+  r->response.content_fd = -1;
   http_request_start_response(r);
 }
 
@@ -2016,6 +2075,27 @@ void http_request_response_generated(struct http_request *r, int result, const c
   r->response.header.content_type = mime_type;
   r->response.content = NULL;
   r->response.content_generator = generator;
+  r->response.content_fd = -1;
+  http_request_start_response(r);
+}
+
+/* Start sending a response whose content is read directly from an open file, starting at the given
+ * file offset, without copying it through the response buffer.  The caller must set the response
+ * content length and range headers, and keep the file open until the request is finalised.  Only
+ * available if the system has sendfile(2); callers must otherwise use a content generator.
+ */
+void http_request_response_sendfile(struct http_request *r, int result, const char *mime_type, int fd, uint64_t offset)
+{
+  assert(r->phase == RECEIVE);
+  assert(mime_type != NULL);
+  assert(mime_type[0]);
+  assert(fd != -1);
+  r->response.result_code = result;
+  r->response.header.content_type = mime_type;
+  r->response.content = NULL;
+  r->response.content_generator = NULL;
+  r->response.content_fd = fd;
+  r->response.content_fd_offset = offset;
   http_request_start_response(r);
 }
 
@@ -2044,5 +2124,6 @@ void http_request_simple_response(struct http_request *r, uint16_t result, const
     r->response.content = strbuf_str(h);
   }
   r->response.content_generator = NULL;
+  r->response.content_fd = -1;
   http_request_start_response(r);
 }
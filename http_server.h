@@ -103,6 +103,8 @@ struct http_response {
   struct http_response_headers header;
   const char *content;
   HTTP_CONTENT_GENERATOR content_generator; // callback to produce more content
+  int content_fd; // if not -1, content is sent from this file by the kernel
+  off_t content_fd_offset; // file offset of the next content byte to send
 };
 
 #define MIME_FILENAME_MAXLEN 127
@@ -140,6 +142,7 @@ int http_request_set_response_bufsize(struct http_request *r, size_t bufsiz);
 void http_request_finalise(struct http_request *r);
 void http_request_response_static(struct http_request *r, int result, const char *mime_type, const char *body, uint64_t bytes);
 void http_request_response_generated(struct http_request *r, int result, const char *mime_type, HTTP_CONTENT_GENERATOR);
+void http_request_response_sendfile(struct http_request *r, int result, const char *mime_type, int fd, uint64_t offset);
 void http_request_simple_response(struct http_request *r, uint16_t result, const char *body);
 
 typedef int (*HTTP_REQUEST_PARSER)(struct http_request *);
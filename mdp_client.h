@@ -55,6 +55,8 @@ struct mdp_identity_request{
 };
 
 #define MDP_IDENTITY 1
+// reply payload is a JSON object of daemon profiling and queue statistics
+#define MDP_STATS 2
 
 #pragma pack(pop)
 
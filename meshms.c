@@ -149,19 +149,18 @@ static int get_database_conversations(const sid_t *my_sid, const sid_t *their_si
     DEBUGF("Looking for conversations for %s, %s", my_sid_hex, their_sid_hex);
   }
   while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
-    const char *id_hex = (const char *)sqlite3_column_text(statement, 0);
+    rhizome_bid_t bid;
+    if (sqlite_column_rhizome_bid_t(statement, 0, &bid) == -1) {
+      WHY("malformed Bundle ID column -- skipping");
+      continue;
+    }
     int64_t version = sqlite3_column_int64(statement, 1);
     int64_t size = sqlite3_column_int64(statement, 2);
     int64_t tail = sqlite3_column_int64(statement, 3);
     const char *sender = (const char *)sqlite3_column_text(statement, 4);
     const char *recipient = (const char *)sqlite3_column_text(statement, 5);
     if (config.debug.meshms)
-      DEBUGF("found id %s, sender %s, recipient %s", id_hex, sender, recipient);
-    rhizome_bid_t bid;
-    if (str_to_rhizome_bid_t(&bid, id_hex) == -1) {
-      WHYF("invalid Bundle ID hex: %s -- skipping", alloca_str_toprint(id_hex));
-      continue;
-    }
+      DEBUGF("found id %s, sender %s, recipient %s", alloca_tohex_rhizome_bid_t(bid), sender, recipient);
     const char *them = recipient;
     sid_t their_sid;
     if (str_to_sid_t(&their_sid, them) == -1) {
@@ -191,7 +190,7 @@ static int get_database_conversations(const sid_t *my_sid, const sid_t *their_si
     p->tail = tail;
     p->size = size;
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   return 0;
 }
 
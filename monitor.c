@@ -195,6 +195,8 @@ void monitor_client_poll(struct sched_ent *alarm)
 	    monitor_close(c);
 	    return;
 	  }
+	  // the rest of the line has not arrived yet
+	  break;
 	}
 	
 	// silently skip all \r characters
@@ -243,9 +245,8 @@ void monitor_client_poll(struct sched_ent *alarm)
 	      monitor_close(c);
 	      return;
 	  }
-	}
-	
-	c->data_offset += bytes;
+	} else
+	  c->data_offset += bytes;
       }
       
       if (c->data_offset < c->data_expected)
@@ -619,10 +620,14 @@ int monitor_tell_clients(char *msg, int msglen, int mask)
   for(i=monitor_socket_count -1;i>=0;i--) {
     if (monitor_sockets[i].flags & mask) {
       // DEBUG("Writing AUDIOPACKET to client");
-      if ( set_nonblock(monitor_sockets[i].alarm.poll.fd) == -1
-	|| write_all_nonblock(monitor_sockets[i].alarm.poll.fd, msg, msglen) == -1
-	|| set_block(monitor_sockets[i].alarm.poll.fd) == -1
-      ) {
+      int fd = monitor_sockets[i].alarm.poll.fd;
+#ifdef USE_EPOLL
+      // watched descriptors are left non-blocking by the epoll main loop
+      int ret = write_all_nonblock(fd, msg, msglen);
+#else
+      int ret = (set_nonblock(fd) == -1 || write_all_nonblock(fd, msg, msglen) == -1 || set_block(fd) == -1) ? -1 : 0;
+#endif
+      if (ret == -1) {
 	INFOF("Tearing down monitor client #%d", i);
 	monitor_close(&monitor_sockets[i]);
       }
@@ -139,6 +139,32 @@ ssize_t _write_str_nonblock(int fd, const char *str, struct __sourceloc __whence
   return _write_all_nonblock(fd, str, strlen(str), __whence);
 }
 
+/* Find the TTL of a received packet in the control messages returned by recvmsg() or recvmmsg().
+ * Leaves *ttl unchanged if the kernel did not supply one.
+ */
+void recvmsg_ttl(struct msghdr *msg, int *ttl)
+{
+  struct cmsghdr *cmsg;
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (   cmsg->cmsg_level == IPPROTO_IP
+	&& ((cmsg->cmsg_type == IP_RECVTTL) || (cmsg->cmsg_type == IP_TTL))
+	&& cmsg->cmsg_len
+    ) {
+      if (config.debug.packetrx)
+	DEBUGF("  TTL (%p) data location resolves to %p", ttl,CMSG_DATA(cmsg));
+      if (CMSG_DATA(cmsg)) {
+	*ttl = *(unsigned char *) CMSG_DATA(cmsg);
+	if (config.debug.packetrx)
+	  DEBUGF("  TTL of packet is %d", *ttl);
+      } 
+    } else {
+      if (config.debug.packetrx)
+	DEBUGF("I didn't expect to see level=%02x, type=%02x",
+	       cmsg->cmsg_level,cmsg->cmsg_type);
+    }	 
+  }
+}
+
 ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl,
 		    struct sockaddr *recvaddr, socklen_t *recvaddrlen)
 {
@@ -172,27 +198,8 @@ ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl,
   }
 #endif
   
-  if (len > 0) {
-    struct cmsghdr *cmsg;
-    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-      if (   cmsg->cmsg_level == IPPROTO_IP
-	  && ((cmsg->cmsg_type == IP_RECVTTL) || (cmsg->cmsg_type == IP_TTL))
-	  && cmsg->cmsg_len
-      ) {
-	if (config.debug.packetrx)
-	  DEBUGF("  TTL (%p) data location resolves to %p", ttl,CMSG_DATA(cmsg));
-	if (CMSG_DATA(cmsg)) {
-	  *ttl = *(unsigned char *) CMSG_DATA(cmsg);
-	  if (config.debug.packetrx)
-	    DEBUGF("  TTL of packet is %d", *ttl);
-	} 
-      } else {
-	if (config.debug.packetrx)
-	  DEBUGF("I didn't expect to see level=%02x, type=%02x",
-		 cmsg->cmsg_level,cmsg->cmsg_type);
-      }	 
-    }
-  }
+  if (len > 0)
+    recvmsg_ttl(&msg, ttl);
   *recvaddrlen=msg.msg_namelen;
   
   return len;
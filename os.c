@@ -25,6 +25,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <fcntl.h>
 #include <alloca.h>
 #include <dirent.h>
@@ -132,6 +133,21 @@ time_ms_t gettime_ms()
   return nowtv.tv_sec * 1000LL + nowtv.tv_usec / 1000;
 }
 
+time_ns_t gettime_ns()
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+    FATAL_perror("clock_gettime(CLOCK_MONOTONIC)");
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+#else
+  struct timeval nowtv;
+  if (gettimeofday(&nowtv, NULL) == -1)
+    FATAL_perror("gettimeofday");
+  return nowtv.tv_sec * 1000000000LL + nowtv.tv_usec * 1000LL;
+#endif
+}
+
 // Returns sleep time remaining.
 time_ms_t sleep_ms(time_ms_t milliseconds)
 {
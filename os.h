@@ -59,6 +59,16 @@ typedef int64_t time_ms_t;
 time_ms_t gettime_ms();
 time_ms_t sleep_ms(time_ms_t milliseconds);
 
+/* Short intervals, eg, function execution times, are measured in nanoseconds
+ * from an arbitrary starting point.  The gettime_ns() function uses the
+ * monotonic clock where the platform has one, so intervals are not disturbed
+ * by adjustments to the wall clock.  Its value is unrelated to gettime_ms().
+ */
+typedef int64_t time_ns_t;
+#define PRItime_ns_t PRId64
+
+time_ns_t gettime_ns();
+
 #ifndef HAVE_BZERO
 __SERVALDNA_OS_INLINE void bzero(void *buf, size_t len) {
     memset(buf, 0, len);
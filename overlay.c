@@ -131,6 +131,8 @@ schedule(&_sched_##X); }
     rhizome_opendb();
     if (config.rhizome.clean_on_start && !config.rhizome.clean_on_open)
       rhizome_cleanup(NULL);
+    /* Periodically checkpoint the write-ahead log, if there is one */
+    SCHEDULE(rhizome_wal_checkpoint, config.rhizome.database_checkpoint_ms, 1000);
   }
 
   // start the HTTP server if enabled
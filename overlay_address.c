@@ -292,7 +292,7 @@ static int add_explain_response(struct subscriber *subscriber, void *context){
   subscriber->last_explained = now;
 
   if (!response->please_explain){
-    response->please_explain = calloc(sizeof(struct overlay_frame),1);
+    response->please_explain = op_new();
     response->please_explain->payload=ob_new();
     ob_limitsize(response->please_explain->payload, 1024);
   }
@@ -344,7 +344,7 @@ static int find_subscr_buffer(struct decode_context *context, struct overlay_buf
     
     // add the abbreviation you told me about
     if (!context->please_explain){
-      context->please_explain = calloc(sizeof(struct overlay_frame),1);
+      context->please_explain = op_new();
       context->please_explain->payload=ob_new();
       ob_limitsize(context->please_explain->payload, MDP_MTU);
     }
@@ -395,7 +395,7 @@ int overlay_address_parse(struct decode_context *context, struct overlay_buffer
       }else{
 	// add the abbreviation you told me about
 	if (!context->please_explain){
-	  context->please_explain = calloc(sizeof(struct overlay_frame),1);
+	  context->please_explain = op_new();
 	  context->please_explain->payload=ob_new();
 	  ob_limitsize(context->please_explain->payload, MDP_MTU);
 	}
@@ -32,9 +32,132 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 
 
+/*
+ Buffer structs, and the memory they hold up to OB_POOL_MAX_BYTES, are kept on free lists when
+ they are released, so the buffers built and parsed for every packet are recycled instead of going
+ back to malloc(3).  Memory is pooled in power of two size classes, each list holding at most
+ ob_pool_max_free entries; larger buffers are allocated and freed directly.
+ */
+
+#define OB_POOL_MIN_SHIFT 6
+#define OB_POOL_CLASSES 6
+#define OB_POOL_MAX_BYTES (1<<(OB_POOL_MIN_SHIFT+OB_POOL_CLASSES-1))
+
+struct ob_pool_entry{
+  struct ob_pool_entry *next;
+};
+
+static struct ob_pool_entry *ob_free_structs=NULL;
+static unsigned ob_free_struct_count=0;
+static struct ob_pool_entry *ob_free_blocks[OB_POOL_CLASSES];
+static unsigned ob_free_block_count[OB_POOL_CLASSES];
+static unsigned ob_pool_max_free=OB_POOL_MAX_FREE;
+static struct ob_pool_stats ob_stats;
+
+void ob_pool_set_limit(unsigned max_free)
+{
+  ob_pool_max_free = max_free;
+  while (ob_free_struct_count > max_free){
+    struct ob_pool_entry *e = ob_free_structs;
+    ob_free_structs = e->next;
+    ob_free_struct_count--;
+    free(e);
+  }
+  int i;
+  for (i=0;i<OB_POOL_CLASSES;i++){
+    while (ob_free_block_count[i] > max_free){
+      struct ob_pool_entry *e = ob_free_blocks[i];
+      ob_free_blocks[i] = e->next;
+      ob_free_block_count[i]--;
+      free(e);
+    }
+  }
+}
+
+void ob_pool_stats(struct ob_pool_stats *stats)
+{
+  *stats = ob_stats;
+  stats->free_structs = ob_free_struct_count;
+  stats->free_blocks = 0;
+  int i;
+  for (i=0;i<OB_POOL_CLASSES;i++)
+    stats->free_blocks += ob_free_block_count[i];
+}
+
+static struct overlay_buffer *ob_alloc_struct(void)
+{
+  struct overlay_buffer *ret;
+  if (ob_free_structs){
+    struct ob_pool_entry *e = ob_free_structs;
+    ob_free_structs = e->next;
+    ob_free_struct_count--;
+    ob_stats.struct_reuses++;
+    ret = (struct overlay_buffer *)e;
+    bzero(ret, sizeof *ret);
+  }else{
+    ret = calloc(sizeof(struct overlay_buffer),1);
+    if (!ret) return NULL;
+    ob_stats.struct_allocs++;
+  }
+  ob_stats.structs_in_use++;
+  return ret;
+}
+
+static void ob_release_struct(struct overlay_buffer *b)
+{
+  ob_stats.structs_in_use--;
+  if (ob_free_struct_count >= ob_pool_max_free){
+    free(b);
+    return;
+  }
+  struct ob_pool_entry *e = (struct ob_pool_entry *)b;
+  e->next = ob_free_structs;
+  ob_free_structs = e;
+  ob_free_struct_count++;
+}
+
+// the size class of a block, or -1 if it is too big to pool
+static int ob_block_class(int size)
+{
+  int c;
+  for (c=0;c<OB_POOL_CLASSES;c++)
+    if (size == 1<<(OB_POOL_MIN_SHIFT+c))
+      return c;
+  return -1;
+}
+
+static unsigned char *ob_alloc_block(int size)
+{
+  int c = ob_block_class(size);
+  if (c!=-1 && ob_free_blocks[c]){
+    struct ob_pool_entry *e = ob_free_blocks[c];
+    ob_free_blocks[c] = e->next;
+    ob_free_block_count[c]--;
+    ob_stats.block_reuses++;
+    return (unsigned char *)e;
+  }
+  unsigned char *ret = malloc(size);
+  if (ret)
+    ob_stats.block_allocs++;
+  return ret;
+}
+
+static void ob_release_block(unsigned char *block, int size)
+{
+  int c = ob_block_class(size);
+  if (c==-1 || ob_free_block_count[c] >= ob_pool_max_free){
+    free(block);
+    return;
+  }
+  struct ob_pool_entry *e = (struct ob_pool_entry *)block;
+  e->next = ob_free_blocks[c];
+  ob_free_blocks[c] = e;
+  ob_free_block_count[c]++;
+}
+
 struct overlay_buffer *ob_new(void)
 {
-  struct overlay_buffer *ret=calloc(sizeof(struct overlay_buffer),1);
+  struct overlay_buffer *ret=ob_alloc_struct();
   if (!ret) return NULL;
   
   ob_unlimitsize(ret);
@@ -45,7 +168,7 @@ struct overlay_buffer *ob_new(void)
 // index an existing static buffer.
 // and allow other callers to use the ob_ convenience methods for reading and writing up to size bytes.
 struct overlay_buffer *ob_static(unsigned char *bytes, int size){
-  struct overlay_buffer *ret=calloc(sizeof(struct overlay_buffer),1);
+  struct overlay_buffer *ret=ob_alloc_struct();
   if (!ret) return NULL;
   ret->bytes = bytes;
   ret->allocSize = size;
@@ -64,7 +187,7 @@ struct overlay_buffer *ob_slice(struct overlay_buffer *b, int offset, int length
 	return NULL;
   }
       
-  struct overlay_buffer *ret=calloc(sizeof(struct overlay_buffer),1);
+  struct overlay_buffer *ret=ob_alloc_struct();
   if (!ret)
       return NULL;
   ret->bytes = b->bytes+offset;
@@ -76,10 +199,8 @@ struct overlay_buffer *ob_slice(struct overlay_buffer *b, int offset, int length
 }
 
 struct overlay_buffer *ob_dup(struct overlay_buffer *b){
-  struct overlay_buffer *ret=calloc(sizeof(struct overlay_buffer),1);
-  ret->sizeLimit = b->sizeLimit;
-  ret->position = b->position;
-  ret->checkpointLength = b->checkpointLength;
+  struct overlay_buffer *ret=ob_new();
+  if (!ret) return NULL;
   
   if (b->bytes && b->allocSize){
     // duplicate any bytes that might be relevant
@@ -91,19 +212,17 @@ struct overlay_buffer *ob_dup(struct overlay_buffer *b){
     
     ob_append_bytes(ret, b->bytes, byteCount);
   }
+  // the copy is positioned after the bytes that were copied, ready to be sent or appended to
+  ret->sizeLimit = b->sizeLimit;
+  ret->checkpointLength = b->checkpointLength;
   return ret;
 }
 
 int ob_free(struct overlay_buffer *b)
 {
   if (!b) return WHY("Asked to free NULL");
-  if (b->bytes && b->allocated) free(b->allocated);
-  // we're about to free this anyway, why are we clearing it?
-  b->bytes=NULL;
-  b->allocated=NULL;
-  b->allocSize=0;
-  b->sizeLimit=0;
-  free(b);
+  if (b->bytes && b->allocated) ob_release_block(b->allocated, b->allocSize);
+  ob_release_struct(b);
   return 0;
 }
 
@@ -168,8 +287,14 @@ int _ob_makespace(struct __sourceloc __whence, struct overlay_buffer *b,int byte
 	   b,bytes,b->bytes,b->position,b->allocSize);
 
   int newSize=b->position+bytes;
-  if (newSize<64) newSize=64;
-  if (newSize&63) newSize+=64-(newSize&63);
+  // packet buffers are limited to the MTU, so allocate that much at once rather than growing
+  if (b->sizeLimit != -1 && b->sizeLimit <= OB_POOL_MAX_BYTES && newSize < b->sizeLimit)
+    newSize=b->sizeLimit;
+  if (newSize<=OB_POOL_MAX_BYTES) {
+    int size=1<<OB_POOL_MIN_SHIFT;
+    while(size<newSize) size<<=1;
+    newSize=size;
+  }
   if (newSize>1024) {
     if (newSize&1023) newSize+=1024-(newSize&1023);
   }
@@ -203,10 +328,11 @@ int _ob_makespace(struct __sourceloc __whence, struct overlay_buffer *b,int byte
     for(i=0;i<4096;i++) new[newSize+i]=0xbd;
   }
 #else
-  unsigned char *new=malloc(newSize);
+  unsigned char *new=ob_alloc_block(newSize);
+  if (!new) return WHY("malloc() failed");
 #endif
   bcopy(b->bytes,new,b->position);
-  if (b->allocated) free(b->allocated);
+  if (b->allocated) ob_release_block(b->allocated, b->allocSize);
   b->bytes=new;
   b->allocated=new;
   b->allocSize=newSize;
@@ -414,8 +540,8 @@ uint64_t ob_get_ui64(struct overlay_buffer *b)
   uint64_t ret = (uint64_t)b->bytes[b->position] << 56
 	| (uint64_t)b->bytes[b->position +1] << 48
 	| (uint64_t)b->bytes[b->position +2] << 40
-	| (uint64_t)b->bytes[b->position +3] << 36
-	| b->bytes[b->position +4] << 24
+	| (uint64_t)b->bytes[b->position +3] << 32
+	| (uint64_t)b->bytes[b->position +4] << 24
 	| b->bytes[b->position +5] << 16
 	| b->bytes[b->position +6] << 8
 	| b->bytes[b->position +7];
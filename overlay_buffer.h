@@ -42,6 +42,23 @@ struct overlay_buffer {
   int var_length_offset;
 };
 
+// freed buffer structs and blocks of each size kept for reuse
+#define OB_POOL_MAX_FREE 256
+
+struct ob_pool_stats {
+  unsigned structs_in_use;
+  unsigned free_structs;
+  unsigned free_blocks;
+  // calls to malloc(3), and allocations satisfied from the free lists instead
+  unsigned struct_allocs;
+  unsigned struct_reuses;
+  unsigned block_allocs;
+  unsigned block_reuses;
+};
+
+void ob_pool_set_limit(unsigned max_free);
+void ob_pool_stats(struct ob_pool_stats *stats);
+
 struct overlay_buffer *ob_new(void);
 struct overlay_buffer *ob_static(unsigned char *bytes, int size);
 struct overlay_buffer *ob_slice(struct overlay_buffer *b, int offset, int length);
@@ -56,6 +56,8 @@ overlay_interface_close(overlay_interface *interface){
   link_interface_down(interface);
   INFOF("Interface %s addr %s is down", 
 	interface->name, inet_ntoa(interface->address.sin_addr));
+  while (interface->tx_batch_count>0)
+    ob_free(interface->tx_batch[--interface->tx_batch_count]);
   unschedule(&interface->alarm);
   unwatch(&interface->alarm);
   close(interface->alarm.poll.fd);
@@ -107,8 +109,25 @@ void interface_state_html(struct strbuf *b, struct overlay_interface *interface)
       strbuf_puts(b, "Socket: File<br>");
       break;
   }
-  strbuf_sprintf(b, "TX: %d<br>", interface->tx_count);
-  strbuf_sprintf(b, "RX: %d<br>", interface->recv_count);
+  strbuf_sprintf(b, "TX: %d in %d calls<br>", interface->tx_count, interface->tx_calls);
+  strbuf_sprintf(b, "RX: %d in %d calls<br>", interface->recv_count, interface->recv_calls);
+}
+
+int overlay_interface_stats_json(struct strbuf *b)
+{
+  int i, n=0;
+  strbuf_putc(b, '[');
+  for (i=0;i<overlay_interface_count;i++){
+    struct overlay_interface *interface = &overlay_interfaces[i];
+    if (interface->state!=INTERFACE_STATE_UP)
+      continue;
+    strbuf_puts(b, n++?",{\"name\":":"{\"name\":");
+    strbuf_json_string(b, interface->name);
+    strbuf_sprintf(b, ",\"batch\":%d,\"rx_packets\":%d,\"rx_calls\":%d,\"tx_packets\":%d,\"tx_calls\":%d}",
+      interface->batch, interface->recv_count, interface->recv_calls, interface->tx_count, interface->tx_calls);
+  }
+  strbuf_putc(b, ']');
+  return 0;
 }
 
 // create a socket with options common to all our UDP sockets
@@ -245,10 +264,90 @@ int overlay_interface_compare(overlay_interface *one, overlay_interface *two)
   return 0;
 }
 
+#ifdef HAVE_RECVMMSG
+// UDP packets read together by recvmmsg()
+static struct {
+  unsigned char packets[OVERLAY_INTERFACE_BATCH_MAX][8096];
+  struct sockaddr addrs[OVERLAY_INTERFACE_BATCH_MAX];
+  struct cmsghdr cmsgs[OVERLAY_INTERFACE_BATCH_MAX][16];
+  struct iovec iov[OVERLAY_INTERFACE_BATCH_MAX];
+  struct mmsghdr msgs[OVERLAY_INTERFACE_BATCH_MAX];
+} rx_batch;
+
+/* Read up to max UDP packets that are waiting on a socket into rx_batch, with a single system call.
+ * Returns the number of packets read, 0 if none were waiting, or -1 on error.
+ */
+static int recv_dgram_batch(int fd, int max)
+{
+  int i;
+  bzero(rx_batch.msgs, sizeof rx_batch.msgs);
+  for (i=0;i<max;i++){
+    rx_batch.iov[i].iov_base = rx_batch.packets[i];
+    rx_batch.iov[i].iov_len = sizeof rx_batch.packets[i];
+    rx_batch.msgs[i].msg_hdr.msg_name = &rx_batch.addrs[i];
+    rx_batch.msgs[i].msg_hdr.msg_namelen = sizeof rx_batch.addrs[i];
+    rx_batch.msgs[i].msg_hdr.msg_iov = &rx_batch.iov[i];
+    rx_batch.msgs[i].msg_hdr.msg_iovlen = 1;
+    rx_batch.msgs[i].msg_hdr.msg_control = rx_batch.cmsgs[i];
+    rx_batch.msgs[i].msg_hdr.msg_controllen = sizeof rx_batch.cmsgs[i];
+  }
+  int count = recvmmsg(fd, rx_batch.msgs, max, MSG_DONTWAIT, NULL);
+  if (count == -1){
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    return WHY_perror("recvmmsg");
+  }
+  return count;
+}
+
+static int rx_batch_ttl(int i)
+{
+  int recvttl=1;
+  recvmsg_ttl(&rx_batch.msgs[i].msg_hdr, &recvttl);
+  return recvttl;
+}
+
+// read the broadcast socket in batches if any interface that shares it wants to
+static int sock_any_batch=1;
+
+static int overlay_interface_read_any_batch(struct sched_ent *alarm)
+{
+  int count = recv_dgram_batch(alarm->poll.fd, sock_any_batch);
+  if (count == -1) {
+    unwatch(alarm);
+    close(alarm->poll.fd);
+    return -1;
+  }
+  char counted[OVERLAY_MAX_INTERFACES];
+  bzero(counted, sizeof counted);
+  int i;
+  for (i=0;i<count;i++){
+    struct in_addr src = ((struct sockaddr_in *)&rx_batch.addrs[i])->sin_addr;
+    overlay_interface *interface = overlay_interface_find(src, 0);
+    if (!interface){
+      if (config.debug.overlayinterfaces)
+	DEBUGF("Could not find matching interface for packet received from %s", inet_ntoa(src));
+      continue;
+    }
+    if (!counted[interface - overlay_interfaces]++)
+      interface->recv_calls++;
+    packetOkOverlay(interface, rx_batch.packets[i], rx_batch.msgs[i].msg_len, rx_batch_ttl(i),
+		    &rx_batch.addrs[i], rx_batch.msgs[i].msg_hdr.msg_namelen);
+  }
+  return 0;
+}
+#endif
+
 // OSX doesn't recieve broadcast packets on sockets bound to an interface's address
 // So we have to bind a socket to INADDR_ANY to receive these packets.
 static void
 overlay_interface_read_any(struct sched_ent *alarm){
+#ifdef HAVE_RECVMMSG
+  if ((alarm->poll.revents & POLLIN) && sock_any_batch > 1){
+    if (overlay_interface_read_any_batch(alarm) == -1)
+      return;
+  }else
+#endif
   if (alarm->poll.revents & POLLIN) {
     int plen=0;
     int recvttl=1;
@@ -278,6 +377,7 @@ overlay_interface_read_any(struct sched_ent *alarm){
 	DEBUGF("Could not find matching interface for packet received from %s", inet_ntoa(src));
       return;
     }
+    interface->recv_calls++;
     packetOkOverlay(interface, packet, plen, recvttl, &src_addr, addrlen);
   }
   if (alarm->poll.revents & (POLLHUP | POLLERR)) {
@@ -339,6 +439,10 @@ overlay_interface_init_socket(int interface_index)
    */
   
   overlay_interface_init_any(interface->port);
+#ifdef HAVE_RECVMMSG
+  if (interface->batch > sock_any_batch)
+    sock_any_batch = interface->batch;
+#endif
   
   interface->alarm.poll.fd = overlay_bind_socket(
       (const struct sockaddr *)&interface->address, 
@@ -423,6 +527,12 @@ overlay_interface_init(const char *name, struct in_addr src_addr, struct in_addr
   interface->debug = ifconfig->debug;
   interface->tx_count=0;
   interface->recv_count=0;
+  interface->tx_calls=0;
+  interface->recv_calls=0;
+  interface->tx_batch_count=0;
+  interface->batch = ifconfig->batch;
+  if (interface->batch > OVERLAY_INTERFACE_BATCH_MAX)
+    interface->batch = OVERLAY_INTERFACE_BATCH_MAX;
 
   // How often do we announce ourselves on this interface?
   int tick_ms=-1;
@@ -575,6 +685,20 @@ cleanup:
 }
 
 static void interface_read_dgram(struct overlay_interface *interface){
+#ifdef HAVE_RECVMMSG
+  if (interface->batch > 1){
+    int i, count = recv_dgram_batch(interface->alarm.poll.fd, interface->batch);
+    if (count == -1) {
+      overlay_interface_close(interface);
+      return;
+    }
+    interface->recv_calls++;
+    for (i=0;i<count && interface->state==INTERFACE_STATE_UP;i++)
+      packetOkOverlay(interface, rx_batch.packets[i], rx_batch.msgs[i].msg_len, rx_batch_ttl(i),
+		      &rx_batch.addrs[i], rx_batch.msgs[i].msg_hdr.msg_namelen);
+    return;
+  }
+#endif
   int plen=0;
   unsigned char packet[8096];
   
@@ -591,6 +715,7 @@ static void interface_read_dgram(struct overlay_interface *interface){
     overlay_interface_close(interface);
     return;
   }
+  interface->recv_calls++;
   
   packetOkOverlay(interface, packet, plen, recvttl, &src_addr, addrlen);
 }
@@ -670,6 +795,7 @@ static void interface_read_file(struct overlay_interface *interface)
     
     if (nread == sizeof packet) {
       interface->recv_offset += nread;
+      interface->recv_calls++;
       if (should_drop(interface, packet.dst_addr) || (packet.pid == getpid() && !interface->local_echo)){
 	if (config.debug.packetrx)
 	  DEBUGF("Ignoring packet from %d, addressed to %s:%d", packet.pid,
@@ -892,6 +1018,73 @@ static void overlay_interface_poll(struct sched_ent *alarm)
   }  
 }
 
+#ifdef HAVE_SENDMMSG
+/* Send every UDP packet queued on this interface with as few system calls as possible.  As for a
+ * single sendto(), failing to send a broadcast packet closes the interface, but failing to send a
+ * unicast packet does not.
+ */
+static int overlay_interface_flush(struct overlay_interface *interface)
+{
+  struct iovec iov[OVERLAY_INTERFACE_BATCH_MAX];
+  struct mmsghdr msgs[OVERLAY_INTERFACE_BATCH_MAX];
+  int count = interface->tx_batch_count;
+  int i, ret=0, close_interface=0;
+  
+  bzero(msgs, sizeof msgs);
+  for (i=0;i<count;i++){
+    iov[i].iov_base = ob_ptr(interface->tx_batch[i]);
+    iov[i].iov_len = ob_position(interface->tx_batch[i]);
+    msgs[i].msg_hdr.msg_name = &interface->tx_batch_addr[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof interface->tx_batch_addr[i];
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  
+  i=0;
+  while (i<count){
+    interface->tx_calls++;
+    int sent = sendmmsg(interface->alarm.poll.fd, &msgs[i], count - i, 0);
+    if (sent == -1){
+      // skip the packet that failed and carry on with the rest
+      WHY_perror("sendmmsg");
+      if (interface->tx_batch_broadcast[i])
+	close_interface=1;
+      ret=-1;
+      i++;
+      continue;
+    }
+    int j;
+    for (j=i;j<i+sent;j++){
+      if (msgs[j].msg_len != iov[j].iov_len){
+	WHYF("sendmmsg only sent %u of %zu bytes", msgs[j].msg_len, iov[j].iov_len);
+	if (interface->tx_batch_broadcast[j])
+	  close_interface=1;
+	ret=-1;
+      }
+    }
+    i+=sent;
+  }
+  
+  for (i=0;i<count;i++)
+    ob_free(interface->tx_batch[i]);
+  interface->tx_batch_count=0;
+  if (close_interface)
+    overlay_interface_close(interface);
+  return ret;
+}
+#endif
+
+void overlay_broadcast_flush()
+{
+#ifdef HAVE_SENDMMSG
+  int i;
+  for (i=0;i<overlay_interface_count;i++){
+    if (overlay_interfaces[i].tx_batch_count>0)
+      overlay_interface_flush(&overlay_interfaces[i]);
+  }
+#endif
+}
+
 int overlay_broadcast_ensemble(struct network_destination *destination, struct overlay_buffer *buffer)
 {
   assert(destination && destination->interface);
@@ -966,6 +1159,7 @@ int overlay_broadcast_ensemble(struct network_destination *destination, struct o
 	} else
 	  DEBUGF("Write to interface %s at offset=%"PRId64, interface->name, (int64_t)fsize);
       }
+      interface->tx_calls++;
       ssize_t nwrite = write(interface->alarm.poll.fd, &packet, sizeof(packet));
       if (nwrite == -1)
 	return WHY_perror("write");
@@ -978,6 +1172,18 @@ int overlay_broadcast_ensemble(struct network_destination *destination, struct o
     {
       if (config.debug.overlayinterfaces) 
 	DEBUGF("Sending %d byte overlay frame on %s to %s",len,interface->name,inet_ntoa(destination->address.sin_addr));
+#ifdef HAVE_SENDMMSG
+      if (interface->batch > 1){
+	int i = interface->tx_batch_count++;
+	interface->tx_batch[i] = buffer;
+	interface->tx_batch_addr[i] = destination->address;
+	interface->tx_batch_broadcast[i] = (destination == interface->destination);
+	if (interface->tx_batch_count >= interface->batch)
+	  return overlay_interface_flush(interface);
+	return 0;
+      }
+#endif
+      interface->tx_calls++;
       int sent=sendto(interface->alarm.poll.fd, 
 		bytes, len, 0, 
 		(struct sockaddr *)&destination->address, sizeof(destination->address));
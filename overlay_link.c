@@ -213,8 +213,7 @@ int overlay_send_probe(struct subscriber *peer, struct network_destination *dest
   if (destination->last_tx + destination->tick_ms > now)
     return -1;
   
-  struct overlay_frame *frame=malloc(sizeof(struct overlay_frame));
-  bzero(frame,sizeof(struct overlay_frame));
+  struct overlay_frame *frame=op_new();
   frame->type=OF_TYPE_DATA;
   frame->source = my_subscriber;
   frame->next_hop = frame->destination = peer;
@@ -375,23 +374,20 @@ int overlay_send_stun_request(struct subscriber *server, struct subscriber *requ
   
   request->last_stun_request=now;
   
-  overlay_mdp_frame mdp;
-  bzero(&mdp, sizeof(mdp));
-  mdp.packetTypeAndFlags=MDP_TX;
+  struct internal_mdp_header header;
+  bzero(&header, sizeof header);
+  header.source = my_subscriber;
+  header.source_port = MDP_PORT_STUN;
+  header.destination = server;
+  header.destination_port = MDP_PORT_STUNREQ;
+  header.queue = OQ_MESH_MANAGEMENT;
   
-  mdp.out.src.sid = my_subscriber->sid;
-  mdp.out.dst.sid = server->sid;
-  mdp.out.src.port=MDP_PORT_STUN;
-  mdp.out.dst.port=MDP_PORT_STUNREQ;
-  mdp.out.queue=OQ_MESH_MANAGEMENT;
-  
-  struct overlay_buffer *payload = ob_static(mdp.out.payload, sizeof(mdp.out.payload));
+  struct overlay_buffer *payload = overlay_mdp_payload(&header);
+  if (!payload)
+    return -1;
   overlay_address_append(NULL, payload, request);
-  mdp.out.payload_length=ob_position(payload);
   if (config.debug.overlayrouting)
     DEBUGF("Sending STUN request to %s", alloca_tohex_sid_t(server->sid));
-  overlay_mdp_dispatch(&mdp,0 /* system generated */,
-		       NULL,0);
-  ob_free(payload);
+  overlay_mdp_send_payload(&header, payload);
   return 0;
 }
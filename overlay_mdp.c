@@ -117,6 +117,7 @@ int overlay_mdp_setup_sockets()
 
 #define MDP_MAX_BINDINGS 100
 #define MDP_MAX_SOCKET_NAME_LEN 110
+#define MDP_PAYLOAD_BYTES (sizeof ((overlay_mdp_frame *)NULL)->out.payload)
 
 struct mdp_binding{
   struct subscriber *subscriber;
@@ -372,7 +373,8 @@ int overlay_saw_mdp_containing_frame(struct overlay_frame *f, time_ms_t now)
      Take payload from mdp frame itself.
   */
   overlay_mdp_frame mdp;
-  bzero(&mdp, sizeof(overlay_mdp_frame));
+  // only the header needs clearing, the payload is filled in up to its length
+  bzero(&mdp, &mdp.in.payload[0] - (unsigned char *)&mdp);
   
   mdp.in.queue = f->queue;
   mdp.in.ttl = f->ttl;
@@ -616,6 +618,30 @@ static struct overlay_buffer * encrypt_payload(
   return ret;
 }
 
+// the crypto modifiers for a combination of MDP_NOCRYPT and MDP_NOSIGN flags, or -1
+static int overlay_mdp_modifiers(int flags)
+{
+  switch(flags&(MDP_NOCRYPT|MDP_NOSIGN)) {
+  case 0:
+    // default to encrypted and authenticated
+    return OF_CRYPTO_SIGNED|OF_CRYPTO_CIPHERED;
+  case MDP_NOCRYPT: 
+    // sign it, but don't encrypt it.
+    return OF_CRYPTO_SIGNED;
+  case MDP_NOSIGN|MDP_NOCRYPT:
+    // just send the payload unmodified
+    return 0;
+  case MDP_NOSIGN: 
+    /* ciphered, but not signed.
+     This means we don't use CryptoBox, but rather a more compact means
+     of representing the ciphered stream segment.
+     */
+     // fall through
+  default:
+    return -1;
+  }
+}
+
 // encrypt or sign the plaintext, then queue the frame for transmission.
 int overlay_send_frame(struct overlay_frame *frame, struct overlay_buffer *plaintext){
   
@@ -631,8 +657,8 @@ int overlay_send_frame(struct overlay_frame *frame, struct overlay_buffer *plain
   case OF_CRYPTO_SIGNED|OF_CRYPTO_CIPHERED:
     /* crypted and signed (using CryptoBox authcryption primitive) */
     frame->payload = encrypt_payload(frame->source, frame->destination, ob_ptr(plaintext), ob_position(plaintext));
+    ob_free(plaintext);
     if (!frame->payload){
-      ob_free(plaintext);
       op_free(frame);
       return -1;
     }
@@ -665,6 +691,26 @@ int overlay_send_frame(struct overlay_frame *frame, struct overlay_buffer *plain
   return 0;
 }
 
+// build an overlay frame around a plaintext MDP payload and queue it
+static int overlay_mdp_queue_plaintext(struct subscriber *source, struct subscriber *destination,
+				       int ttl, int queue, int modifiers, struct overlay_buffer *plaintext)
+{
+  struct overlay_frame *frame = op_new();
+  if (!frame){
+    ob_free(plaintext);
+    return -1;
+  }
+  
+  frame->source = source;
+  frame->destination = destination;
+  frame->ttl = ttl;
+  frame->queue = queue;
+  frame->type=OF_TYPE_DATA;
+  frame->modifiers=modifiers;
+  
+  return overlay_send_frame(frame, plaintext);
+}
+
 /* Construct MDP packet frame from overlay_mdp_frame structure
    (need to add return address from bindings list, and copy
    payload etc).
@@ -743,30 +789,9 @@ int overlay_mdp_dispatch(overlay_mdp_frame *mdp,int userGeneratedFrameP,
     }
   }
   
-  int modifiers=0;
-  
-  switch(mdp->packetTypeAndFlags&(MDP_NOCRYPT|MDP_NOSIGN)) {
-  case 0:
-    // default to encrypted and authenticated
-    modifiers=OF_CRYPTO_SIGNED|OF_CRYPTO_CIPHERED;
-    break;
-  case MDP_NOCRYPT: 
-    // sign it, but don't encrypt it.
-    modifiers=OF_CRYPTO_SIGNED;
-    break;
-  case MDP_NOSIGN|MDP_NOCRYPT:
-    // just send the payload unmodified
-    modifiers=0; 
-    break;
-  case MDP_NOSIGN: 
-    /* ciphered, but not signed.
-     This means we don't use CryptoBox, but rather a more compact means
-     of representing the ciphered stream segment.
-     */
-     // fall through
-  default:
+  int modifiers=overlay_mdp_modifiers(mdp->packetTypeAndFlags);
+  if (modifiers==-1)
     RETURN(WHY("Not implemented"));
-  };
   
   // copy the plain text message into a new buffer, with the wire encoded port numbers
   struct overlay_buffer *plaintext=ob_new();
@@ -782,23 +807,80 @@ int overlay_mdp_dispatch(overlay_mdp_frame *mdp,int userGeneratedFrameP,
     RETURN(-1);
   }
   
-  /* Prepare the overlay frame for dispatch */
-  struct overlay_frame *frame = emalloc_zero(sizeof(struct overlay_frame));
-  if (!frame){
+  RETURN(overlay_mdp_queue_plaintext(source, destination, mdp->out.ttl, mdp->out.queue, modifiers, plaintext));
+  OUT();
+}
+
+/* Internal MDP frames are built directly into a pooled buffer that starts with the wire encoded
+ * port numbers, so only the bytes that are used get written, and they are not copied again before
+ * they are signed or encrypted.  The buffer is limited to the payload size of an overlay_mdp_frame.
+ */
+struct overlay_buffer *overlay_mdp_payload(const struct internal_mdp_header *header)
+{
+  struct overlay_buffer *plaintext=ob_new();
+  if (!plaintext)
+    return NULL;
+  if (overlay_mdp_encode_ports(plaintext, header->destination_port, header->source_port)
+    || ob_limitsize(plaintext, ob_position(plaintext) + MDP_PAYLOAD_BYTES)){
     ob_free(plaintext);
+    return NULL;
+  }
+  return plaintext;
+}
+
+// send a payload from overlay_mdp_payload(), which is freed whether or not it could be sent
+int overlay_mdp_send_payload(const struct internal_mdp_header *header, struct overlay_buffer *payload)
+{
+  IN();
+  if (!payload)
     RETURN(-1);
+  
+  struct subscriber *source = header->source ? header->source : my_subscriber;
+  if (!source || source->reachable != REACHABLE_SELF){
+    ob_free(payload);
+    RETURN(WHY("Internal MDP frames must be sent from a local identity"));
+  }
+  if (!header->destination && !(header->crypt_flags & MDP_NOCRYPT)){
+    ob_free(payload);
+    RETURN(WHY("Broadcast packets cannot be encrypted"));
+  }
+  int ttl = header->ttl ? header->ttl : PAYLOAD_TTL_DEFAULT;
+  int queue = header->queue ? header->queue : OQ_ORDINARY;
+  if (ttl > PAYLOAD_TTL_MAX){
+    ob_free(payload);
+    RETURN(WHYF("TTL %d out of range", ttl));
+  }
+  int modifiers = overlay_mdp_modifiers(header->crypt_flags);
+  if (modifiers==-1){
+    ob_free(payload);
+    RETURN(WHY("Not implemented"));
   }
   
-  frame->source = source;
-  frame->destination = destination;
-  frame->ttl = mdp->out.ttl;
-  frame->queue = mdp->out.queue;
-  frame->type=OF_TYPE_DATA;
-  frame->prev=NULL;
-  frame->next=NULL;
-  frame->modifiers=modifiers;
+  if (!header->destination || header->destination->reachable == REACHABLE_SELF){
+    /* Addressed to us or broadcast, so process it first, from a copy of just the bytes we wrote */
+    overlay_mdp_frame mdp;
+    bzero(&mdp, &mdp.out.payload[0] - (unsigned char *)&mdp);
+    mdp.packetTypeAndFlags = MDP_TX | (header->crypt_flags & (MDP_NOCRYPT|MDP_NOSIGN));
+    mdp.out.src.sid = source->sid;
+    mdp.out.dst.sid = header->destination ? header->destination->sid : SID_BROADCAST;
+    mdp.out.ttl = ttl;
+    mdp.out.queue = queue;
+    struct overlay_buffer *b = ob_static(ob_ptr(payload), ob_position(payload));
+    if (b){
+      ob_limitsize(b, ob_position(payload));
+      if (overlay_mdp_decode_header(b, &mdp)==0)
+	overlay_saw_mdp_frame(NULL, &mdp, gettime_ms());
+      ob_free(b);
+    }
+    if (header->destination){
+      ob_free(payload);
+      RETURN(0);
+    }
+  }
   
-  RETURN(overlay_send_frame(frame, plaintext));
+  // signing appends to the payload, and the queue limits it to what was written
+  ob_unlimitsize(payload);
+  RETURN(overlay_mdp_queue_plaintext(source, header->destination, ttl, queue, modifiers, payload));
   OUT();
 }
 
@@ -1035,6 +1117,24 @@ static int mdp_process_identity_request(struct mdp_client *client, struct mdp_he
   return 0;
 }
 
+static int mdp_process_stats_request(struct mdp_client *client, struct mdp_header *header)
+{
+  char *buf = emalloc(FD_STATS_JSON_MAX);
+  if (!buf){
+    mdp_reply_error(client, header);
+    return -1;
+  }
+  strbuf b = strbuf_local(buf, FD_STATS_JSON_MAX);
+  int ret = 0;
+  if (fd_stats_json(b) == -1){
+    mdp_reply_error(client, header);
+    ret = WHY("Statistics do not fit in one reply");
+  }else
+    mdp_reply2(client, header, MDP_FLAG_OK, (unsigned char *)buf, strbuf_len(b));
+  free(buf);
+  return ret;
+}
+
 static void mdp_poll2(struct sched_ent *alarm)
 {
   if (alarm->poll.revents & POLLIN) {
@@ -1048,7 +1148,7 @@ static void mdp_poll2(struct sched_ent *alarm)
     
     ssize_t len = recvwithttl(alarm->poll.fd, buffer, sizeof(buffer), &ttl, (struct sockaddr *)&addr, &client.addrlen);
     
-    if (len<=sizeof(struct mdp_header)){
+    if (len<(ssize_t)sizeof(struct mdp_header)){
       WHYF("Expected length %d, got %d from %s", (int)sizeof(struct mdp_header), (int)len, alloca_sockaddr(client.addr, client.addrlen));
       return;
     }
@@ -1066,6 +1166,11 @@ static void mdp_poll2(struct sched_ent *alarm)
 	    DEBUGF("Processing MDP_IDENTITY from %s", alloca_sockaddr(client.addr, client.addrlen));
 	  mdp_process_identity_request(&client, header, payload, payload_len);
 	  break;
+	case MDP_STATS:
+	  if (config.debug.mdprequests)
+	    DEBUGF("Processing MDP_STATS from %s", alloca_sockaddr(client.addr, client.addrlen));
+	  mdp_process_stats_request(&client, header);
+	  break;
 	default:
 	  mdp_reply_error(&client, header);
 	  WHY("Unknown port number");
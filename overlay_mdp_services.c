@@ -29,7 +29,11 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "crypto.h"
 #include "log.h"
 
-int rhizome_mdp_send_block(struct subscriber *dest, const rhizome_bid_t *bid, uint64_t version, uint64_t fileOffset, uint32_t bitmap, uint16_t blockLength)
+/* Send the blocks of a payload that are not marked in the bitmap, which has 32 blocks per word.
+ * Stops early if the opportunistic queue is nearly full; the receiver will ask again.
+ */
+int rhizome_mdp_send_block(struct subscriber *dest, const rhizome_bid_t *bid, uint64_t version, uint64_t fileOffset,
+			   const uint32_t *bitmap, int bitmap_words, uint16_t blockLength)
 {
   IN();
   if (!is_rhizome_mdp_server_running())
@@ -38,10 +42,10 @@ int rhizome_mdp_send_block(struct subscriber *dest, const rhizome_bid_t *bid, ui
     RETURN(WHYF("Invalid block length %d", blockLength));
 
   if (config.debug.rhizome_tx)
-    DEBUGF("Requested blocks for %s @%"PRIx64" bitmap %x", alloca_tohex_rhizome_bid_t(*bid), fileOffset, bitmap);
+    DEBUGF("Requested blocks for %s @%"PRIx64" bitmap %x (%d words)", alloca_tohex_rhizome_bid_t(*bid), fileOffset, bitmap[0], bitmap_words);
     
-  overlay_mdp_frame reply;
-  bzero(&reply,sizeof(reply));
+  struct internal_mdp_header header;
+  bzero(&header, sizeof header);
   // Reply is broadcast, so we cannot authcrypt, and signing is too time consuming
   // for low devices.  The result is that an attacker can prevent rhizome transfers
   // if they want to by injecting fake blocks.  The alternative is to not broadcast
@@ -51,54 +55,63 @@ int rhizome_mdp_send_block(struct subscriber *dest, const rhizome_bid_t *bid, ui
   // for now would seem the safest.  But that would stop us from allowing multiple
   // receivers in the special case where additional nodes begin listening in from the
   // beginning.
-  reply.packetTypeAndFlags=MDP_TX|MDP_NOCRYPT|MDP_NOSIGN;
-  reply.out.src.sid = my_subscriber->sid;
-  reply.out.src.port=MDP_PORT_RHIZOME_RESPONSE;
+  header.crypt_flags = MDP_NOCRYPT|MDP_NOSIGN;
+  header.source = my_subscriber;
+  header.source_port = MDP_PORT_RHIZOME_RESPONSE;
   
   if (dest && (dest->reachable==REACHABLE_UNICAST || dest->reachable==REACHABLE_INDIRECT)){
     // if we get a request from a peer that we can only talk to via unicast, send data via unicast too.
-    reply.out.dst.sid = dest->sid;
+    header.destination = dest;
   }else{
     // send replies to broadcast so that others can hear blocks and record them
     // (not that preemptive listening is implemented yet).
-    reply.out.dst.sid = SID_BROADCAST;
-    reply.out.ttl=1;
+    header.ttl = 1;
   }
   
-  reply.out.dst.port=MDP_PORT_RHIZOME_RESPONSE;
-  reply.out.queue=OQ_OPPORTUNISTIC;
-  reply.out.payload[0]='B'; // reply contains blocks
-  // include 16 bytes of BID prefix for identification
-  bcopy(bid->binary, &reply.out.payload[1], 16);
-  // and version of manifest (in the correct byte order)
-  //  bcopy(&version, &reply.out.payload[1+16], sizeof(uint64_t));
-  write_uint64(&reply.out.payload[1+16],version);
+  header.destination_port = MDP_PORT_RHIZOME_RESPONSE;
+  header.queue = OQ_OPPORTUNISTIC;
   
   int i;
-  for(i=0;i<32;i++){
-    if (bitmap&(1<<(31-i)))
+  for(i=0;i<bitmap_words*32;i++){
+    if (bitmap[i/32]&(1u<<(31-i%32)))
       continue;
     
-    if (overlay_queue_remaining(reply.out.queue) < 10)
+    if (overlay_queue_remaining(header.queue) < 10)
       break;
     
     // calculate and set offset of block
     uint64_t offset = fileOffset+i*blockLength;
     
-    write_uint64(&reply.out.payload[1+16+8], offset);
-    
-    int bytes_read = rhizome_read_cached(bid, version, gettime_ms()+5000, offset, &reply.out.payload[1+16+8+8], blockLength);
-    if (bytes_read<=0)
+    // the block is read straight into the outgoing payload
+    struct overlay_buffer *payload = overlay_mdp_payload(&header);
+    if (!payload)
+      break;
+    int type_offset = ob_position(payload);
+    unsigned char *p = ob_append_space(payload, 1+16+8+8+blockLength);
+    if (!p){
+      ob_free(payload);
       break;
+    }
+    p[0]='B'; // reply contains blocks
+    // include 16 bytes of BID prefix for identification
+    bcopy(bid->binary, &p[1], 16);
+    // and version of manifest (in the correct byte order)
+    write_uint64(&p[1+16],version);
+    write_uint64(&p[1+16+8], offset);
     
-    reply.out.payload_length=1+16+8+8+bytes_read;
+    int bytes_read = rhizome_read_cached(bid, version, gettime_ms()+5000, offset, &p[1+16+8+8], blockLength);
+    if (bytes_read<=0){
+      ob_free(payload);
+      break;
+    }
+    payload->position = type_offset+1+16+8+8+bytes_read;
     
     // Mark the last block of the file, if required
     if (bytes_read < blockLength)
-      reply.out.payload[0]='T';
+      p[0]='T';
     
     // send packet
-    if (overlay_mdp_dispatch(&reply,0 /* system generated */, NULL,0))
+    if (overlay_mdp_send_payload(&header, payload))
       break;
   }
 
@@ -106,14 +119,86 @@ int rhizome_mdp_send_block(struct subscriber *dest, const rhizome_bid_t *bid, ui
   OUT();
 }
 
+/* Send up to 32 leaf hashes of a payload's hash tree, starting at leaf first, so that the
+ * receiver can check each block it fetches.
+ */
+int rhizome_mdp_send_merkle(struct subscriber *dest, const rhizome_bid_t *bid, uint64_t version, uint64_t first)
+{
+  IN();
+  if (!is_rhizome_mdp_server_running())
+    RETURN(-1);
+  if (first > UINT32_MAX)
+    RETURN(WHYF("Invalid leaf index %"PRIu64, first));
+  
+  if (config.debug.rhizome_tx)
+    DEBUGF("Requested hash tree for %s from leaf %"PRIu64, alloca_tohex_rhizome_bid_t(*bid), first);
+  
+  struct internal_mdp_header header;
+  bzero(&header, sizeof header);
+  // the hashes are checked against the root in the signed manifest, so they need no signature
+  header.crypt_flags = MDP_NOCRYPT|MDP_NOSIGN;
+  header.source = my_subscriber;
+  header.source_port = MDP_PORT_RHIZOME_RESPONSE;
+  
+  if (dest && (dest->reachable==REACHABLE_UNICAST || dest->reachable==REACHABLE_INDIRECT))
+    header.destination = dest;
+  else
+    header.ttl = 1;
+  
+  header.destination_port = MDP_PORT_RHIZOME_RESPONSE;
+  header.queue = OQ_OPPORTUNISTIC;
+  
+  struct overlay_buffer *payload = overlay_mdp_payload(&header);
+  if (!payload)
+    RETURN(-1);
+  int type_offset = ob_position(payload);
+  unsigned char *p = ob_append_space(payload, 1+16+8+4+4+32*RHIZOME_MERKLE_HASH_BYTES);
+  if (!p){
+    ob_free(payload);
+    RETURN(-1);
+  }
+  p[0]='H'; // reply contains leaf hashes
+  bcopy(bid->binary, &p[1], 16);
+  write_uint64(&p[1+16], version);
+  write_uint32(&p[1+16+8], (uint32_t)first);
+  
+  size_t leaf_count=0;
+  int count = rhizome_read_cached_merkle(bid, version, gettime_ms()+5000, (size_t)first,
+					 &p[1+16+8+4+4], 32, &leaf_count);
+  if (count<=0){
+    ob_free(payload);
+    RETURN(-1);
+  }
+  write_uint32(&p[1+16+8+4], (uint32_t)leaf_count);
+  payload->position = type_offset+1+16+8+4+4+count*RHIZOME_MERKLE_HASH_BYTES;
+  
+  overlay_mdp_send_payload(&header, payload);
+  RETURN(0);
+  OUT();
+}
+
 int overlay_mdp_service_rhizomerequest(struct overlay_frame *frame, overlay_mdp_frame *mdp)
 {
   const rhizome_bid_t *bidp = (const rhizome_bid_t *) &mdp->out.payload[0];
   uint64_t version = read_uint64(&mdp->out.payload[sizeof bidp->binary]);
   uint64_t fileOffset = read_uint64(&mdp->out.payload[sizeof bidp->binary + 8]);
-  uint32_t bitmap = read_uint32(&mdp->out.payload[sizeof bidp->binary + 8 + 8]);
+  uint32_t bitmap[RHIZOME_MDP_MAX_BITMAP_WORDS];
+  bitmap[0] = read_uint32(&mdp->out.payload[sizeof bidp->binary + 8 + 8]);
   uint16_t blockLength = read_uint16(&mdp->out.payload[sizeof bidp->binary + 8 + 8 + 4]);
-  return rhizome_mdp_send_block(frame->source, bidp, version, fileOffset, bitmap, blockLength);
+  // a zero block length asks for the payload hash tree, starting from the leaf at fileOffset
+  if (blockLength==0){
+    if (!config.rhizome.mdp.merkle)
+      return 0;
+    return rhizome_mdp_send_merkle(frame->source, bidp, version, fileOffset);
+  }
+  // newer receivers append more bitmap words to ask for a larger window
+  int words = 1;
+  int extra = sizeof bidp->binary + 8 + 8 + 4 + 2;
+  while (words < RHIZOME_MDP_MAX_BITMAP_WORDS && extra + 4 <= mdp->out.payload_length){
+    bitmap[words++] = read_uint32(&mdp->out.payload[extra]);
+    extra += 4;
+  }
+  return rhizome_mdp_send_block(frame->source, bidp, version, fileOffset, bitmap, words, blockLength);
 }
 
 int overlay_mdp_service_rhizomeresponse(overlay_mdp_frame *mdp)
@@ -151,11 +236,30 @@ int overlay_mdp_service_rhizomeresponse(overlay_mdp_frame *mdp)
 	 a slot to capture this files as it is being requested
 	 by someone else.
       */
-      rhizome_received_content(bidprefix,version,offset, count, bytes, type);
+      rhizome_received_content(bidprefix,version,offset, count, bytes, type, &mdp->out.src.sid);
 
       RETURN(0);
     }
     break;
+
+  case 'H': /* payload hash tree leaves */
+    {
+      if (mdp->out.payload_length<(1+16+8+4+4+RHIZOME_MERKLE_HASH_BYTES))
+	RETURN(WHYF("Payload too short"));
+      unsigned char *bidprefix=&mdp->out.payload[1];
+      uint64_t version=read_uint64(&mdp->out.payload[1+16]);
+      uint32_t first=read_uint32(&mdp->out.payload[1+16+8]);
+      uint32_t leaf_count=read_uint32(&mdp->out.payload[1+16+8+4]);
+      size_t count = (mdp->out.payload_length-(1+16+8+4+4)) / RHIZOME_MERKLE_HASH_BYTES;
+      
+      if (config.debug.rhizome_mdp_rx)
+	DEBUGF("bidprefix=%02x%02x%02x%02x*, leaves %"PRIu32"..%zu of %"PRIu32,
+	       bidprefix[0],bidprefix[1],bidprefix[2],bidprefix[3],first,first+count,leaf_count);
+      
+      rhizome_received_merkle(bidprefix, version, first, leaf_count, &mdp->out.payload[1+16+8+4+4], count);
+      RETURN(0);
+    }
+    break;
   }
 
   RETURN(-1);
@@ -359,8 +463,10 @@ static int overlay_mdp_service_manifest_requests(struct overlay_frame *frame, ov
     if (!rhizome_retrieve_manifest_by_prefix(&bar[RHIZOME_BAR_PREFIX_OFFSET], RHIZOME_BAR_PREFIX_BYTES, m)){
       rhizome_advertise_manifest(frame->source, m);
       // pre-emptively send the payload if it will fit in a single packet
-      if (m->filesize > 0 && m->filesize <= 1024)
-	rhizome_mdp_send_block(frame->source, &m->cryptoSignPublic, m->version, 0, 0, m->filesize);
+      if (m->filesize > 0 && m->filesize <= 1024){
+	uint32_t bitmap = 0;
+	rhizome_mdp_send_block(frame->source, &m->cryptoSignPublic, m->version, 0, &bitmap, 1, m->filesize);
+      }
     }
     rhizome_manifest_free(m);
     offset+=RHIZOME_BAR_BYTES;
@@ -35,6 +35,10 @@ struct packet_destination{
   time_ms_t transmit_time;
   // the actual out going stream for this packet
   struct network_destination *destination;
+  // while queued, the frame this belongs to and the other frames queued for the same destination
+  struct overlay_frame *frame;
+  struct packet_destination *prev;
+  struct packet_destination *next;
 };
 
 struct overlay_frame {
@@ -99,7 +103,10 @@ struct overlay_frame {
 };
 
 
+struct overlay_frame *op_new(void);
 int op_free(struct overlay_frame *p);
 struct overlay_frame *op_dup(struct overlay_frame *f);
+void op_pool_set_limit(unsigned max_free);
+void op_pool_stats(unsigned *in_use, unsigned *free_frames, unsigned *allocs, unsigned *reuses);
 
 #endif
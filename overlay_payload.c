@@ -20,6 +20,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "serval.h"
 #include "conf.h"
 #include "str.h"
+#include "cli.h"
 #include "overlay_buffer.h"
 #include "overlay_packet.h"
 
@@ -132,6 +133,58 @@ cleanup:
   return -1;
 }
 
+/* Freed frames are kept on a free list, up to op_pool_max_free of them, and handed out again by
+ * op_new() and op_dup(), so queued, forwarded and decoded frames don't each cost a malloc(3).
+ */
+static struct overlay_frame *op_free_frames=NULL;
+static unsigned op_free_count=0;
+static unsigned op_pool_max_free=OB_POOL_MAX_FREE;
+static unsigned op_in_use=0, op_allocs=0, op_reuses=0;
+
+void op_pool_set_limit(unsigned max_free)
+{
+  op_pool_max_free = max_free;
+  while (op_free_count > max_free){
+    struct overlay_frame *p = op_free_frames;
+    op_free_frames = p->next;
+    op_free_count--;
+    free(p);
+  }
+}
+
+void op_pool_stats(unsigned *in_use, unsigned *free_frames, unsigned *allocs, unsigned *reuses)
+{
+  *in_use = op_in_use;
+  *free_frames = op_free_count;
+  *allocs = op_allocs;
+  *reuses = op_reuses;
+}
+
+static struct overlay_frame *op_alloc(void)
+{
+  struct overlay_frame *p;
+  if (op_free_frames){
+    p = op_free_frames;
+    op_free_frames = p->next;
+    op_free_count--;
+    op_reuses++;
+  }else{
+    p = malloc(sizeof(struct overlay_frame));
+    if (!p) { WHY("malloc() failed"); return NULL; }
+    op_allocs++;
+  }
+  op_in_use++;
+  return p;
+}
+
+struct overlay_frame *op_new(void)
+{
+  struct overlay_frame *p = op_alloc();
+  if (p)
+    bzero(p, sizeof(struct overlay_frame));
+  return p;
+}
+
 int op_free(struct overlay_frame *p)
 {
   if (!p) return WHY("Asked to free NULL");
@@ -141,7 +194,14 @@ int op_free(struct overlay_frame *p)
   p->next=NULL;
   if (p->payload) ob_free(p->payload);
   p->payload=NULL;
-  free(p);
+  op_in_use--;
+  if (op_free_count >= op_pool_max_free){
+    free(p);
+    return 0;
+  }
+  p->next = op_free_frames;
+  op_free_frames = p;
+  op_free_count++;
   return 0;
 }
 
@@ -150,13 +210,101 @@ struct overlay_frame *op_dup(struct overlay_frame *in)
   if (!in) return NULL;
 
   /* clone the frame */
-  struct overlay_frame *out=malloc(sizeof(struct overlay_frame));
-  if (!out) { WHY("malloc() failed"); return NULL; }
+  struct overlay_frame *out=op_alloc();
+  if (!out) return NULL;
 
   /* copy main data structure */
   bcopy(in,out,sizeof(struct overlay_frame));
 
+  /* Forwarded payloads are slices of a received datagram, whose buffer is reused by the next
+     read, so the payload is copied rather than shared. */
   if (in->payload)
     out->payload=ob_dup(in->payload);
   return out;
 }
+
+/* Time a forwarding workload, with and without the frame and buffer free lists: each received
+ * packet is sliced into a frame, the frame is duplicated onto a transmit queue, and once the queue
+ * is full the oldest frame is copied into an outgoing packet buffer and freed.
+ */
+#define OVERLAY_POOL_TEST_QUEUE 64
+static time_ns_t overlay_pool_forward(unsigned count)
+{
+  unsigned char packet[1200];
+  struct overlay_frame *queue[OVERLAY_POOL_TEST_QUEUE];
+  bzero(queue, sizeof queue);
+  unsigned i;
+  for (i = 0; i < sizeof packet; ++i)
+    packet[i] = random();
+  
+  time_ns_t start = gettime_ns();
+  for (i = 0; i < count; ++i) {
+    int payload_len = 40 + random() % 1000;
+    struct overlay_buffer *b = ob_static(packet, sizeof packet);
+    ob_limitsize(b, sizeof packet);
+    struct overlay_frame f;
+    bzero(&f, sizeof f);
+    f.ttl = 4;
+    f.payload = ob_slice(b, 20, payload_len);
+    ob_limitsize(f.payload, payload_len);
+    
+    struct overlay_frame *qf = op_dup(&f);
+    ob_free(f.payload);
+    ob_free(b);
+    if (!qf)
+      break;
+    
+    struct overlay_frame **slot = &queue[i % OVERLAY_POOL_TEST_QUEUE];
+    if (*slot) {
+      struct overlay_buffer *out = ob_new();
+      ob_limitsize(out, sizeof packet);
+      ob_append_byte(out, (*slot)->ttl);
+      ob_append_bytes(out, ob_ptr((*slot)->payload), ob_position((*slot)->payload));
+      ob_free(out);
+      op_free(*slot);
+    }
+    *slot = qf;
+  }
+  for (i = 0; i < OVERLAY_POOL_TEST_QUEUE; ++i)
+    if (queue[i])
+      op_free(queue[i]);
+  return gettime_ns() - start;
+}
+
+int app_overlay_pool_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *count_arg = NULL;
+  if (cli_arg(parsed, "--count", &count_arg, cli_uint, NULL) == -1)
+    return -1;
+  unsigned count = count_arg ? atoi(count_arg) : 1000000;
+  if (count == 0)
+    return WHY("--count must be greater than zero");
+  
+  struct ob_pool_stats before, after;
+  unsigned in_use, free_frames, frame_allocs_before, frame_allocs, reuses;
+  
+  ob_pool_set_limit(0);
+  op_pool_set_limit(0);
+  time_ns_t malloc_ns = overlay_pool_forward(count);
+  cli_printf(context, "forward %u frames with malloc took %"PRId64"ms\n", count, (int64_t)(malloc_ns / 1000000));
+  
+  ob_pool_set_limit(OB_POOL_MAX_FREE);
+  op_pool_set_limit(OB_POOL_MAX_FREE);
+  ob_pool_stats(&before);
+  op_pool_stats(&in_use, &free_frames, &frame_allocs_before, &reuses);
+  time_ns_t pool_ns = overlay_pool_forward(count);
+  ob_pool_stats(&after);
+  op_pool_stats(&in_use, &free_frames, &frame_allocs, &reuses);
+  cli_printf(context, "forward %u frames with pools took %"PRId64"ms\n", count, (int64_t)(pool_ns / 1000000));
+  
+  unsigned mallocs = (frame_allocs - frame_allocs_before)
+		   + (after.struct_allocs - before.struct_allocs)
+		   + (after.block_allocs - before.block_allocs);
+  cli_printf(context, "pooled run called malloc %u times\n", mallocs);
+  
+  // only the frames held in the queue, and their buffers, should have needed new memory
+  if (mallocs > 16 * OVERLAY_POOL_TEST_QUEUE)
+    return WHYF("Pools did not reuse memory, %u allocations", mallocs);
+  cli_printf(context, "Test passed.\n");
+  return 0;
+}
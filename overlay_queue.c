@@ -23,6 +23,7 @@
 #include "overlay_packet.h"
 #include "str.h"
 #include "strbuf.h"
+#include "strlcpy.h"
 
 typedef struct overlay_txqueue {
   struct overlay_frame *first;
@@ -50,6 +51,8 @@ struct outgoing_packet{
 #define SMALL_PACKET_SIZE (400)
 
 int32_t mdp_sequence=0;
+// how many times a queued frame has been considered for an outgoing packet
+static unsigned frames_examined=0;
 struct sched_ent next_packet;
 struct profile_total send_packet;
 
@@ -74,6 +77,69 @@ int overlay_queue_init(){
   return 0;
 }
 
+/* Every destination of a queued frame is also linked into a list held by that network destination,
+ * so filling a packet, or processing an ack, only needs to look at the frames going that way.
+ */
+static void destination_queue_link(struct overlay_frame *frame, struct packet_destination *d){
+  struct network_destination *dest = d->destination;
+  d->frame = frame;
+  d->next = NULL;
+  d->prev = dest->queued_last[frame->queue];
+  if (d->prev)
+    d->prev->next = d;
+  else
+    dest->queued_first[frame->queue] = d;
+  dest->queued_last[frame->queue] = d;
+}
+
+static void destination_queue_unlink(struct packet_destination *d){
+  if (!d->frame)
+    return;
+  struct network_destination *dest = d->destination;
+  int queue = d->frame->queue;
+  if (d->prev)
+    d->prev->next = d->next;
+  else
+    dest->queued_first[queue] = d->next;
+  if (d->next)
+    d->next->prev = d->prev;
+  else
+    dest->queued_last[queue] = d->prev;
+  d->frame = NULL;
+  d->prev = d->next = NULL;
+}
+
+// link any destinations that have been added since the frame was queued
+static void overlay_queue_link_destinations(struct overlay_frame *frame){
+  int i;
+  for (i=0;i<frame->destination_count;i++)
+    if (!frame->destinations[i].frame)
+      destination_queue_link(frame, &frame->destinations[i]);
+}
+
+static void remove_destination(struct overlay_frame *frame, int i){
+  struct packet_destination *d = &frame->destinations[i];
+  destination_queue_unlink(d);
+  release_destination_ref(d->destination);
+  frame->destination_count --;
+  if (i<frame->destination_count){
+    *d = frame->destinations[frame->destination_count];
+    frame->destinations[frame->destination_count].frame = NULL;
+    // the last destination has moved, so point its neighbours at the new location
+    if (d->frame){
+      struct network_destination *dest = d->destination;
+      if (d->prev)
+	d->prev->next = d;
+      else
+	dest->queued_first[frame->queue] = d;
+      if (d->next)
+	d->next->prev = d;
+      else
+	dest->queued_last[frame->queue] = d;
+    }
+  }
+}
+
 /* remove and free a payload from the queue */
 static struct overlay_frame *
 overlay_queue_remove(overlay_txqueue *queue, struct overlay_frame *frame){
@@ -92,7 +158,7 @@ overlay_queue_remove(overlay_txqueue *queue, struct overlay_frame *frame){
   queue->length--;
   
   while(frame->destination_count>0)
-    release_destination_ref(frame->destinations[--frame->destination_count].destination);
+    remove_destination(frame, frame->destination_count -1);
     
   op_free(frame);
   
@@ -140,6 +206,36 @@ int overlay_queue_remaining(int queue){
   return overlay_tx[queue].maxLength - overlay_tx[queue].length;
 }
 
+int overlay_queue_stats_json(strbuf b)
+{
+  int i;
+  strbuf_putc(b, '[');
+  for (i=0;i<OQ_MAX;i++){
+    strbuf_sprintf(b, "%s{\"queue\":%d,\"length\":%d,\"max_length\":%d,\"latency_target_ms\":%d}",
+      i?",":"", i, overlay_tx[i].length, overlay_tx[i].maxLength, overlay_tx[i].latencyTarget);
+  }
+  strbuf_putc(b, ']');
+  return 0;
+}
+
+// choose the destinations of a unicast frame from the current route to its next hop
+static void overlay_queue_route_frame(struct overlay_frame *frame){
+  link_add_destinations(frame);
+  
+  int i=0;
+  for (i=0;i<frame->destination_count;i++){
+    frame->destinations[i].sent_sequence=-1;
+    if (config.debug.verbose && config.debug.overlayframes)
+      DEBUGF("Sending %s on interface %s", 
+	  frame->destinations[i].destination->unicast?"unicast":"broadcast",
+	  frame->destinations[i].destination->interface->name);
+  }
+  
+  // degrade packet version if required to reach the destination
+  if (frame->packet_version > frame->next_hop->max_packet_version)
+    frame->packet_version = frame->next_hop->max_packet_version;
+}
+
 int overlay_payload_enqueue(struct overlay_frame *p)
 {
   /* Add payload p to queue q.
@@ -222,6 +318,11 @@ int overlay_payload_enqueue(struct overlay_frame *p)
   if (p->queue==OQ_ISOCHRONOUS_VOICE)
     rhizome_saw_voice_traffic();
   
+  // route unicast frames now, so they can join any packet that is already going their way
+  if (p->destination_count==0)
+    overlay_queue_route_frame(p);
+  overlay_queue_link_destinations(p);
+  
   overlay_calc_queue_time(queue, p);
   return 0;
 }
@@ -271,13 +372,6 @@ int overlay_queue_schedule_next(time_ms_t next_allowed_packet){
   return 0;  
 }
 
-static void remove_destination(struct overlay_frame *frame, int i){
-  release_destination_ref(frame->destinations[i].destination);
-  frame->destination_count --;
-  if (i<frame->destination_count)
-    frame->destinations[i]=frame->destinations[frame->destination_count];
-}
-
 // update the alarm time and return 1 if changed
 static int
 overlay_calc_queue_time(overlay_txqueue *queue, struct overlay_frame *frame){
@@ -323,174 +417,187 @@ overlay_calc_queue_time(overlay_txqueue *queue, struct overlay_frame *frame){
   return 0;
 }
 
-static void
-overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, time_ms_t now){
-  struct overlay_frame *frame = queue->first;
+/* Try to add one frame to the packet, or start a new packet with it if we don't have one yet.
+ * Returns 1 if the frame was removed from the queue.
+ */
+static int
+overlay_stuff_frame(struct outgoing_packet *packet, overlay_txqueue *queue, struct overlay_frame *frame, time_ms_t now){
+  frames_examined++;
   
-  // TODO stop when the packet is nearly full?
-  while(frame){
-    if (frame->enqueued_at + queue->latencyTarget < now){
-      if (config.debug.overlayframes)
-	DEBUGF("Dropping frame type %x for %s due to expiry timeout", 
-	       frame->type, frame->destination?alloca_tohex_sid_t(frame->destination->sid):"All");
-      frame = overlay_queue_remove(queue, frame);
-      continue;
-    }
-    
-    /* Note, once we queue a broadcast packet we are currently 
-     * committed to sending it to every destination, 
-     * even if we hear it from somewhere else in the mean time
-     */
-    
-    // ignore payloads that are waiting for ack / nack resends
-    if (frame->delay_until > now)
-      goto skip;
+  if (frame->enqueued_at + queue->latencyTarget < now){
+    if (config.debug.overlayframes)
+      DEBUGF("Dropping frame type %x for %s due to expiry timeout", 
+	     frame->type, frame->destination?alloca_tohex_sid_t(frame->destination->sid):"All");
+    overlay_queue_remove(queue, frame);
+    return 1;
+  }
+  
+  /* Note, once we queue a broadcast packet we are currently 
+   * committed to sending it to every destination, 
+   * even if we hear it from somewhere else in the mean time
+   */
+  
+  // ignore payloads that are waiting for ack / nack resends
+  if (frame->delay_until > now)
+    goto skip;
 
-    if (packet->buffer && packet->destination->encapsulation==ENCAP_SINGLE)
-      goto skip;
-      
-    // quickly skip payloads that have no chance of fitting
-    if (packet->buffer && ob_limit(frame->payload) > ob_remaining(packet->buffer))
-      goto skip;
+  if (packet->buffer && packet->destination->encapsulation==ENCAP_SINGLE)
+    goto skip;
     
-    if (frame->destination_count==0 && frame->destination){
-      link_add_destinations(frame);
-      
-      int i=0;
-      for (i=0;i<frame->destination_count;i++){
-	frame->destinations[i].sent_sequence=-1;
-	if (config.debug.verbose && config.debug.overlayframes)
-	  DEBUGF("Sending %s on interface %s", 
-	      frame->destinations[i].destination->unicast?"unicast":"broadcast",
-	      frame->destinations[i].destination->interface->name);
+  // quickly skip payloads that have no chance of fitting
+  if (packet->buffer && ob_limit(frame->payload) > ob_remaining(packet->buffer))
+    goto skip;
+  
+  if (frame->destination_count==0 && frame->destination){
+    overlay_queue_route_frame(frame);
+    overlay_queue_link_destinations(frame);
+  }
+  
+  int destination_index=-1;
+  {
+    int i;
+    for (i=frame->destination_count -1;i>=0;i--){
+      struct network_destination *dest = frame->destinations[i].destination;
+      if (!dest)
+	FATALF("Destination %d is NULL", i);
+      if (!dest->interface)
+	FATALF("Destination interface %d is NULL", i);
+      if (dest->interface->state!=INTERFACE_STATE_UP){
+	// remove this destination
+	remove_destination(frame, i);
+	continue;
       }
       
-      // degrade packet version if required to reach the destination
-      if (frame->packet_version > frame->next_hop->max_packet_version)
-	frame->packet_version = frame->next_hop->max_packet_version;
-    }
-    
-    int destination_index=-1;
-    {
-      int i;
-      for (i=frame->destination_count -1;i>=0;i--){
-	struct network_destination *dest = frame->destinations[i].destination;
-	if (!dest)
-	  FATALF("Destination %d is NULL", i);
-	if (!dest->interface)
-	  FATALF("Destination interface %d is NULL", i);
-	if (dest->interface->state!=INTERFACE_STATE_UP){
-	  // remove this destination
-	  remove_destination(frame, i);
-	  continue;
-	}
-	
-	if (frame->destinations[i].transmit_time && 
-	  frame->destinations[i].transmit_time + frame->destinations[i].destination->resend_delay > now)
+      if (frame->destinations[i].transmit_time && 
+	frame->destinations[i].transmit_time + frame->destinations[i].destination->resend_delay > now)
+	continue;
+      
+      if (packet->buffer){
+	if (frame->packet_version!=packet->packet_version)
 	  continue;
 	
-	if (packet->buffer){
-	  if (frame->packet_version!=packet->packet_version)
-	    continue;
-	  
-	  // is this packet going our way?
-	  if (dest==packet->destination){
-	    destination_index=i;
-	    break;
-	  }
-	}else{
-	  // skip this interface if the stream tx buffer has data
-	  if (dest->interface->socket_type==SOCK_STREAM 
-	    && dest->interface->tx_packet)
-	    continue;
-	    
-	  // can we send a packet on this interface now?
-	  if (limit_is_allowed(&dest->transfer_limit))
-	    continue;
-      
-	  // send a packet to this destination
-	  if (frame->source_full)
-	    my_subscriber->send_full=1;
-
-	  overlay_init_packet(packet, frame->packet_version, dest);
+	// is this packet going our way?
+	if (dest==packet->destination){
 	  destination_index=i;
-	  frame->destinations[i].sent_sequence = dest->sequence_number;
 	  break;
 	}
-      }
-    }
-    
-    if (frame->destination_count==0){
-      frame = overlay_queue_remove(queue, frame);
-      continue;
-    }
-    
-    if (destination_index==-1)
-      goto skip;
+      }else{
+	// skip this interface if the stream tx buffer has data
+	if (dest->interface->socket_type==SOCK_STREAM 
+	  && dest->interface->tx_packet)
+	  continue;
+	  
+	// can we send a packet on this interface now?
+	if (limit_is_allowed(&dest->transfer_limit))
+	  continue;
     
-    if (frame->send_hook){
-      // last minute check if we really want to send this frame, or track when we sent it
-      if (frame->send_hook(frame, packet->seq, frame->send_context)){
-        // drop packet
-        frame = overlay_queue_remove(queue, frame);
-        continue;
+	// send a packet to this destination
+	if (frame->source_full)
+	  my_subscriber->send_full=1;
+
+	overlay_init_packet(packet, frame->packet_version, dest);
+	destination_index=i;
+	frame->destinations[i].sent_sequence = dest->sequence_number;
+	break;
       }
     }
-
-    if (frame->mdp_sequence == -1){
-      frame->mdp_sequence = mdp_sequence = (mdp_sequence+1)&0xFFFF;
-    }else if(((mdp_sequence - frame->mdp_sequence)&0xFFFF) >= 64){
-      // too late, we've sent too many packets for the next hop to correctly de-duplicate
-      if (config.debug.overlayframes)
-        DEBUGF("Retransmition of frame %p mdp seq %d, is too late to be de-duplicated", 
-	  frame, frame->mdp_sequence);
-      frame = overlay_queue_remove(queue, frame);
-      continue;
-    }
-    
-    char will_retransmit=1;
-    if (frame->packet_version<1 || frame->resend<=0 || packet->seq==-1)
-      will_retransmit=0;
-    
-    if (overlay_frame_append_payload(&packet->context, packet->destination->encapsulation, frame, packet->buffer, will_retransmit)){
-      // payload was not queued, delay the next attempt slightly
-      frame->delay_until = now + 5;
-      goto skip;
-    }
-    
-    {
-      struct packet_destination *dest = &frame->destinations[destination_index];
-      dest->sent_sequence = dest->destination->sequence_number;
-      dest->transmit_time = now;
-    }
-    
-    frame->transmit_count++;
-    
-    if (config.debug.overlayframes){
-      DEBUGF("Appended payload %p, %d type %x len %d for %s via %s", 
-	     frame, frame->mdp_sequence,
-	     frame->type, ob_position(frame->payload),
-	     frame->destination?alloca_tohex_sid_t(frame->destination->sid):"All",
-	     frame->next_hop?alloca_tohex_sid_t(frame->next_hop->sid):alloca_tohex(frame->broadcast_id.id, BROADCAST_LEN));
+  }
+  
+  if (frame->destination_count==0){
+    overlay_queue_remove(queue, frame);
+    return 1;
+  }
+  
+  if (destination_index==-1)
+    goto skip;
+  
+  if (frame->send_hook){
+    // last minute check if we really want to send this frame, or track when we sent it
+    if (frame->send_hook(frame, packet->seq, frame->send_context)){
+      // drop packet
+      overlay_queue_remove(queue, frame);
+      return 1;
     }
-    
-    // dont retransmit if we aren't sending sequence numbers, or we've been asked not to
-    if (!will_retransmit){
-      if (config.debug.overlayframes)
-	DEBUGF("Not waiting for retransmission (%d, %d, %d)", frame->packet_version, frame->resend, packet->seq);
-      remove_destination(frame, destination_index);
-      if (frame->destination_count==0){
-	frame = overlay_queue_remove(queue, frame);
-	continue;
-      }
+  }
+
+  if (frame->mdp_sequence == -1){
+    frame->mdp_sequence = mdp_sequence = (mdp_sequence+1)&0xFFFF;
+  }else if(((mdp_sequence - frame->mdp_sequence)&0xFFFF) >= 64){
+    // too late, we've sent too many packets for the next hop to correctly de-duplicate
+    if (config.debug.overlayframes)
+      DEBUGF("Retransmition of frame %p mdp seq %d, is too late to be de-duplicated", 
+	frame, frame->mdp_sequence);
+    overlay_queue_remove(queue, frame);
+    return 1;
+  }
+  
+  char will_retransmit=1;
+  if (frame->packet_version<1 || frame->resend<=0 || packet->seq==-1)
+    will_retransmit=0;
+  
+  if (overlay_frame_append_payload(&packet->context, packet->destination->encapsulation, frame, packet->buffer, will_retransmit)){
+    // payload was not queued, delay the next attempt slightly
+    frame->delay_until = now + 5;
+    goto skip;
+  }
+  
+  {
+    struct packet_destination *dest = &frame->destinations[destination_index];
+    dest->sent_sequence = dest->destination->sequence_number;
+    dest->transmit_time = now;
+  }
+  
+  frame->transmit_count++;
+  
+  if (config.debug.overlayframes){
+    DEBUGF("Appended payload %p, %d type %x len %d for %s via %s", 
+	   frame, frame->mdp_sequence,
+	   frame->type, ob_position(frame->payload),
+	   frame->destination?alloca_tohex_sid_t(frame->destination->sid):"All",
+	   frame->next_hop?alloca_tohex_sid_t(frame->next_hop->sid):alloca_tohex(frame->broadcast_id.id, BROADCAST_LEN));
+  }
+  
+  // dont retransmit if we aren't sending sequence numbers, or we've been asked not to
+  if (!will_retransmit){
+    if (config.debug.overlayframes)
+      DEBUGF("Not waiting for retransmission (%d, %d, %d)", frame->packet_version, frame->resend, packet->seq);
+    remove_destination(frame, destination_index);
+    if (frame->destination_count==0){
+      overlay_queue_remove(queue, frame);
+      return 1;
     }
-    
-    // TODO recalc route on retransmittion??
-    
-  skip:
-    // if we can't send the payload now, check when we should try next
-    overlay_calc_queue_time(queue, frame);
-    frame = frame->next;
+  }
+  
+  // TODO recalc route on retransmittion??
+  
+skip:
+  // if we can't send the payload now, check when we should try next
+  overlay_calc_queue_time(queue, frame);
+  return 0;
+}
+
+static void
+overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, time_ms_t now){
+  // until we have a packet, look for the oldest frame that can start one
+  struct overlay_frame *frame = queue->first;
+  while(frame && !packet->buffer){
+    struct overlay_frame *next = frame->next;
+    overlay_stuff_frame(packet, queue, frame, now);
+    frame = next;
+  }
+  if (!packet->buffer)
+    return;
+  
+  // then only consider the frames that are queued for the packet's destination
+  // TODO stop when the packet is nearly full?
+  struct packet_destination *entry = packet->destination->queued_first[queue - overlay_tx];
+  while(entry){
+    frame = entry->frame;
+    // a frame may list the same destination more than once
+    do
+      entry = entry->next;
+    while(entry && entry->frame == frame);
+    overlay_stuff_frame(packet, queue, frame, now);
   }
 }
 
@@ -517,6 +624,8 @@ overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now) {
       
     overlay_broadcast_ensemble(packet->destination, packet->buffer);
     ret=1;
+    // frames for other destinations were not looked at, they may be ready to send too
+    overlay_queue_schedule_next(now);
   }
   if (packet->destination)
     release_destination_ref(packet->destination);
@@ -524,12 +633,19 @@ overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now) {
   OUT();
 }
 
-// when the queue timer elapses, send a packet
+// when the queue timer elapses, send a packet, and any others that are already due, 
+// so that interfaces can write them out together
 static void overlay_send_packet(struct sched_ent *alarm){
-  struct outgoing_packet packet;
-  bzero(&packet, sizeof(struct outgoing_packet));
-  packet.seq=-1;
-  overlay_fill_send_packet(&packet, gettime_ms());
+  time_ms_t now = gettime_ms();
+  int count=0;
+  do{
+    struct outgoing_packet packet;
+    bzero(&packet, sizeof(struct outgoing_packet));
+    packet.seq=-1;
+    if (!overlay_fill_send_packet(&packet, now))
+      break;
+  }while(++count < OVERLAY_INTERFACE_BATCH_MAX && next_packet.alarm && next_packet.alarm <= now);
+  overlay_broadcast_flush();
 }
 
 int overlay_send_tick_packet(struct network_destination *destination){
@@ -538,6 +654,7 @@ int overlay_send_tick_packet(struct network_destination *destination){
   overlay_init_packet(&packet, 0, destination);
   
   overlay_fill_send_packet(&packet, gettime_ms());
+  overlay_broadcast_flush();
   return 0;
 }
 
@@ -546,10 +663,16 @@ int overlay_queue_ack(struct subscriber *neighbour, struct network_destination *
 {
   int i, j;
   time_ms_t now = gettime_ms();
+  // removing frames releases their references to this destination
+  add_destination_ref(destination);
   for (i=0;i<OQ_MAX;i++){
-    struct overlay_frame *frame = overlay_tx[i].first;
+    struct packet_destination *entry = destination->queued_first[i];
 
-    while(frame){
+    while(entry){
+      struct overlay_frame *frame = entry->frame;
+      do
+	entry = entry->next;
+      while(entry && entry->frame == frame);
       
       for (j=frame->destination_count -1;j>=0;j--)
 	if (frame->destinations[j].destination==destination)
@@ -581,7 +704,7 @@ int overlay_queue_ack(struct subscriber *neighbour, struct network_destination *
 		
 	    // drop packets that don't need to be retransmitted
 	    if (frame->destination || frame->destination_count<=1){
-	      frame = overlay_queue_remove(&overlay_tx[i], frame);
+	      overlay_queue_remove(&overlay_tx[i], frame);
 	      continue;
 	    }
 	    remove_destination(frame, j);
@@ -595,9 +718,130 @@ int overlay_queue_ack(struct subscriber *neighbour, struct network_destination *
 	  }
 	}
       }
-      
-      frame = frame->next;
     }
   }
+  release_destination_ref(destination);
   return 0;
 }
+
+/* Time filling and draining every queue with unicast frames spread over many neighbours, and
+ * count how often a queued frame was looked at while packets were being assembled.
+ */
+#define OVERLAY_QUEUE_TEST_NEIGHBOURS 200
+int app_overlay_queue_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *count_arg = NULL;
+  if (cli_arg(parsed, "--count", &count_arg, cli_uint, NULL) == -1)
+    return -1;
+  unsigned count = count_arg ? atoi(count_arg) : 100;
+  if (count == 0)
+    return WHY("--count must be greater than zero");
+  
+  overlay_queue_init();
+  
+  // a dummy interface that writes its packets to /dev/null
+  overlay_interface *interface = &overlay_interfaces[0];
+  bzero(interface, sizeof *interface);
+  strlcpy(interface->name, "queuetest", sizeof interface->name);
+  interface->state = INTERFACE_STATE_UP;
+  interface->socket_type = SOCK_FILE;
+  interface->mtu = 1200;
+  interface->alarm.poll.fd = open("/dev/null", O_WRONLY);
+  if (interface->alarm.poll.fd == -1)
+    return WHY_perror("open(\"/dev/null\")");
+  
+  struct subscriber *self = my_subscriber;
+  struct subscriber *neighbours[OVERLAY_QUEUE_TEST_NEIGHBOURS];
+  struct network_destination *destinations[OVERLAY_QUEUE_TEST_NEIGHBOURS];
+  bzero(destinations, sizeof destinations);
+  unsigned char sid[SID_SIZE];
+  int ret = 0;
+  unsigned i;
+  urandombytes(sid, sizeof sid);
+  my_subscriber = find_subscriber(sid, sizeof sid, 1);
+  for (i = 0; i < OVERLAY_QUEUE_TEST_NEIGHBOURS; ++i) {
+    urandombytes(sid, sizeof sid);
+    neighbours[i] = find_subscriber(sid, sizeof sid, 1);
+    destinations[i] = new_destination(interface, ENCAP_OVERLAY);
+    if (!my_subscriber || !neighbours[i] || !destinations[i]) {
+      ret = WHY("Could not create test neighbours");
+      goto end;
+    }
+    destinations[i]->unicast = 1;
+    destinations[i]->sequence_number = -1;
+    destinations[i]->address.sin_family = AF_INET;
+    destinations[i]->address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    destinations[i]->address.sin_port = htons(4110 + i);
+  }
+  
+  unsigned frames = 0, packets = 0, neighbour = 0;
+  frames_examined = 0;
+  time_ns_t elapsed = 0;
+  unsigned round;
+  for (round = 0; round < count; ++round) {
+    int q;
+    for (q = OQ_MESH_MANAGEMENT; q < OQ_MAX; ++q) {
+      while (overlay_queue_remaining(q) > 0) {
+	struct overlay_frame *frame = op_new();
+	if (!frame) {
+	  ret = -1;
+	  goto end;
+	}
+	frame->type = OF_TYPE_DATA;
+	frame->source = my_subscriber;
+	frame->next_hop = frame->destination = neighbours[neighbour];
+	frame->ttl = 1;
+	frame->queue = q;
+	frame->destinations[frame->destination_count++].destination = add_destination_ref(destinations[neighbour]);
+	frame->payload = ob_new();
+	ob_append_space(frame->payload, 40 + random() % 80);
+	if (overlay_payload_enqueue(frame)) {
+	  op_free(frame);
+	  ret = WHY("Could not queue frame");
+	  goto end;
+	}
+	frames++;
+	neighbour = (neighbour + 1) % OVERLAY_QUEUE_TEST_NEIGHBOURS;
+      }
+    }
+    
+    time_ns_t start = gettime_ns();
+    for (;;) {
+      struct outgoing_packet packet;
+      bzero(&packet, sizeof packet);
+      packet.seq = -1;
+      if (!overlay_fill_send_packet(&packet, gettime_ms()))
+	break;
+      packets++;
+    }
+    overlay_broadcast_flush();
+    elapsed += gettime_ns() - start;
+    
+    for (q = 0; q < OQ_MAX; ++q) {
+      if (overlay_tx[q].length) {
+	ret = WHYF("%d frames were left in queue #%d", overlay_tx[q].length, q);
+	goto end;
+      }
+    }
+  }
+  
+  cli_printf(context, "sent %u frames to %d neighbours in %u packets, took %"PRId64"ms\n",
+	     frames, OVERLAY_QUEUE_TEST_NEIGHBOURS, packets, (int64_t)(elapsed / 1000000));
+  cli_printf(context, "examined queued frames %u times, scanning the whole queue for every packet would take about %u\n",
+	     frames_examined, frames / count * packets / 2);
+  // each frame should only be looked at when its own packet is filled, or when starting a packet
+  if (frames_examined > frames * 2)
+    ret = WHYF("Frames were examined %u times while sending %u of them", frames_examined, frames);
+  else
+    cli_printf(context, "Test passed.\n");
+  
+end:
+  unschedule(&next_packet);
+  for (i = 0; i < OVERLAY_QUEUE_TEST_NEIGHBOURS; ++i)
+    if (destinations[i])
+      release_destination_ref(destinations[i]);
+  close(interface->alarm.poll.fd);
+  bzero(interface, sizeof *interface);
+  my_subscriber = self;
+  return ret;
+}
@@ -19,34 +19,66 @@
 
 #include "fdqueue.h"
 #include "conf.h"
+#include "strbuf.h"
+#include "strbuf_helpers.h"
+#include "rhizome.h"
+#include "overlay_buffer.h"
+#include "overlay_packet.h"
 
 struct profile_total *stats_head=NULL;
 struct call_stats *current_call=NULL;
 
+#define NS_PER_MS 1000000.0
+
 void fd_clearstat(struct profile_total *s){
   s->max_time = 0;
   s->total_time = 0;
   s->child_time = 0;
   s->calls = 0;
+  bzero(s->histogram, sizeof s->histogram);
 }
 
 int fd_tallystats(struct profile_total *total,struct profile_total *a)
 {
+  int i;
   total->total_time+=a->total_time;
   total->calls+=a->calls;
   if (a->max_time>total->max_time) total->max_time=a->max_time;
+  for (i = 0; i < PROFILE_HISTOGRAM_BUCKETS; ++i)
+    total->histogram[i]+=a->histogram[i];
   return 0;
 }
 
+// Return an upper bound on the time taken by the given fraction (in parts per thousand) of calls
+time_ns_t fd_profile_percentile(const struct profile_total *stats, unsigned permille)
+{
+  if (stats->calls <= 0)
+    return 0;
+  uint64_t wanted = ((uint64_t)stats->calls * permille + 999) / 1000;
+  uint64_t count = 0;
+  int i;
+  for (i = 0; i < PROFILE_HISTOGRAM_BUCKETS - 1; ++i) {
+    count += stats->histogram[i];
+    if (count >= wanted) {
+      time_ns_t bound = ((time_ns_t)1 << i) - 1;
+      return bound < stats->max_time ? bound : stats->max_time;
+    }
+  }
+  return stats->max_time;
+}
+
 int fd_showstat(struct profile_total *total, struct profile_total *a)
 {
-  INFOF("%"PRId64"ms (%2.1f%%) in %d calls (max %"PRId64"ms, avg %.1fms, +child avg %.1fms) : %s",
-       (int64_t) a->total_time,
+  INFOF("%.3fms (%2.1f%%) in %d calls (max %.3fms, avg %.3fms, +child avg %.3fms, p50 %.3fms, p99 %.3fms, p999 %.3fms) : %s",
+       a->total_time / NS_PER_MS,
        a->total_time*100.0/total->total_time,
        a->calls,
-       (int64_t) a->max_time,
-       a->total_time*1.00/a->calls,
-       (a->total_time+a->child_time)*1.00/a->calls,
+       a->max_time / NS_PER_MS,
+       a->total_time / NS_PER_MS / a->calls,
+       (a->total_time+a->child_time) / NS_PER_MS / a->calls,
+       fd_profile_percentile(a, 500) / NS_PER_MS,
+       fd_profile_percentile(a, 990) / NS_PER_MS,
+       fd_profile_percentile(a, 999) / NS_PER_MS,
        a->name);
   return 0;
 }
@@ -133,12 +165,27 @@ int fd_clearstats()
     fd_clearstat(stats);
     stats = stats->_next;
   }
+  bzero(&fd_loop_stats, sizeof fd_loop_stats);
   return 0;
 }
 
+static void fd_showloopstats()
+{
+  strbuf b = strbuf_alloca(128);
+  int i;
+  for (i = 0; i < FD_LOOP_HISTOGRAM_BUCKETS; ++i)
+    strbuf_sprintf(b, "%s%u", i ? "," : "", fd_loop_stats.histogram[i]);
+  INFOF("%u main loop iterations, %u alarm and %u io callbacks (max %u per iteration, histogram %s)",
+       fd_loop_stats.loops,
+       fd_loop_stats.alarm_calls,
+       fd_loop_stats.io_calls,
+       fd_loop_stats.max_calls,
+       strbuf_str(b));
+}
+
 int fd_showstats()
 {
-  struct profile_total total={NULL, 0, "Total", 0,0,0};
+  struct profile_total total={.name="Total"};
   
   stats_head = sort(stats_head);
   
@@ -168,7 +215,7 @@ int fd_showstats()
       while(stats!=NULL){
 	/* If a function spends more than 1 second in any 
 	   notionally 3 second period, then dob on it */
-	if (stats->total_time>1000
+	if (stats->total_time>1000 * NS_PER_MS
 	    &&strcmp(stats->name,"Idle (in poll)"))
 	  fd_showstat(&total,stats);
 	stats = stats->_next;
@@ -184,11 +231,89 @@ int fd_showstats()
       stats = stats->_next;
     }    
     fd_showstat(&total,&total);
+    fd_showloopstats();
   }
   
   return 0;
 }
 
+static void fd_profile_json(strbuf b, const struct profile_total *a)
+{
+  strbuf_puts(b, "{\"name\":");
+  strbuf_json_string(b, a->name ? a->name : "");
+  strbuf_sprintf(b, ",\"calls\":%d,\"total_ns\":%"PRItime_ns_t",\"child_ns\":%"PRItime_ns_t",\"max_ns\":%"PRItime_ns_t
+      ",\"p50_ns\":%"PRItime_ns_t",\"p99_ns\":%"PRItime_ns_t",\"p999_ns\":%"PRItime_ns_t",\"histogram\":[",
+      a->calls, a->total_time, a->child_time, a->max_time,
+      fd_profile_percentile(a, 500), fd_profile_percentile(a, 990), fd_profile_percentile(a, 999));
+  // trailing empty buckets are omitted; bucket i counts calls shorter than 2^i ns
+  int used = PROFILE_HISTOGRAM_BUCKETS;
+  while (used > 0 && a->histogram[used - 1] == 0)
+    --used;
+  int i;
+  for (i = 0; i < used; ++i)
+    strbuf_sprintf(b, "%s%u", i ? "," : "", a->histogram[i]);
+  strbuf_puts(b, "]}");
+}
+
+/* Append a JSON object describing the profile counters collected since they were last cleared,
+ * along with a snapshot of the main loop, overlay transmit queues and rhizome fetch slots.
+ */
+int fd_stats_json(strbuf b)
+{
+  stats_head = sort(stats_head);
+
+  strbuf_sprintf(b, "{\"now_ms\":%"PRId64",\"profile\":[", (int64_t)gettime_ms());
+  struct profile_total *stats;
+  int n = 0;
+  for (stats = stats_head; stats; stats = stats->_next) {
+    if (stats->calls == 0)
+      continue;
+    if (n++)
+      strbuf_putc(b, ',');
+    fd_profile_json(b, stats);
+  }
+  strbuf_sprintf(b, "],\"loop\":{\"iterations\":%u,\"alarm_calls\":%u,\"io_calls\":%u,\"max_calls\":%u,\"histogram\":[",
+      fd_loop_stats.loops,
+      fd_loop_stats.alarm_calls,
+      fd_loop_stats.io_calls,
+      fd_loop_stats.max_calls);
+  int i;
+  for (i = 0; i < FD_LOOP_HISTOGRAM_BUCKETS; ++i)
+    strbuf_sprintf(b, "%s%u", i ? "," : "", fd_loop_stats.histogram[i]);
+  strbuf_puts(b, "]},\"overlay_queues\":");
+  overlay_queue_stats_json(b);
+  strbuf_puts(b, ",\"overlay_interfaces\":");
+  overlay_interface_stats_json(b);
+  struct ob_pool_stats ob_stats;
+  unsigned frames, free_frames, frame_allocs, frame_reuses;
+  ob_pool_stats(&ob_stats);
+  op_pool_stats(&frames, &free_frames, &frame_allocs, &frame_reuses);
+  strbuf_sprintf(b, ",\"overlay_pools\":{\"frames\":{\"in_use\":%u,\"free\":%u,\"allocs\":%u,\"reuses\":%u}"
+      ",\"buffers\":{\"in_use\":%u,\"free\":%u,\"allocs\":%u,\"reuses\":%u}"
+      ",\"blocks\":{\"free\":%u,\"allocs\":%u,\"reuses\":%u}}",
+      frames, free_frames, frame_allocs, frame_reuses,
+      ob_stats.structs_in_use, ob_stats.free_structs, ob_stats.struct_allocs, ob_stats.struct_reuses,
+      ob_stats.free_blocks, ob_stats.block_allocs, ob_stats.block_reuses);
+  strbuf_puts(b, ",\"rhizome_fetch\":");
+  rhizome_fetch_stats_json(b);
+  strbuf_puts(b, ",\"rhizome_sync\":");
+  rhizome_sync_stats_json(b);
+  unsigned known, hits, misses, sql_hits, sql_misses, blocks, block_hits, block_misses;
+  rhizome_known_bundle_stats(&known, &hits, &misses);
+  sqlite_statement_cache_stats(&sql_hits, &sql_misses);
+  rhizome_cache_stats(&blocks, &block_hits, &block_misses);
+  strbuf_sprintf(b, ",\"rhizome_fetch_queue_bytes\":%"PRIu64",\"rhizome_cache_entries\":%d"
+      ",\"rhizome_block_cache\":{\"blocks\":%u,\"hits\":%u,\"misses\":%u}"
+      ",\"rhizome_known_bundles\":{\"count\":%u,\"hits\":%u,\"misses\":%u}"
+      ",\"sqlite_statement_cache\":{\"hits\":%u,\"misses\":%u}}",
+      rhizome_fetch_queue_bytes(),
+      rhizome_cache_count(),
+      blocks, block_hits, block_misses,
+      known, hits, misses,
+      sql_hits, sql_misses);
+  return strbuf_overrun(b) ? -1 : 0;
+}
+
 void fd_periodicstats(struct sched_ent *alarm)
 {
   fd_showstats();
@@ -208,13 +333,27 @@ void dump_stack(int log_level)
   }
 }
 
+static inline unsigned histogram_bucket(time_ns_t elapsed)
+{
+  if (elapsed <= 0)
+    return 0;
+#ifdef __GNUC__
+  unsigned bucket = 64 - __builtin_clzll((unsigned long long)elapsed);
+#else
+  unsigned bucket = 0;
+  while ((elapsed >> bucket) != 0)
+    bucket++;
+#endif
+  return bucket < PROFILE_HISTOGRAM_BUCKETS ? bucket : PROFILE_HISTOGRAM_BUCKETS - 1;
+}
+
 int fd_func_enter(struct __sourceloc __whence, struct call_stats *this_call)
 {
   if (config.debug.profiling)
     DEBUGF("%s called from %s() %s:%d",
 	   __FUNCTION__,__whence.function,__whence.file,__whence.line); 
  
-  this_call->enter_time=gettime_ms();
+  this_call->enter_time=gettime_ns();
   this_call->child_time=0;
   this_call->prev = current_call;
   current_call = this_call;
@@ -234,8 +373,8 @@ int fd_func_exit(struct __sourceloc __whence, struct call_stats *this_call)
   if (current_call != this_call)
     FATAL("performance timing stack trace corrupted");
   
-  time_ms_t now = gettime_ms();
-  time_ms_t elapsed = now - this_call->enter_time;
+  time_ns_t now = gettime_ns();
+  time_ns_t elapsed = now - this_call->enter_time;
   current_call = this_call->prev;
   
   if (this_call->totals && !this_call->totals->_initialised){
@@ -256,6 +395,8 @@ int fd_func_exit(struct __sourceloc __whence, struct call_stats *this_call)
     this_call->totals->calls++;
     
     if (elapsed>this_call->totals->max_time) this_call->totals->max_time=elapsed;
+    
+    this_call->totals->histogram[histogram_bucket(elapsed)]++;
   }
   
   return 0;
@@ -50,6 +50,14 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 // assumed to always be 2^n
 #define RHIZOME_CRYPT_PAGE_SIZE         4096
 
+// payload hash tree; leaves cover one crypt page each, hashes are truncated SHA-512
+#define RHIZOME_MERKLE_BLOCK_SIZE       RHIZOME_CRYPT_PAGE_SIZE
+#define RHIZOME_MERKLE_HASH_BYTES       32
+#define RHIZOME_MERKLE_HASH_STRLEN      (RHIZOME_MERKLE_HASH_BYTES * 2)
+
+// MDP block requests carry a bitmap of up to this many 32-bit words, one bit per block
+#define RHIZOME_MDP_MAX_BITMAP_WORDS    8
+
 #define RHIZOME_HTTP_PORT 4110
 #define RHIZOME_HTTP_PORT_MAX 4150
 
@@ -119,6 +127,7 @@ extern time_ms_t rhizome_voice_timeout;
 #define RHIZOME_PRIORITY_NOTINTERESTED 0
 
 #define RHIZOME_IDLE_TIMEOUT 20000
+#define RHIZOME_PARTIAL_PERSIST_MS (7*24*60*60*1000)
 
 typedef struct rhizome_signature {
   unsigned char signature[crypto_sign_edwards25519sha512batch_BYTES
@@ -179,16 +188,18 @@ typedef struct rhizome_manifest
    * and allow manifest struct copying without string lifetime issues.
    */
   unsigned short var_count;
-  const char *vars[MAX_MANIFEST_VARS];
-  const char *values[MAX_MANIFEST_VARS];
+  unsigned short var_alloc;
+  const char **vars;
+  const char **values;
 
   /* Parties who have signed this manifest (binary format, malloc(3)).
    * Recognised signature types:
    *    0x17 = crypto_sign_edwards25519sha512batch()
    */
   unsigned short sig_count;
-  unsigned char *signatories[MAX_MANIFEST_VARS];
-  uint8_t signatureTypes[MAX_MANIFEST_VARS];
+  unsigned short sig_alloc;
+  unsigned char **signatories;
+  uint8_t *signatureTypes;
 
   /* Imperfections.
    *  - Errors involve the correctness of fields that are mandatory for proper
@@ -291,6 +302,11 @@ typedef struct rhizome_manifest
   sid_t sender;
   sid_t recipient;
 
+  /* Root of the payload hash tree, from the optional "merkle" field.
+   */
+  bool_t has_merkle_root;
+  unsigned char merkle_root[RHIZOME_MERKLE_HASH_BYTES];
+
   /* Local data, not encapsulated in the bundle.  The system time of the most
    * recent INSERT or UPDATE of the manifest into the store.  Zero if the manifest
    * has not been stored yet.
@@ -303,14 +319,14 @@ typedef struct rhizome_manifest
    */
   sid_t author;
 
-  /* Unused.  SHOULD BE DELETED.
+  /* The manifest text and signature blocks, in a heap buffer (malloc(3)) of
+   * manifest_data_size bytes, which is always at least one more than
+   * manifest_all_bytes so the content is followed by a NUL.
    */
-  unsigned group_count;
-  char *groups[MAX_MANIFEST_VARS];
-
   unsigned manifest_bytes;
   unsigned manifest_all_bytes;
-  unsigned char manifestdata[MAX_MANIFEST_BYTES];
+  unsigned manifest_data_size;
+  unsigned char *manifestdata;
   unsigned char manifesthash[crypto_hash_sha512_BYTES];
 
 } rhizome_manifest;
@@ -345,6 +361,7 @@ typedef struct rhizome_manifest
 #define rhizome_manifest_set_inserttime(m,v)    _rhizome_manifest_set_inserttime(__WHENCE__,(m),(v))
 #define rhizome_manifest_set_author(m,v)        _rhizome_manifest_set_author(__WHENCE__,(m),(v))
 #define rhizome_manifest_del_author(m)          _rhizome_manifest_del_author(__WHENCE__,(m))
+#define rhizome_manifest_set_merkle_root(m,v)   _rhizome_manifest_set_merkle_root(__WHENCE__,(m),(v))
 
 void _rhizome_manifest_set_id(struct __sourceloc, rhizome_manifest *, const rhizome_bid_t *);
 void _rhizome_manifest_set_version(struct __sourceloc, rhizome_manifest *, int64_t); // TODO change to uint64_t
@@ -367,6 +384,7 @@ void _rhizome_manifest_set_crypt(struct __sourceloc, rhizome_manifest *, enum rh
 void _rhizome_manifest_set_inserttime(struct __sourceloc, rhizome_manifest *, time_ms_t);
 void _rhizome_manifest_set_author(struct __sourceloc, rhizome_manifest *, const sid_t *);
 void _rhizome_manifest_del_author(struct __sourceloc, rhizome_manifest *);
+void _rhizome_manifest_set_merkle_root(struct __sourceloc, rhizome_manifest *, const unsigned char *);
 
 /* Supported service identifiers.  These go in the 'service' field of every
  * manifest, and indicate which application must be used to process the bundle
@@ -400,12 +418,14 @@ extern sqlite3 *rhizome_db;
 
 int rhizome_opendb();
 int rhizome_close_db();
+void rhizome_wal_checkpoint(struct sched_ent *alarm);
 void verify_bundles();
 
 struct rhizome_cleanup_report {
     unsigned deleted_stale_incoming_files;
     unsigned deleted_orphan_files;
     unsigned deleted_orphan_fileblobs;
+    unsigned deleted_expired_partials;
 };
 
 int rhizome_cleanup(struct rhizome_cleanup_report *report);
@@ -449,6 +469,7 @@ void _rhizome_manifest_free(struct __sourceloc __whence, rhizome_manifest *m);
 #define rhizome_manifest_free(m) _rhizome_manifest_free(__WHENCE__,m)
 rhizome_manifest *_rhizome_new_manifest(struct __sourceloc __whence);
 #define rhizome_new_manifest() _rhizome_new_manifest(__WHENCE__)
+int rhizome_manifest_add_signatory(rhizome_manifest *m, uint8_t type, const unsigned char *public_key);
 
 int rhizome_manifest_pack_variables(rhizome_manifest *m);
 int rhizome_store_bundle(rhizome_manifest *m);
@@ -521,6 +542,10 @@ sqlite3_stmt *_sqlite_prepare_bind(struct __sourceloc, int log_level, sqlite_ret
 int _sqlite_retry(struct __sourceloc, sqlite_retry_state *retry, const char *action);
 void _sqlite_retry_done(struct __sourceloc, sqlite_retry_state *retry, const char *action);
 int _sqlite_step(struct __sourceloc, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement);
+void sqlite_finalize(sqlite3_stmt *statement);
+int sqlite_column_rhizome_bid_t(sqlite3_stmt *statement, int column, rhizome_bid_t *bidp);
+int sqlite_column_rhizome_filehash_t(sqlite3_stmt *statement, int column, rhizome_filehash_t *hashp);
+void sqlite_statement_cache_stats(unsigned *hits, unsigned *misses);
 int _sqlite_exec_void(struct __sourceloc, int log_level, const char *sqltext, ...);
 int _sqlite_exec_void_retry(struct __sourceloc, int log_level, sqlite_retry_state *retry, const char *sqltext, ...);
 int _sqlite_exec_int64(struct __sourceloc, int64_t *result, const char *sqltext, ...);
@@ -557,12 +582,13 @@ int _sqlite_vexec_strbuf_retry(struct __sourceloc, sqlite_retry_state *retry, st
 
 double rhizome_manifest_get_double(rhizome_manifest *m,char *var,double default_value);
 int rhizome_manifest_extract_signature(rhizome_manifest *m, unsigned *ofs);
-int rhizome_update_file_priority(const char *fileid);
+int rhizome_update_file_priority(const rhizome_filehash_t *hashp);
 int rhizome_find_duplicate(const rhizome_manifest *m, rhizome_manifest **found);
 int rhizome_manifest_to_bar(rhizome_manifest *m,unsigned char *bar);
 int64_t rhizome_bar_version(const unsigned char *bar);
 uint64_t rhizome_bar_bidprefix_ll(unsigned char *bar);
 int rhizome_is_bar_interesting(unsigned char *bar);
+void rhizome_known_bundle_stats(unsigned *count, unsigned *hits, unsigned *misses);
 int rhizome_is_manifest_interesting(rhizome_manifest *m);
 int rhizome_list_manifests(struct cli_context *context, const char *service, const char *name,
 			   const char *sender_sid, const char *recipient_sid,
@@ -613,14 +639,17 @@ int rhizome_verify_bundle_privatekey(const unsigned char *sk, const unsigned cha
 int rhizome_queue_ignore_manifest(unsigned char *bid_prefix, int prefix_len, int timeout);
 int rhizome_ignore_manifest_check(unsigned char *bid_prefix, int prefix_len);
 
-/* one manifest is required per candidate, plus a few spare.
-   so MAX_RHIZOME_MANIFESTS must be > MAX_CANDIDATES. 
+/* Manifest records are allocated from a pool that grows on demand, this many
+   records at a time.  The pool never holds more than MAX_RHIZOME_MANIFESTS
+   records, so that a leak is reported instead of exhausting memory.
 */
-#define MAX_RHIZOME_MANIFESTS 40
+#define RHIZOME_MANIFEST_POOL_BLOCK 16
+#define MAX_RHIZOME_MANIFESTS 4096
 #define MAX_CANDIDATES 32
 
 int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sockaddr_in *peerip, const sid_t *peersidp);
 rhizome_manifest * rhizome_fetch_search(const unsigned char *id, int prefix_length);
+int rhizome_fetch_add_source(const unsigned char *prefix, size_t prefix_length, uint64_t version, const sid_t *peersidp);
 
 /* Rhizome file storage api */
 struct rhizome_write_buffer
@@ -653,6 +682,28 @@ struct rhizome_write
   int64_t blob_rowid;
   int blob_fd;
   sqlite3_blob *sql_blob;
+  
+  /* Payload hash tree leaves (malloc(3)).  If merkle_verify is set these are the expected hashes,
+   * and each leaf is checked as soon as all of its data has been processed; a leaf that fails is
+   * discarded and the write rewinds to its start.  Otherwise the leaves are computed as the data
+   * is processed, and rhizome_finish_write() sets merkle_root.
+   */
+  unsigned char *merkle_leaves;
+  size_t merkle_leaf_count;
+  bool_t merkle_verify;
+  bool_t merkle_active; // merkle_context has seen the current leaf from its start
+  SHA512_CTX merkle_context;
+  SHA512_CTX merkle_file_context; // sha512_context as at the start of the current leaf
+  unsigned merkle_rejected;
+  bool_t has_merkle_root;
+  unsigned char merkle_root[RHIZOME_MERKLE_HASH_BYTES];
+  
+  /* Set if the data received so far is recorded in the PARTIALS table, so that an interrupted
+   * fetch of the same payload can carry on from it.  partial_offset is the length of the prefix
+   * that was last recorded.
+   */
+  bool_t partial;
+  uint64_t partial_offset;
 };
 
 struct rhizome_read_buffer{
@@ -675,6 +726,9 @@ struct rhizome_read
   
   int64_t blob_rowid;
   int blob_fd;
+  // read-only mapping of an external blob file, or NULL if reads go through blob_fd
+  const unsigned char *blob_map;
+  size_t blob_map_length;
   
   uint64_t tail;
   uint64_t offset;
@@ -721,7 +775,9 @@ typedef struct rhizome_http_request
 
 int rhizome_received_content(const unsigned char *bidprefix,uint64_t version, 
 			     uint64_t offset, size_t count,unsigned char *bytes,
-			     int type);
+			     int type, const sid_t *senderp);
+int rhizome_received_merkle(const unsigned char *bidprefix, uint64_t version,
+			    size_t first, size_t leaf_count, const unsigned char *hashes, size_t count);
 int64_t rhizome_database_create_blob_for(const char *filehashhex_or_tempid,
 					 int64_t fileLength,int priority);
 int rhizome_server_set_response(rhizome_http_request *r, const struct http_response *h);
@@ -859,7 +915,9 @@ int rhizome_any_fetch_active();
 int rhizome_any_fetch_queued();
 uint64_t rhizome_fetch_queue_bytes();
 int rhizome_fetch_status_html(struct strbuf *b);
+int rhizome_fetch_stats_json(struct strbuf *b);
 int rhizome_fetch_has_queue_space(unsigned char log2_size);
+void rhizome_fetch_suspend_all();
 
 struct http_response_parts {
   uint16_t code;
@@ -879,7 +937,11 @@ int rhizome_write_buffer(struct rhizome_write *write_state, unsigned char *buffe
 int rhizome_random_write(struct rhizome_write *write_state, uint64_t offset, unsigned char *buffer, size_t data_size);
 int rhizome_write_open_manifest(struct rhizome_write *write, rhizome_manifest *m);
 int rhizome_write_file(struct rhizome_write *write, const char *filename);
+int rhizome_write_merkle_build(struct rhizome_write *write);
+int rhizome_write_merkle_verify(struct rhizome_write *write, unsigned char *leaves, size_t leaf_count);
+int rhizome_open_write_partial(struct rhizome_write *write, const rhizome_filehash_t *expectedHashp, uint64_t file_length, int priority);
 int rhizome_fail_write(struct rhizome_write *write);
+int rhizome_suspend_write(struct rhizome_write *write);
 int rhizome_finish_write(struct rhizome_write *write);
 int rhizome_import_file(rhizome_manifest *m, const char *filepath);
 int rhizome_import_buffer(rhizome_manifest *m, unsigned char *buffer, size_t length);
@@ -903,11 +965,22 @@ int rhizome_dump_file(const rhizome_filehash_t *hashp, const char *filepath, int
 int rhizome_read_cached(const rhizome_bid_t *bid, uint64_t version, time_ms_t timeout, 
   uint64_t fileOffset, unsigned char *buffer, size_t length);
 int rhizome_cache_close();
+void rhizome_cache_stats(unsigned *count, unsigned *hits, unsigned *misses);
+int rhizome_read_cached_merkle(const rhizome_bid_t *bidp, uint64_t version, time_ms_t timeout,
+  size_t first, unsigned char *hashes, size_t max, size_t *leaf_count);
+
+size_t rhizome_merkle_leaf_count(uint64_t length);
+void rhizome_merkle_leaf_init(SHA512_CTX *context);
+void rhizome_merkle_leaf_final(SHA512_CTX *context, unsigned char *hash);
+void rhizome_merkle_leaf(const unsigned char *data, size_t len, unsigned char *hash);
+int rhizome_merkle_root(const unsigned char *leaves, size_t leaf_count, unsigned char *root);
 
 int rhizome_database_filehash_from_id(const rhizome_bid_t *bidp, uint64_t version, rhizome_filehash_t *hashp);
 
 int overlay_mdp_service_rhizome_sync(struct overlay_frame *frame, overlay_mdp_frame *mdp);
 int rhizome_sync_announce();
-int rhizome_sync_bundle_inserted(const unsigned char *bar);
+int rhizome_sync_bundle_inserted(uint64_t rowid, const unsigned char *bar);
+void rhizome_sync_bundle_deleted(const unsigned char *prefix);
+void rhizome_sync_stats_json(struct strbuf *b);
 
 #endif //__SERVALDNA__RHIZOME_H
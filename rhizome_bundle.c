@@ -48,6 +48,75 @@ static int64_t rhizome_manifest_get_ll(rhizome_manifest *m, const char *var)
 }
 #endif
 
+/* Make room for at least one more entry in the vars[] and values[] arrays, which start small and
+ * double as needed up to MAX_MANIFEST_VARS.
+ */
+static int rhizome_manifest_grow_vars(rhizome_manifest *m)
+{
+  if (m->var_count < m->var_alloc)
+    return 0;
+  if (m->var_count >= MAX_MANIFEST_VARS)
+    return -1;
+  unsigned alloc = m->var_alloc ? m->var_alloc * 2 : 8;
+  if (alloc > MAX_MANIFEST_VARS)
+    alloc = MAX_MANIFEST_VARS;
+  const char **vars = erealloc(m->vars, alloc * sizeof *vars);
+  if (vars == NULL)
+    return -1;
+  m->vars = vars;
+  const char **values = erealloc(m->values, alloc * sizeof *values);
+  if (values == NULL)
+    return -1;
+  m->values = values;
+  m->var_alloc = alloc;
+  return 0;
+}
+
+/* Append a signatory's public key to the manifest's list of verified signatures.
+ */
+int rhizome_manifest_add_signatory(rhizome_manifest *m, uint8_t type, const unsigned char *public_key)
+{
+  if (m->sig_count >= m->sig_alloc) {
+    if (m->sig_count >= MAX_MANIFEST_VARS)
+      return WHY("Too many signatures");
+    unsigned alloc = m->sig_alloc ? m->sig_alloc * 2 : 2;
+    unsigned char **signatories = erealloc(m->signatories, alloc * sizeof *signatories);
+    if (signatories == NULL)
+      return -1;
+    m->signatories = signatories;
+    uint8_t *types = erealloc(m->signatureTypes, alloc * sizeof *types);
+    if (types == NULL)
+      return -1;
+    m->signatureTypes = types;
+    m->sig_alloc = alloc;
+  }
+  unsigned char *key = emalloc(crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
+  if (key == NULL)
+    return -1;
+  bcopy(public_key, key, crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
+  m->signatureTypes[m->sig_count] = type;
+  m->signatories[m->sig_count] = key;
+  m->sig_count++;
+  return 0;
+}
+
+/* Ensure the manifestdata[] buffer can hold the given number of bytes followed by a NUL.
+ */
+static int rhizome_manifest_reserve_data(rhizome_manifest *m, unsigned bytes)
+{
+  if (bytes > MAX_MANIFEST_BYTES)
+    return WHY("Manifest is too long");
+  if (bytes + 1 > m->manifest_data_size) {
+    unsigned char *data = erealloc(m->manifestdata, bytes + 1);
+    if (data == NULL)
+      return -1;
+    m->manifestdata = data;
+    m->manifest_data_size = bytes + 1;
+  }
+  m->manifestdata[bytes] = '\0';
+  return 0;
+}
+
 /* @author Andrew Bettison <andrew@servalproject.com>
  */
 static int _rhizome_manifest_del(struct __sourceloc __whence, rhizome_manifest *m, const char *var)
@@ -91,7 +160,7 @@ static const char *_rhizome_manifest_set(struct __sourceloc __whence, rhizome_ma
       m->finalised = 0;
       return ret;
     }
-  if (m->var_count >= MAX_MANIFEST_VARS)
+  if (rhizome_manifest_grow_vars(m) == -1)
     return WHYNULL("no more manifest vars");
   if ((m->vars[m->var_count] = str_edup(var)) == NULL)
     return NULL;
@@ -159,11 +228,27 @@ void _rhizome_manifest_set_filehash(struct __sourceloc __whence, rhizome_manifes
     assert(m->filesize > 0);
     const char *v = rhizome_manifest_set(m, "filehash", alloca_tohex_rhizome_filehash_t(*hash));
     assert(v); // TODO: remove known manifest fields from vars[]
+    if (cmp_rhizome_filehash_t(&m->filehash, hash) != 0)
+      _rhizome_manifest_set_merkle_root(__whence, m, NULL); // describes the old payload
     m->filehash = *hash;
   } else {
     assert(m->filesize == 0);
     rhizome_manifest_del(m, "filehash");
     m->filehash = RHIZOME_FILEHASH_NONE;
+    _rhizome_manifest_set_merkle_root(__whence, m, NULL);
+  }
+}
+
+void _rhizome_manifest_set_merkle_root(struct __sourceloc __whence, rhizome_manifest *m, const unsigned char *root)
+{
+  if (root) {
+    const char *v = rhizome_manifest_set(m, "merkle", alloca_tohex(root, RHIZOME_MERKLE_HASH_BYTES));
+    assert(v); // TODO: remove known manifest fields from vars[]
+    bcopy(root, m->merkle_root, sizeof m->merkle_root);
+    m->has_merkle_root = 1;
+  } else if (m->has_merkle_root || rhizome_manifest_get(m, "merkle")) {
+    rhizome_manifest_del(m, "merkle");
+    m->has_merkle_root = 0;
   }
 }
 
@@ -343,7 +428,9 @@ int rhizome_manifest_verify(rhizome_manifest *m)
   unsigned end_of_text=0;
 
   /* find end of manifest body and start of signatures */
-  while(m->manifestdata[end_of_text]&&end_of_text<m->manifest_all_bytes)
+  if (m->manifest_all_bytes == 0)
+    return WHY("Manifest is empty");
+  while(end_of_text<m->manifest_all_bytes && m->manifestdata[end_of_text])
     end_of_text++;
   end_of_text++; /* include null byte in body for verification purposes */
 
@@ -466,7 +553,7 @@ int rhizome_manifest_parse(rhizome_manifest *m)
 	if (config.debug.rejecteddata)
 	  DEBUGF("Ill formed manifest file, duplicate variable \"%s\"", var);
 	m->errors++;
-      } else if (m->var_count >= MAX_MANIFEST_VARS) {
+      } else if (rhizome_manifest_grow_vars(m) == -1) {
 	if (config.debug.rejecteddata)
 	  WARN("Ill formed manifest file, too many variables");
 	m->errors++;
@@ -597,6 +684,16 @@ int rhizome_manifest_parse(rhizome_manifest *m)
 	  m->name = m->values[m->var_count]; // will be free()d when vars[] and values[] are free()d
 	  if (config.debug.rhizome_manifest)
 	    DEBUGF("PARSE manifest[%d].name = %s", m->manifest_record_number, alloca_str_toprint(m->name));
+	} else if (strcasecmp(var, "merkle") == 0) {
+	  if (strlen(value) != RHIZOME_MERKLE_HASH_STRLEN || fromhexstr(m->merkle_root, value, RHIZOME_MERKLE_HASH_BYTES) == -1) {
+	    if (config.debug.rejecteddata)
+	      DEBUGF("Invalid merkle: %s", value);
+	    m->warnings++;
+	  } else {
+	    m->has_merkle_root = 1;
+	    if (config.debug.rhizome_manifest)
+	      DEBUGF("PARSE manifest[%d].merkle = %s", m->manifest_record_number, alloca_tohex(m->merkle_root, RHIZOME_MERKLE_HASH_BYTES));
+	  }
 	} else if (strcasecmp(var, "crypt") == 0) {
 	  if (!(strcmp(value, "0") == 0 || strcmp(value, "1") == 0)) {
 	    if (config.debug.rejecteddata)
@@ -676,17 +773,23 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, size_t
 {
   if (!m)
     return WHY("Null manifest");
-  if (bufferP>sizeof(m->manifestdata))
+  if (bufferP>MAX_MANIFEST_BYTES)
     return WHY("Buffer too big");
 
   if (bufferP) {
+    if (rhizome_manifest_reserve_data(m, bufferP) == -1)
+      return -1;
     m->manifest_bytes=bufferP;
     memcpy(m->manifestdata, filename, m->manifest_bytes);
   } else {
-    ssize_t bytes = read_whole_file(filename, m->manifestdata, sizeof m->manifestdata);
+    unsigned char buffer[MAX_MANIFEST_BYTES];
+    ssize_t bytes = read_whole_file(filename, buffer, sizeof buffer);
     if (bytes == -1)
       return -1;
+    if (rhizome_manifest_reserve_data(m, bytes) == -1)
+      return -1;
     m->manifest_bytes = bytes;
+    memcpy(m->manifestdata, buffer, m->manifest_bytes);
   }
   return rhizome_manifest_parse(m);
 }
@@ -735,65 +838,111 @@ int rhizome_hash_file(rhizome_manifest *m, const char *path, rhizome_filehash_t
   return 0;
 }
 
-rhizome_manifest manifests[MAX_RHIZOME_MANIFESTS];
-char manifest_free[MAX_RHIZOME_MANIFESTS];
-int manifest_first_free=-1;
-struct __sourceloc manifest_alloc_whence[MAX_RHIZOME_MANIFESTS];
-struct __sourceloc manifest_free_whence[MAX_RHIZOME_MANIFESTS];
+/* Manifest records are allocated in blocks of RHIZOME_MANIFEST_POOL_BLOCK, which are never
+ * released.  Free records are chained through next_free, so allocating and freeing are O(1).  A
+ * record's manifest_record_number is its index in the pool, which stays fixed for the life of the
+ * process, and is used to check that a pointer being freed really is a pool record.
+ */
+struct manifest_record {
+  rhizome_manifest manifest;
+  struct manifest_record *next_free;
+  unsigned index;
+  bool_t is_free;
+  struct __sourceloc alloc_whence;
+  struct __sourceloc free_whence;
+};
+
+static struct manifest_record **manifest_blocks = NULL;
+static unsigned manifest_block_count = 0;
+static struct manifest_record *manifest_free_list = NULL;
+static unsigned manifest_count_free = 0;
+
+static struct manifest_record *manifest_record(unsigned mid)
+{
+  if (mid >= manifest_block_count * RHIZOME_MANIFEST_POOL_BLOCK)
+    return NULL;
+  return &manifest_blocks[mid / RHIZOME_MANIFEST_POOL_BLOCK][mid % RHIZOME_MANIFEST_POOL_BLOCK];
+}
 
 static void _log_manifest_trace(struct __sourceloc __whence, const char *operation)
 {
-  int count_free = 0;
-  unsigned i;
-  for (i = 0; i != MAX_RHIZOME_MANIFESTS; ++i)
-    if (manifest_free[i])
-      ++count_free;
-  DEBUGF("%s(): count_free = %d", operation, count_free);
+  DEBUGF("%s(): count_free = %u of %u", operation, manifest_count_free, manifest_block_count * RHIZOME_MANIFEST_POOL_BLOCK);
 }
 
-rhizome_manifest *_rhizome_new_manifest(struct __sourceloc __whence)
+static void _log_manifest_leaks()
 {
-  if (manifest_first_free<0) {
-    /* Setup structures */
-    unsigned i;
-    for(i=0;i<MAX_RHIZOME_MANIFESTS;i++) {
-      manifest_alloc_whence[i]=__NOWHERE__;
-      manifest_free_whence[i]=__NOWHERE__;
-      manifest_free[i]=1;
+  unsigned total = manifest_block_count * RHIZOME_MANIFEST_POOL_BLOCK;
+  unsigned i, j;
+  WHYF("   Count | Allocated by");
+  for (i = 0; i < total; i++) {
+    struct manifest_record *r = manifest_record(i);
+    if (r->is_free)
+      continue;
+    // only report the first record allocated from each place
+    for (j = 0; j < i; j++) {
+      struct manifest_record *q = manifest_record(j);
+      if (!q->is_free && q->alloc_whence.line == r->alloc_whence.line && q->alloc_whence.file == r->alloc_whence.file)
+	break;
+    }
+    if (j < i)
+      continue;
+    unsigned count = 0;
+    for (j = i; j < total; j++) {
+      struct manifest_record *q = manifest_record(j);
+      if (!q->is_free && q->alloc_whence.line == r->alloc_whence.line && q->alloc_whence.file == r->alloc_whence.file)
+	count++;
     }
-    manifest_first_free=0;
+    WHYF("   %-5u | %s:%d in %s()", count, r->alloc_whence.file, r->alloc_whence.line, r->alloc_whence.function);
   }
+}
 
-  /* No free manifests */
-  if (manifest_first_free>=MAX_RHIZOME_MANIFESTS)
-    {
-      unsigned i;
-      WHYF("%s(): no free manifest records, this probably indicates a memory leak", __FUNCTION__);
-      WHYF("   Slot# | Last allocated by");
-      for(i=0;i<MAX_RHIZOME_MANIFESTS;i++) {
-	WHYF("   %-5d | %s:%d in %s()",
-		i,
-		manifest_alloc_whence[i].file,
-		manifest_alloc_whence[i].line,
-		manifest_alloc_whence[i].function
-	    );
-      }
-      return NULL;
-    }
+static int manifest_pool_grow()
+{
+  if (manifest_block_count * RHIZOME_MANIFEST_POOL_BLOCK >= MAX_RHIZOME_MANIFESTS)
+    return -1;
+  struct manifest_record **blocks = erealloc(manifest_blocks, (manifest_block_count + 1) * sizeof *blocks);
+  if (blocks == NULL)
+    return -1;
+  manifest_blocks = blocks;
+  struct manifest_record *block = emalloc_zero(RHIZOME_MANIFEST_POOL_BLOCK * sizeof *block);
+  if (block == NULL)
+    return -1;
+  manifest_blocks[manifest_block_count++] = block;
+  // chain the new records in index order, so the lowest numbered records are used first
+  unsigned i = RHIZOME_MANIFEST_POOL_BLOCK;
+  while (i--) {
+    block[i].index = (manifest_block_count - 1) * RHIZOME_MANIFEST_POOL_BLOCK + i;
+    block[i].is_free = 1;
+    block[i].alloc_whence = __NOWHERE__;
+    block[i].free_whence = __NOWHERE__;
+    block[i].next_free = manifest_free_list;
+    manifest_free_list = &block[i];
+  }
+  manifest_count_free += RHIZOME_MANIFEST_POOL_BLOCK;
+  return 0;
+}
 
-  rhizome_manifest *m=&manifests[manifest_first_free];
-  bzero(m,sizeof(rhizome_manifest));
-  m->manifest_record_number=manifest_first_free;
+rhizome_manifest *_rhizome_new_manifest(struct __sourceloc __whence)
+{
+  if (manifest_free_list == NULL && manifest_pool_grow() == -1) {
+    WHYF("%s(): no free manifest records, this probably indicates a memory leak", __FUNCTION__);
+    _log_manifest_leaks();
+    return NULL;
+  }
+
+  struct manifest_record *r = manifest_free_list;
+  manifest_free_list = r->next_free;
+  --manifest_count_free;
+  rhizome_manifest *m = &r->manifest;
+  bzero(m, sizeof(rhizome_manifest));
+  m->manifest_record_number = r->index;
 
   /* Indicate where manifest was allocated, and that it is no longer
      free. */
-  manifest_alloc_whence[manifest_first_free]=__whence;
-  manifest_free[manifest_first_free]=0;
-  manifest_free_whence[manifest_first_free]=__NOWHERE__;
-
-  /* Work out where next free manifest record lives */
-  for (; manifest_first_free < MAX_RHIZOME_MANIFESTS && !manifest_free[manifest_first_free]; ++manifest_first_free)
-    ;
+  r->alloc_whence = __whence;
+  r->is_free = 0;
+  r->next_free = NULL;
+  r->free_whence = __NOWHERE__;
 
   if (config.debug.manifests) _log_manifest_trace(__whence, __FUNCTION__);
 
@@ -808,18 +957,19 @@ void _rhizome_manifest_free(struct __sourceloc __whence, rhizome_manifest *m)
 {
   if (!m) return;
   int mid=m->manifest_record_number;
+  struct manifest_record *r = mid < 0 ? NULL : manifest_record(mid);
 
-  if (m!=&manifests[mid])
+  if (r == NULL || m!=&r->manifest)
     FATALF("%s(): asked to free manifest %p, which claims to be manifest slot #%d (%p), but isn't",
-	  __FUNCTION__, m, mid, &manifests[mid]
+	  __FUNCTION__, m, mid, r ? &r->manifest : NULL
       );
 
-  if (manifest_free[mid])
+  if (r->is_free)
     FATALF("%s(): asked to free manifest slot #%d (%p), which was already freed at %s:%d:%s()",
 	  __FUNCTION__, mid, m,
-	  manifest_free_whence[mid].file,
-	  manifest_free_whence[mid].line,
-	  manifest_free_whence[mid].function
+	  r->free_whence.file,
+	  r->free_whence.line,
+	  r->free_whence.function
 	);
 
   /* Free variable and signature blocks. */
@@ -827,12 +977,18 @@ void _rhizome_manifest_free(struct __sourceloc __whence, rhizome_manifest *m)
   for(i=0;i<m->var_count;i++) {
     free((char *) m->vars[i]);
     free((char *) m->values[i]);
-    m->vars[i] = m->values[i] = NULL;
   }
-  for(i=0;i<m->sig_count;i++) {
+  free(m->vars);
+  free(m->values);
+  m->vars = m->values = NULL;
+  for(i=0;i<m->sig_count;i++)
     free(m->signatories[i]);
-    m->signatories[i] = NULL;
-  }
+  free(m->signatories);
+  free(m->signatureTypes);
+  m->signatories = NULL;
+  m->signatureTypes = NULL;
+  free(m->manifestdata);
+  m->manifestdata = NULL;
 
   if (m->dataFileName) {
     if (m->dataFileUnlinkOnFree && unlink(m->dataFileName) == -1)
@@ -841,9 +997,11 @@ void _rhizome_manifest_free(struct __sourceloc __whence, rhizome_manifest *m)
     m->dataFileName = NULL;
   }
 
-  manifest_free[mid]=1;
-  manifest_free_whence[mid]=__whence;
-  if (mid<manifest_first_free) manifest_first_free=mid;
+  r->is_free=1;
+  r->free_whence=__whence;
+  r->next_free=manifest_free_list;
+  manifest_free_list=r;
+  ++manifest_count_free;
 
   if (config.debug.manifests) _log_manifest_trace(__whence, __FUNCTION__);
 
@@ -859,9 +1017,16 @@ int rhizome_manifest_pack_variables(rhizome_manifest *m)
   unsigned ofs = 0;
   for(i=0;i<m->var_count;i++)
     {
-      if ((ofs+strlen(m->vars[i])+1+strlen(m->values[i])+1+1)>MAX_MANIFEST_BYTES)
+      ofs+=strlen(m->vars[i])+1+strlen(m->values[i])+1;
+      if (ofs+1>MAX_MANIFEST_BYTES)
 	return WHY("Manifest variables too long in total to fit in MAX_MANIFEST_BYTES");
-      snprintf((char *)&m->manifestdata[ofs],MAX_MANIFEST_BYTES-ofs,"%s=%s\n",
+    }
+  if (rhizome_manifest_reserve_data(m, ofs+1) == -1)
+    return -1;
+  ofs = 0;
+  for(i=0;i<m->var_count;i++)
+    {
+      snprintf((char *)&m->manifestdata[ofs],m->manifest_data_size-ofs,"%s=%s\n",
 	       m->vars[i],m->values[i]);
       ofs+=strlen((char *)&m->manifestdata[ofs]);
     }
@@ -889,6 +1054,8 @@ int rhizome_manifest_selfsign(rhizome_manifest *m)
   /* Append signature to end of manifest data */
   if (sig.signatureLength + m->manifest_bytes > MAX_MANIFEST_BYTES)
     return WHY("Manifest plus signatures is too long");
+  if (rhizome_manifest_reserve_data(m, m->manifest_bytes + sig.signatureLength) == -1)
+    return -1;
   bcopy(&sig.signature[0], &m->manifestdata[m->manifest_bytes], sig.signatureLength);
   m->manifest_bytes += sig.signatureLength;
   m->manifest_all_bytes = m->manifest_bytes;
@@ -514,6 +514,11 @@ int rhizome_manifest_extract_signature(rhizome_manifest *m, unsigned *ofs)
 
   uint8_t sigType = m->manifestdata[*ofs];
   uint8_t len = (sigType << 2) + 4 + 1;
+  if ((*ofs) + len > m->manifest_all_bytes) {
+    (*ofs) = m->manifest_all_bytes;
+    m->errors++;
+    RETURN(WHY("Truncated signature block"));
+  }
 
   /* Each signature type is required to have a different length to detect it.
      At present only crypto_sign_edwards25519sha512batch() signatures are
@@ -543,16 +548,10 @@ int rhizome_manifest_extract_signature(rhizome_manifest *m, unsigned *ofs)
 	  RETURN(WHY("Error in signature block (verification failed)."));
 	} else {
 	  /* Signature block passes, so add to list of signatures */
-	  m->signatureTypes[m->sig_count]=len;
-	  m->signatories[m->sig_count]
-	    =malloc(crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
-	  if(!m->signatories[m->sig_count]) {
+	  if (rhizome_manifest_add_signatory(m, len, &m->manifestdata[(*ofs)+1+64]) == -1) {
 	    (*ofs)+=len;
-	    RETURN(WHY("malloc() failed when reading signature block"));
+	    RETURN(WHY("failed to record signature block"));
 	  }
-	  bcopy(&m->manifestdata[(*ofs)+1+64],m->signatories[m->sig_count],
-		crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
-	  m->sig_count++;
 	  if (config.debug.rhizome) DEBUG("Signature passed.");
 	}
 	break;
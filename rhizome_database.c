@@ -22,9 +22,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <time.h>
 #include <ctype.h>
 #include <assert.h>
+#include <sys/wait.h>
 #include "serval.h"
 #include "conf.h"
 #include "rhizome.h"
+#include "cli.h"
+#include "net.h"
 #include "strbuf.h"
 #include "strbuf_helpers.h"
 #include "str.h"
@@ -34,6 +37,11 @@ static char rhizome_thisdatastore_path[256];
 static int rhizome_delete_manifest_retry(sqlite_retry_state *retry, const rhizome_bid_t *bidp);
 static int rhizome_delete_file_retry(sqlite_retry_state *retry, const rhizome_filehash_t *hashp);
 static int rhizome_delete_payload_retry(sqlite_retry_state *retry, const rhizome_bid_t *bidp);
+static void known_bundle_add(const unsigned char *prefix, int64_t version);
+static void known_bundle_remove(const unsigned char *prefix);
+static void known_bundle_clear();
+static void sqlite_statement_cache_flush();
+static int _sqlite_exec(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement);
 
 const char *rhizome_datastore_path()
 {
@@ -82,7 +90,7 @@ int rhizome_manifest_priority(sqlite_retry_state *retry, const rhizome_bid_t *bi
 {
   int64_t result = 0;
   if (sqlite_exec_int64_retry(retry, &result,
-	"SELECT max(grouplist.priorty) FROM GROUPLIST,MANIFESTS,GROUPMEMBERSHIPS"
+	"SELECT max(grouplist.priority) FROM GROUPLIST,MANIFESTS,GROUPMEMBERSHIPS"
 	" WHERE MANIFESTS.id = ?"
 	"   AND GROUPLIST.id = GROUPMEMBERSHIPS.groupid"
 	"   AND GROUPMEMBERSHIPS.manifestid = MANIFESTS.id;",
@@ -173,7 +181,7 @@ void verify_bundles(){
     }
     rhizome_manifest_free(m);
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
 }
 
 /*
@@ -205,6 +213,82 @@ void verify_bundles(){
  * -- Andrew Bettison <andrew@servalproject.com>, October 2012
  */
 
+/* SQL function rhizome_fromhex(text, bytes) used by the schema upgrade; converts hex text of
+ * exactly the given number of bytes into a BLOB, and passes any other value through unchanged.
+ */
+static void sqlite_fromhex(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+  assert(argc == 2);
+  int bytes = sqlite3_value_int(argv[1]);
+  if (sqlite3_value_type(argv[0]) == SQLITE_TEXT && bytes > 0 && sqlite3_value_bytes(argv[0]) == bytes * 2) {
+    unsigned char binary[bytes];
+    if (fromhexstr(binary, (const char *) sqlite3_value_text(argv[0]), bytes) == 0) {
+      sqlite3_result_blob(context, binary, bytes, SQLITE_TRANSIENT);
+      return;
+    }
+  }
+  sqlite3_result_value(context, argv[0]);
+}
+
+/* Apply the configured journal mode and tuning pragmas to a freshly opened connection.  The journal
+ * mode is persistent in the database file, so it is only changed when it differs from the
+ * configuration; the others only last for the life of the connection.
+ */
+static int rhizome_configure_db(sqlite_retry_state *retry)
+{
+  strbuf mode = strbuf_alloca(16);
+  if (sqlite_exec_strbuf_retry(retry, mode, "PRAGMA journal_mode;", END) == -1)
+    return -1;
+  int is_wal = strcasecmp(strbuf_str(mode), "wal") == 0;
+  if (config.rhizome.database_wal != is_wal) {
+    strbuf_reset(mode);
+    if (sqlite_exec_strbuf_retry(retry, mode,
+	  config.rhizome.database_wal ? "PRAGMA journal_mode=WAL;" : "PRAGMA journal_mode=DELETE;", END) == -1)
+      return -1;
+    if (config.debug.rhizome)
+      DEBUGF("Rhizome database journal_mode=%s", strbuf_str(mode));
+  }
+  char sql[64];
+  if (config.rhizome.database_synchronous != RHIZOME_DB_SYNC_DEFAULT) {
+    snprintf(sql, sizeof sql, "PRAGMA synchronous=%d;", config.rhizome.database_synchronous);
+    if (sqlite_exec_void_retry(retry, sql, END) == -1)
+      return -1;
+  }
+  if (config.rhizome.database_cache_size) {
+    if (sqlite3_libversion_number() >= 3007010) {
+      // since SQLite 3.7.10 a negative cache_size is in KiB rather than pages
+      snprintf(sql, sizeof sql, "PRAGMA cache_size=-%"PRIu64";", (config.rhizome.database_cache_size + 1023) / 1024);
+    } else {
+      int64_t page_size;
+      if (sqlite_exec_int64_retry(retry, &page_size, "PRAGMA page_size;", END) == -1)
+	return -1;
+      if (page_size <= 0)
+	page_size = 1024;
+      snprintf(sql, sizeof sql, "PRAGMA cache_size=%"PRIu64";",
+	  (config.rhizome.database_cache_size + page_size - 1) / page_size);
+    }
+    if (sqlite_exec_void_retry(retry, sql, END) == -1)
+      return -1;
+  }
+  if (config.rhizome.database_mmap_size) {
+    if (sqlite3_libversion_number() < 3007017) {
+      // older versions ignore the pragma, so say once that the setting does nothing
+      static int warned = 0;
+      if (!warned) {
+	WARNF("rhizome.database_mmap_size has no effect, SQLite %s does not support memory-mapped I/O", sqlite3_libversion());
+	warned = 1;
+      }
+    } else {
+      // SQLite silently clamps this to its compile-time maximum, which may be zero
+      int64_t mmap_size;
+      snprintf(sql, sizeof sql, "PRAGMA mmap_size=%"PRIu64";", config.rhizome.database_mmap_size);
+      if (sqlite_exec_int64_retry(retry, &mmap_size, sql, END) == -1)
+	return -1;
+    }
+  }
+  return 0;
+}
+
 int rhizome_opendb()
 {
   if (rhizome_db) return 0;
@@ -240,6 +324,9 @@ int rhizome_opendb()
   
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
 
+  if (rhizome_configure_db(&retry) == -1)
+    RETURN(WHY("Failed to configure database"));
+
   int64_t version;
   if (sqlite_exec_int64_retry(&retry, &version, "PRAGMA user_version;", END) == -1)
     RETURN(-1);
@@ -284,7 +371,68 @@ int rhizome_opendb()
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=4;", END);
   }
   
-  // TODO recreate tables with collate nocase on hex columns
+  if (version<5){
+    /* Bundle IDs and file hashes used to be stored as upper case hex text.  Rebuild the tables
+       with BLOB keys, preserving MANIFESTS rowids because peers use them as sync tokens.  The
+       temporary numeric ids of incomplete writes are left as they are. */
+    sqlite3_create_function(rhizome_db, "rhizome_fromhex", 2, SQLITE_UTF8, NULL, sqlite_fromhex, NULL, NULL);
+    if (	sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "CREATE TABLE MANIFESTS5(id blob not null primary key, version integer, inserttime integer, filesize integer, filehash blob, author text, bar blob, manifest blob, service text, name text, sender text collate nocase, recipient text collate nocase, tail integer);", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "INSERT INTO MANIFESTS5(rowid, id, version, inserttime, filesize, filehash, author, bar, manifest, service, name, sender, recipient, tail)"
+						" SELECT rowid, rhizome_fromhex(id, 32), version, inserttime, filesize, rhizome_fromhex(filehash, 64), author, bar, manifest, service, name, sender, recipient, tail FROM MANIFESTS;", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "DROP TABLE MANIFESTS;", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "ALTER TABLE MANIFESTS5 RENAME TO MANIFESTS;", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "CREATE TABLE FILES5(id blob not null primary key, length integer, highestpriority integer, datavalid integer, inserttime integer);", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "INSERT INTO FILES5(rowid, id, length, highestpriority, datavalid, inserttime)"
+						" SELECT rowid, rhizome_fromhex(id, 64), length, highestpriority, datavalid, inserttime FROM FILES;", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "DROP TABLE FILES;", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "ALTER TABLE FILES5 RENAME TO FILES;", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "CREATE TABLE FILEBLOBS5(id blob not null primary key, data blob);", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "INSERT INTO FILEBLOBS5(rowid, id, data) SELECT rowid, rhizome_fromhex(id, 64), data FROM FILEBLOBS;", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "DROP TABLE FILEBLOBS;", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "ALTER TABLE FILEBLOBS5 RENAME TO FILEBLOBS;", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "CREATE INDEX bundlesizeindex ON MANIFESTS(filesize);", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "CREATE INDEX IDX_MANIFESTS_HASH ON MANIFESTS(filehash);", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "CREATE INDEX IDX_MANIFESTS_ID_VERSION ON MANIFESTS(id, version);", END) == -1
+      // BARs begin with the BID prefix, so this orders rhizome direct sync's BAR scans
+      ||	sqlite_exec_void_retry(&retry, "CREATE INDEX IDX_MANIFESTS_BAR ON MANIFESTS(bar);", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "PRAGMA user_version=5;", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "COMMIT;", END) == -1
+    ) {
+      sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "ROLLBACK;", END);
+      RETURN(WHY("Failed to convert schema to BLOB keys"));
+    }
+    // give the pages of the old tables back to the file system
+    sqlite_exec_retry_loglevel(LOG_LEVEL_WARN, &retry, sqlite_prepare(&retry, "PRAGMA incremental_vacuum;"));
+  }
+  
+  if (version<6){
+    // payloads that are part way through being fetched, see rhizome_open_write_partial()
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TABLE IF NOT EXISTS PARTIALS(filehash blob not null primary key, temp_id text not null, length integer, ranges blob, updatetime integer);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=6;", END);
+  }
+  
+  if (version<7){
+    /* The group tables are joined against MANIFESTS.id, so their bundle ids must be BLOBs too */
+    sqlite3_create_function(rhizome_db, "rhizome_fromhex", 2, SQLITE_UTF8, NULL, sqlite_fromhex, NULL, NULL);
+    if (	sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "CREATE TABLE GROUPLIST7(id blob not null primary key, closed integer, ciphered integer, priority integer);", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "INSERT INTO GROUPLIST7(id, closed, ciphered, priority)"
+						" SELECT rhizome_fromhex(id, 32), closed, ciphered, priority FROM GROUPLIST;", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "DROP TABLE GROUPLIST;", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "ALTER TABLE GROUPLIST7 RENAME TO GROUPLIST;", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "CREATE TABLE GROUPMEMBERSHIPS7(manifestid blob not null, groupid blob not null);", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "INSERT INTO GROUPMEMBERSHIPS7(manifestid, groupid)"
+						" SELECT rhizome_fromhex(manifestid, 32), rhizome_fromhex(groupid, 32) FROM GROUPMEMBERSHIPS;", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "DROP TABLE GROUPMEMBERSHIPS;", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "ALTER TABLE GROUPMEMBERSHIPS7 RENAME TO GROUPMEMBERSHIPS;", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "PRAGMA user_version=7;", END) == -1
+      ||	sqlite_exec_void_retry(&retry, "COMMIT;", END) == -1
+    ) {
+      sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "ROLLBACK;", END);
+      RETURN(WHY("Failed to convert group tables to BLOB keys"));
+    }
+  }
   
   /* Future schema updates should be performed here. 
    The above schema can be assumed to exist.
@@ -297,6 +445,29 @@ int rhizome_opendb()
   OUT();
 }
 
+/* Scheduled by the server to copy the write-ahead log back into the database while nobody is
+ * looking, rather than leaving it to grow until the commit that crosses SQLite's auto-checkpoint
+ * threshold pays for the whole copy.  PASSIVE mode never waits on readers, so a busy CLI command
+ * only delays the checkpoint to the next interval.
+ */
+void rhizome_wal_checkpoint(struct sched_ent *alarm)
+{
+  if (rhizome_db && config.rhizome.database_wal) {
+    sqlite3_stmt *statement = sqlite_prepare(NULL, "PRAGMA wal_checkpoint(PASSIVE);");
+    if (statement) {
+      if (sqlite_step(statement) == SQLITE_ROW && config.debug.rhizome)
+	DEBUGF("WAL checkpoint copied %d of %d frames%s",
+	    sqlite3_column_int(statement, 2),
+	    sqlite3_column_int(statement, 1),
+	    sqlite3_column_int(statement, 0) ? " (busy)" : "");
+      sqlite_finalize(statement);
+    }
+  }
+  alarm->alarm = gettime_ms() + config.rhizome.database_checkpoint_ms;
+  alarm->deadline = alarm->alarm + 1000;
+  schedule(alarm);
+}
+
 int rhizome_close_db()
 {
   IN();
@@ -307,6 +478,7 @@ int rhizome_close_db()
       WHY("Uncommitted transaction!");
       sqlite_exec_void("ROLLBACK;", END);
     }
+    sqlite_statement_cache_flush();
     sqlite3_stmt *stmt = NULL;
     while ((stmt = sqlite3_next_stmt(rhizome_db, stmt))) {
       const char *sql = sqlite3_sql(stmt);
@@ -372,10 +544,13 @@ sqlite_retry_state sqlite_retry_state_init(int serverLimit, int serverSleep, int
     };
 }
 
+static unsigned sqlite_busy_retries = 0;
+
 int _sqlite_retry(struct __sourceloc __whence, sqlite_retry_state *retry, const char *action)
 {
   time_ms_t now = gettime_ms();
   ++retry->busytries;
+  ++sqlite_busy_retries;
   if (retry->start == -1)
     retry->start = now;
   retry->elapsed = now - retry->start;
@@ -418,6 +593,112 @@ void _sqlite_retry_done(struct __sourceloc __whence, sqlite_retry_state *retry,
     retry->start = -1;
 }
 
+/* Prepared statements are kept in a small cache keyed by their SQL text, so that queries which are
+ * run over and over (eg, by rhizome sync and adverts) skip SQLite's parser and planner.  A statement
+ * handed out by _sqlite_prepare() is marked as in use until it is given back by sqlite_finalize(),
+ * which resets it and clears its bindings instead of destroying it.  If the same SQL is requested
+ * while its cached statement is still in use (eg, a nested query), then a private statement is
+ * prepared and finalised as usual.  Least recently used idle statements are evicted to make room.
+ */
+#define SQLITE_STATEMENT_CACHE_SIZE 32
+
+struct sqlite_cached_statement {
+  sqlite3_stmt *statement;
+  uint32_t hash;
+  bool_t in_use;
+  unsigned last_used;
+};
+
+static struct sqlite_cached_statement sqlite_statement_cache[SQLITE_STATEMENT_CACHE_SIZE];
+static unsigned sqlite_statement_cache_clock = 0;
+static unsigned sqlite_statement_cache_hits = 0;
+static unsigned sqlite_statement_cache_misses = 0;
+
+static uint32_t sqlite_text_hash(const char *sqltext)
+{
+  uint32_t h = 5381;
+  for (; *sqltext; ++sqltext)
+    h = h * 33 + (unsigned char)*sqltext;
+  return h;
+}
+
+static sqlite3_stmt *sqlite_statement_cache_take(const char *sqltext, uint32_t hash)
+{
+  unsigned i;
+  for (i = 0; i < SQLITE_STATEMENT_CACHE_SIZE; ++i) {
+    struct sqlite_cached_statement *c = &sqlite_statement_cache[i];
+    if (c->statement && !c->in_use && c->hash == hash && strcmp(sqlite3_sql(c->statement), sqltext) == 0) {
+      c->in_use = 1;
+      c->last_used = ++sqlite_statement_cache_clock;
+      return c->statement;
+    }
+  }
+  return NULL;
+}
+
+static void sqlite_statement_cache_put(sqlite3_stmt *statement, uint32_t hash)
+{
+  struct sqlite_cached_statement *victim = NULL;
+  unsigned i;
+  for (i = 0; i < SQLITE_STATEMENT_CACHE_SIZE; ++i) {
+    struct sqlite_cached_statement *c = &sqlite_statement_cache[i];
+    if (!c->statement) {
+      victim = c;
+      break;
+    }
+    if (!c->in_use && (!victim || c->last_used < victim->last_used))
+      victim = c;
+  }
+  if (!victim)
+    return; // every entry is in use, so this statement will just be finalised when released
+  if (victim->statement)
+    sqlite3_finalize(victim->statement);
+  victim->statement = statement;
+  victim->hash = hash;
+  victim->in_use = 1;
+  victim->last_used = ++sqlite_statement_cache_clock;
+}
+
+/* Release a statement obtained from _sqlite_prepare() or _sqlite_prepare_bind().  Cached statements
+ * are reset for re-use, others are finalised.  Must be used instead of sqlite3_finalize().
+ */
+void sqlite_finalize(sqlite3_stmt *statement)
+{
+  if (!statement)
+    return;
+  unsigned i;
+  for (i = 0; i < SQLITE_STATEMENT_CACHE_SIZE; ++i) {
+    struct sqlite_cached_statement *c = &sqlite_statement_cache[i];
+    if (c->statement == statement) {
+      sqlite3_reset(statement);
+      sqlite3_clear_bindings(statement);
+      c->in_use = 0;
+      return;
+    }
+  }
+  sqlite3_finalize(statement);
+}
+
+/* Finalise every cached statement that is not currently in use, eg, before closing the database.
+ */
+static void sqlite_statement_cache_flush()
+{
+  unsigned i;
+  for (i = 0; i < SQLITE_STATEMENT_CACHE_SIZE; ++i) {
+    struct sqlite_cached_statement *c = &sqlite_statement_cache[i];
+    if (c->statement && !c->in_use) {
+      sqlite3_finalize(c->statement);
+      c->statement = NULL;
+    }
+  }
+}
+
+void sqlite_statement_cache_stats(unsigned *hits, unsigned *misses)
+{
+  *hits = sqlite_statement_cache_hits;
+  *misses = sqlite_statement_cache_misses;
+}
+
 /* Prepare an SQL command from a simple string.  Returns NULL if an error occurs (logged as an
  * error), otherwise returns a pointer to the prepared SQLite statement.
  *
@@ -440,9 +721,16 @@ sqlite3_stmt *_sqlite_prepare(struct __sourceloc __whence, int log_level, sqlite
   sqlite3_stmt *statement = NULL;
   if (!rhizome_db && rhizome_opendb() == -1)
     RETURN(NULL);
+  uint32_t hash = sqlite_text_hash(sqltext);
+  if ((statement = sqlite_statement_cache_take(sqltext, hash))) {
+    ++sqlite_statement_cache_hits;
+    RETURN(statement);
+  }
+  ++sqlite_statement_cache_misses;
   while (1) {
     switch (sqlite3_prepare_v2(rhizome_db, sqltext, -1, &statement, NULL)) {
       case SQLITE_OK:
+	sqlite_statement_cache_put(statement, hash);
 	RETURN(statement);
       case SQLITE_BUSY:
       case SQLITE_LOCKED:
@@ -523,7 +811,7 @@ int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state
 		continue; \
 	    default: \
 	      LOGF(log_level, #FUNC "(%d) failed, %s: %s", index, sqlite3_errmsg(rhizome_db), sqlite3_sql(statement)); \
-	      sqlite3_finalize(statement); \
+	      sqlite_finalize(statement); \
 	      return -1; \
 	  } \
 	  break; \
@@ -534,7 +822,7 @@ int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state
 	  BIND_RETRY(sqlite3_bind_null); \
 	} else { \
 	  LOGF(log_level, "at bind arg %u, %s%s parameter is NULL: %s", argnum, #TYP, strbuf_str(ext), sqlite3_sql(statement)); \
-	  sqlite3_finalize(statement); \
+	  sqlite_finalize(statement); \
 	  return -1; \
 	}
     switch (typ) {
@@ -678,9 +966,8 @@ int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state
 	      if (bidp == NULL) {
 		BIND_NULL(RHIZOME_BID_T);
 	      } else {
-		const char *bid_hex = alloca_tohex_rhizome_bid_t(*bidp);
-		BIND_DEBUG(RHIZOME_BID_T, sqlite3_bind_text, "%s,%u,SQLITE_TRANSIENT", bid_hex, RHIZOME_MANIFEST_ID_STRLEN);
-		BIND_RETRY(sqlite3_bind_text, bid_hex, RHIZOME_MANIFEST_ID_STRLEN, SQLITE_TRANSIENT);
+		BIND_DEBUG(RHIZOME_BID_T, sqlite3_bind_blob, "%s,%zu,SQLITE_TRANSIENT", alloca_tohex_rhizome_bid_t(*bidp), sizeof bidp->binary);
+		BIND_RETRY(sqlite3_bind_blob, bidp->binary, sizeof bidp->binary, SQLITE_TRANSIENT);
 	      }
 	    }
 	    break;
@@ -690,10 +977,8 @@ int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state
 	      if (hashp == NULL) {
 		BIND_NULL(RHIZOME_FILEHASH_T);
 	      } else {
-		char hash_hex[RHIZOME_FILEHASH_STRLEN];
-		tohex(hash_hex, sizeof hash_hex, hashp->binary);
-		BIND_DEBUG(RHIZOME_FILEHASH_T, sqlite3_bind_text, "%s,%zu,SQLITE_TRANSIENT", hash_hex, sizeof hash_hex);
-		BIND_RETRY(sqlite3_bind_text, hash_hex, sizeof hash_hex, SQLITE_TRANSIENT);
+		BIND_DEBUG(RHIZOME_FILEHASH_T, sqlite3_bind_blob, "%s,%zu,SQLITE_TRANSIENT", alloca_tohex_rhizome_filehash_t(*hashp), sizeof hashp->binary);
+		BIND_RETRY(sqlite3_bind_blob, hashp->binary, sizeof hashp->binary, SQLITE_TRANSIENT);
 	      }
 	    }
 	    break;
@@ -773,7 +1058,7 @@ sqlite3_stmt *_sqlite_prepare_bind(struct __sourceloc __whence, int log_level, s
     int ret = _sqlite_vbind(__whence, log_level, retry, statement, ap);
     va_end(ap);
     if (ret == -1) {
-      sqlite3_finalize(statement);
+      sqlite_finalize(statement);
       statement = NULL;
     }
   }
@@ -838,7 +1123,7 @@ static int _sqlite_exec(struct __sourceloc __whence, int log_level, sqlite_retry
   int stepcode;
   while ((stepcode = _sqlite_step(__whence, log_level, retry, statement)) == SQLITE_ROW)
     ++rowcount;
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   if (sqlite_trace_func())
     DEBUGF("rowcount=%d changes=%d", rowcount, sqlite3_changes(rhizome_db));
   return sqlite_code_ok(stepcode) ? rowcount : -1;
@@ -915,7 +1200,7 @@ static int _sqlite_vexec_int64(struct __sourceloc __whence, sqlite_retry_state *
   }
   if (rowcount > 1)
     WARNF("query unexpectedly returned %d rows, ignored all but first", rowcount);
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   if (!sqlite_code_ok(stepcode) || ret == -1)
     return -1;
   if (sqlite_trace_func())
@@ -1005,10 +1290,77 @@ int _sqlite_vexec_strbuf_retry(struct __sourceloc __whence, sqlite_retry_state *
   }
   if (rowcount > 1)
     WARNF("query unexpectedly returned %d rows, ignored all but first", rowcount);
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   return sqlite_code_ok(stepcode) && ret != -1 ? rowcount : -1;
 }
 
+/* Fetch a Bundle ID or file hash from a BLOB column.  Returns -1 if the column is NULL, not a BLOB
+ * (eg, a FILES.id temporary id during an incomplete write) or the wrong size.
+ */
+int sqlite_column_rhizome_bid_t(sqlite3_stmt *statement, int column, rhizome_bid_t *bidp)
+{
+  if (sqlite3_column_type(statement, column) != SQLITE_BLOB)
+    return -1;
+  const void *blob = sqlite3_column_blob(statement, column);
+  if (sqlite3_column_bytes(statement, column) != sizeof bidp->binary) // must call after sqlite3_column_blob()
+    return -1;
+  bcopy(blob, bidp->binary, sizeof bidp->binary);
+  return 0;
+}
+
+int sqlite_column_rhizome_filehash_t(sqlite3_stmt *statement, int column, rhizome_filehash_t *hashp)
+{
+  if (sqlite3_column_type(statement, column) != SQLITE_BLOB)
+    return -1;
+  const void *blob = sqlite3_column_blob(statement, column);
+  if (sqlite3_column_bytes(statement, column) != sizeof hashp->binary) // must call after sqlite3_column_blob()
+    return -1;
+  bcopy(blob, hashp->binary, sizeof hashp->binary);
+  return 0;
+}
+
+/* The inclusive range of Bundle IDs that start with the given prefix, so that a prefix lookup is a
+ * range scan of the MANIFESTS primary key.
+ */
+static void rhizome_bid_prefix_range(const unsigned char *prefix, unsigned prefix_len, rhizome_bid_t *low, rhizome_bid_t *high)
+{
+  assert(prefix_len <= sizeof low->binary);
+  memset(low->binary, 0x00, sizeof low->binary);
+  memset(high->binary, 0xff, sizeof high->binary);
+  bcopy(prefix, low->binary, prefix_len);
+  bcopy(prefix, high->binary, prefix_len);
+}
+
+/* Look up the file hash of a bundle.  Returns 1 if the bundle has a payload, 0 if it does not
+ * exist or has no payload, -1 on error.
+ */
+static int rhizome_filehash_retry(sqlite_retry_state *retry, rhizome_filehash_t *hashp, const char *sqltext, ...)
+{
+  va_list ap;
+  va_start(ap, sqltext);
+  sqlite3_stmt *statement = _sqlite_prepare(__WHENCE__, LOG_LEVEL_ERROR, retry, sqltext);
+  int ret = -1;
+  if (statement && _sqlite_vbind(__WHENCE__, LOG_LEVEL_ERROR, retry, statement, ap) != -1) {
+    switch (sqlite_step_retry(retry, statement)) {
+    case SQLITE_ROW:
+      if (sqlite3_column_type(statement, 0) == SQLITE_NULL)
+	ret = 0;
+      else if (sqlite_column_rhizome_filehash_t(statement, 0, hashp) == -1)
+	ret = WHYF("malformed MANIFESTS.filehash column: %s", sqlite3_sql(statement));
+      else
+	ret = 1;
+      break;
+    case SQLITE_DONE:
+      ret = 0;
+      break;
+    }
+  }
+  va_end(ap);
+  if (statement)
+    sqlite_finalize(statement);
+  return ret;
+}
+
 int64_t rhizome_database_used_bytes()
 {
   int64_t db_page_size;
@@ -1025,12 +1377,14 @@ int64_t rhizome_database_used_bytes()
 int rhizome_database_filehash_from_id(const rhizome_bid_t *bidp, uint64_t version, rhizome_filehash_t *hashp)
 {
   IN();
-  strbuf hash_sb = strbuf_alloca(RHIZOME_FILEHASH_STRLEN + 1);
-  if (	 sqlite_exec_strbuf(hash_sb, "SELECT filehash FROM MANIFESTS WHERE version = ? AND id = ?;",
-			    INT64, version, RHIZOME_BID_T, bidp, END) == -1)
-    RETURN(-1);
-  if (strbuf_overrun(hash_sb) || str_to_rhizome_filehash_t(hashp, strbuf_str(hash_sb)) == -1)
-    RETURN(WHYF("malformed file hash for bid=%s version=%"PRId64, alloca_tohex_rhizome_bid_t(*bidp), version));
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  switch (rhizome_filehash_retry(&retry, hashp, "SELECT filehash FROM MANIFESTS WHERE version = ? AND id = ?;",
+			    INT64, version, RHIZOME_BID_T, bidp, END)) {
+    case -1:
+      RETURN(-1);
+    case 0:
+      RETURN(WHYF("no file hash for bid=%s version=%"PRId64, alloca_tohex_rhizome_bid_t(*bidp), version));
+  }
   RETURN(0);
   OUT();
 }
@@ -1084,42 +1438,65 @@ int rhizome_cleanup(struct rhizome_cleanup_report *report)
   time_ms_t now = gettime_ms();
   time_ms_t insert_horizon_no_manifest = now - (orphan_payload_persist_ms ? atoi(orphan_payload_persist_ms) : 1000); // 1 second ago
   time_ms_t insert_horizon_not_valid = now - (invalid_payload_persist_ms ? atoi(invalid_payload_persist_ms) : 300000); // 5 minutes ago
+  time_ms_t update_horizon_partial = now - config.rhizome.partial_persist_ms;
 
-  // cleanup external blobs for unreferenced files
+  // forget partly fetched payloads that nobody has tried to resume for a while
   unsigned candidates = 0;
   sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
-      "SELECT id FROM FILES WHERE inserttime < ? AND datavalid = 0;",
+      "SELECT temp_id FROM PARTIALS WHERE updatetime < ?;",
+      INT64, update_horizon_partial, END);
+  while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+    candidates++;
+    char blob_path[1024];
+    const char *temp_id = (const char *) sqlite3_column_text(statement, 0);
+    if (temp_id && FORM_RHIZOME_DATASTORE_PATH(blob_path, "%s", temp_id))
+      unlink(blob_path);
+  }
+  sqlite_finalize(statement);
+  if (candidates) {
+    sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry,
+	"DELETE FROM FILES WHERE id IN (SELECT temp_id FROM PARTIALS WHERE updatetime < ?);",
+	INT64, update_horizon_partial, END);
+    int ret = sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry,
+	"DELETE FROM PARTIALS WHERE updatetime < ?;",
+	INT64, update_horizon_partial, END);
+    if (report && ret > 0)
+      report->deleted_expired_partials += ret;
+  }
+
+  // cleanup external blobs for unreferenced files, leaving those of partly fetched payloads
+  candidates = 0;
+  statement = sqlite_prepare_bind(&retry,
+      "SELECT id FROM FILES WHERE inserttime < ? AND datavalid = 0 AND NOT EXISTS( SELECT 1 FROM PARTIALS WHERE PARTIALS.temp_id = FILES.id);",
       INT64, insert_horizon_not_valid, END);
   while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
     candidates++;
-    const char *id = (const char *) sqlite3_column_text(statement, 0);
     rhizome_filehash_t hash;
-    if (str_to_rhizome_filehash_t(&hash, id) == -1)
-      WARNF("invalid field FILES.id=%s -- ignored", alloca_str_toprint(id));
-    else if (rhizome_delete_external(&hash) == 0 && report)
+    // incomplete writes have a temporary id, and their external blob is named after it
+    if (sqlite_column_rhizome_filehash_t(statement, 0, &hash) == 0
+	&& rhizome_delete_external(&hash) == 0 && report)
 	++report->deleted_stale_incoming_files;
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
 
   statement = sqlite_prepare_bind(&retry,
       "SELECT id FROM FILES WHERE inserttime < ? AND datavalid = 1 AND NOT EXISTS( SELECT 1 FROM MANIFESTS WHERE MANIFESTS.filehash = FILES.id);",
       INT64, insert_horizon_no_manifest, END);
   while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
     candidates++;
-    const char *id = (const char *) sqlite3_column_text(statement, 0);
     rhizome_filehash_t hash;
-    if (str_to_rhizome_filehash_t(&hash, id) == -1)
-      WARNF("invalid field FILES.id=%s -- ignored", alloca_str_toprint(id));
+    if (sqlite_column_rhizome_filehash_t(statement, 0, &hash) == -1)
+      WARN("invalid field FILES.id -- ignored");
     else if (rhizome_delete_external(&hash) == 0 && report)
       ++report->deleted_orphan_files;
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   
   int ret;
   if (candidates) {
     // clean out unreferenced files
     ret = sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry,
-	"DELETE FROM FILES WHERE inserttime < ? AND datavalid = 0;",
+	"DELETE FROM FILES WHERE inserttime < ? AND datavalid = 0 AND NOT EXISTS( SELECT 1 FROM PARTIALS WHERE PARTIALS.temp_id = FILES.id);",
 	INT64, insert_horizon_not_valid, END);
     if (report && ret > 0)
       report->deleted_stale_incoming_files += ret;
@@ -1134,10 +1511,11 @@ int rhizome_cleanup(struct rhizome_cleanup_report *report)
     report->deleted_orphan_fileblobs += ret;
    
   if (config.debug.rhizome && report)
-    DEBUGF("report deleted_stale_incoming_files=%u deleted_orphan_files=%u deleted_orphan_fileblobs=%u",
+    DEBUGF("report deleted_stale_incoming_files=%u deleted_orphan_files=%u deleted_orphan_fileblobs=%u deleted_expired_partials=%u",
 	report->deleted_stale_incoming_files,
 	report->deleted_orphan_files,
-	report->deleted_orphan_fileblobs
+	report->deleted_orphan_fileblobs,
+	report->deleted_expired_partials
       );
   RETURN(0);
   OUT();
@@ -1170,11 +1548,9 @@ int rhizome_make_space(int group_priority, uint64_t bytes)
       && sqlite_step_retry(&retry, statement) == SQLITE_ROW
   ) {
     /* Make sure we can drop this blob, and if so drop it, and recalculate number of bytes required */
-    const char *id;
+    rhizome_filehash_t hash;
     /* Get values */
-    if (sqlite3_column_type(statement, 0)==SQLITE_TEXT)
-      id = (const char *) sqlite3_column_text(statement, 0);
-    else {
+    if (sqlite_column_rhizome_filehash_t(statement, 0, &hash) == -1) {
       WHY("Incorrect type in id column of files table");
       break;
     }
@@ -1184,10 +1560,7 @@ int rhizome_make_space(int group_priority, uint64_t bytes)
       WHY("Incorrect type in length column of files table");
       break;
     }
-    rhizome_filehash_t hash;
-    if (str_to_rhizome_filehash_t(&hash, id) == -1)
-      WHYF("invalid field FILES.id=%s -- ignored", alloca_str_toprint(id));
-    else {
+    {
       /* Try to drop this file from storage, discarding any references that do not trump the
        * priority of this request.  The query done earlier should ensure this, but it doesn't hurt
        * to be paranoid, and it also protects against inconsistency in the database.
@@ -1195,7 +1568,7 @@ int rhizome_make_space(int group_priority, uint64_t bytes)
       rhizome_drop_stored_file(&hash, group_priority + 1);
     }
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
 
   //int64_t equal_priority_larger_file_space_used = sqlite_exec_int64("SELECT COUNT(length) FROM
   //FILES WHERE highestpriority = ? and length > ?", INT, group_priority, INT64, bytes, END);
@@ -1219,16 +1592,11 @@ int rhizome_drop_stored_file(const rhizome_filehash_t *hashp, int maximum_priori
   int can_drop = 1;
   while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
     /* Find manifests for this file */
-    if (sqlite3_column_type(statement, 0) != SQLITE_TEXT) {
+    rhizome_bid_t bid;
+    if (sqlite_column_rhizome_bid_t(statement, 0, &bid) == -1) {
       WHYF("Incorrect type in id column of manifests table");
       break;
     }
-    const char *q_id = (char *) sqlite3_column_text(statement, 0);
-    rhizome_bid_t bid;
-    if (str_to_rhizome_bid_t(&bid, q_id) == -1) {
-      WARNF("malformed column value MANIFESTS.id = %s -- skipped", alloca_str_toprint(q_id));
-      continue;
-    }
     /* Check that manifest is not part of a higher priority group.
 	If so, we cannot drop the manifest or the file.
 	However, we will keep iterating, as we can still drop any other manifests pointing to this file
@@ -1242,12 +1610,14 @@ int rhizome_drop_stored_file(const rhizome_filehash_t *hashp, int maximum_priori
     } else {
       if (config.debug.rhizome)
 	DEBUGF("removing stale manifests, groupmemberships");
+      known_bundle_remove(bid.binary);
+      rhizome_sync_bundle_deleted(bid.binary);
       sqlite_exec_void_retry(&retry, "DELETE FROM MANIFESTS WHERE id = ?;", RHIZOME_BID_T, &bid, END);
       sqlite_exec_void_retry(&retry, "DELETE FROM KEYPAIRS WHERE public = ?;", RHIZOME_BID_T, &bid, END);
       sqlite_exec_void_retry(&retry, "DELETE FROM GROUPMEMBERSHIPS WHERE manifestid = ?;", RHIZOME_BID_T, &bid, END);
     }
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   if (can_drop)
     rhizome_delete_file_retry(&retry, hashp);
   return 0;
@@ -1337,12 +1707,10 @@ int rhizome_store_bundle(rhizome_manifest *m)
     goto rollback;
   if (sqlite_step_retry(&retry, stmt) == -1)
     goto rollback;
-  sqlite3_finalize(stmt);
+  sqlite_finalize(stmt);
   stmt = NULL;
   rhizome_manifest_set_inserttime(m, now);
-
-//  if (serverMode)
-//    rhizome_sync_bundle_inserted(bar);
+  uint64_t rowid = sqlite3_last_insert_rowid(rhizome_db);
 
   // TODO remove old payload?
   
@@ -1365,7 +1733,7 @@ int rhizome_store_bundle(rhizome_manifest *m)
       goto rollback;
     if (sqlite_step_retry(&retry, stmt) == -1)
       goto rollback;
-    sqlite3_finalize(stmt);
+    sqlite_finalize(stmt);
     stmt = NULL;
   }
 #endif
@@ -1382,7 +1750,7 @@ int rhizome_store_bundle(rhizome_manifest *m)
 	goto rollback;
       sqlite3_reset(stmt);
     }
-    sqlite3_finalize(stmt);
+    sqlite_finalize(stmt);
     stmt = NULL;
   }
 #endif
@@ -1394,14 +1762,19 @@ int rhizome_store_bundle(rhizome_manifest *m)
 	  alloca_tohex_rhizome_bid_t(m->cryptoSignPublic),
 	  m->version
 	);
+    // the stored version replaces any other, even a later one
+    known_bundle_remove(m->cryptoSignPublic.binary);
+    known_bundle_add(m->cryptoSignPublic.binary, m->version);
     monitor_announce_bundle(m);
-    if (serverMode)
+    if (serverMode){
+      rhizome_sync_bundle_inserted(rowid, bar);
       rhizome_sync_announce();
+    }
     return 0;
   }
 rollback:
   if (stmt)
-    sqlite3_finalize(stmt);
+    sqlite_finalize(stmt);
   WHYF("Failed to store bundle bid=%s", alloca_tohex_rhizome_bid_t(m->cryptoSignPublic));
   sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
   return -1;
@@ -1460,7 +1833,7 @@ static int rhizome_list_open(sqlite_retry_state *retry, struct rhizome_list_curs
   RETURN(0);
   OUT();
 failure:
-  sqlite3_finalize(cursor->_statement);
+  sqlite_finalize(cursor->_statement);
   cursor->_statement = NULL;
   RETURN(-1);
   OUT();
@@ -1478,13 +1851,18 @@ static int rhizome_list_next(sqlite_retry_state *retry, struct rhizome_list_curs
       cursor->manifest = NULL;
     }
     assert(sqlite3_column_count(cursor->_statement) == 6);
-    assert(sqlite3_column_type(cursor->_statement, 0) == SQLITE_TEXT);
+    assert(sqlite3_column_type(cursor->_statement, 0) == SQLITE_BLOB);
     assert(sqlite3_column_type(cursor->_statement, 1) == SQLITE_BLOB);
     assert(sqlite3_column_type(cursor->_statement, 2) == SQLITE_INTEGER);
     assert(sqlite3_column_type(cursor->_statement, 3) == SQLITE_INTEGER);
     assert(sqlite3_column_type(cursor->_statement, 4) == SQLITE_TEXT || sqlite3_column_type(cursor->_statement, 4) == SQLITE_NULL);
     assert(sqlite3_column_type(cursor->_statement, 5) == SQLITE_INTEGER);
-    const char *q_manifestid = (const char *) sqlite3_column_text(cursor->_statement, 0);
+    rhizome_bid_t bid;
+    if (sqlite_column_rhizome_bid_t(cursor->_statement, 0, &bid) == -1) {
+      WHY("MANIFESTS row has malformed id column -- skipped");
+      continue;
+    }
+    const char *q_manifestid = alloca_tohex_rhizome_bid_t(bid);
     const char *manifestblob = (char *) sqlite3_column_blob(cursor->_statement, 1);
     size_t manifestblobsize = sqlite3_column_bytes(cursor->_statement, 1); // must call after sqlite3_column_blob()
     int64_t q_version = sqlite3_column_int64(cursor->_statement, 2);
@@ -1536,7 +1914,7 @@ static void rhizome_list_release(struct rhizome_list_cursor *cursor)
     cursor->manifest = NULL;
   }
   if (cursor->_statement) {
-    sqlite3_finalize(cursor->_statement);
+    sqlite_finalize(cursor->_statement);
     cursor->_statement = NULL;
   }
 }
@@ -1616,7 +1994,7 @@ void rhizome_bytes_to_hex_upper(unsigned const char *in, char *out, int byteCoun
   (void) tohex(out, byteCount * 2, in);
 }
 
-int rhizome_update_file_priority(const char *fileid)
+int rhizome_update_file_priority(const rhizome_filehash_t *hashp)
 {
   /* work out the highest priority of any referrer */
   int64_t highestPriority = -1;
@@ -1626,15 +2004,15 @@ int rhizome_update_file_priority(const char *fileid)
 	" WHERE MANIFESTS.filehash = ?"
 	"   AND GROUPMEMBERSHIPS.manifestid = MANIFESTS.id"
 	"   AND GROUPMEMBERSHIPS.groupid = GROUPLIST.id;",
-	TEXT_TOUPPER, fileid, END) == -1)
+	RHIZOME_FILEHASH_T, hashp, END) == -1)
     return -1;
   if (   highestPriority >= 0
       && sqlite_exec_void_retry(&retry,
 	      "UPDATE files SET highestPriority = ? WHERE id = ?;",
-	      INT, highestPriority, TEXT_TOUPPER, fileid, END
+	      INT, highestPriority, RHIZOME_FILEHASH_T, hashp, END
 	  ) == -1
   )
-    return WHYF("cannot update priority for fileid=%s", fileid);
+    return WHYF("cannot update priority for fileid=%s", alloca_tohex_rhizome_filehash_t(*hashp));
   return 0;
 }
 
@@ -1689,7 +2067,12 @@ int rhizome_find_duplicate(const rhizome_manifest *m, rhizome_manifest **found)
       ret = WHY("Out of manifests");
       break;
     }
-    const unsigned char *q_manifestid = sqlite3_column_text(statement, 0);
+    rhizome_bid_t bid;
+    if (sqlite_column_rhizome_bid_t(statement, 0, &bid) == -1) {
+      WARN("MANIFESTS row has malformed id column -- skipped");
+      goto next;
+    }
+    const char *q_manifestid = alloca_tohex_rhizome_bid_t(bid);
     const char *manifestblob = (char *) sqlite3_column_blob(statement, 1);
     size_t manifestblobsize = sqlite3_column_bytes(statement, 1); // must call after sqlite3_column_blob()
     if (rhizome_read_manifest_file(blob_m, manifestblob, manifestblobsize) == -1) {
@@ -1721,13 +2104,16 @@ next:
     if (blob_m)
       rhizome_manifest_free(blob_m);
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   return ret;
 }
 
 static int unpack_manifest_row(rhizome_manifest *m, sqlite3_stmt *statement)
 {
-  const char *q_id = (const char *) sqlite3_column_text(statement, 0);
+  rhizome_bid_t bid;
+  if (sqlite_column_rhizome_bid_t(statement, 0, &bid) == -1)
+    return WHY("Manifest has malformed id column");
+  const char *q_id = alloca_tohex_rhizome_bid_t(bid);
   const char *q_blob = (char *) sqlite3_column_blob(statement, 1);
   int64_t q_version = sqlite3_column_int64(statement, 2);
   int64_t q_inserttime = sqlite3_column_int64(statement, 3);
@@ -1769,7 +2155,7 @@ int rhizome_retrieve_manifest(const rhizome_bid_t *bidp, rhizome_manifest *m)
     ret = unpack_manifest_row(m, statement);
   else
     INFOF("Manifest id=%s not found", alloca_tohex_rhizome_bid_t(*bidp));
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   return ret;
 }
 
@@ -1783,14 +2169,12 @@ int rhizome_retrieve_manifest(const rhizome_bid_t *bidp, rhizome_manifest *m)
 int rhizome_retrieve_manifest_by_prefix(const unsigned char *prefix, unsigned prefix_len, rhizome_manifest *m)
 {
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  const unsigned prefix_strlen = prefix_len * 2;
-  char like[prefix_strlen + 2];
-  tohex(like, prefix_strlen, prefix);
-  like[prefix_strlen] = '%';
-  like[prefix_strlen + 1] = '\0';
+  rhizome_bid_t low, high;
+  rhizome_bid_prefix_range(prefix, prefix_len, &low, &high);
   sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
-      "SELECT id, manifest, version, inserttime, author FROM manifests WHERE id like ?",
-      TEXT, like,
+      "SELECT id, manifest, version, inserttime, author FROM manifests WHERE id BETWEEN ? AND ?",
+      RHIZOME_BID_T, &low,
+      RHIZOME_BID_T, &high,
       END);
   if (!statement)
     return -1;
@@ -1798,13 +2182,15 @@ int rhizome_retrieve_manifest_by_prefix(const unsigned char *prefix, unsigned pr
   if (sqlite_step_retry(&retry, statement) == SQLITE_ROW)
     ret = unpack_manifest_row(m, statement);
   else
-    INFOF("Manifest with id prefix=`%s` not found", like);
-  sqlite3_finalize(statement);
+    INFOF("Manifest with id prefix=`%s` not found", alloca_tohex(prefix, prefix_len));
+  sqlite_finalize(statement);
   return ret;
 }
 
 static int rhizome_delete_manifest_retry(sqlite_retry_state *retry, const rhizome_bid_t *bidp)
 {
+  known_bundle_remove(bidp->binary);
+  rhizome_sync_bundle_deleted(bidp->binary);
   sqlite3_stmt *statement = sqlite_prepare_bind(retry,
       "DELETE FROM manifests WHERE id = ?",
       RHIZOME_BID_T, bidp,
@@ -1831,13 +2217,11 @@ static int rhizome_delete_file_retry(sqlite_retry_state *retry, const rhizome_fi
 
 static int rhizome_delete_payload_retry(sqlite_retry_state *retry, const rhizome_bid_t *bidp)
 {
-  strbuf fh = strbuf_alloca(RHIZOME_FILEHASH_STRLEN + 1);
-  int rows = sqlite_exec_strbuf_retry(retry, fh, "SELECT filehash FROM manifests WHERE id = ?", RHIZOME_BID_T, bidp, END);
+  known_bundle_remove(bidp->binary);
+  rhizome_filehash_t hash;
+  int rows = rhizome_filehash_retry(retry, &hash, "SELECT filehash FROM manifests WHERE id = ?", RHIZOME_BID_T, bidp, END);
   if (rows == -1)
     return -1;
-  rhizome_filehash_t hash;
-  if (str_to_rhizome_filehash_t(&hash, strbuf_str(fh)) == -1)
-    return WHYF("invalid field FILES.id=%s", strbuf_str(fh));
   if (rows && rhizome_delete_file_retry(retry, &hash) == -1)
     return -1;
   return 0;
@@ -1901,37 +2285,157 @@ int rhizome_delete_payload(const rhizome_bid_t *bidp)
  */
 int rhizome_delete_file(const rhizome_filehash_t *hashp)
 {
+  // any number of bundles may share this payload
+  known_bundle_clear();
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
   return rhizome_delete_file_retry(&retry, hashp);
 }
 
-static int is_interesting(const char *id_hex, int64_t version)
+/* An in-memory index of the bundles that this process knows to be in the store with their payload,
+ * keyed by BID prefix (as carried in a BAR) and holding the highest version seen.  Lets
+ * is_interesting() answer "already have it" for the bundles that every neighbour keeps advertising
+ * without running a LIKE query and a rhizome_exists() lookup.  An entry is only ever added after
+ * the store has been seen to hold that version, and is dropped whenever this process deletes the
+ * manifest or its payload, so a hit is always safe to act on; a miss falls back to the database.
+ * Deletions made by other processes are not seen until the entry's bundle is updated or the daemon
+ * restarts.
+ *
+ * Open addressing with linear probing, so lookups touch one or two cache lines.
+ */
+struct known_bundle {
+  unsigned char prefix[RHIZOME_BAR_PREFIX_BYTES];
+  bool_t used;
+  int64_t version;
+};
+
+static struct known_bundle *known_bundles = NULL;
+static unsigned known_bundles_size = 0; // always zero or a power of two
+static unsigned known_bundles_count = 0;
+static unsigned known_bundle_hits = 0;
+static unsigned known_bundle_misses = 0;
+
+static unsigned known_bundle_slot(const unsigned char *prefix)
+{
+  // BIDs are public keys, so their leading bytes are already uniformly distributed
+  uint32_t h = ((uint32_t)prefix[0] << 24) | ((uint32_t)prefix[1] << 16) | ((uint32_t)prefix[2] << 8) | prefix[3];
+  return h & (known_bundles_size - 1);
+}
+
+static struct known_bundle *known_bundle_find(const unsigned char *prefix)
+{
+  if (known_bundles_size == 0)
+    return NULL;
+  unsigned i = known_bundle_slot(prefix);
+  while (known_bundles[i].used) {
+    if (memcmp(known_bundles[i].prefix, prefix, RHIZOME_BAR_PREFIX_BYTES) == 0)
+      return &known_bundles[i];
+    i = (i + 1) & (known_bundles_size - 1);
+  }
+  return NULL;
+}
+
+static void known_bundle_add(const unsigned char *prefix, int64_t version)
+{
+  struct known_bundle *k = known_bundle_find(prefix);
+  if (k) {
+    if (version > k->version)
+      k->version = version;
+    return;
+  }
+  // keep the load factor below 3/4
+  if ((known_bundles_count + 1) * 4 > known_bundles_size * 3) {
+    unsigned old_size = known_bundles_size;
+    struct known_bundle *old = known_bundles;
+    unsigned new_size = old_size ? old_size * 2 : 1024;
+    struct known_bundle *table = emalloc_zero(new_size * sizeof *table);
+    if (table == NULL)
+      return;
+    known_bundles = table;
+    known_bundles_size = new_size;
+    known_bundles_count = 0;
+    unsigned i;
+    for (i = 0; i < old_size; ++i)
+      if (old[i].used)
+	known_bundle_add(old[i].prefix, old[i].version);
+    free(old);
+  }
+  unsigned i = known_bundle_slot(prefix);
+  while (known_bundles[i].used)
+    i = (i + 1) & (known_bundles_size - 1);
+  bcopy(prefix, known_bundles[i].prefix, RHIZOME_BAR_PREFIX_BYTES);
+  known_bundles[i].version = version;
+  known_bundles[i].used = 1;
+  ++known_bundles_count;
+}
+
+static void known_bundle_remove(const unsigned char *prefix)
+{
+  struct known_bundle *k = known_bundle_find(prefix);
+  if (k == NULL)
+    return;
+  // shift any following entries of the same probe run back into the hole
+  unsigned mask = known_bundles_size - 1;
+  unsigned hole = k - known_bundles;
+  unsigned i = hole;
+  while (1) {
+    i = (i + 1) & mask;
+    if (!known_bundles[i].used)
+      break;
+    unsigned home = known_bundle_slot(known_bundles[i].prefix);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      known_bundles[hole] = known_bundles[i];
+      hole = i;
+    }
+  }
+  known_bundles[hole].used = 0;
+  --known_bundles_count;
+}
+
+static void known_bundle_clear()
+{
+  if (known_bundles)
+    bzero(known_bundles, known_bundles_size * sizeof *known_bundles);
+  known_bundles_count = 0;
+}
+
+static int is_interesting(const unsigned char *prefix, unsigned prefix_len, int64_t version)
 {
   IN();
   int ret=1;
 
+  struct known_bundle *k = known_bundle_find(prefix);
+  if (k && k->version >= version) {
+    ++known_bundle_hits;
+    RETURN(0);
+  }
+  ++known_bundle_misses;
+
   // do we have this bundle [or later]?
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  rhizome_bid_t low, high;
+  rhizome_bid_prefix_range(prefix, prefix_len, &low, &high);
   sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
-    "SELECT filehash FROM MANIFESTS WHERE id LIKE ? AND version >= ?",
-    TEXT_TOUPPER, id_hex,
+    "SELECT filehash FROM MANIFESTS WHERE id BETWEEN ? AND ? AND version >= ?",
+    RHIZOME_BID_T, &low,
+    RHIZOME_BID_T, &high,
     INT64, version,
     END);
   if (!statement)
     RETURN(-1);
   if (sqlite_step_retry(&retry, statement) == SQLITE_ROW){
-    const char *q_filehash = (const char *) sqlite3_column_text(statement, 0);
     ret=0;
-    if (q_filehash && *q_filehash) {
+    if (sqlite3_column_type(statement, 0) != SQLITE_NULL) {
       rhizome_filehash_t hash;
-      if (str_to_rhizome_filehash_t(&hash, q_filehash) == -1) {
-	WARNF("invalid field MANIFESTS.filehash=%s -- ignored", alloca_str_toprint(q_filehash));
+      if (sqlite_column_rhizome_filehash_t(statement, 0, &hash) == -1) {
+	WARN("invalid field MANIFESTS.filehash -- ignored");
 	ret = 1;
       } else if (!rhizome_exists(&hash))
 	ret = 1;
     }
+    if (ret == 0)
+      known_bundle_add(prefix, version);
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   RETURN(ret);
   OUT();
 }
@@ -1939,13 +2443,157 @@ static int is_interesting(const char *id_hex, int64_t version)
 int rhizome_is_bar_interesting(unsigned char *bar)
 {
   int64_t version = rhizome_bar_version(bar);
-  char id_hex[RHIZOME_MANIFEST_ID_STRLEN];
-  tohex(id_hex, RHIZOME_BAR_PREFIX_BYTES * 2, &bar[RHIZOME_BAR_PREFIX_OFFSET]);
-  strcat(id_hex, "%");
-  return is_interesting(id_hex, version);
+  return is_interesting(&bar[RHIZOME_BAR_PREFIX_OFFSET], RHIZOME_BAR_PREFIX_BYTES, version);
 }
 
 int rhizome_is_manifest_interesting(rhizome_manifest *m)
 {
-  return is_interesting(alloca_tohex_rhizome_bid_t(m->cryptoSignPublic), m->version);
+  return is_interesting(m->cryptoSignPublic.binary, sizeof m->cryptoSignPublic.binary, m->version);
+}
+
+void rhizome_known_bundle_stats(unsigned *count, unsigned *hits, unsigned *misses)
+{
+  *count = known_bundles_count;
+  *hits = known_bundle_hits;
+  *misses = known_bundle_misses;
+}
+
+struct rhizome_db_test_result {
+  unsigned lists;
+  unsigned failures;
+  unsigned busy;
+};
+
+#define RHIZOME_DB_TEST_SERVICE "rhizomedb-test"
+#define RHIZOME_DB_TEST_LIST "SELECT id, manifest, version, inserttime, author, rowid FROM MANIFESTS ORDER BY inserttime DESC LIMIT 100;"
+
+static int rhizome_db_test_list()
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare(&retry, RHIZOME_DB_TEST_LIST);
+  if (!statement)
+    return -1;
+  int stepcode;
+  while ((stepcode = sqlite_step_retry(&retry, statement)) == SQLITE_ROW)
+    sqlite3_column_blob(statement, 1);
+  sqlite_finalize(statement);
+  return stepcode == -1 ? -1 : 0;
+}
+
+/* Runs in a forked child with its own database connection, listing manifests as fast as it can
+ * until the parent closes the stop pipe, like a CLI "rhizome list" racing the server.
+ */
+static void rhizome_db_test_reader(int stop_fd, int result_fd)
+{
+  struct rhizome_db_test_result result = {0, 0, 0};
+  sqlite_busy_retries = 0;
+  char c;
+  while (read(stop_fd, &c, 1) == -1 && errno == EAGAIN) {
+    if (rhizome_db_test_list() == -1)
+      ++result.failures;
+    else
+      ++result.lists;
+  }
+  result.busy = sqlite_busy_retries;
+  if (write(result_fd, &result, sizeof result) != sizeof result)
+    WHY_perror("write");
+  rhizome_close_db();
+}
+
+int app_rhizome_db_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *count_arg = NULL;
+  if (cli_arg(parsed, "--count", &count_arg, cli_uint, NULL) == -1)
+    return -1;
+  unsigned count = count_arg ? atoi(count_arg) : 1000;
+  if (count == 0)
+    return WHY("--count must be greater than zero");
+  // create the schema before anyone else opens the database
+  if (rhizome_opendb() == -1 || rhizome_close_db() == -1)
+    return -1;
+  
+  int stop[2], results[2];
+  if (pipe(stop) == -1)
+    return WHY_perror("pipe");
+  if (pipe(results) == -1) {
+    close(stop[0]);
+    close(stop[1]);
+    return WHY_perror("pipe");
+  }
+  pid_t pid = fork();
+  if (pid == -1) {
+    close(stop[0]);
+    close(stop[1]);
+    close(results[0]);
+    close(results[1]);
+    return WHY_perror("fork");
+  }
+  if (pid == 0) {
+    close(stop[1]);
+    close(results[0]);
+    if (set_nonblock(stop[0]) == 0)
+      rhizome_db_test_reader(stop[0], results[1]);
+    _exit(0);
+  }
+  close(stop[0]);
+  close(results[1]);
+  
+  int ret = 0;
+  unsigned i, failed = 0;
+  time_ms_t start = gettime_ms();
+  for (i = 0; i < count; ++i) {
+    rhizome_bid_t bid;
+    urandombytes(bid.binary, sizeof bid.binary);
+    // one transaction per bundle, the same as rhizome_store_bundle()
+    sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+    if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;", END) == -1) {
+      ++failed;
+      continue;
+    }
+    if (sqlite_exec_void_retry(&retry,
+	  "INSERT INTO MANIFESTS(id, version, inserttime, filesize, filehash, author, bar, manifest, service, name) "
+	  "VALUES(?, ?, ?, 0, NULL, NULL, ?, ?, ?, ?);",
+	  RHIZOME_BID_T, &bid,
+	  INT64, (int64_t) i,
+	  INT64, (int64_t) gettime_ms(),
+	  ZEROBLOB, (int) RHIZOME_BAR_BYTES,
+	  ZEROBLOB, 256,
+	  STATIC_TEXT, RHIZOME_DB_TEST_SERVICE,
+	  STATIC_TEXT, alloca_tohex_rhizome_bid_t(bid),
+	  END) == -1
+      || sqlite_exec_void_retry(&retry, "COMMIT;", END) == -1
+    ) {
+      sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
+      ++failed;
+    }
+  }
+  time_ms_t elapsed = gettime_ms() - start;
+  close(stop[1]);
+  
+  struct rhizome_db_test_result result = {0, 0, 0};
+  if (read(results[0], &result, sizeof result) != sizeof result)
+    ret = WHY("Reader did not report");
+  close(results[0]);
+  waitpid(pid, NULL, 0);
+  
+  cli_printf(context, "insert %u manifests took %"PRId64"ms (%"PRId64"/s), %u failed\n",
+      count, (int64_t) elapsed, (int64_t) count * 1000 / (elapsed ? elapsed : 1), failed);
+  cli_printf(context, "concurrent list ran %u times (%"PRId64"/s), %u failed, %u busy retries\n",
+      result.lists, (int64_t) result.lists * 1000 / (elapsed ? elapsed : 1), result.failures, result.busy);
+  
+  unsigned lists = count < 100 ? count : 100;
+  start = gettime_ms();
+  for (i = 0; i < lists; ++i)
+    if (rhizome_db_test_list() == -1)
+      ret = -1;
+  elapsed = gettime_ms() - start;
+  cli_printf(context, "list %u times took %"PRId64"ms\n", lists, (int64_t) elapsed);
+  
+  if (sqlite_exec_void("DELETE FROM MANIFESTS WHERE service = ?;", STATIC_TEXT, RHIZOME_DB_TEST_SERVICE, END) == -1)
+    ret = -1;
+  if (failed || result.failures)
+    ret = WHYF("%u inserts and %u lists failed", failed, result.failures);
+  else if (ret == 0)
+    cli_printf(context, "Test passed.\n");
+  return ret;
 }
@@ -427,7 +427,7 @@ rhizome_manifest *rhizome_direct_get_manifest(unsigned char *bid_prefix,int pref
       while (sqlite_code_busy(ret) && sqlite_retry(&retry, "sqlite3_blob_open"));
       if (!sqlite_code_ok(ret)) {
 	WHYF("sqlite3_blob_open() failed, %s", sqlite3_errmsg(rhizome_db));
-	sqlite3_finalize(statement);
+	sqlite_finalize(statement);
 	return NULL;
 	
       }
@@ -450,18 +450,18 @@ rhizome_manifest *rhizome_direct_get_manifest(unsigned char *bid_prefix,int pref
       
       DEBUGF("Read manifest");
       sqlite3_blob_close(blob);
-      sqlite3_finalize(statement);
+      sqlite_finalize(statement);
       return m;
 
  error:
       sqlite3_blob_close(blob);
-      sqlite3_finalize(statement);
+      sqlite_finalize(statement);
       return NULL;
     }
   else 
     {
       DEBUGF("no matching manifests");
-      sqlite3_finalize(statement);
+      sqlite_finalize(statement);
       return NULL;
     }
 
@@ -794,7 +794,7 @@ int rhizome_direct_get_bars(const rhizome_bid_t *bidp_low,
 
 	/* Remember the BID so that we cant write it into bid_high so that the
 	   caller knows how far we got. */
-	str_to_rhizome_bid_t(bidp_high, (const char *)sqlite3_column_text(statement, 2));
+	sqlite_column_rhizome_bid_t(statement, 2, bidp_high);
 
 	bars_written++;
 	break;
@@ -805,7 +805,7 @@ int rhizome_direct_get_bars(const rhizome_bid_t *bidp_low,
       }
     }
   if (statement)
-    sqlite3_finalize(statement);
+    sqlite_finalize(statement);
   statement = NULL;
   
   return bars_written;
@@ -26,6 +26,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "str.h"
 #include "strbuf_helpers.h"
 #include "overlay_address.h"
+#include "overlay_buffer.h"
 
 /* Represents a queued fetch of a bundle payload, for which the manifest is already known.
  */
@@ -39,13 +40,68 @@ struct rhizome_fetch_candidate {
   sid_t peer_sid;
 
   int priority;
+  unsigned sequence; // order of arrival, so that equal priorities are fetched first come first served
+  unsigned heap_index; // position in its queue's heap
+  struct rhizome_fetch_candidate *deferred; // next candidate set aside while an older version is fetched
 };
 
+/* A peer that has advertised the bundle being fetched, and the range of the payload most recently
+ * requested from it over MDP.  Faster peers are given larger ranges.
+ */
+struct rhizome_fetch_source {
+  sid_t sid;
+  uint64_t range_start;
+  uint64_t range_end;
+  int outstanding; // blocks requested and not yet received
+  time_ms_t request_time;
+  time_ms_t last_rx_time;
+  uint64_t received; // bytes received since request_time
+  uint32_t rate; // bytes per second, smoothed, zero until measured
+  int window; // blocks to request at once
+  int ssthresh; // window grows quickly below this, slowly above it
+  bool_t rtt_sampled; // the first block of the current request has been timed
+  bool_t multiword; // has answered blocks from a second bitmap word, so can be given larger windows
+  int probes; // requests that have asked for a second bitmap word
+  uint64_t probe_start; // blocks asked for in the second word of the last probe, not waited for
+  uint64_t probe_end;
+  int stalls; // timeouts since this source last answered a whole request
+};
+
+#define RHIZOME_FETCH_MAX_SOURCES 4
+/* A source that stalls loses its range to the sources that are still answering, and is dropped
+ * after this many stalls in a row if another source is answering.
+ */
+#define RHIZOME_FETCH_MAX_STALLS 3
+
+/* Each source's request window is opened by AIMD: doubled for every request that is answered in
+ * full until the first loss, then grown by RHIZOME_MDP_WINDOW_STEP blocks, and halved on every loss.
+ * The window is sent as a bitmap of up to RHIZOME_MDP_MAX_BITMAP_WORDS 32-bit words.  Older servers
+ * only read the first word, so a source's window stays within it until the source has answered a
+ * block from a second word, which is added to a few full windows as a probe.
+ */
+#define RHIZOME_MDP_MAX_WINDOW (RHIZOME_MDP_MAX_BITMAP_WORDS * 32)
+#define RHIZOME_MDP_SINGLE_WORD_WINDOW 32
+#define RHIZOME_MDP_MAX_PROBES 4
+#define RHIZOME_MDP_MIN_WINDOW 2
+#define RHIZOME_MDP_INITIAL_WINDOW 32
+#define RHIZOME_MDP_WINDOW_STEP 4
+
+/* The block length is halved whenever a request times out with blocks missing, and doubled again
+ * after RHIZOME_MDP_CLEAN_ROUNDS requests have been answered in full.
+ */
+#define RHIZOME_MDP_MIN_BLOCK_LENGTH 128
+#define RHIZOME_MDP_MAX_BLOCK_LENGTH 1024
+#define RHIZOME_MDP_CLEAN_ROUNDS 8
+
+#define RHIZOME_MDP_MIN_RTO 250
+#define RHIZOME_MDP_MAX_RTO 5000
+
 /* Represents an active fetch (in progress) of a bundle payload (.manifest != NULL) or of a bundle
  * manifest (.manifest == NULL).
  */
 struct rhizome_fetch_slot {
   struct sched_ent alarm; // must be first element in struct
+  struct rhizome_fetch_queue *queue;
   rhizome_manifest *manifest;
 
   struct sockaddr_in peer_ipandport;
@@ -80,54 +136,167 @@ struct rhizome_fetch_slot {
   int64_t bidVersion;
   int prefix_length;
   int mdpIdleTimeout;
-  time_ms_t mdp_last_request_time;
-  uint64_t mdp_last_request_offset;
-  int mdpResponsesOutstanding;
   int mdpRXBlockLength;
-  unsigned char mdpRXWindow[32*200];
+  struct rhizome_fetch_source sources[RHIZOME_FETCH_MAX_SOURCES];
+  int source_count;
+  time_ms_t mdp_srtt; // smoothed time from request to first block, zero until measured
+  time_ms_t mdp_rttvar;
+  int mdp_clean_rounds; // requests answered in full since the last loss
+  unsigned mdp_timeouts;
+  time_ms_t mdp_start_time;
+  uint64_t mdp_start_offset;
+  
+  /* Leaf hashes of the payload hash tree, fetched before any blocks if the manifest has a root */
+  unsigned char *merkle_leaves;
+  size_t merkle_received;
+  bool_t merkle_failed;
 };
 
 static int rhizome_fetch_switch_to_mdp(struct rhizome_fetch_slot *slot);
 static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot);
-
-/* Represents a queue of fetch candidates and a single active fetch for bundle payloads whose size
- * is less than a given threshold.
- *
- * TODO: If the queues ever get much larger, use pointer-linked queue instead of physically ordered
- * in memory, to avoid the need for memory copies when deleting or inserting queue entries.
+static int rhizome_fetch_mdp_request_range(struct rhizome_fetch_slot *slot, struct rhizome_fetch_source *source);
+static void fetch_source_lost(struct rhizome_fetch_slot *slot, struct rhizome_fetch_source *source);
+static void fetch_drop_stalled_sources(struct rhizome_fetch_slot *slot);
+static void rhizome_fetch_mdp_request_ranges(struct rhizome_fetch_slot *slot);
+
+/* Represents a queue of fetch candidates and a set of active fetches for bundle payloads whose size
+ * is less than a given threshold.  The candidates are kept in a binary heap ordered by priority and
+ * then by order of arrival, so queueing and unqueueing a candidate are O(log n) and never copy more
+ * than a pointer per level.  The size of each queue comes from the rhizome.fetch_queue config, and
+ * the queues are built the first time a fetch is queued.
  *
  * @author Andrew Bettison <andrew@servalproject.com>
  */
 struct rhizome_fetch_queue {
-  struct rhizome_fetch_slot active; // must be first element in struct
-  unsigned candidate_queue_size;
-  struct rhizome_fetch_candidate *candidate_queue;
+  struct rhizome_fetch_slot *active; // array of active_count slots, never moved once allocated
+  unsigned active_count;
+  struct rhizome_fetch_candidate **candidates; // heap, highest priority first
+  unsigned candidate_count;
+  unsigned candidate_alloc;
+  unsigned candidate_queue_size; // will only queue this many candidates
   unsigned char log_size_threshold; // will only queue payloads smaller than this.
 };
 
-/* Static allocation of the candidate queues.
+/* Built-in queue layout, used for any queue that the config does not override.  Must be in order of
+ * ascending log_size_threshold.
  */
-struct rhizome_fetch_candidate queue0[10];
-struct rhizome_fetch_candidate queue1[8];
-struct rhizome_fetch_candidate queue2[6];
-struct rhizome_fetch_candidate queue3[4];
-struct rhizome_fetch_candidate queue4[2];
-struct rhizome_fetch_candidate queue5[2];
+static const struct {
+  unsigned char log_size_threshold;
+  unsigned candidates;
+  unsigned slots;
+} default_fetch_queues[] = {
+  { .log_size_threshold =   10, .candidates = 64, .slots = 1 },
+  { .log_size_threshold =   13, .candidates = 32, .slots = 1 },
+  { .log_size_threshold =   16, .candidates = 16, .slots = 1 },
+  { .log_size_threshold =   19, .candidates =  8, .slots = 1 },
+  { .log_size_threshold =   22, .candidates =  4, .slots = 1 },
+  { .log_size_threshold = 0xFF, .candidates =  4, .slots = 1 },
+};
+
+#define RHIZOME_FETCH_MAX_QUEUES 8
 
-#define slotno(slot) (int)((struct rhizome_fetch_queue *)(slot) - &rhizome_fetch_queues[0])
+static struct rhizome_fetch_queue rhizome_fetch_queues[RHIZOME_FETCH_MAX_QUEUES];
+static unsigned fetch_queue_count = 0;
+static unsigned candidate_sequence = 0;
 
-/* Static allocation of the queue structures.  Must be in order of ascending log_size_threshold.
+#define queueno(q) (int)((q) - &rhizome_fetch_queues[0])
+#define slotno(slot) (int)((slot) - (slot)->queue->active)
+
+/* Build the fetch queues from the config.  A queue that is configured without a threshold takes
+ * the threshold of the built-in queue with the same number, and the last queue always accepts
+ * payloads of any size.
  */
-struct rhizome_fetch_queue rhizome_fetch_queues[] = {
-  { .candidate_queue_size = NELS(queue0), .candidate_queue = queue0, .log_size_threshold =   10, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue1), .candidate_queue = queue1, .log_size_threshold =   13, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue2), .candidate_queue = queue2, .log_size_threshold =   16, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue3), .candidate_queue = queue3, .log_size_threshold =   19, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue4), .candidate_queue = queue4, .log_size_threshold =   22, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue5), .candidate_queue = queue5, .log_size_threshold = 0xFF, .active = { .state = RHIZOME_FETCH_FREE } }
-};
+static int rhizome_fetch_queues_init()
+{
+  if (fetch_queue_count)
+    return 0;
+  unsigned n = NELS(default_fetch_queues);
+  unsigned i;
+  for (i = 0; i < config.rhizome.fetch_queue.ac; ++i)
+    if (config.rhizome.fetch_queue.av[i].key >= n)
+      n = config.rhizome.fetch_queue.av[i].key + 1;
+  if (n > RHIZOME_FETCH_MAX_QUEUES)
+    n = RHIZOME_FETCH_MAX_QUEUES;
+  // stop after the queue that accepts payloads of any size
+  for (i = 0; i < n && (i == 0 || rhizome_fetch_queues[i - 1].log_size_threshold != 0xFF); ++i) {
+    struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
+    unsigned d = i < NELS(default_fetch_queues) ? i : NELS(default_fetch_queues) - 1;
+    int threshold = default_fetch_queues[d].log_size_threshold;
+    unsigned candidates = default_fetch_queues[d].candidates;
+    unsigned slots = default_fetch_queues[d].slots;
+    unsigned short key = i;
+    int c = config_rhizome_fetch_queuelist__get(&config.rhizome.fetch_queue, &key);
+    if (c != -1) {
+      const struct config_rhizome_fetch_queue *cq = &config.rhizome.fetch_queue.av[c].value;
+      if (cq->log_size_threshold >= 0)
+	threshold = cq->log_size_threshold;
+      if (cq->candidates >= 0)
+	candidates = cq->candidates;
+      if (cq->slots > 0)
+	slots = cq->slots;
+    }
+    if (i + 1 == n || threshold > 0xFF)
+      threshold = 0xFF;
+    if (i > 0 && threshold <= rhizome_fetch_queues[i - 1].log_size_threshold) {
+      WARNF("rhizome.fetch_queue.%u.log_size_threshold must be larger than that of queue %u", i, i - 1);
+      threshold = rhizome_fetch_queues[i - 1].log_size_threshold + 1;
+    }
+    q->log_size_threshold = threshold;
+    q->candidate_queue_size = candidates;
+    q->active = emalloc_zero(slots * sizeof *q->active);
+    if (!q->active)
+      return -1;
+    q->active_count = slots;
+    unsigned j;
+    for (j = 0; j < slots; ++j)
+      q->active[j].queue = q;
+    fetch_queue_count = i + 1;
+  }
+  return 0;
+}
+
+static inline int candidate_before(const struct rhizome_fetch_candidate *a, const struct rhizome_fetch_candidate *b)
+{
+  if (a->priority != b->priority)
+    return a->priority > b->priority;
+  return (int)(a->sequence - b->sequence) < 0;
+}
+
+static inline void candidate_set(struct rhizome_fetch_queue *q, unsigned i, struct rhizome_fetch_candidate *c)
+{
+  q->candidates[i] = c;
+  c->heap_index = i;
+}
 
-#define NQUEUES	    NELS(rhizome_fetch_queues)
+static void candidate_sift_up(struct rhizome_fetch_queue *q, unsigned i)
+{
+  struct rhizome_fetch_candidate *c = q->candidates[i];
+  while (i > 0) {
+    unsigned parent = (i - 1) / 2;
+    if (!candidate_before(c, q->candidates[parent]))
+      break;
+    candidate_set(q, i, q->candidates[parent]);
+    i = parent;
+  }
+  candidate_set(q, i, c);
+}
+
+static void candidate_sift_down(struct rhizome_fetch_queue *q, unsigned i)
+{
+  struct rhizome_fetch_candidate *c = q->candidates[i];
+  while (1) {
+    unsigned child = i * 2 + 1;
+    if (child >= q->candidate_count)
+      break;
+    if (child + 1 < q->candidate_count && candidate_before(q->candidates[child + 1], q->candidates[child]))
+      child++;
+    if (!candidate_before(q->candidates[child], c))
+      break;
+    candidate_set(q, i, q->candidates[child]);
+    i = child;
+  }
+  candidate_set(q, i, c);
+}
 
 static const char * fetch_state(int state)
 {
@@ -151,73 +320,122 @@ static const char * fetch_state(int state)
 
 int rhizome_active_fetch_count()
 {
-  int i,active=0;
-  for(i=0;i<NQUEUES;i++)
-    if (rhizome_fetch_queues[i].active.state!=RHIZOME_FETCH_FREE)
-      active++;
+  unsigned i, j;
+  int active=0;
+  for(i=0;i<fetch_queue_count;i++)
+    for (j=0;j<rhizome_fetch_queues[i].active_count;j++)
+      if (rhizome_fetch_queues[i].active[j].state!=RHIZOME_FETCH_FREE)
+	active++;
   return active;
 }
 
+/* Total bytes received by the active fetches of queue q, or -1 if none of them are active. */
 uint64_t rhizome_active_fetch_bytes_received(int q)
 {
-  if (q<0 || q>=NQUEUES) return -1;
-  if (rhizome_fetch_queues[q].active.state==RHIZOME_FETCH_FREE) return -1;
-  return rhizome_fetch_queues[q].active.write_state.file_offset;
+  if (q<0 || (unsigned)q>=fetch_queue_count) return -1;
+  uint64_t bytes = -1;
+  unsigned j;
+  for (j=0;j<rhizome_fetch_queues[q].active_count;j++){
+    struct rhizome_fetch_slot *slot = &rhizome_fetch_queues[q].active[j];
+    if (slot->state==RHIZOME_FETCH_FREE)
+      continue;
+    bytes = (bytes == (uint64_t)-1 ? 0 : bytes) + slot->write_state.file_offset;
+  }
+  return bytes;
 }
 
 uint64_t rhizome_fetch_queue_bytes()
 {
   uint64_t bytes = 0;
   unsigned i;
-  for(i=0;i<NQUEUES;i++){
-    if (rhizome_fetch_queues[i].active.state!=RHIZOME_FETCH_FREE){
-      assert(rhizome_fetch_queues[i].active.manifest->filesize != RHIZOME_SIZE_UNSET);
-      bytes += rhizome_fetch_queues[i].active.manifest->filesize - rhizome_fetch_queues[i].active.write_state.file_offset;
-    }
+  for(i=0;i<fetch_queue_count;i++){
+    struct rhizome_fetch_queue *q=&rhizome_fetch_queues[i];
     unsigned j;
-    for (j=0;j<rhizome_fetch_queues[i].candidate_queue_size;j++){
-      if (rhizome_fetch_queues[i].candidate_queue[j].manifest) {
-        assert(rhizome_fetch_queues[i].candidate_queue[j].manifest->filesize != RHIZOME_SIZE_UNSET);
-        bytes += rhizome_fetch_queues[i].candidate_queue[j].manifest->filesize;
+    for (j=0;j<q->active_count;j++){
+      if (q->active[j].state!=RHIZOME_FETCH_FREE){
+	assert(q->active[j].manifest->filesize != RHIZOME_SIZE_UNSET);
+	bytes += q->active[j].manifest->filesize - q->active[j].write_state.file_offset;
       }
     }
+    for (j=0;j<q->candidate_count;j++){
+      assert(q->candidates[j]->manifest->filesize != RHIZOME_SIZE_UNSET);
+      bytes += q->candidates[j]->manifest->filesize;
+    }
   }
   return bytes;
 }
 
 int rhizome_fetch_status_html(strbuf b)
 {
+  rhizome_fetch_queues_init();
   unsigned i;
-  for(i=0;i<NQUEUES;i++){
+  for(i=0;i<fetch_queue_count;i++){
     struct rhizome_fetch_queue *q=&rhizome_fetch_queues[i];
-    unsigned used=0;
+    strbuf_sprintf(b, "<p>Slot %u, (%u of %u): ", i, q->candidate_count, q->candidate_queue_size);
     unsigned j;
-    for (j=0;j<q->candidate_queue_size;j++){
-      if (q->candidate_queue[j].manifest)
-	used++;
+    int active=0;
+    for (j=0;j<q->active_count;j++){
+      struct rhizome_fetch_slot *slot=&q->active[j];
+      if (slot->state==RHIZOME_FETCH_FREE)
+	continue;
+      strbuf_sprintf(b, "%s%s %"PRIu64" of %"PRIu64" from %s*",
+	active++?", ":"",
+	fetch_state(slot->state),
+	slot->write_state.file_offset,
+	slot->manifest->filesize,
+	alloca_tohex_sid_t_trunc(slot->peer_sid, 16));
     }
-    strbuf_sprintf(b, "<p>Slot %u, (%u of %u): ", i, used, q->candidate_queue_size);
-    if (q->active.state!=RHIZOME_FETCH_FREE){
-      strbuf_sprintf(b, "%s %"PRIu64" of %"PRIu64" from %s*",
-	fetch_state(q->active.state),
-	q->active.write_state.file_offset,
-	q->active.manifest->filesize,
-	alloca_tohex_sid_t_trunc(q->active.peer_sid, 16));
-    }else{
+    if (!active)
       strbuf_puts(b, "inactive");
+    uint64_t candidate_size = 0;
+    for (j=0; j< q->candidate_count;j++){
+      assert(q->candidates[j]->manifest->filesize != RHIZOME_SIZE_UNSET);
+      candidate_size += q->candidates[j]->manifest->filesize;
     }
-    int candidates=0;
+    if (q->candidate_count)
+      strbuf_sprintf(b, ", %u candidates [%"PRIu64" bytes]", q->candidate_count, candidate_size);
+  }
+  return 0;
+}
+
+int rhizome_fetch_stats_json(strbuf b)
+{
+  rhizome_fetch_queues_init();
+  unsigned i;
+  strbuf_putc(b, '[');
+  for(i=0;i<fetch_queue_count;i++){
+    struct rhizome_fetch_queue *q=&rhizome_fetch_queues[i];
     uint64_t candidate_size = 0;
-    for (j=0; j< q->candidate_queue_size;j++){
-      if (q->candidate_queue[j].manifest){
-	candidates++;
-	assert(q->candidate_queue[j].manifest->filesize != RHIZOME_SIZE_UNSET);
-	candidate_size += q->candidate_queue[j].manifest->filesize;
+    unsigned j;
+    for (j=0; j< q->candidate_count;j++)
+      candidate_size += q->candidates[j]->manifest->filesize;
+    strbuf_sprintf(b, "%s{\"queue\":%u,\"log_size_threshold\":%u,\"candidates\":%u,\"candidate_capacity\":%u,\"candidate_bytes\":%"PRIu64",\"slots\":[",
+      i?",":"", i, q->log_size_threshold, q->candidate_count, q->candidate_queue_size, candidate_size);
+    for (j=0;j<q->active_count;j++){
+      struct rhizome_fetch_slot *slot=&q->active[j];
+      strbuf_puts(b, j?",{\"state\":":"{\"state\":");
+      strbuf_json_string(b, fetch_state(slot->state));
+      if (slot->state!=RHIZOME_FETCH_FREE){
+	strbuf_sprintf(b, ",\"received\":%"PRIu64",\"filesize\":%"PRIu64",\"peer\":\"%s\"",
+	  slot->write_state.file_offset,
+	  slot->manifest->filesize,
+	  alloca_tohex_sid_t(slot->peer_sid));
+	if (slot->state==RHIZOME_FETCH_RXFILEMDP){
+	  time_ms_t elapsed = gettime_ms() - slot->mdp_start_time;
+	  strbuf_sprintf(b, ",\"goodput\":%"PRIu64",\"rtt_ms\":%"PRId64",\"block_length\":%d,\"timeouts\":%u,\"windows\":[",
+	    elapsed > 0 ? (slot->write_state.file_offset - slot->mdp_start_offset) * 1000 / (uint64_t)elapsed : 0,
+	    slot->mdp_srtt, slot->mdpRXBlockLength, slot->mdp_timeouts);
+	  int k;
+	  for (k=0;k<slot->source_count;k++)
+	    strbuf_sprintf(b, "%s%d", k?",":"", slot->sources[k].window);
+	  strbuf_putc(b, ']');
+	}
       }
+      strbuf_putc(b, '}');
     }
-    if (candidates)
-      strbuf_sprintf(b, ", %d candidates [%"PRIu64" bytes]", candidates, candidate_size);
+    strbuf_puts(b, "]}");
   }
+  strbuf_putc(b, ']');
   return 0;
 }
 
@@ -225,6 +443,20 @@ static struct sched_ent sched_activate = STRUCT_SCHED_ENT_UNUSED;
 static struct profile_total rsnqf_stats = { .name="rhizome_start_next_queued_fetches" };
 static struct profile_total fetch_stats = { .name="rhizome_fetch_poll" };
 
+/* Find a queue suitable for a fetch of payloads of the given log2 size.  The size may come straight
+ * off the network, so is compared with each threshold rather than shifted back into a byte count.
+ */
+static struct rhizome_fetch_queue *rhizome_find_queue_log2(unsigned char log_size)
+{
+  unsigned i;
+  for (i = 0; i < fetch_queue_count; ++i) {
+    struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
+    if (log_size < q->log_size_threshold)
+      return q;
+  }
+  return NULL;
+}
+
 /* Find a queue suitable for a fetch of the given number of bytes.  If there is no suitable queue,
  * return NULL.
  *
@@ -232,13 +464,17 @@ static struct profile_total fetch_stats = { .name="rhizome_fetch_poll" };
  */
 static struct rhizome_fetch_queue *rhizome_find_queue(uint64_t size)
 {
-  int i;
-  unsigned char log_size = log2ll(size);
-  for (i = 0; i < NQUEUES; ++i) {
-    struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-    if (log_size < q->log_size_threshold)
-      return q;
-  }
+  return rhizome_find_queue_log2(log2ll(size));
+}
+
+/* Find a free fetch slot in the given queue, or NULL if all of its slots are busy.
+ */
+static struct rhizome_fetch_slot *rhizome_queue_free_slot(struct rhizome_fetch_queue *q)
+{
+  unsigned j;
+  for (j = 0; j < q->active_count; ++j)
+    if (q->active[j].state == RHIZOME_FETCH_FREE)
+      return &q->active[j];
   return NULL;
 }
 
@@ -250,12 +486,13 @@ static struct rhizome_fetch_queue *rhizome_find_queue(uint64_t size)
  */
 static struct rhizome_fetch_slot *rhizome_find_fetch_slot(uint64_t size)
 {
-  int i;
+  unsigned i;
   unsigned char log_size = log2ll(size);
-  for (i = 0; i < NQUEUES; ++i) {
+  for (i = 0; i < fetch_queue_count; ++i) {
     struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-    if (log_size < q->log_size_threshold && q->active.state == RHIZOME_FETCH_FREE)
-      return &q->active;
+    struct rhizome_fetch_slot *slot;
+    if (log_size < q->log_size_threshold && (slot = rhizome_queue_free_slot(q)))
+      return slot;
   }
   return NULL;
 }
@@ -264,13 +501,15 @@ static struct rhizome_fetch_slot *rhizome_find_fetch_slot(uint64_t size)
 // find the first matching active slot for this bundle
 static struct rhizome_fetch_slot *fetch_search_slot(const unsigned char *id, int prefix_length)
 {
-  int i;
-  for (i = 0; i < NQUEUES; ++i) {
+  unsigned i, j;
+  for (i = 0; i < fetch_queue_count; ++i) {
     struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-    
-    if (q->active.state != RHIZOME_FETCH_FREE && 
-	memcmp(id, q->active.manifest->cryptoSignPublic.binary, prefix_length) == 0)
-      return &q->active;
+    for (j = 0; j < q->active_count; ++j) {
+      struct rhizome_fetch_slot *slot = &q->active[j];
+      if (slot->state != RHIZOME_FETCH_FREE &&
+	  memcmp(id, slot->manifest->cryptoSignPublic.binary, prefix_length) == 0)
+	return slot;
+    }
   }
   return NULL;
 }
@@ -279,13 +518,11 @@ static struct rhizome_fetch_slot *fetch_search_slot(const unsigned char *id, int
 static struct rhizome_fetch_candidate *fetch_search_candidate(const unsigned char *id, int prefix_length)
 {
   unsigned i;
-  for (i = 0; i < NQUEUES; ++i) {
+  for (i = 0; i < fetch_queue_count; ++i) {
     struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
     unsigned j;
-    for (j = 0; j < q->candidate_queue_size; j++) {
-      struct rhizome_fetch_candidate *c = &q->candidate_queue[j];
-      if (!c->manifest)
-	continue;
+    for (j = 0; j < q->candidate_count; j++) {
+      struct rhizome_fetch_candidate *c = q->candidates[j];
       if (memcmp(c->manifest->cryptoSignPublic.binary, id, prefix_length))
 	continue;
       return c;
@@ -305,62 +542,100 @@ rhizome_manifest * rhizome_fetch_search(const unsigned char *id, int prefix_leng
   return NULL;
 }
 
-/* Insert a candidate into a given queue at a given position.  All candidates succeeding the given
- * position are copied backward in the queue to open up an empty element at the given position.  If
- * the queue was full, then the tail element is discarded, freeing the manifest it points to.
+/* Return the lowest priority candidate in a given queue, which must be one of the heap's leaves, or
+ * NULL if the queue is empty.
+ */
+static struct rhizome_fetch_candidate *queue_lowest(struct rhizome_fetch_queue *q)
+{
+  struct rhizome_fetch_candidate *last = NULL;
+  unsigned j;
+  for (j = q->candidate_count / 2; j < q->candidate_count; ++j)
+    if (!last || candidate_before(last, q->candidates[j]))
+      last = q->candidates[j];
+  return last;
+}
+
+/* Put a candidate into its place in a given queue's heap.  There must be room for it.
+ */
+static void candidate_attach(struct rhizome_fetch_queue *q, struct rhizome_fetch_candidate *c)
+{
+  assert(q->candidate_count < q->candidate_alloc);
+  q->candidates[q->candidate_count] = c;
+  candidate_sift_up(q, q->candidate_count++);
+}
+
+/* Take a candidate out of a given queue's heap without freeing it.
+ */
+static void candidate_detach(struct rhizome_fetch_queue *q, struct rhizome_fetch_candidate *c)
+{
+  unsigned i = c->heap_index;
+  assert(i < q->candidate_count && q->candidates[i] == c);
+  struct rhizome_fetch_candidate *last = q->candidates[--q->candidate_count];
+  if (last != c) {
+    candidate_set(q, i, last);
+    if (i > 0 && candidate_before(last, q->candidates[(i - 1) / 2]))
+      candidate_sift_up(q, i);
+    else
+      candidate_sift_down(q, i);
+  }
+}
+
+/* Remove the given candidate from a given queue and free it.  If the candidate points to a manifest
+ * structure, then frees the manifest.
  *
  * @author Andrew Bettison <andrew@servalproject.com>
  */
-static struct rhizome_fetch_candidate *rhizome_fetch_insert(struct rhizome_fetch_queue *q, unsigned i)
+static void rhizome_fetch_unqueue(struct rhizome_fetch_queue *q, struct rhizome_fetch_candidate *c)
 {
-  struct rhizome_fetch_candidate * const c = &q->candidate_queue[i];
-  struct rhizome_fetch_candidate * e = &q->candidate_queue[q->candidate_queue_size - 1];
   if (config.debug.rhizome_rx)
-    DEBUGF("insert queue[%d] candidate[%u]", (int)(q - rhizome_fetch_queues), i);
-  assert(i >= 0 && i < q->candidate_queue_size);
-  assert(i == 0 || c[i-1].manifest);
-  if (e->manifest) // queue is full
-    rhizome_manifest_free(e->manifest);
-  else
-    while (e > c && !e[-1].manifest)
-      --e;
-  for (; e > c; --e)
-    e[0] = e[-1];
-  assert(e == c);
-  c->manifest = NULL;
-  return c;
+    DEBUGF("unqueue queue[%d] candidate[%u] manifest=%p", queueno(q), c->heap_index, c->manifest);
+  candidate_detach(q, c);
+  if (c->manifest)
+    rhizome_manifest_free(c->manifest);
+  free(c);
 }
 
-/* Remove the given candidate from a given queue.  If the element points to a manifest structure,
- * then frees the manifest.  All succeeding candidates are copied forward in the queue to close up
- * the gap, leaving an empty element at the tail of the queue.
+/* Insert a new, empty candidate into a given queue with the given priority.  If the queue is full,
+ * then the lowest priority candidate is discarded to make room, freeing the manifest it points to,
+ * unless it has at least the new candidate's priority, in which case returns NULL.  The caller must
+ * set the candidate's manifest.
  *
  * @author Andrew Bettison <andrew@servalproject.com>
  */
-static void rhizome_fetch_unqueue(struct rhizome_fetch_queue *q, unsigned i)
+static struct rhizome_fetch_candidate *rhizome_fetch_insert(struct rhizome_fetch_queue *q, int priority)
 {
-  assert(i >= 0 && i < q->candidate_queue_size);
-  struct rhizome_fetch_candidate *c = &q->candidate_queue[i];
-  if (config.debug.rhizome_rx)
-    DEBUGF("unqueue queue[%d] candidate[%d] manifest=%p", (int)(q - rhizome_fetch_queues), i, c->manifest);
-  if (c->manifest) {
-    rhizome_manifest_free(c->manifest);
-    c->manifest = NULL;
+  if (q->candidate_count >= q->candidate_queue_size) {
+    struct rhizome_fetch_candidate *last = queue_lowest(q);
+    if (!last || last->priority >= priority)
+      return NULL;
+    rhizome_fetch_unqueue(q, last);
+  }
+  if (q->candidate_count >= q->candidate_alloc) {
+    unsigned size = q->candidate_alloc ? q->candidate_alloc * 2 : 16;
+    struct rhizome_fetch_candidate **candidates = erealloc(q->candidates, size * sizeof *candidates);
+    if (!candidates)
+      return NULL;
+    q->candidates = candidates;
+    q->candidate_alloc = size;
   }
-  struct rhizome_fetch_candidate *e = &q->candidate_queue[q->candidate_queue_size - 1];
-  for (; c < e && c[1].manifest; ++c)
-    c[0] = c[1];
-  c->manifest = NULL;
+  struct rhizome_fetch_candidate *c = emalloc_zero(sizeof *c);
+  if (!c)
+    return NULL;
+  c->priority = priority;
+  c->sequence = candidate_sequence++;
+  if (config.debug.rhizome_rx)
+    DEBUGF("insert queue[%d] candidate[%u]", queueno(q), q->candidate_count);
+  candidate_attach(q, c);
+  return c;
 }
 
 static void candidate_unqueue(struct rhizome_fetch_candidate *c)
 {
   unsigned i;
-  for (i = 0; i < NQUEUES; ++i) {
+  for (i = 0; i < fetch_queue_count; ++i) {
     struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-    unsigned index = c - q->candidate_queue;
-    if (index>=0 && index < q->candidate_queue_size){
-      rhizome_fetch_unqueue(q, index);
+    if (c->heap_index < q->candidate_count && q->candidates[c->heap_index] == c){
+      rhizome_fetch_unqueue(q, c);
       return;
     }
   }
@@ -372,11 +647,7 @@ static void candidate_unqueue(struct rhizome_fetch_candidate *c)
  */
 int rhizome_any_fetch_active()
 {
-  int i;
-  for (i = 0; i < NQUEUES; ++i)
-    if (rhizome_fetch_queues[i].active.state != RHIZOME_FETCH_FREE)
-      return 1;
-  return 0;
+  return rhizome_active_fetch_count() != 0;
 }
 
 /* Return true if there are any fetches queued.
@@ -385,9 +656,9 @@ int rhizome_any_fetch_active()
  */
 int rhizome_any_fetch_queued()
 {
-  int i;
-  for (i = 0; i < NQUEUES; ++i)
-    if (rhizome_fetch_queues[i].candidate_queue[0].manifest)
+  unsigned i;
+  for (i = 0; i < fetch_queue_count; ++i)
+    if (rhizome_fetch_queues[i].candidate_count)
       return 1;
   return 0;
 }
@@ -473,16 +744,45 @@ static int rhizome_import_received_bundle(struct rhizome_manifest *m)
   return rhizome_add_manifest(m, m->ttl - 1 /* TTL */);
 }
 
+static void fetch_source_init(struct rhizome_fetch_source *source, const sid_t *sidp)
+{
+  bzero(source, sizeof *source);
+  source->sid = *sidp;
+  source->window = RHIZOME_MDP_INITIAL_WINDOW;
+  source->ssthresh = RHIZOME_MDP_MAX_WINDOW;
+}
+
+// where the payload fetched over HTTP should start
+static uint64_t rhizome_fetch_range_start(struct rhizome_fetch_slot *slot)
+{
+  uint64_t start = slot->write_state.file_offset;
+  if (slot->previous && slot->previous->filesize - slot->manifest->tail > start)
+    start = slot->previous->filesize - slot->manifest->tail;
+  return start;
+}
+
 // begin fetching a bundle
 static int schedule_fetch(struct rhizome_fetch_slot *slot)
 {
   IN();
   int sock = -1;
-  /* TODO Don't forget to implement resume */
   slot->start_time=gettime_ms();
   slot->alarm.poll.fd = -1;
   slot->write_state.blob_fd=-1;
   slot->write_state.blob_rowid=-1;
+  slot->write_state.partial=0;
+  slot->merkle_leaves=NULL;
+  slot->merkle_received=0;
+  slot->merkle_failed=0;
+  bzero(slot->sources, sizeof slot->sources);
+  fetch_source_init(&slot->sources[0], &slot->peer_sid);
+  slot->source_count=1;
+  slot->mdp_srtt=0;
+  slot->mdp_rttvar=0;
+  slot->mdp_clean_rounds=0;
+  slot->mdp_timeouts=0;
+  slot->mdp_start_time=slot->start_time;
+  slot->mdp_start_offset=0;
 
   if (slot->manifest) {
     slot->bid = slot->manifest->cryptoSignPublic;
@@ -493,6 +793,10 @@ static int schedule_fetch(struct rhizome_fetch_slot *slot)
     slot->manifest->dataFileName = NULL;
     slot->manifest->dataFileUnlinkOnFree = 0;
     
+    // carry on from whatever an earlier, interrupted fetch of the same payload left behind
+    if (rhizome_open_write_partial(&slot->write_state, &slot->manifest->filehash, slot->manifest->filesize, RHIZOME_PRIORITY_DEFAULT))
+      RETURN(-1);
+    
     strbuf r = strbuf_local(slot->request, sizeof slot->request);
     strbuf_sprintf(r, "GET /rhizome/file/%s HTTP/1.0\r\n", alloca_tohex_rhizome_filehash_t(slot->manifest->filehash));
     
@@ -513,21 +817,22 @@ static int schedule_fetch(struct rhizome_fetch_slot *slot)
       }else{
 	assert(slot->previous->filesize >= slot->manifest->tail);
 	assert(slot->manifest->filesize > 0);
-	strbuf_sprintf(r, "Range: bytes=%"PRIu64"-%"PRIu64"\r\n",
-	    slot->previous->filesize - slot->manifest->tail,
-	    slot->manifest->filesize - 1
-	  );
       }
     }
+    
+    // ask only for the bytes we can't copy from the previous journal or already have
+    uint64_t range_start = rhizome_fetch_range_start(slot);
+    if (range_start)
+      strbuf_sprintf(r, "Range: bytes=%"PRIu64"-%"PRIu64"\r\n",
+	  range_start,
+	  slot->manifest->filesize - 1
+	);
 
     strbuf_puts(r, "\r\n");
 
     if (strbuf_overrun(r))
       RETURN(WHY("request overrun"));
     slot->request_len = strbuf_len(r);
-
-    if (rhizome_open_write(&slot->write_state, &slot->manifest->filehash, slot->manifest->filesize, RHIZOME_PRIORITY_DEFAULT))
-      RETURN(-1);
   } else {
     strbuf r = strbuf_local(slot->request, sizeof slot->request);
     strbuf_sprintf(r, "GET /rhizome/manifestbyprefix/%s HTTP/1.0\r\n\r\n", alloca_tohex(slot->bid.binary, slot->prefix_length));
@@ -657,8 +962,8 @@ rhizome_fetch(struct rhizome_fetch_slot *slot, rhizome_manifest *m, const struct
   */
 
   if (config.debug.rhizome_rx)
-    DEBUGF("Fetching bundle slot=%d bid=%s version=%"PRId64" size=%"PRIu64" peerip=%s",
-	   slotno(slot),
+    DEBUGF("Fetching bundle slot=%d.%d bid=%s version=%"PRId64" size=%"PRIu64" peerip=%s",
+	   queueno(slot->queue), slotno(slot),
 	   alloca_tohex_rhizome_bid_t(m->cryptoSignPublic),
 	   m->version,
 	   m->filesize,
@@ -698,14 +1003,16 @@ rhizome_fetch(struct rhizome_fetch_slot *slot, rhizome_manifest *m, const struct
       }
     }
   }
-  int i;
-  for (i = 0; i < NQUEUES; ++i) {
-    struct rhizome_fetch_slot *as = &rhizome_fetch_queues[i].active;
-    const rhizome_manifest *am = as->manifest;
-    if (as->state != RHIZOME_FETCH_FREE && cmp_rhizome_filehash_t(&m->filehash, &am->filehash) == 0) {
-      if (config.debug.rhizome_rx)
-	DEBUGF("   fetch already in progress, slot=%d filehash=%s", i, alloca_tohex_rhizome_filehash_t(m->filehash));
-      RETURN(SAMEPAYLOAD);
+  unsigned i, j;
+  for (i = 0; i < fetch_queue_count; ++i) {
+    for (j = 0; j < rhizome_fetch_queues[i].active_count; ++j) {
+      struct rhizome_fetch_slot *as = &rhizome_fetch_queues[i].active[j];
+      const rhizome_manifest *am = as->manifest;
+      if (as->state != RHIZOME_FETCH_FREE && cmp_rhizome_filehash_t(&m->filehash, &am->filehash) == 0) {
+	if (config.debug.rhizome_rx)
+	  DEBUGF("   fetch already in progress, slot=%u.%u filehash=%s", i, j, alloca_tohex_rhizome_filehash_t(m->filehash));
+	RETURN(SAMEPAYLOAD);
+      }
     }
   }
 
@@ -747,6 +1054,8 @@ rhizome_fetch_request_manifest_by_prefix(const struct sockaddr_in *peerip,
 					 const unsigned char *prefix, size_t prefix_length)
 {
   assert(peerip);
+  if (rhizome_fetch_queues_init() == -1)
+    return -1;
   struct rhizome_fetch_slot *slot = rhizome_find_fetch_slot(MAX_MANIFEST_BYTES);
   if (slot == NULL)
     return SLOTBUSY;
@@ -778,18 +1087,23 @@ static void rhizome_start_next_queued_fetch(struct rhizome_fetch_slot *slot)
 {
   IN();
   struct rhizome_fetch_queue *q;
-  for (q = (struct rhizome_fetch_queue *) slot; q >= rhizome_fetch_queues; --q) {
-    unsigned i = 0;
-    struct rhizome_fetch_candidate *c;
-    while (i < q->candidate_queue_size && (c = &q->candidate_queue[i])->manifest) {
+  for (q = slot->queue; q >= rhizome_fetch_queues; --q) {
+    // candidates for newer versions of bundles that are still being fetched are set aside, and put
+    // back once this queue has been tried
+    struct rhizome_fetch_candidate *deferred = NULL;
+    int started = 0;
+    while (!started && q->candidate_count) {
+      struct rhizome_fetch_candidate *c = q->candidates[0];
       int result = rhizome_fetch(slot, c->manifest, &c->peer_ipandport, &c->peer_sid);
       switch (result) {
       case SLOTBUSY:
-	OUT(); return;
+	started = 1;
+	break;
       case STARTED:
 	c->manifest = NULL;
-	rhizome_fetch_unqueue(q, i);
-	OUT(); return;
+	rhizome_fetch_unqueue(q, c);
+	started = 1;
+	break;
       case IMPORTED:
       case SAMEBUNDLE:
       case SAMEPAYLOAD:
@@ -797,15 +1111,25 @@ static void rhizome_start_next_queued_fetch(struct rhizome_fetch_slot *slot)
       case NEWERBUNDLE:
       default:
 	// Discard the candidate fetch and loop to try the next in queue.
-	rhizome_fetch_unqueue(q, i);
+	rhizome_fetch_unqueue(q, c);
 	break;
       case OLDERBUNDLE:
 	// Do not un-queue, so that when the fetch of the older bundle finishes, we will start
 	// fetching a newer one.
-	++i;
+	candidate_detach(q, c);
+	c->deferred = deferred;
+	deferred = c;
 	break;
       }
     }
+    while (deferred) {
+      struct rhizome_fetch_candidate *c = deferred;
+      deferred = c->deferred;
+      c->deferred = NULL;
+      candidate_attach(q, c);
+    }
+    if (started)
+      break;
   }
   OUT();
 }
@@ -817,27 +1141,37 @@ static void rhizome_start_next_queued_fetch(struct rhizome_fetch_slot *slot)
 static void rhizome_start_next_queued_fetches(struct sched_ent *alarm)
 {
   IN();
-  int i;
-  for (i = 0; i < NQUEUES; ++i)
-    rhizome_start_next_queued_fetch(&rhizome_fetch_queues[i].active);
+  unsigned i, j;
+  for (i = 0; i < fetch_queue_count; ++i)
+    for (j = 0; j < rhizome_fetch_queues[i].active_count; ++j)
+      if (rhizome_fetch_queues[i].active[j].state == RHIZOME_FETCH_FREE)
+	rhizome_start_next_queued_fetch(&rhizome_fetch_queues[i].active[j]);
   OUT();
 }
 
 /* Do we have space to add a fetch candidate of this size? */
 int rhizome_fetch_has_queue_space(unsigned char log2_size){
-  int i;
-  for (i = 0; i < NQUEUES; ++i) {
+  if (rhizome_fetch_queues_init() == -1)
+    return 0;
+  struct rhizome_fetch_queue *q = rhizome_find_queue_log2(log2_size);
+  return q && q->candidate_count < q->candidate_queue_size;
+}
+
+/* Called as the server shuts down, so that the payloads being fetched can be resumed when it
+ * starts again.  Leaves the slots themselves alone, they go when the process does.
+ */
+void rhizome_fetch_suspend_all()
+{
+  unsigned i, j;
+  for (i = 0; i < fetch_queue_count; ++i) {
     struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-    if (log2_size < q->log_size_threshold){
-      // is there an empty candidate?
-      unsigned j;
-      for (j=0;j < q->candidate_queue_size;j++)
-	if (!q->candidate_queue[j].manifest)
-	  return 1;
-      return 0;
+    for (j = 0; j < q->active_count; ++j) {
+      struct rhizome_fetch_slot *slot = &q->active[j];
+      if (slot->state != RHIZOME_FETCH_FREE && slot->manifest
+	  && (slot->write_state.blob_fd>=0 || slot->write_state.blob_rowid>=0))
+	rhizome_suspend_write(&slot->write_state);
     }
   }
-  return 0;
 }
 
 /* Queue a fetch for the payload of the given manifest.  If 'peerip' is not NULL, then it is used as
@@ -900,6 +1234,10 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
   }
 
   // Find the proper queue for the payload.  If there is none suitable, it is an error.
+  if (rhizome_fetch_queues_init() == -1) {
+    rhizome_manifest_free(m);
+    RETURN(-1);
+  }
   struct rhizome_fetch_queue *qi = rhizome_find_queue(m->filesize);
   if (!qi) {
     WHYF("No suitable fetch queue for bundle size=%"PRIu64, m->filesize);
@@ -910,43 +1248,37 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
   // Search all the queues for the same manifest (it could be in any queue because its payload size
   // may have changed between versions.) If a newer or the same version is already queued, then
   // ignore this one.  Otherwise, unqueue all older candidates.
-  int ci = -1;
   unsigned i;
-  for (i = 0; i < NQUEUES; ++i) {
+  for (i = 0; i < fetch_queue_count; ++i) {
     struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
     unsigned j;
-    for (j = 0; j < q->candidate_queue_size; ) {
-      struct rhizome_fetch_candidate *c = &q->candidate_queue[j];
-      if (c->manifest) {
-	if (cmp_rhizome_bid_t(&m->cryptoSignPublic, &c->manifest->cryptoSignPublic) == 0) {
-	  if (c->manifest->version >= m->version) {
-	    rhizome_manifest_free(m);
-	    RETURN(0);
-	  }
-	  if (!m->selfSigned && rhizome_manifest_verify(m)) {
-	    WHY("Error verifying manifest when considering queuing for import");
-	    /* Don't waste time looking at this manifest again for a while */
-	    rhizome_queue_ignore_manifest(m->cryptoSignPublic.binary, sizeof m->cryptoSignPublic.binary, 60000);
-	    rhizome_manifest_free(m);
-	    RETURN(-1);
-	  }
-	  rhizome_fetch_unqueue(q, j);
-	} else {
-	  if (ci == -1 && q == qi && c->priority < priority)
-	    ci = j;
-	  ++j;
+    for (j = 0; j < q->candidate_count; ) {
+      struct rhizome_fetch_candidate *c = q->candidates[j];
+      if (cmp_rhizome_bid_t(&m->cryptoSignPublic, &c->manifest->cryptoSignPublic) == 0) {
+	if (c->manifest->version >= m->version) {
+	  rhizome_manifest_free(m);
+	  RETURN(0);
 	}
-      } else {
-	if (ci == -1 && q == qi)
-	  ci = j;
-	break;
-      }
+	if (!m->selfSigned && rhizome_manifest_verify(m)) {
+	  WHY("Error verifying manifest when considering queuing for import");
+	  /* Don't waste time looking at this manifest again for a while */
+	  rhizome_queue_ignore_manifest(m->cryptoSignPublic.binary, sizeof m->cryptoSignPublic.binary, 60000);
+	  rhizome_manifest_free(m);
+	  RETURN(-1);
+	}
+	// the last candidate has moved into this place in the heap, so look at it next
+	rhizome_fetch_unqueue(q, c);
+      } else
+	++j;
     }
   }
-  // No duplicate was found, so if no free queue place was found either then bail out.
-  if (ci == -1) {
-    rhizome_manifest_free(m);
-    RETURN(1);
+  // No duplicate was found, so if there is no room in the queue either then bail out.
+  if (qi->candidate_count >= qi->candidate_queue_size) {
+    struct rhizome_fetch_candidate *last = queue_lowest(qi);
+    if (!last || last->priority >= priority) {
+      rhizome_manifest_free(m);
+      RETURN(1);
+    }
   }
 
   if (!m->selfSigned && rhizome_manifest_verify(m)) {
@@ -957,21 +1289,22 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
     RETURN(-1);
   }
 
-  struct rhizome_fetch_candidate *c = rhizome_fetch_insert(qi, ci);
+  struct rhizome_fetch_candidate *c = rhizome_fetch_insert(qi, priority);
+  if (!c) {
+    rhizome_manifest_free(m);
+    RETURN(1);
+  }
   c->manifest = m;
-  c->priority = priority;
   c->peer_ipandport = *peerip;
   c->peer_sid = *peersidp;
 
   if (config.debug.rhizome_rx) {
     DEBUG("Rhizome fetch queues:");
     unsigned i, j;
-    for (i = 0; i < NQUEUES; ++i) {
+    for (i = 0; i < fetch_queue_count; ++i) {
       struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-      for (j = 0; j < q->candidate_queue_size; ++j) {
-	struct rhizome_fetch_candidate *c = &q->candidate_queue[j];
-	if (!c->manifest)
-	  break;
+      for (j = 0; j < q->candidate_count; ++j) {
+	struct rhizome_fetch_candidate *c = q->candidates[j];
 	DEBUGF("%d:%d manifest=%p bid=%s priority=%d size=%"PRIu64, i, j,
 	    c->manifest,
 	    alloca_tohex_rhizome_bid_t(c->manifest->cryptoSignPublic),
@@ -997,7 +1330,7 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
 static int rhizome_fetch_close(struct rhizome_fetch_slot *slot)
 {
   if (config.debug.rhizome_rx)
-    DEBUGF("close Rhizome fetch slot=%d", slotno(slot));
+    DEBUGF("close Rhizome fetch slot=%d.%d", queueno(slot->queue), slotno(slot));
   assert(slot->state != RHIZOME_FETCH_FREE);
 
   /* close socket and stop watching it */
@@ -1017,9 +1350,14 @@ static int rhizome_fetch_close(struct rhizome_fetch_slot *slot)
     rhizome_manifest_free(slot->previous);
   slot->previous = NULL;
   
+  if (slot->merkle_leaves)
+    free(slot->merkle_leaves);
+  slot->merkle_leaves = NULL;
+  
+  // keep what we have received so far for the next attempt
   if (slot->write_state.blob_fd>=0 ||
       slot->write_state.blob_rowid>=0)
-    rhizome_fail_write(&slot->write_state);
+    rhizome_suspend_write(&slot->write_state);
 
   // Release the fetch slot.
   slot->state = RHIZOME_FETCH_FREE;
@@ -1050,85 +1388,336 @@ static void rhizome_fetch_mdp_slot_callback(struct sched_ent *alarm)
     DEBUGF("Timeout: Resending request for slot=0x%p (%"PRIu64" of %"PRIu64" received)",
 	   slot, slot->write_state.file_offset,
 	   slot->write_state.file_length);
+  if (slot->manifest->has_merkle_root && !slot->write_state.merkle_leaves && !slot->merkle_failed){
+    // Older servers, and those that can't read the payload to hash it, never answer a hash tree
+    // request.  Don't wait for them, fetch the blocks unverified and check the whole file hash.
+    if (config.debug.rhizome_rx)
+      DEBUGF("No hash tree for %s after %zu leaves, fetching blocks unverified",
+	     alloca_tohex_rhizome_bid_t(slot->bid), slot->merkle_received);
+    if (slot->merkle_leaves)
+      free(slot->merkle_leaves);
+    slot->merkle_leaves=NULL;
+    slot->merkle_failed=1;
+  }
+  // every source that still owes us blocks has lost some
+  int i, lost=0;
+  for (i = 0; i < slot->source_count; i++){
+    if (slot->sources[i].outstanding > 0){
+      fetch_source_lost(slot, &slot->sources[i]);
+      slot->sources[i].stalls++;
+      lost=1;
+    }
+  }
+  if (lost){
+    fetch_drop_stalled_sources(slot);
+    slot->mdp_timeouts++;
+    slot->mdp_clean_rounds=0;
+    if (slot->mdpRXBlockLength > RHIZOME_MDP_MIN_BLOCK_LENGTH){
+      slot->mdpRXBlockLength /= 2;
+      if (config.debug.rhizome_rx)
+	DEBUGF("Reduced MDP block length of %s to %d", alloca_tohex_rhizome_bid_t(slot->bid), slot->mdpRXBlockLength);
+    }
+  }
   rhizome_fetch_mdp_requestblocks(slot);
   OUT();
 }
 
+/* Retransmission timeout, from the smoothed round trip time of block requests as in RFC 6298.  Until
+ * the first block arrives, allow a second.
+ */
+static time_ms_t rhizome_fetch_mdp_rto(const struct rhizome_fetch_slot *slot)
+{
+  if (!slot->mdp_srtt)
+    return 1000;
+  time_ms_t rto = slot->mdp_srtt + 4 * slot->mdp_rttvar;
+  if (rto < RHIZOME_MDP_MIN_RTO)
+    rto = RHIZOME_MDP_MIN_RTO;
+  if (rto > RHIZOME_MDP_MAX_RTO)
+    rto = RHIZOME_MDP_MAX_RTO;
+  return rto;
+}
+
+static void rhizome_fetch_mdp_rtt_sample(struct rhizome_fetch_slot *slot, time_ms_t rtt)
+{
+  if (!slot->mdp_srtt){
+    slot->mdp_srtt = rtt ? rtt : 1;
+    slot->mdp_rttvar = rtt / 2;
+  }else{
+    time_ms_t err = rtt > slot->mdp_srtt ? rtt - slot->mdp_srtt : slot->mdp_srtt - rtt;
+    slot->mdp_rttvar = (3 * slot->mdp_rttvar + err) / 4;
+    slot->mdp_srtt = (7 * slot->mdp_srtt + rtt) / 8;
+    if (!slot->mdp_srtt)
+      slot->mdp_srtt = 1;
+  }
+}
+
+/* A source answered its whole request, so open its window and perhaps use bigger blocks. */
+static void fetch_source_answered(struct rhizome_fetch_slot *slot, struct rhizome_fetch_source *source)
+{
+  source->stalls = 0;
+  if (source->window < source->ssthresh)
+    source->window *= 2;
+  else
+    source->window += RHIZOME_MDP_WINDOW_STEP;
+  int max = source->multiword ? RHIZOME_MDP_MAX_WINDOW : RHIZOME_MDP_SINGLE_WORD_WINDOW;
+  if (source->window > max)
+    source->window = max;
+  if (++slot->mdp_clean_rounds >= RHIZOME_MDP_CLEAN_ROUNDS && slot->mdpRXBlockLength < RHIZOME_MDP_MAX_BLOCK_LENGTH){
+    slot->mdpRXBlockLength *= 2;
+    if (slot->mdpRXBlockLength > RHIZOME_MDP_MAX_BLOCK_LENGTH)
+      slot->mdpRXBlockLength = RHIZOME_MDP_MAX_BLOCK_LENGTH;
+    slot->mdp_clean_rounds = 0;
+  }
+}
+
+/* Some of the blocks requested from a source did not arrive in time. */
+static void fetch_source_lost(struct rhizome_fetch_slot *slot, struct rhizome_fetch_source *source)
+{
+  source->ssthresh = source->window / 2;
+  if (source->ssthresh < RHIZOME_MDP_MIN_WINDOW)
+    source->ssthresh = RHIZOME_MDP_MIN_WINDOW;
+  source->window = source->ssthresh;
+  if (config.debug.rhizome_rx)
+    DEBUGF("Fetch source %s lost blocks of %s, window now %d",
+	   alloca_tohex_sid_t(source->sid), alloca_tohex_rhizome_bid_t(slot->bid), source->window);
+}
+
+/* Stop asking sources that keep stalling, as long as another source is still answering. */
+static void fetch_drop_stalled_sources(struct rhizome_fetch_slot *slot)
+{
+  int i, answering = 0;
+  for (i = 0; i < slot->source_count; i++)
+    if (slot->sources[i].stalls == 0)
+      answering = 1;
+  if (!answering)
+    return;
+  for (i = 0; i < slot->source_count; ){
+    if (slot->sources[i].stalls < RHIZOME_FETCH_MAX_STALLS){
+      i++;
+      continue;
+    }
+    if (config.debug.rhizome_rx)
+      DEBUGF("Dropped fetch source %s of %s after %d stalls",
+	     alloca_tohex_sid_t(slot->sources[i].sid), alloca_tohex_rhizome_bid_t(slot->bid), slot->sources[i].stalls);
+    slot->source_count--;
+    memmove(&slot->sources[i], &slot->sources[i + 1], (slot->source_count - i) * sizeof slot->sources[i]);
+  }
+}
+
 static int rhizome_fetch_mdp_touch_timeout(struct rhizome_fetch_slot *slot)
 {
-  // 266ms @ 1mbit (WiFi broadcast speed) = 32x1024 byte packets.
-  // But on a packet radio interface at perhaps 50kbit, this is clearly
-  // a bad policy.  Ideally we should know about the interface speed
-  // and adjust behaviour accordingly. Also the packet size should be smaller
-  // on lossy links.  1K packets seem to get through only very rarely.
-  // For now, we will just make the timeout 1 second from the time of the last
-  // received block.
+  // Re-request anything missing if nothing has arrived for a retransmission timeout.
   unschedule(&slot->alarm);
-  slot->alarm.alarm=gettime_ms()+1000; 
+  slot->alarm.alarm=gettime_ms()+rhizome_fetch_mdp_rto(slot);
   slot->alarm.deadline=slot->alarm.alarm+500;
   schedule(&slot->alarm);
   return 0;
 }
 
-static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
+// start a request to dest, followed by the offset, the first bitmap word and the block length
+static struct overlay_buffer *rhizome_fetch_mdp_request_init(struct rhizome_fetch_slot *slot, const sid_t *dest,
+							     struct internal_mdp_header *header,
+							     uint64_t offset, uint32_t bitmap, uint16_t block_length)
 {
-  IN();
-  // only issue new requests every 133ms.  
-  // we automatically re-issue once we have received all packets in this
-  // request also, so if there is no packet loss, we can go substantially
-  // faster.  Optimising behaviour when there is no packet loss is an
-  // outstanding task.
-  
-  overlay_mdp_frame mdp;
-
-  bzero(&mdp,sizeof(mdp));
-  mdp.out.src.sid = my_subscriber->sid;
-  mdp.out.src.port=MDP_PORT_RHIZOME_RESPONSE;
-  mdp.out.dst.sid = slot->peer_sid;
-  mdp.out.dst.port=MDP_PORT_RHIZOME_REQUEST;
-  mdp.out.ttl=1;
-  mdp.packetTypeAndFlags=MDP_TX;
-
-  mdp.out.queue=OQ_ORDINARY;
-  mdp.out.payload_length= sizeof slot->bid.binary + 8 + 8 + 4 + 2;
-  bcopy(slot->bid.binary, &mdp.out.payload[0], sizeof slot->bid.binary);
-
-  uint32_t bitmap=0;
-  int requests=32;
+  bzero(header, sizeof *header);
+  header->source = my_subscriber;
+  header->source_port = MDP_PORT_RHIZOME_RESPONSE;
+  header->destination = find_subscriber(dest->binary, SID_SIZE, 1);
+  header->destination_port = MDP_PORT_RHIZOME_REQUEST;
+  header->ttl = 1;
+  header->queue = OQ_ORDINARY;
+  if (!header->destination)
+    return NULL;
+
+  struct overlay_buffer *payload = overlay_mdp_payload(header);
+  if (!payload)
+    return NULL;
+  unsigned char *p = ob_append_space(payload, sizeof slot->bid.binary + 8 + 8 + 4 + 2);
+  if (!p){
+    ob_free(payload);
+    return NULL;
+  }
+  bcopy(slot->bid.binary, p, sizeof slot->bid.binary);
+  p += sizeof slot->bid.binary;
+  write_uint64(p, slot->bidVersion);
+  write_uint64(p + 8, offset);
+  write_uint32(p + 8 + 8, bitmap);
+  write_uint16(p + 8 + 8 + 4, block_length);
+  return payload;
+}
+
+/* Ask one source for the next range of the payload that no other source is fetching.  The range is
+ * as long as the source's window for the fastest source, and proportionally shorter for slower ones.
+ * A source that is answering may take over ranges from sources that have stalled, so the head of the
+ * payload isn't left waiting on a peer that has gone quiet.
+ */
+static int rhizome_fetch_mdp_request_range(struct rhizome_fetch_slot *slot, struct rhizome_fetch_source *source)
+{
+  time_ms_t now = gettime_ms();
+  uint64_t block_length = slot->mdpRXBlockLength;
+
+  // measure how fast this source answered its last request
+  if (source->request_time && now > source->request_time && source->received){
+    uint32_t rate = source->received * 1000 / (now - source->request_time);
+    source->rate = source->rate ? (source->rate + rate) / 2 : rate;
+  }
+  uint32_t fastest = 0;
   int i;
+  for (i = 0; i < slot->source_count; i++)
+    if (slot->sources[i].rate > fastest)
+      fastest = slot->sources[i].rate;
+  int want = source->window;
+  if (source->rate && fastest){
+    want = (int)((uint64_t)source->window * source->rate / fastest);
+    if (want < 1)
+      want = 1;
+  }
+
+  // skip over the ranges that other sources are still working on
+  uint64_t start = slot->write_state.file_offset;
+  int blocks = want;
+  for (i = 0; i < slot->source_count; ){
+    struct rhizome_fetch_source *other = &slot->sources[i];
+    if (other == source || other->outstanding <= 0 || (other->stalls && !source->stalls)
+	|| start >= other->range_end || start + blocks * block_length <= other->range_start){
+      i++;
+      continue;
+    }
+    if (other->range_start > start && other->range_start - start >= block_length){
+      blocks = (other->range_start - start) / block_length;
+      i++;
+      continue;
+    }
+    start = other->range_end;
+    blocks = want;
+    i = 0;
+  }
+
+  if (source->multiword || !source->probe_end || source->probe_start != source->range_end)
+    source->probe_start = source->probe_end = 0;
+  else if (start >= source->probe_start && start < source->probe_end
+	   && source->probe_end < slot->write_state.file_length)
+    // the last request was a probe, so step past it and any answer to it will stand out
+    start = source->probe_end;
+
+  source->range_start = source->range_end = start;
+  source->outstanding = 0;
+  source->received = 0;
+  source->request_time = now;
+  source->rtt_sampled = 0;
+  if (start >= slot->write_state.file_length)
+    return 0;
+
+  // Until this source is known to read more than one bitmap word, only the first word is waited for.
+  // Now and then a full first word is followed by a second, that a newer server will answer and an
+  // older one ignore.
+  int counted = blocks;
+  if (!source->multiword){
+    if (counted > RHIZOME_MDP_SINGLE_WORD_WINDOW)
+      counted = RHIZOME_MDP_SINGLE_WORD_WINDOW;
+    blocks = counted;
+    if (counted == RHIZOME_MDP_SINGLE_WORD_WINDOW && !source->probe_end && source->probes < RHIZOME_MDP_MAX_PROBES)
+      blocks = 2 * RHIZOME_MDP_SINGLE_WORD_WINDOW;
+  }
+
+  uint32_t bitmap[RHIZOME_MDP_MAX_BITMAP_WORDS];
+  bzero(bitmap, sizeof bitmap);
+  int words = (blocks + 31) / 32;
+  int requests=0;
   struct rhizome_write_buffer *p = slot->write_state.buffer_list;
-  uint64_t offset = slot->write_state.file_offset;
-  for (i=0;i<32;i++){
+  uint64_t offset = start;
+  uint64_t counted_end = 0;
+  for (i=0;i<words*32;i++){
+    if (i == counted)
+      counted_end = offset;
+    if (i >= blocks || offset >= slot->write_state.file_length){
+      bitmap[i/32] |= 1u<<(31-i%32);
+      continue;
+    }
     while(p && p->offset + p->data_size < offset)
       p=p->_next;
-    if (!p)
-      break;
-    if (p->offset <= offset && p->offset+p->data_size >= offset+slot->mdpRXBlockLength){
-      bitmap |= 1<<(31-i);
-      requests --;
-    }
-    offset+=slot->mdpRXBlockLength;
+    if (p && p->offset <= offset && p->offset+p->data_size >= offset+block_length)
+      bitmap[i/32] |= 1u<<(31-i%32);
+    else if (i < counted)
+      requests++;
+    offset+=block_length;
   }
+  if (counted == words*32)
+    counted_end = offset;
+  source->range_end = counted_end < slot->write_state.file_length ? counted_end : slot->write_state.file_length;
+  if (requests==0)
+    return 0;
 
-  write_uint64(&mdp.out.payload[sizeof slot->bid.binary], slot->bidVersion);
-  write_uint64(&mdp.out.payload[sizeof slot->bid.binary + 8], slot->write_state.file_offset);
-  write_uint32(&mdp.out.payload[sizeof slot->bid.binary + 8 + 8], bitmap);
-  write_uint16(&mdp.out.payload[sizeof slot->bid.binary + 8 + 8 + 4], slot->mdpRXBlockLength);
+  struct internal_mdp_header header;
+  struct overlay_buffer *payload = rhizome_fetch_mdp_request_init(slot, &source->sid, &header,
+								  start, bitmap[0], slot->mdpRXBlockLength);
+  if (!payload)
+    return -1;
+  for (i=1;i<words;i++){
+    unsigned char *p = ob_append_space(payload, 4);
+    if (!p){
+      ob_free(payload);
+      return -1;
+    }
+    write_uint32(p, bitmap[i]);
+  }
 
   if (config.debug.rhizome_tx)
-    DEBUGF("src sid=%s, dst sid=%s, mdpRXWindowStart=0x%"PRIx64", slot->bidVersion=0x%"PRIx64,
-	   alloca_tohex_sid_t(mdp.out.src.sid),
-	   alloca_tohex_sid_t(mdp.out.dst.sid),
-	   slot->write_state.file_offset,
+    DEBUGF("src sid=%s, dst sid=%s, mdpRXWindowStart=0x%"PRIx64", blocks=%d, block_length=%d, slot->bidVersion=0x%"PRIx64,
+	   alloca_tohex_sid_t(my_subscriber->sid),
+	   alloca_tohex_sid_t(source->sid),
+	   start, blocks, slot->mdpRXBlockLength,
 	   slot->bidVersion);
 
-  overlay_mdp_dispatch(&mdp,0 /* system generated */,NULL,0);
+  overlay_mdp_send_payload(&header, payload);
+  source->outstanding = requests;
+  if (offset > counted_end){
+    source->probe_start = source->range_end;
+    source->probe_end = offset < slot->write_state.file_length ? offset : slot->write_state.file_length;
+    source->probes++;
+  }
+  return 0;
+}
+
+/* Ask every source that has answered its previous request for more, those that are answering first
+ * so that they get the earliest ranges.
+ */
+static void rhizome_fetch_mdp_request_ranges(struct rhizome_fetch_slot *slot)
+{
+  int i, stalled;
+  for (stalled = 0; stalled <= 1; stalled++)
+    for (i = 0; i < slot->source_count; i++)
+      if (slot->sources[i].outstanding <= 0 && (slot->sources[i].stalls > 0) == stalled)
+	rhizome_fetch_mdp_request_range(slot, &slot->sources[i]);
+}
+
+static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
+{
+  IN();
+  // Called when the fetch starts and whenever the retransmission timeout expires.  Each source is
+  // asked for more as soon as it has answered its previous request in full, so this only matters
+  // when blocks have been lost.
   
-  // remember when we sent the request so that we can adjust the inter-request
-  // interval based on how fast the packets arrive.
-  slot->mdpResponsesOutstanding=requests;
-  slot->mdp_last_request_offset = slot->write_state.file_offset;
-  slot->mdp_last_request_time = gettime_ms();
+  if (slot->manifest->has_merkle_root && !slot->write_state.merkle_leaves && !slot->merkle_failed
+      && slot->write_state.file_length > 0){
+    // fetch the leaf hashes first, so that every block can be checked as it arrives.
+    // A zero block length asks for hashes, starting from the leaf index in place of the offset.
+    struct internal_mdp_header header;
+    struct overlay_buffer *payload = rhizome_fetch_mdp_request_init(slot, &slot->peer_sid, &header,
+								    slot->merkle_received, 0, 0);
+    if (config.debug.rhizome_tx)
+      DEBUGF("Requesting hash tree leaves of %s from %zu", alloca_tohex_rhizome_bid_t(slot->bid), slot->merkle_received);
+    if (payload)
+      overlay_mdp_send_payload(&header, payload);
+    rhizome_fetch_mdp_touch_timeout(slot);
+    RETURN(0);
+  }
+
+  // start again with every source, forgetting any ranges that were not answered
+  int i;
+  for (i = 0; i < slot->source_count; i++)
+    slot->sources[i].outstanding = 0;
+  rhizome_fetch_mdp_request_ranges(slot);
   
   rhizome_fetch_mdp_touch_timeout(slot);
   
@@ -1136,6 +1725,30 @@ static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
   OUT();
 }
 
+/* Another peer has advertised the same version of a bundle that we are fetching, so it can serve
+ * part of the payload.  Returns 1 if the peer was added as a new source.
+ */
+int rhizome_fetch_add_source(const unsigned char *prefix, size_t prefix_length, uint64_t version, const sid_t *peersidp)
+{
+  struct rhizome_fetch_slot *slot = fetch_search_slot(prefix, prefix_length);
+  if (!slot || !slot->manifest || slot->manifest->version != version)
+    return 0;
+  int i;
+  for (i = 0; i < slot->source_count; i++)
+    if (cmp_sid_t(&slot->sources[i].sid, peersidp) == 0)
+      return 0;
+  if (slot->source_count >= RHIZOME_FETCH_MAX_SOURCES)
+    return 0;
+  struct rhizome_fetch_source *source = &slot->sources[slot->source_count++];
+  fetch_source_init(source, peersidp);
+  if (config.debug.rhizome_rx)
+    DEBUGF("Fetching %s from %d sources, added %s",
+	   alloca_tohex_rhizome_bid_t(slot->bid), slot->source_count, alloca_tohex_sid_t(*peersidp));
+  if (slot->state == RHIZOME_FETCH_RXFILEMDP && (!slot->manifest->has_merkle_root || slot->write_state.merkle_leaves || slot->merkle_failed))
+    rhizome_fetch_mdp_request_range(slot, source);
+  return 1;
+}
+
 static int pipe_journal(struct rhizome_fetch_slot *slot){
   if (!slot->previous)
     return 0;
@@ -1151,10 +1764,11 @@ static int pipe_journal(struct rhizome_fetch_slot *slot){
   assert(slot->previous->tail != RHIZOME_SIZE_UNSET);
   assert(slot->previous->filesize != RHIZOME_SIZE_UNSET);
   uint64_t start = slot->manifest->tail - slot->previous->tail + slot->write_state.file_offset;
-  uint64_t length = slot->previous->filesize - slot->manifest->tail - slot->write_state.file_offset;
+  uint64_t overlap = slot->previous->filesize - slot->manifest->tail;
   
-  // of course there might not be any overlap
-  if (start>=0 && start < slot->previous->filesize && length>0){
+  // of course there might not be any overlap, or a resumed fetch might already have it
+  if (overlap > slot->write_state.file_offset && start < slot->previous->filesize){
+    uint64_t length = overlap - slot->write_state.file_offset;
     if (config.debug.rhizome)
       DEBUGF("Copying %"PRId64" bytes from previous journal", length);
     rhizome_journal_pipe(&slot->write_state, &slot->previous->filehash, start, length);
@@ -1224,6 +1838,10 @@ static int rhizome_fetch_switch_to_mdp(struct rhizome_fetch_slot *slot)
     */
   slot->mdpIdleTimeout=config.rhizome.idle_timeout; // give up if nothing received for 5 seconds
   slot->mdpRXBlockLength=config.rhizome.rhizome_mdp_block_size; // Rhizome over MDP block size
+  if (slot->mdpRXBlockLength > RHIZOME_MDP_MAX_BLOCK_LENGTH)
+    slot->mdpRXBlockLength = RHIZOME_MDP_MAX_BLOCK_LENGTH;
+  slot->mdp_start_time=slot->last_write_time;
+  slot->mdp_start_offset=slot->write_state.file_offset;
   rhizome_fetch_mdp_requestblocks(slot);
 
   RETURN(0);
@@ -1294,9 +1912,14 @@ int rhizome_write_complete(struct rhizome_fetch_slot *slot)
 	      buf, ntohs(slot->peer_ipandport.sin_port), 
 	      alloca_tohex_rhizome_filehash_t(slot->manifest->filehash));
     } else {
-      INFOF("Completed MDP request from %s  for file %s",
+      time_ms_t elapsed = gettime_ms() - slot->mdp_start_time;
+      if (elapsed <= 0)
+	elapsed = 1;
+      INFOF("Completed MDP request from %s  for file %s, goodput %"PRIu64" bytes/s over %"PRId64"ms, %d sources, %u timeouts, rtt %"PRId64"ms",
 	    alloca_tohex_sid_t(slot->peer_sid),
-	    alloca_tohex_rhizome_filehash_t(slot->manifest->filehash));
+	    alloca_tohex_rhizome_filehash_t(slot->manifest->filehash),
+	    (slot->write_state.file_offset - slot->mdp_start_offset) * 1000 / (uint64_t)elapsed,
+	    elapsed, slot->source_count, slot->mdp_timeouts, slot->mdp_srtt);
     }
   } else {
     /* This was to fetch the manifest, so now fetch the file if needed */
@@ -1375,9 +1998,63 @@ int rhizome_write_content(struct rhizome_fetch_slot *slot, unsigned char *buffer
   OUT();
 }
 
+/* Collect the leaf hashes of a payload that we are fetching over MDP.  Once all of them have
+ * arrived and their root matches the manifest, every block that arrives is checked against them.
+ */
+int rhizome_received_merkle(const unsigned char *bidprefix, uint64_t version,
+			    size_t first, size_t leaf_count, const unsigned char *hashes, size_t count)
+{
+  IN();
+  if (!is_rhizome_mdp_enabled())
+    RETURN(-1);
+  struct rhizome_fetch_slot *slot=fetch_search_slot(bidprefix, 16);
+  if (!slot || slot->bidVersion != version || slot->state != RHIZOME_FETCH_RXFILEMDP
+      || !slot->manifest->has_merkle_root || slot->write_state.merkle_leaves || slot->merkle_failed)
+    RETURN(0);
+  
+  size_t expected = rhizome_merkle_leaf_count(slot->write_state.file_length);
+  if (leaf_count != expected){
+    WARNF("Expected %zu leaf hashes for %s, peer has %zu", expected, alloca_tohex_rhizome_bid_t(slot->bid), leaf_count);
+    slot->merkle_failed=1;
+    rhizome_fetch_mdp_requestblocks(slot);
+    RETURN(-1);
+  }
+  // ignore duplicate or out of order replies, the next request will ask again
+  if (first != slot->merkle_received || count > expected - first)
+    RETURN(0);
+  if (!slot->merkle_leaves && (slot->merkle_leaves = emalloc(expected * RHIZOME_MERKLE_HASH_BYTES)) == NULL)
+    RETURN(-1);
+  bcopy(hashes, &slot->merkle_leaves[first * RHIZOME_MERKLE_HASH_BYTES], count * RHIZOME_MERKLE_HASH_BYTES);
+  slot->merkle_received += count;
+  slot->last_write_time = gettime_ms();
+  
+  if (slot->merkle_received == expected){
+    unsigned char root[RHIZOME_MERKLE_HASH_BYTES];
+    if (rhizome_merkle_root(slot->merkle_leaves, expected, root) == 0
+	&& memcmp(root, slot->manifest->merkle_root, sizeof root) == 0){
+      // the write state takes ownership of the leaves
+      if (rhizome_write_merkle_verify(&slot->write_state, slot->merkle_leaves, expected) == 0){
+	if (config.debug.rhizome_rx)
+	  DEBUGF("Verified hash tree of %zu leaves for %s", expected, alloca_tohex_rhizome_bid_t(slot->bid));
+      }else
+	slot->merkle_failed=1;
+    }else{
+      // the payload will still be checked against the manifest's file hash
+      WARNF("Hash tree for %s does not match its manifest", alloca_tohex_rhizome_bid_t(slot->bid));
+      free(slot->merkle_leaves);
+      slot->merkle_failed=1;
+    }
+    slot->merkle_leaves=NULL;
+  }
+  rhizome_fetch_mdp_requestblocks(slot);
+  RETURN(0);
+  OUT();
+}
+
 int rhizome_received_content(const unsigned char *bidprefix,
 			     uint64_t version, uint64_t offset,
-			     size_t count, unsigned char *bytes, int type)
+			     size_t count, unsigned char *bytes, int type,
+			     const sid_t *senderp)
 {
   IN();
   if (!is_rhizome_mdp_enabled()) {
@@ -1388,26 +2065,65 @@ int rhizome_received_content(const unsigned char *bidprefix,
   if (slot && slot->bidVersion == version && slot->state == RHIZOME_FETCH_RXFILEMDP){
     if (config.debug.rhizome)
       DEBUGF("Rhizome over MDP receiving %zu bytes.", count);
-    if (rhizome_random_write(&slot->write_state, offset, bytes, count)){
+    int r = rhizome_random_write(&slot->write_state, offset, bytes, count);
+    if (r==-1){
       if (config.debug.rhizome)
 	DEBUGF("Write failed!");
       RETURN (-1);
     }
+    if (r==1 && config.debug.rhizome_rx)
+      DEBUGF("Discarded a block that failed verification, will fetch it again");
     
     if (rhizome_write_complete(slot)){
       if (config.debug.rhizome)
 	DEBUGF("Complete failed!");
       RETURN(-1);
     }
+    // the fetch may have completed and released the slot
+    if (slot->state != RHIZOME_FETCH_RXFILEMDP)
+      RETURN(0);
     
-    slot->last_write_time=gettime_ms();
-    rhizome_fetch_mdp_touch_timeout(slot);
-
-    slot->mdpResponsesOutstanding--;
-    if (slot->mdpResponsesOutstanding==0) {
-      // We have received all responses, so immediately ask for more
-      rhizome_fetch_mdp_requestblocks(slot);
+    time_ms_t now = gettime_ms();
+    slot->last_write_time=now;
+    time_ms_t rto = rhizome_fetch_mdp_rto(slot);
+
+    int i;
+    for (i = 0; i < slot->source_count; i++){
+      struct rhizome_fetch_source *source = &slot->sources[i];
+      if (senderp && cmp_sid_t(&source->sid, senderp) == 0){
+	if (!source->rtt_sampled && source->outstanding > 0){
+	  rhizome_fetch_mdp_rtt_sample(slot, now - source->request_time);
+	  source->rtt_sampled = 1;
+	}
+	source->last_rx_time = now;
+	source->received += count;
+	if (offset >= source->probe_start && offset < source->probe_end
+	    && (offset < source->range_start || offset >= source->range_end)){
+	  // the probe was answered, so this source can be given larger windows
+	  if (!source->multiword && config.debug.rhizome_rx)
+	    DEBUGF("Fetch source %s answers more than one bitmap word", alloca_tohex_sid_t(source->sid));
+	  source->multiword = 1;
+	}else if (source->outstanding > 0 && --source->outstanding == 0)
+	  fetch_source_answered(slot, source);
+	// a source that sent a bad block gets less to do
+	if (r==1)
+	  source->rate /= 2;
+      }else if (source->outstanding > 0
+	  && now - (source->last_rx_time > source->request_time ? source->last_rx_time : source->request_time) > rto){
+	// this source has stalled, so give its range to someone else
+	if (config.debug.rhizome_rx)
+	  DEBUGF("Fetch source %s stalled", alloca_tohex_sid_t(source->sid));
+	fetch_source_lost(slot, source);
+	source->rate = source->rate > 1 ? source->rate / 2 : 1;
+	source->outstanding = 0;
+	source->range_start = source->range_end = 0;
+	source->stalls++;
+      }
     }
+    fetch_drop_stalled_sources(slot);
+    rhizome_fetch_mdp_touch_timeout(slot);
+    // We have received all responses from a source, so immediately ask it for more
+    rhizome_fetch_mdp_request_ranges(slot);
     RETURN(0);
   }
   
@@ -1537,12 +2253,19 @@ void rhizome_fetch_poll(struct sched_ent *alarm)
 	  /* We have all we need.  The file is already open, so just write out any initial bytes of
 	     the body we read.
 	  */
-	  slot->state = RHIZOME_FETCH_RXFILE;
 	  if (slot->previous && parts.range_start){
-	    if (parts.range_start != slot->previous->filesize - slot->manifest->tail)
-	      WARNF("Expected Content-Range header to start @%"PRIu64, slot->previous->filesize - slot->manifest->tail);
+	    if (parts.range_start != rhizome_fetch_range_start(slot))
+	      WARNF("Expected Content-Range header to start @%"PRIu64, rhizome_fetch_range_start(slot));
 	    pipe_journal(slot);
 	  }
+	  if (parts.range_start != slot->write_state.file_offset){
+	    // the content doesn't carry on from what we already have
+	    if (config.debug.rhizome_rx)
+	      DEBUGF("Content starts @%"PRIu64", expected @%"PRIu64, parts.range_start, slot->write_state.file_offset);
+	    rhizome_fetch_switch_to_mdp(slot);
+	    return;
+	  }
+	  slot->state = RHIZOME_FETCH_RXFILE;
 	  
 	  int content_bytes = slot->request + slot->request_len - parts.content_start;
 	  if (content_bytes > 0){
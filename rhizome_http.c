@@ -42,6 +42,7 @@ struct http_handler{
 };
 
 static HTTP_HANDLER restful_rhizome_bundlelist_json;
+static HTTP_HANDLER restful_stats_json;
 
 static HTTP_HANDLER rhizome_status_page;
 static HTTP_HANDLER rhizome_file_page;
@@ -57,6 +58,7 @@ extern HTTP_HANDLER rhizome_direct_dispatch;
 
 struct http_handler paths[]={
   {"/restful/rhizome/bundlelist.json", restful_rhizome_bundlelist_json},
+  {"/restful/stats.json", restful_stats_json},
   {"/rhizome/status", rhizome_status_page},
   {"/rhizome/file/", rhizome_file_page},
   {"/rhizome/import", rhizome_direct_import},
@@ -273,6 +275,7 @@ void rhizome_server_poll(struct sched_ent *alarm)
 	request->uuid = rhizome_http_request_uuid_counter++;
 	request->data_file_name[0] = '\0';
 	request->read_state.blob_fd = -1;
+	request->read_state.blob_map = NULL;
 	request->read_state.blob_rowid = -1;
 	if (peerip)
 	  request->http.client_sockaddr_in = *peerip;
@@ -354,6 +357,31 @@ static int restful_rhizome_bundlelist_json(rhizome_http_request *r, const char *
   return 0;
 }
 
+static int restful_stats_json(rhizome_http_request *r, const char *remainder)
+{
+  if (*remainder)
+    return 1;
+  if (r->http.verb != HTTP_VERB_GET) {
+    http_request_simple_response(&r->http, 405, NULL);
+    return 0;
+  }
+  if (!is_authorized(&r->http.request_header.authorization)) {
+    r->http.response.header.www_authenticate.scheme = BASIC;
+    r->http.response.header.www_authenticate.realm = "Serval Rhizome";
+    http_request_simple_response(&r->http, 401, NULL);
+    return 0;
+  }
+  char *buf = emalloc(FD_STATS_JSON_MAX);
+  if (!buf)
+    return -1;
+  strbuf b = strbuf_local(buf, FD_STATS_JSON_MAX);
+  int ret = fd_stats_json(b);
+  if (ret == 0)
+    http_request_response_static(&r->http, 200, "application/json", buf, strbuf_len(b));
+  free(buf);
+  return ret;
+}
+
 static int neighbour_page(rhizome_http_request *r, const char *remainder)
 {
   if (r->http.verb != HTTP_VERB_GET) {
@@ -412,6 +440,9 @@ static int rhizome_status_page(rhizome_http_request *r, const char *remainder)
   strbuf_puts(b, "<html><head><meta http-equiv=\"refresh\" content=\"5\" ></head><body>");
   strbuf_sprintf(b, "%d HTTP requests<br>", request_count);
   strbuf_sprintf(b, "%d Bundles transferring via MDP<br>", rhizome_cache_count());
+  unsigned blocks, hits, misses;
+  rhizome_cache_stats(&blocks, &hits, &misses);
+  strbuf_sprintf(b, "%u Payload pages cached, %u hits, %u misses<br>", blocks, hits, misses);
   rhizome_fetch_status_html(b);
   strbuf_puts(b, "</body></html>");
   if (strbuf_overrun(b))
@@ -494,6 +525,14 @@ static int rhizome_file_page(rhizome_http_request *r, const char *remainder)
     r->http.response.header.content_length = r->http.response.header.resource_length;
     r->read_state.offset = 0;
   }
+#ifdef HAVE_SYS_SENDFILE_H
+  // Payloads stored in external blob files can be sent by the kernel straight from the page cache;
+  // SQLite blobs and encrypted payloads have to be copied through rhizome_read().
+  if (r->read_state.blob_fd != -1 && !r->read_state.crypt) {
+    http_request_response_sendfile(&r->http, 200, "application/binary", r->read_state.blob_fd, r->read_state.offset);
+    return 0;
+  }
+#endif
   http_request_response_generated(&r->http, 200, "application/binary", rhizome_file_content);
   return 0;
 }
@@ -0,0 +1,108 @@
+/*
+Serval DNA Rhizome payload hash trees
+Copyright (C) 2013 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* A payload is cut into RHIZOME_MERKLE_BLOCK_SIZE leaves (the last may be short), and each leaf
+ * is hashed.  Pairs of hashes are then hashed together, level by level, until one root hash
+ * remains; an odd hash at the end of a level is carried up unchanged.  Leaf and interior hashes
+ * are prefixed with different bytes, so that an interior node can never be passed off as a leaf.
+ * All hashes are SHA-512 truncated to RHIZOME_MERKLE_HASH_BYTES.
+ *
+ * The root goes in the manifest's "merkle" field, so it is covered by the manifest signature.  A
+ * receiver that has fetched the list of leaf hashes and checked it against the root can verify
+ * every leaf of the payload as it arrives, instead of only after receiving the whole payload.
+ */
+
+#include "serval.h"
+#include "rhizome.h"
+
+#define MERKLE_LEAF_PREFIX 0x00
+#define MERKLE_NODE_PREFIX 0x01
+
+size_t rhizome_merkle_leaf_count(uint64_t length)
+{
+  return (size_t)((length + RHIZOME_MERKLE_BLOCK_SIZE - 1) / RHIZOME_MERKLE_BLOCK_SIZE);
+}
+
+void rhizome_merkle_leaf_init(SHA512_CTX *context)
+{
+  unsigned char prefix = MERKLE_LEAF_PREFIX;
+  SHA512_Init(context);
+  SHA512_Update(context, &prefix, 1);
+}
+
+void rhizome_merkle_leaf_final(SHA512_CTX *context, unsigned char *hash)
+{
+  unsigned char digest[SHA512_DIGEST_LENGTH];
+  SHA512_Final(digest, context);
+  SHA512_End(context, NULL);
+  bcopy(digest, hash, RHIZOME_MERKLE_HASH_BYTES);
+}
+
+void rhizome_merkle_leaf(const unsigned char *data, size_t len, unsigned char *hash)
+{
+  SHA512_CTX context;
+  rhizome_merkle_leaf_init(&context);
+  SHA512_Update(&context, data, len);
+  rhizome_merkle_leaf_final(&context, hash);
+}
+
+static void merkle_node(const unsigned char *left, const unsigned char *right, unsigned char *hash)
+{
+  unsigned char prefix = MERKLE_NODE_PREFIX;
+  unsigned char digest[SHA512_DIGEST_LENGTH];
+  SHA512_CTX context;
+  SHA512_Init(&context);
+  SHA512_Update(&context, &prefix, 1);
+  SHA512_Update(&context, left, RHIZOME_MERKLE_HASH_BYTES);
+  SHA512_Update(&context, right, RHIZOME_MERKLE_HASH_BYTES);
+  SHA512_Final(digest, &context);
+  SHA512_End(&context, NULL);
+  bcopy(digest, hash, RHIZOME_MERKLE_HASH_BYTES);
+}
+
+/* Compute the root hash of a tree from its leaf hashes.
+ * Returns 0 on success, -1 on error.
+ */
+int rhizome_merkle_root(const unsigned char *leaves, size_t leaf_count, unsigned char *root)
+{
+  if (leaf_count == 0)
+    return WHY("Cannot compute the hash tree of an empty payload");
+  if (leaf_count == 1){
+    bcopy(leaves, root, RHIZOME_MERKLE_HASH_BYTES);
+    return 0;
+  }
+  unsigned char *level = emalloc(((leaf_count + 1) / 2) * RHIZOME_MERKLE_HASH_BYTES);
+  if (!level)
+    return -1;
+  const unsigned char *src = leaves;
+  size_t count = leaf_count;
+  while (count > 1){
+    size_t i;
+    for (i = 0; i + 1 < count; i += 2)
+      merkle_node(&src[i * RHIZOME_MERKLE_HASH_BYTES], &src[(i + 1) * RHIZOME_MERKLE_HASH_BYTES],
+		  &level[(i / 2) * RHIZOME_MERKLE_HASH_BYTES]);
+    if (i < count)
+      bcopy(&src[i * RHIZOME_MERKLE_HASH_BYTES], &level[(i / 2) * RHIZOME_MERKLE_HASH_BYTES], RHIZOME_MERKLE_HASH_BYTES);
+    count = (count + 1) / 2;
+    src = level;
+  }
+  bcopy(level, root, RHIZOME_MERKLE_HASH_BYTES);
+  free(level);
+  return 0;
+}
@@ -177,7 +177,7 @@ static int append_bars(struct overlay_buffer *e, sqlite_retry_state *retry, cons
     *last_rowid=rowid;
   }
   if (statement)
-    sqlite3_finalize(statement);
+    sqlite_finalize(statement);
   return count;
 }
 
@@ -211,8 +211,7 @@ void overlay_rhizome_advertise(struct sched_ent *alarm){
   if (bundles_available<1)
     goto end;
   
-  struct overlay_frame *frame = malloc(sizeof(struct overlay_frame));
-  bzero(frame,sizeof(struct overlay_frame));
+  struct overlay_frame *frame = op_new();
   frame->type = OF_TYPE_RHIZOME_ADVERT;
   frame->source = my_subscriber;
   frame->ttl = 1;
@@ -254,8 +253,7 @@ end:
 
 /* Queue an advertisment for a single manifest */
 int rhizome_advertise_manifest(struct subscriber *dest, rhizome_manifest *m){
-  struct overlay_frame *frame = malloc(sizeof(struct overlay_frame));
-  bzero(frame,sizeof(struct overlay_frame));
+  struct overlay_frame *frame = op_new();
   frame->type = OF_TYPE_RHIZOME_ADVERT;
   frame->source = my_subscriber;
   if (dest && dest->reachable&REACHABLE)
@@ -377,8 +375,11 @@ int overlay_rhizome_saw_advertisements(int i, struct decode_context *context, st
 
       // are we already fetching this bundle [or later]?
       rhizome_manifest *mf=rhizome_fetch_search(m->cryptoSignPublic.binary, sizeof m->cryptoSignPublic.binary);
-      if (mf && mf->version >= m->version)
+      if (mf && mf->version >= m->version){
+	if (mf->version == m->version)
+	  rhizome_fetch_add_source(m->cryptoSignPublic.binary, sizeof m->cryptoSignPublic.binary, m->version, &f->source->sid);
 	goto next;
+      }
 	
       if (!rhizome_is_manifest_interesting(m)) {
 	/* We already have this version or newer */
@@ -435,8 +436,11 @@ next:
     int64_t version = rhizome_bar_version(bar);
     // are we already fetching this bundle [or later]?
     rhizome_manifest *m=rhizome_fetch_search(&bar[RHIZOME_BAR_PREFIX_OFFSET], RHIZOME_BAR_PREFIX_BYTES);
-    if (m && m->version >= version)
+    if (m && m->version >= version){
+      if (m->version == version)
+	rhizome_fetch_add_source(&bar[RHIZOME_BAR_PREFIX_OFFSET], RHIZOME_BAR_PREFIX_BYTES, version, &f->source->sid);
       continue;
+    }
 
     bar_count++;
   }
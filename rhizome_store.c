@@ -14,9 +14,22 @@ int rhizome_exists(const rhizome_filehash_t *hashp)
   return gotfile;
 }
 
-int rhizome_open_write(struct rhizome_write *write, const rhizome_filehash_t *expectedHashp, uint64_t file_length, int priority)
+static void write_init(struct rhizome_write *write)
 {
   write->blob_fd=-1;
+  write->merkle_leaves = NULL;
+  write->merkle_leaf_count = 0;
+  write->merkle_verify = 0;
+  write->merkle_active = 0;
+  write->merkle_rejected = 0;
+  write->has_merkle_root = 0;
+  write->partial = 0;
+  write->partial_offset = 0;
+}
+
+int rhizome_open_write(struct rhizome_write *write, const rhizome_filehash_t *expectedHashp, uint64_t file_length, int priority)
+{
+  write_init(write);
   
   if (expectedHashp){
     if (rhizome_exists(expectedHashp))
@@ -97,11 +110,11 @@ int rhizome_open_write(struct rhizome_write *write, const rhizome_filehash_t *ex
     if (!sqlite_code_ok(stepcode)){
     insert_row_fail:
       WHYF("Failed to insert row for id='%"PRId64"'", write->temp_id);
-      if (statement) sqlite3_finalize(statement);
+      if (statement) sqlite_finalize(statement);
       sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
       return -1;
     }
-    sqlite3_finalize(statement);
+    sqlite_finalize(statement);
     statement=NULL;
     
     /* Get rowid for inserted row, so that we can modify the blob */
@@ -135,7 +148,112 @@ int rhizome_open_write(struct rhizome_write *write, const rhizome_filehash_t *ex
  * use it at the same time. However, opening a blob has about O(n^2) performance. 
  * */
 
-// encrypt and hash data, data buffers must be passed in file order.
+/* Compute the hash tree of the payload as it is written, so that rhizome_finish_write() can set
+ * merkle_root.  Must be called before any data is written.
+ */
+int rhizome_write_merkle_build(struct rhizome_write *write)
+{
+  assert(write->file_offset == 0);
+  if (write->file_length == 0 || write->file_length == RHIZOME_SIZE_UNSET)
+    return 0;
+  free(write->merkle_leaves);
+  write->merkle_leaf_count = rhizome_merkle_leaf_count(write->file_length);
+  write->merkle_leaves = emalloc(write->merkle_leaf_count * RHIZOME_MERKLE_HASH_BYTES);
+  if (!write->merkle_leaves)
+    return -1;
+  write->merkle_verify = 0;
+  write->merkle_active = 0;
+  return 0;
+}
+
+/* Verify each leaf of the payload against the given hashes, which must already have been checked
+ * against the manifest's merkle root.  Takes ownership of the leaves (malloc(3)).  If some data has
+ * already been processed, verification starts at the next leaf boundary.
+ */
+int rhizome_write_merkle_verify(struct rhizome_write *write, unsigned char *leaves, size_t leaf_count)
+{
+  if (leaf_count != rhizome_merkle_leaf_count(write->file_length)){
+    free(leaves);
+    return WHYF("Expected %zu leaf hashes, got %zu", rhizome_merkle_leaf_count(write->file_length), leaf_count);
+  }
+  free(write->merkle_leaves);
+  write->merkle_leaves = leaves;
+  write->merkle_leaf_count = leaf_count;
+  write->merkle_verify = 1;
+  write->merkle_active = 0;
+  return 0;
+}
+
+static void merkle_free(struct rhizome_write *write)
+{
+  if (write->merkle_leaves)
+    free(write->merkle_leaves);
+  write->merkle_leaves = NULL;
+  write->merkle_leaf_count = 0;
+  write->merkle_active = 0;
+}
+
+// throw away any cached data that overlaps [start, end)
+static void discard_buffered(struct rhizome_write *write_state, uint64_t start, uint64_t end)
+{
+  struct rhizome_write_buffer **ptr = &write_state->buffer_list;
+  while (*ptr){
+    struct rhizome_write_buffer *n = *ptr;
+    if (n->offset + n->data_size <= start || n->offset >= end){
+      ptr = &n->_next;
+    }else if (n->offset < start){
+      // keep the front, anything past the end will be requested again
+      write_state->buffer_size -= n->data_size - (start - n->offset);
+      n->data_size = start - n->offset;
+      ptr = &n->_next;
+    }else if (n->offset + n->data_size > end){
+      // keep the back
+      size_t cut = end - n->offset;
+      bcopy(n->data + cut, n->data, n->data_size - cut);
+      n->offset = end;
+      n->data_size -= cut;
+      write_state->buffer_size -= cut;
+      ptr = &n->_next;
+    }else{
+      write_state->buffer_size -= n->data_size;
+      *ptr = n->_next;
+      free(n);
+    }
+  }
+}
+
+/* The current leaf of the hash tree has been completely processed, so record or check its hash.
+ * Returns 1 if it failed verification, after rewinding the write to the start of the leaf.
+ */
+static int merkle_leaf_complete(struct rhizome_write *write_state)
+{
+  size_t leaf = (write_state->file_offset - 1) / RHIZOME_MERKLE_BLOCK_SIZE;
+  unsigned char *expected = &write_state->merkle_leaves[leaf * RHIZOME_MERKLE_HASH_BYTES];
+  unsigned char hash[RHIZOME_MERKLE_HASH_BYTES];
+  rhizome_merkle_leaf_final(&write_state->merkle_context, hash);
+  write_state->merkle_active = 0;
+  if (!write_state->merkle_verify){
+    bcopy(hash, expected, sizeof hash);
+    return 0;
+  }
+  if (memcmp(hash, expected, sizeof hash) == 0)
+    return 0;
+  
+  uint64_t start = (uint64_t)leaf * RHIZOME_MERKLE_BLOCK_SIZE;
+  WARNF("Payload %s block @%"PRIu64" failed hash tree verification, discarding it",
+	alloca_tohex_rhizome_filehash_t(write_state->id), start);
+  write_state->merkle_rejected++;
+  write_state->sha512_context = write_state->merkle_file_context;
+  write_state->file_offset = start;
+  if (write_state->written_offset > start)
+    write_state->written_offset = start;
+  discard_buffered(write_state, start, start + RHIZOME_MERKLE_BLOCK_SIZE);
+  return 1;
+}
+
+/* Encrypt and hash data, data buffers must be passed in file order.
+ * Returns 1 if the data completed a leaf of the payload hash tree that failed verification.
+ */
 static int prepare_data(struct rhizome_write *write_state, unsigned char *buffer, size_t data_size)
 {
   if (data_size <= 0)
@@ -154,8 +272,29 @@ static int prepare_data(struct rhizome_write *write_state, unsigned char *buffer
       return -1;
   }
   
-  SHA512_Update(&write_state->sha512_context, buffer, data_size);
-  write_state->file_offset+=data_size;
+  while (data_size > 0){
+    size_t size = data_size;
+    if (write_state->merkle_leaves){
+      size_t leaf_offset = write_state->file_offset % RHIZOME_MERKLE_BLOCK_SIZE;
+      if (leaf_offset == 0){
+	rhizome_merkle_leaf_init(&write_state->merkle_context);
+	write_state->merkle_file_context = write_state->sha512_context;
+	write_state->merkle_active = 1;
+      }
+      if (size > RHIZOME_MERKLE_BLOCK_SIZE - leaf_offset)
+	size = RHIZOME_MERKLE_BLOCK_SIZE - leaf_offset;
+      if (write_state->merkle_active)
+	SHA512_Update(&write_state->merkle_context, buffer, size);
+    }
+    SHA512_Update(&write_state->sha512_context, buffer, size);
+    write_state->file_offset+=size;
+    buffer+=size;
+    data_size-=size;
+    if (write_state->merkle_active
+	&& (write_state->file_offset % RHIZOME_MERKLE_BLOCK_SIZE == 0 || write_state->file_offset == write_state->file_length)
+	&& merkle_leaf_complete(write_state))
+      return 1;
+  }
   
   if (config.debug.rhizome)
     DEBUGF("Processed %"PRIu64" of %"PRIu64, write_state->file_offset, write_state->file_length);
@@ -187,20 +326,9 @@ static int write_get_lock(struct rhizome_write *write_state){
   }
 }
 
-// write data to disk
-static int write_data(struct rhizome_write *write_state, uint64_t file_offset, unsigned char *buffer, size_t data_size)
+// write data to its place in the blob
+static int write_blob(struct rhizome_write *write_state, uint64_t file_offset, unsigned char *buffer, size_t data_size)
 {
-  if (config.debug.rhizome) {
-    DEBUGF("write_state->file_length=%"PRIu64" file_offset=%"PRIu64, write_state->file_length, file_offset);
-    //dump("buffer", buffer, data_size);
-  }
-
-  if (data_size<=0)
-    return 0;
-  
-  if (file_offset != write_state->written_offset)
-    WARNF("Writing file data out of order! [%"PRId64",%"PRId64"]", file_offset, write_state->written_offset);
-    
   if (write_state->blob_fd != -1) {
     int ofs=0;
     // keep trying until all of the data is written.
@@ -231,6 +359,51 @@ static int write_data(struct rhizome_write *write_state, uint64_t file_offset, u
 	return WHY("Giving up");
     }
   }
+  return 0;
+}
+
+// read back data that was written to the blob
+static int read_blob(struct rhizome_write *write_state, uint64_t file_offset, unsigned char *buffer, size_t data_size)
+{
+  if (write_state->blob_fd != -1) {
+    size_t ofs=0;
+    if (lseek64(write_state->blob_fd, (off64_t) file_offset, SEEK_SET) == -1)
+      return WHYF_perror("lseek64(%d,%"PRIu64",SEEK_SET)", write_state->blob_fd, file_offset);
+    while(ofs < data_size){
+      ssize_t r=read(write_state->blob_fd, buffer + ofs, data_size - ofs);
+      if (r<0)
+	return WHY_perror("read");
+      if (r==0)
+	return WHYF("Blob ends before %"PRIu64, file_offset + data_size);
+      ofs+=r;
+    }
+  }else{
+    if (!write_state->sql_blob)
+      return WHY("Must call write_get_lock() before read_blob()");
+    int ret=sqlite3_blob_read(write_state->sql_blob, buffer, data_size, file_offset);
+    if (ret!=SQLITE_OK)
+      return WHYF("sqlite3_blob_read() failed: %s", 
+	     sqlite3_errmsg(rhizome_db));
+  }
+  return 0;
+}
+
+// write data to disk
+static int write_data(struct rhizome_write *write_state, uint64_t file_offset, unsigned char *buffer, size_t data_size)
+{
+  if (config.debug.rhizome) {
+    DEBUGF("write_state->file_length=%"PRIu64" file_offset=%"PRIu64, write_state->file_length, file_offset);
+    //dump("buffer", buffer, data_size);
+  }
+
+  if (data_size<=0)
+    return 0;
+  
+  if (file_offset != write_state->written_offset)
+    WARNF("Writing file data out of order! [%"PRId64",%"PRId64"]", file_offset, write_state->written_offset);
+  
+  if (write_blob(write_state, file_offset, buffer, data_size))
+    return -1;
   
   write_state->written_offset = file_offset + data_size;
   
@@ -259,8 +432,209 @@ static int write_release_lock(struct rhizome_write *write_state){
   return ret;
 }
 
+/* A write opened by rhizome_open_write_partial() keeps its temporary FILES row and blob if it is
+ * interrupted, and a PARTIALS row maps the expected file hash to them, along with the ranges of the
+ * blob that hold received data, as (start, end) pairs of 64-bit integers.  The row is refreshed as
+ * the data is written so that it also outlives a daemon that is killed, and rhizome_cleanup()
+ * drops it once it has not been touched for rhizome.partial_persist_ms.
+ */
+#define RHIZOME_PARTIAL_CHECKPOINT_SIZE (256*1024)
+
+// record the data written so far, and with include_buffered also the blocks held in memory
+static int partial_record(struct rhizome_write *write_state, int include_buffered)
+{
+  struct rhizome_write_buffer *n;
+  size_t count = 1;
+  if (include_buffered)
+    for (n = write_state->buffer_list; n; n = n->_next)
+      count++;
+  unsigned char *ranges = emalloc(count * 16);
+  if (!ranges)
+    return -1;
+  size_t len = 0;
+  uint64_t start = 0, end = write_state->written_offset;
+  for (n = include_buffered ? write_state->buffer_list : NULL; n; n = n->_next){
+    if (n->offset <= end){
+      if (n->offset + n->data_size > end)
+	end = n->offset + n->data_size;
+      continue;
+    }
+    if (end > start){
+      write_uint64(&ranges[len], start);
+      write_uint64(&ranges[len + 8], end);
+      len += 16;
+    }
+    start = n->offset;
+    end = n->offset + n->data_size;
+  }
+  if (end > start){
+    write_uint64(&ranges[len], start);
+    write_uint64(&ranges[len + 8], end);
+    len += 16;
+  }
+  
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  int ret = sqlite_exec_void_retry(
+	&retry,
+	"INSERT OR REPLACE INTO PARTIALS(filehash,temp_id,length,ranges,updatetime) VALUES(?,?,?,?,?);",
+	RHIZOME_FILEHASH_T, &write_state->id,
+	UINT64_TOSTR, write_state->temp_id,
+	INT64, write_state->file_length,
+	STATIC_BLOB, ranges, (int)len,
+	INT64, gettime_ms(),
+	END
+      );
+  free(ranges);
+  if (ret == -1)
+    return -1;
+  write_state->partial_offset = write_state->written_offset;
+  if (config.debug.rhizome_rx)
+    DEBUGF("Recorded partial payload %s, %zu range%s, %"PRIu64" bytes from the start",
+	alloca_tohex_rhizome_filehash_t(write_state->id), len / 16, len == 16 ? "" : "s", write_state->written_offset);
+  return 0;
+}
+
+// forget the data received so far
+static void partial_discard(struct rhizome_write *write_state)
+{
+  char blob_path[1024];
+  if (FORM_RHIZOME_DATASTORE_PATH(blob_path, "%"PRId64, write_state->temp_id))
+    unlink(blob_path);
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry, "DELETE FROM PARTIALS WHERE filehash = ?;", RHIZOME_FILEHASH_T, &write_state->id, END);
+  sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry, "DELETE FROM FILEBLOBS WHERE id = ?;", UINT64_TOSTR, write_state->temp_id, END);
+  sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry, "DELETE FROM FILES WHERE id = ?;", UINT64_TOSTR, write_state->temp_id, END);
+  write_state->partial = 0;
+}
+
+/* Reopen the blob that an earlier write of this payload left behind, process the data at the start
+ * of it again and load any later ranges back into memory, as if it had just been received.
+ * Returns 0 if the write can carry on from there, 1 if there is nothing usable to resume.
+ */
+static int partial_resume(struct rhizome_write *write, const rhizome_filehash_t *hashp, uint64_t file_length)
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
+      "SELECT temp_id, length, ranges FROM PARTIALS WHERE filehash = ?;",
+      RHIZOME_FILEHASH_T, hashp, END);
+  if (!statement)
+    return 1;
+  if (sqlite_step_retry(&retry, statement) != SQLITE_ROW){
+    sqlite_finalize(statement);
+    return 1;
+  }
+  const char *temp_id = (const char *) sqlite3_column_text(statement, 0);
+  uint64_t length = sqlite3_column_int64(statement, 1);
+  size_t ranges_len = sqlite3_column_bytes(statement, 2) / 16 * 16;
+  unsigned char *ranges = NULL;
+  if (ranges_len && (ranges = emalloc(ranges_len)) != NULL)
+    bcopy(sqlite3_column_blob(statement, 2), ranges, ranges_len);
+  
+  write_init(write);
+  write->temp_id = temp_id ? strtoull(temp_id, NULL, 10) : 0;
+  sqlite_finalize(statement);
+  write->id = *hashp;
+  write->id_known = 1;
+  write->blob_rowid = -1;
+  write->sql_blob = NULL;
+  write->buffer_list = NULL;
+  write->buffer_size = 0;
+  write->crypt = 0;
+  write->file_length = file_length;
+  write->file_offset = 0;
+  write->written_offset = 0;
+  write->partial = 1;
+  SHA512_Init(&write->sha512_context);
+  
+  char blob_path[1024];
+  if (length != file_length || !ranges || !FORM_RHIZOME_DATASTORE_PATH(blob_path, "%"PRId64, write->temp_id))
+    goto discard;
+  write->blob_fd = open(blob_path, O_RDWR);
+  if (write->blob_fd == -1 && sqlite_exec_int64_retry(&retry, &write->blob_rowid,
+	  "SELECT rowid FROM FILEBLOBS WHERE id = ?;", UINT64_TOSTR, write->temp_id, END) != 1)
+    goto discard;
+  if (write_get_lock(write))
+    goto fail;
+  
+  unsigned char buffer[RHIZOME_CRYPT_PAGE_SIZE];
+  struct rhizome_write_buffer **tail = &write->buffer_list;
+  size_t i;
+  for (i = 0; i < ranges_len; i += 16){
+    uint64_t offset = read_uint64(&ranges[i]);
+    uint64_t end = read_uint64(&ranges[i + 8]);
+    if (end > file_length)
+      end = file_length;
+    while (offset < end){
+      size_t size = end - offset;
+      if (!write->buffer_list && offset == write->file_offset){
+	// in order, so it can be processed straight away
+	if (size > sizeof buffer)
+	  size = sizeof buffer;
+	if (read_blob(write, offset, buffer, size) || prepare_data(write, buffer, size))
+	  goto fail;
+	write->written_offset = offset + size;
+      }else{
+	// keep no more in memory than rhizome_random_write() would, the rest will be fetched again
+	if (size > RHIZOME_BUFFER_MAXIMUM_SIZE - write->buffer_size)
+	  size = RHIZOME_BUFFER_MAXIMUM_SIZE - write->buffer_size;
+	if (size == 0)
+	  break;
+	struct rhizome_write_buffer *n = emalloc(size + sizeof(struct rhizome_write_buffer));
+	if (!n)
+	  goto fail;
+	n->_next = NULL;
+	n->offset = offset;
+	n->buffer_size = n->data_size = size;
+	*tail = n;
+	tail = &n->_next;
+	write->buffer_size += size;
+	if (read_blob(write, offset, n->data, size))
+	  goto fail;
+      }
+      offset += size;
+    }
+  }
+  if (write_release_lock(write))
+    goto fail;
+  // if everything arrived, something went wrong when it was finished, so start again
+  if (write->file_offset >= file_length)
+    goto fail;
+  
+  free(ranges);
+  write->partial_offset = write->written_offset;
+  sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry,
+      "UPDATE PARTIALS SET updatetime = ? WHERE filehash = ?;",
+      INT64, gettime_ms(), RHIZOME_FILEHASH_T, hashp, END);
+  if (config.debug.rhizome_rx)
+    DEBUGF("Resuming payload %s from %"PRIu64" of %"PRIu64" bytes, %zu bytes buffered",
+	alloca_tohex_rhizome_filehash_t(*hashp), write->file_offset, file_length, write->buffer_size);
+  return 0;
+  
+fail:
+  write_release_lock(write);
+  while(write->buffer_list){
+    struct rhizome_write_buffer *n=write->buffer_list;
+    write->buffer_list=n->_next;
+    free(n);
+  }
+  write->buffer_size = 0;
+  if (write->blob_fd != -1){
+    close(write->blob_fd);
+    write->blob_fd = -1;
+  }
+discard:
+  if (ranges)
+    free(ranges);
+  if (config.debug.rhizome_rx)
+    DEBUGF("Discarding partial payload %s", alloca_tohex_rhizome_filehash_t(*hashp));
+  partial_discard(write);
+  write->blob_rowid = -1;
+  return 1;
+}
+
 // Write data buffers in any order, the data will be cached and streamed into the database in file order. 
 // Though there is an upper bound on the amount of cached data
+// Returns 1 if some data was discarded because it failed hash tree verification.
 int rhizome_random_write(struct rhizome_write *write_state, uint64_t offset, unsigned char *buffer, size_t data_size)
 {
   if (config.debug.rhizome) {
@@ -289,8 +663,9 @@ int rhizome_random_write(struct rhizome_write *write_state, uint64_t offset, uns
     
     // can we process this existing data block now?
     if (*ptr && (*ptr)->offset == write_state->file_offset){
-      if (prepare_data(write_state, (*ptr)->data, (*ptr)->data_size)){
-	ret=-1;
+      int r = prepare_data(write_state, (*ptr)->data, (*ptr)->data_size);
+      if (r){
+	ret=r;
 	break;
       }
       continue;
@@ -329,9 +704,15 @@ int rhizome_random_write(struct rhizome_write *write_state, uint64_t offset, uns
     
     // can we process the incoming data block now?
     if (data_size>0 && offset == write_state->file_offset){
-      if (prepare_data(write_state, buffer, data_size)){
-	ret=-1;
-	break;
+      int r = prepare_data(write_state, buffer, data_size);
+      if (r){
+	ret=r;
+	if (r==-1 || offset >= write_state->file_offset)
+	  break;
+	// a later leaf was rejected, but keep the leading data that passed verification
+	data_size = write_state->file_offset - offset;
+	ptr = &write_state->buffer_list;
+	last_offset = write_state->written_offset;
       }
       continue;
     }
@@ -388,12 +769,18 @@ int rhizome_random_write(struct rhizome_write *write_state, uint64_t offset, uns
   }
   if (write_release_lock(write_state))
     ret=-1;
+  if (ret==0 && write_state->partial
+      && write_state->written_offset >= write_state->partial_offset + RHIZOME_PARTIAL_CHECKPOINT_SIZE)
+    partial_record(write_state, 0);
   return ret;
 }
 
 int rhizome_write_buffer(struct rhizome_write *write_state, unsigned char *buffer, size_t data_size)
 {
-  return rhizome_random_write(write_state, write_state->file_offset, buffer, data_size);
+  // a stream cannot go back to replace a block that failed verification
+  if (rhizome_random_write(write_state, write_state->file_offset, buffer, data_size))
+    return -1;
+  return 0;
 }
 
 /* Expects file to be at least file_length in size, ignoring anything longer than that */
@@ -442,10 +829,71 @@ int rhizome_fail_write(struct rhizome_write *write)
     write->buffer_list=n->_next;
     free(n);
   }
+  merkle_free(write);
+  if (write->partial)
+    partial_discard(write);
   rhizome_delete_file(&write->id);
   return 0;
 }
 
+/* As rhizome_open_write(), for a payload that is being fetched and whose hash is known.  If an
+ * earlier fetch of the same payload was interrupted, from this peer or any other, the write carries
+ * on with the data it left behind, and file_offset is how much of that has already been processed.
+ */
+int rhizome_open_write_partial(struct rhizome_write *write, const rhizome_filehash_t *expectedHashp, uint64_t file_length, int priority)
+{
+  if (rhizome_exists(expectedHashp))
+    return 1;
+  int resumable = config.rhizome.partial_persist_ms && file_length > 0 && file_length != RHIZOME_SIZE_UNSET;
+  if (resumable && partial_resume(write, expectedHashp, file_length) == 0)
+    return 0;
+  int ret = rhizome_open_write(write, expectedHashp, file_length, priority);
+  if (ret == 0 && resumable){
+    write->partial = 1;
+    if (partial_record(write, 0))
+      write->partial = 0;
+  }
+  return ret;
+}
+
+/* Close a write that was interrupted before all of its data arrived.  If it was opened with
+ * rhizome_open_write_partial(), the data received so far, including any blocks that are held in
+ * memory because they arrived out of order, is kept on disk for the next fetch of the payload.
+ * Otherwise the same as rhizome_fail_write().
+ */
+int rhizome_suspend_write(struct rhizome_write *write)
+{
+  if (!write->partial || write->crypt || !config.rhizome.partial_persist_ms)
+    return rhizome_fail_write(write);
+  int ret = write_get_lock(write);
+  struct rhizome_write_buffer *n;
+  for (n = write->buffer_list; ret == 0 && n; n = n->_next)
+    ret = write_blob(write, n->offset, n->data, n->data_size);
+  if (write_release_lock(write))
+    ret = -1;
+  if (ret == 0)
+    ret = partial_record(write, 1);
+  if (ret)
+    return rhizome_fail_write(write);
+  
+  if (write->blob_fd != -1){
+    if (config.debug.externalblobs)
+      DEBUGF("Closing fd %d", write->blob_fd);
+    close(write->blob_fd);
+    write->blob_fd=-1;
+  }
+  while(write->buffer_list){
+    n=write->buffer_list;
+    write->buffer_list=n->_next;
+    free(n);
+  }
+  write->buffer_size = 0;
+  merkle_free(write);
+  write->blob_rowid = -1;
+  write->partial = 0;
+  return 0;
+}
+
 int rhizome_finish_write(struct rhizome_write *write)
 {
   if (write->blob_rowid==-1 && write->blob_fd == -1)
@@ -486,6 +934,11 @@ int rhizome_finish_write(struct rhizome_write *write)
     write->id = hash_out;
   }
   
+  if (write->merkle_leaves && !write->merkle_verify && write->file_offset == write->file_length
+      && rhizome_merkle_root(write->merkle_leaves, write->merkle_leaf_count, write->merkle_root) == 0)
+    write->has_merkle_root = 1;
+  merkle_free(write);
+  
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
   rhizome_remove_file_datainvalid(&retry, &write->id);
   if (rhizome_exists(&write->id)) {
@@ -546,6 +999,10 @@ int rhizome_finish_write(struct rhizome_write *write)
     if (config.debug.rhizome)
       DEBUGF("Stored file %s", alloca_tohex_rhizome_filehash_t(write->id));
   }
+  if (write->partial){
+    sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry, "DELETE FROM PARTIALS WHERE filehash = ?;", RHIZOME_FILEHASH_T, &write->id, END);
+    write->partial = 0;
+  }
   write->blob_rowid=-1;
   return 0;
   
@@ -678,11 +1135,16 @@ int rhizome_add_file(rhizome_manifest *m, const char *filepath)
   bzero(&write, sizeof(write));
   if (rhizome_write_open_manifest(&write, m))
     goto failure;
+  // journals change their payload with every append, so only give fixed payloads a hash tree
+  if (config.rhizome.merkle_hash && !m->is_journal && rhizome_write_merkle_build(&write))
+    goto failure;
   if (rhizome_write_file(&write, filepath))
     goto failure;
   if (rhizome_finish_write(&write))
     goto failure;
   rhizome_manifest_set_filehash(m, &write.id);
+  if (write.has_merkle_root)
+    rhizome_manifest_set_merkle_root(m, write.merkle_root);
   return 0;
 failure:
   rhizome_fail_write(&write);
@@ -696,6 +1158,7 @@ int rhizome_open_read(struct rhizome_read *read, const rhizome_filehash_t *hashp
   read->id = *hashp;
   read->blob_rowid = -1;
   read->blob_fd = -1;
+  read->blob_map = NULL;
   if (sqlite_exec_int64(&read->blob_rowid,
       "SELECT FILEBLOBS.rowid "
       "FROM FILEBLOBS, FILES "
@@ -722,6 +1185,23 @@ int rhizome_open_read(struct rhizome_read *read, const rhizome_filehash_t *hashp
     read->length = pos;
     if (config.debug.externalblobs)
       DEBUGF("Opened stored file %s as fd %d, len %"PRIx64,blob_path, read->blob_fd, read->length);
+#ifdef HAVE_SYS_MMAN_H
+    // Map the whole file, so that repeated block reads (MDP fetches, meshms plys, HTTP) become
+    // memory copies instead of lseek()+read() system calls.  If mmap() is not supported by the
+    // file system, fall back to reading through the file descriptor.
+    if (read->length > 0 && read->length <= SIZE_MAX) {
+      void *addr = mmap(NULL, (size_t) read->length, PROT_READ, MAP_SHARED, read->blob_fd, 0);
+      if (addr == MAP_FAILED) {
+	if (config.debug.externalblobs)
+	  DEBUGF("mmap(%s) failed, errno=%d, reading via fd", alloca_str_toprint(blob_path), errno);
+      } else {
+	read->blob_map = addr;
+	read->blob_map_length = (size_t) read->length;
+	if (config.debug.externalblobs)
+	  DEBUGF("Mapped stored file %s at %p", blob_path, addr);
+      }
+    }
+#endif
   }
   read->offset = 0;
   read->hash_offset = 0;
@@ -732,6 +1212,17 @@ int rhizome_open_read(struct rhizome_read *read, const rhizome_filehash_t *hashp
 static ssize_t rhizome_read_retry(sqlite_retry_state *retry, struct rhizome_read *read_state, unsigned char *buffer, size_t bufsz)
 {
   IN();
+  if (read_state->blob_map) {
+    if (buffer == NULL || bufsz == 0 || read_state->offset >= read_state->blob_map_length)
+      RETURN(0);
+    size_t rd = read_state->blob_map_length - read_state->offset;
+    if (rd > bufsz)
+      rd = bufsz;
+    bcopy(read_state->blob_map + read_state->offset, buffer, rd);
+    if (config.debug.externalblobs)
+      DEBUGF("Copied %zu bytes from mapped fd=%d @%"PRIx64, rd, read_state->blob_fd, read_state->offset);
+    RETURN(rd);
+  }
   if (read_state->blob_fd != -1) {
     if (lseek64(read_state->blob_fd, (off64_t) read_state->offset, SEEK_SET) == -1)
       RETURN(WHYF_perror("lseek64(%d,%"PRIu64",SEEK_SET)", read_state->blob_fd, read_state->offset));
@@ -835,6 +1326,10 @@ ssize_t rhizome_read(struct rhizome_read *read_state, unsigned char *buffer, siz
 /* Read len bytes from read->offset into data, using *buffer to cache any reads */
 ssize_t rhizome_read_buffered(struct rhizome_read *read, struct rhizome_read_buffer *buffer, unsigned char *data, size_t len)
 {
+  // a mapped blob is already in memory, so copying through the buffer would only cost time
+  if (read->blob_map)
+    return rhizome_read(read, data, len);
+
   size_t bytes_copied=0;
   
   while (len>0){
@@ -899,6 +1394,13 @@ ssize_t rhizome_read_buffered(struct rhizome_read *read, struct rhizome_read_buf
 
 int rhizome_read_close(struct rhizome_read *read)
 {
+#ifdef HAVE_SYS_MMAN_H
+  if (read->blob_map){
+    if (munmap((void *)read->blob_map, read->blob_map_length) == -1)
+      WHY_perror("munmap");
+  }
+#endif
+  read->blob_map = NULL;
   if (read->blob_fd >=0){
     if (config.debug.externalblobs)
       DEBUGF("Closing store fd %d", read->blob_fd);
@@ -912,72 +1414,148 @@ int rhizome_read_close(struct rhizome_read *read)
   return 0;
 }
 
+/* Cache of payloads being served to MDP block requests.
+ *
+ * Open read handles are kept in a hash table keyed on (bundle id, version), and are closed by
+ * rhizome_cache_alarm() once nobody has asked for a block for a while.  Each use moves a handle to
+ * the head of an LRU list, so expired handles are always found at the tail without walking the
+ * whole table.
+ *
+ * Decrypted payload pages are kept in a second hash table keyed on (bundle id, version, page
+ * offset), up to rhizome.mdp.block_cache_size bytes, evicting the least recently used page when
+ * full.  Pages outlive the handle that read them, so when many neighbours fetch the same popular
+ * bundle each page is read from the store and decrypted only once.  Pages are aligned on
+ * RHIZOME_CRYPT_PAGE_SIZE boundaries, so reading them in order also lets rhizome_read() verify
+ * the payload hash as usual.
+ */
+
+#define RHIZOME_CACHE_BUCKETS 64
+#define RHIZOME_BLOCK_CACHE_BUCKETS 1024
+
 struct cache_entry{
-  struct cache_entry *_left;
-  struct cache_entry *_right;
+  struct cache_entry *_next; // hash chain
+  struct cache_entry *_lru_prev;
+  struct cache_entry *_lru_next;
   rhizome_bid_t bundle_id;
   uint64_t version;
   struct rhizome_read read_state;
   time_ms_t expires;
+  unsigned char *merkle_leaves; // payload hash tree leaves, computed as they are asked for
+  size_t merkle_leaf_count;
+  size_t merkle_leaves_built;
 };
-struct cache_entry *root;
 
-static struct cache_entry ** find_entry_location(struct cache_entry **ptr, const rhizome_bid_t *bundle_id, uint64_t version)
+struct cache_block{
+  struct cache_block *_next; // hash chain
+  struct cache_block *_lru_prev;
+  struct cache_block *_lru_next;
+  rhizome_bid_t bundle_id;
+  uint64_t version;
+  uint64_t offset;
+  size_t length;
+  unsigned char data[RHIZOME_CRYPT_PAGE_SIZE];
+};
+
+static struct cache_entry *entries[RHIZOME_CACHE_BUCKETS];
+static struct cache_entry *entries_head = NULL; // most recently used
+static struct cache_entry *entries_tail = NULL; // least recently used
+static int entry_count = 0;
+
+static struct cache_block *blocks[RHIZOME_BLOCK_CACHE_BUCKETS];
+static struct cache_block *blocks_head = NULL;
+static struct cache_block *blocks_tail = NULL;
+static unsigned block_count = 0;
+static unsigned block_hits = 0;
+static unsigned block_misses = 0;
+
+static unsigned cache_hash(const rhizome_bid_t *bundle_id, uint64_t version, uint64_t offset)
 {
-  while(*ptr){
-    struct cache_entry *entry = *ptr;
-    int cmp = cmp_rhizome_bid_t(bundle_id, &entry->bundle_id);
-    if (cmp==0){
-      if (entry->version==version)
-	break;
-      if (version < entry->version)
-	ptr = &entry->_left;
-      else
-	ptr = &entry->_right;
-      continue;
-    }
-    if (cmp<0)
-      ptr = &entry->_left;
-    else
-      ptr = &entry->_right;
-  }
+  // BIDs are public keys, so their leading bytes are already uniformly distributed
+  uint32_t h = ((uint32_t)bundle_id->binary[0] << 24) | ((uint32_t)bundle_id->binary[1] << 16)
+	     | ((uint32_t)bundle_id->binary[2] << 8) | bundle_id->binary[3];
+  h ^= (uint32_t)version ^ (uint32_t)(version >> 32);
+  h ^= (uint32_t)(offset / RHIZOME_CRYPT_PAGE_SIZE) * 2654435761u;
+  return h;
+}
+
+// Doubly linked LRU list manipulation, shared by both kinds of cache record.
+#define LRU_UNLINK(HEAD, TAIL, X) do { \
+    if ((X)->_lru_prev) (X)->_lru_prev->_lru_next = (X)->_lru_next; else (HEAD) = (X)->_lru_next; \
+    if ((X)->_lru_next) (X)->_lru_next->_lru_prev = (X)->_lru_prev; else (TAIL) = (X)->_lru_prev; \
+    (X)->_lru_prev = (X)->_lru_next = NULL; \
+  } while (0)
+#define LRU_PUSH(HEAD, TAIL, X) do { \
+    (X)->_lru_prev = NULL; \
+    (X)->_lru_next = (HEAD); \
+    if (HEAD) (HEAD)->_lru_prev = (X); else (TAIL) = (X); \
+    (HEAD) = (X); \
+  } while (0)
+
+static struct cache_entry **find_entry_location(const rhizome_bid_t *bundle_id, uint64_t version)
+{
+  struct cache_entry **ptr = &entries[cache_hash(bundle_id, version, 0) & (RHIZOME_CACHE_BUCKETS - 1)];
+  while (*ptr && ((*ptr)->version != version || cmp_rhizome_bid_t(bundle_id, &(*ptr)->bundle_id) != 0))
+    ptr = &(*ptr)->_next;
   return ptr;
 }
 
-static time_ms_t close_entries(struct cache_entry **entry, time_ms_t timeout)
+static void close_entry(struct cache_entry *entry)
 {
-  if (!*entry)
-    return 0;
-    
-  time_ms_t ret = close_entries(&(*entry)->_left, timeout);
-  time_ms_t t_right = close_entries(&(*entry)->_right, timeout);
-  if (t_right!=0 && (t_right < ret || ret==0))
-    ret=t_right;
-    
-  if ((*entry)->expires < timeout || timeout==0){
-    rhizome_read_close(&(*entry)->read_state);
-    // remember the two children
-    struct cache_entry *left=(*entry)->_left;
-    struct cache_entry *right=(*entry)->_right;
-    // free this entry
-    free(*entry);
-    // re-add both children to the tree
-    *entry=left;
-    if (right){
-      entry = find_entry_location(entry, &right->bundle_id, right->version);
-      *entry=right;
+  struct cache_entry **ptr = find_entry_location(&entry->bundle_id, entry->version);
+  assert(*ptr == entry);
+  *ptr = entry->_next;
+  LRU_UNLINK(entries_head, entries_tail, entry);
+  rhizome_read_close(&entry->read_state);
+  if (entry->merkle_leaves)
+    free(entry->merkle_leaves);
+  free(entry);
+  entry_count--;
+}
+
+static struct cache_block **find_block_location(const rhizome_bid_t *bundle_id, uint64_t version, uint64_t offset)
+{
+  struct cache_block **ptr = &blocks[cache_hash(bundle_id, version, offset) & (RHIZOME_BLOCK_CACHE_BUCKETS - 1)];
+  while (*ptr && ((*ptr)->offset != offset || (*ptr)->version != version
+	|| cmp_rhizome_bid_t(bundle_id, &(*ptr)->bundle_id) != 0))
+    ptr = &(*ptr)->_next;
+  return ptr;
+}
+
+static void unlink_block(struct cache_block *block)
+{
+  struct cache_block **ptr = find_block_location(&block->bundle_id, block->version, block->offset);
+  assert(*ptr == block);
+  *ptr = block->_next;
+  LRU_UNLINK(blocks_head, blocks_tail, block);
+  block_count--;
+}
+
+// discard every cached page of one payload, eg, because it failed its hash check
+static void drop_blocks(const rhizome_bid_t *bundle_id, uint64_t version)
+{
+  struct cache_block *block = blocks_head;
+  while (block) {
+    struct cache_block *next = block->_lru_next;
+    if (block->version == version && cmp_rhizome_bid_t(bundle_id, &block->bundle_id) == 0) {
+      unlink_block(block);
+      free(block);
     }
-  }else{
-    if ((*entry)->expires < ret || ret==0)
-      ret=(*entry)->expires;
+    block = next;
   }
-  return ret;
+}
+
+// close expired entries, returning the time the next one expires, or 0 if there are none left
+static time_ms_t close_entries(time_ms_t timeout)
+{
+  while (entries_tail && (timeout == 0 || entries_tail->expires < timeout))
+    close_entry(entries_tail);
+  return entries_tail ? entries_tail->expires : 0;
 }
 
 // close any expired cache entries
 static void rhizome_cache_alarm(struct sched_ent *alarm)
 {
-  alarm->alarm = close_entries(&root, gettime_ms());
+  alarm->alarm = close_entries(gettime_ms());
   if (alarm->alarm){
     alarm->deadline = alarm->alarm + 1000;
     schedule(alarm);
@@ -992,51 +1570,57 @@ static struct sched_ent cache_alarm={
   .stats = &cache_alarm_stats,
 };
 
-// close all cache entries
+// close all cache entries and discard all cached pages
 int rhizome_cache_close()
 {
-  close_entries(&root, 0);
+  close_entries(0);
+  while (blocks_tail) {
+    struct cache_block *block = blocks_tail;
+    unlink_block(block);
+    free(block);
+  }
   unschedule(&cache_alarm);
   return 0;
 }
 
-static int _rhizome_cache_count(struct cache_entry *entry)
+int rhizome_cache_count()
 {
-  if (!entry)
-    return 0;
-  return 1+_rhizome_cache_count(entry->_left)+_rhizome_cache_count(entry->_right);
+  return entry_count;
 }
 
-int rhizome_cache_count()
+void rhizome_cache_stats(unsigned *count, unsigned *hits, unsigned *misses)
 {
-  return _rhizome_cache_count(root);
+  *count = block_count;
+  *hits = block_hits;
+  *misses = block_misses;
 }
 
-// read a block of data, caching meta data for reuse
-int rhizome_read_cached(const rhizome_bid_t *bidp, uint64_t version, time_ms_t timeout, uint64_t fileOffset, unsigned char *buffer, size_t length)
+// find or open the read handle for a payload, and keep it open until at least timeout
+static struct cache_entry *open_entry(const rhizome_bid_t *bidp, uint64_t version, time_ms_t timeout)
 {
-  // look for a cached entry
-  struct cache_entry **ptr = find_entry_location(&root, bidp, version);
+  struct cache_entry **ptr = find_entry_location(bidp, version);
   struct cache_entry *entry = *ptr;
   
   // if we don't have one yet, create one and open it
   if (!entry){
     rhizome_filehash_t filehash;
     if (rhizome_database_filehash_from_id(bidp, version, &filehash) == -1)
-      return -1;
-    entry = emalloc_zero(sizeof(struct cache_entry));
+      return NULL;
+    if ((entry = emalloc_zero(sizeof(struct cache_entry))) == NULL)
+      return NULL;
     if (rhizome_open_read(&entry->read_state, &filehash)){
       free(entry);
-      return WHYF("Payload %s not found", alloca_tohex_rhizome_filehash_t(filehash));
+      WHYF("Payload %s not found", alloca_tohex_rhizome_filehash_t(filehash));
+      return NULL;
     }
     entry->bundle_id = *bidp;
     entry->version = version;
     *ptr = entry;
+    entry_count++;
+  } else {
+    LRU_UNLINK(entries_head, entries_tail, entry);
   }
-  
-  entry->read_state.offset = fileOffset;
-  if (entry->read_state.length !=-1 && fileOffset >= entry->read_state.length)
-    return 0;
+  LRU_PUSH(entries_head, entries_tail, entry);
   
   if (entry->expires < timeout){
     entry->expires = timeout;
@@ -1047,8 +1631,144 @@ int rhizome_read_cached(const rhizome_bid_t *bidp, uint64_t version, time_ms_t t
       schedule(&cache_alarm);
     }
   }
+  return entry;
+}
+
+/* Find the cached page of a payload that starts at offset, reading it from the store if necessary.
+ * Returns 1 and sets *blockp if found, 0 if offset is past the end of the payload, -1 on error.
+ */
+static int cached_block(const rhizome_bid_t *bidp, uint64_t version, time_ms_t timeout, uint64_t offset, struct cache_block **blockp)
+{
+  struct cache_block **ptr = find_block_location(bidp, version, offset);
+  struct cache_block *block = *ptr;
+  if (block){
+    block_hits++;
+    LRU_UNLINK(blocks_head, blocks_tail, block);
+    LRU_PUSH(blocks_head, blocks_tail, block);
+    *blockp = block;
+    return 1;
+  }
+  block_misses++;
+  
+  struct cache_entry *entry = open_entry(bidp, version, timeout);
+  if (!entry)
+    return -1;
+  if (entry->read_state.length != RHIZOME_SIZE_UNSET && offset >= entry->read_state.length)
+    return 0;
+  
+  // recycle the least recently used page if the cache is full
+  if (blocks_tail && (uint64_t)(block_count + 1) * RHIZOME_CRYPT_PAGE_SIZE > config.rhizome.mdp.block_cache_size){
+    block = blocks_tail;
+    unlink_block(block);
+  } else if ((block = emalloc(sizeof(struct cache_block))) == NULL)
+    return -1;
+  
+  entry->read_state.offset = offset;
+  ssize_t r = rhizome_read(&entry->read_state, block->data, sizeof block->data);
+  if (r <= 0){
+    free(block);
+    if (r == -1)
+      drop_blocks(bidp, version);
+    return (int) r;
+  }
+  block->bundle_id = *bidp;
+  block->version = version;
+  block->offset = offset;
+  block->length = (size_t) r;
+  // the location may have moved if a page was recycled from the same hash chain
+  ptr = find_block_location(bidp, version, offset);
+  block->_next = *ptr;
+  *ptr = block;
+  LRU_PUSH(blocks_head, blocks_tail, block);
+  block_count++;
+  *blockp = block;
+  return 1;
+}
+
+// read a block of data, caching meta data and decrypted pages for reuse
+int rhizome_read_cached(const rhizome_bid_t *bidp, uint64_t version, time_ms_t timeout, uint64_t fileOffset, unsigned char *buffer, size_t length)
+{
+  if (config.rhizome.mdp.block_cache_size < RHIZOME_CRYPT_PAGE_SIZE){
+    // page cache disabled, read straight from the store
+    struct cache_entry *entry = open_entry(bidp, version, timeout);
+    if (!entry)
+      return -1;
+    entry->read_state.offset = fileOffset;
+    if (entry->read_state.length != RHIZOME_SIZE_UNSET && fileOffset >= entry->read_state.length)
+      return 0;
+    return rhizome_read(&entry->read_state, buffer, length);
+  }
   
-  return rhizome_read(&entry->read_state, buffer, length);
+  size_t copied = 0;
+  while (copied < length){
+    uint64_t offset = fileOffset + copied;
+    uint64_t page = offset & ~(uint64_t)(RHIZOME_CRYPT_PAGE_SIZE - 1);
+    struct cache_block *block = NULL;
+    int r = cached_block(bidp, version, timeout, page, &block);
+    if (r == -1)
+      return -1;
+    if (r == 0)
+      break;
+    size_t ofs = offset - page;
+    if (ofs >= block->length)
+      break;
+    size_t n = block->length - ofs;
+    if (n > length - copied)
+      n = length - copied;
+    bcopy(block->data + ofs, buffer + copied, n);
+    copied += n;
+    if (block->length < sizeof block->data)
+      break; // last page of the payload
+  }
+  return copied;
+}
+
+/* Copy up to max leaf hashes of a payload's hash tree, starting from leaf first, into hashes.
+ * Leaf hashes are computed from the stored payload as they are first asked for, so a request only
+ * ever reads as many payload blocks as it returns hashes, however large the payload is.
+ * Returns the number of hashes copied and sets *leaf_count, or -1 on error.
+ */
+int rhizome_read_cached_merkle(const rhizome_bid_t *bidp, uint64_t version, time_ms_t timeout,
+			       size_t first, unsigned char *hashes, size_t max, size_t *leaf_count)
+{
+  struct cache_entry *entry = open_entry(bidp, version, timeout);
+  if (!entry)
+    return -1;
+  unsigned char buffer[RHIZOME_MERKLE_BLOCK_SIZE];
+  if (!entry->merkle_leaves){
+    // the length of a payload stored in the database is only known after the first read
+    if (entry->read_state.length == RHIZOME_SIZE_UNSET){
+      entry->read_state.offset = 0;
+      if (rhizome_read(&entry->read_state, buffer, sizeof buffer) == -1)
+	return -1;
+    }
+    uint64_t length = entry->read_state.length;
+    if (length == 0 || length == RHIZOME_SIZE_UNSET)
+      return WHY("Payload has no hash tree");
+    size_t count = rhizome_merkle_leaf_count(length);
+    if ((entry->merkle_leaves = emalloc(count * RHIZOME_MERKLE_HASH_BYTES)) == NULL)
+      return -1;
+    entry->merkle_leaf_count = count;
+    entry->merkle_leaves_built = 0;
+  }
+  *leaf_count = entry->merkle_leaf_count;
+  if (first >= entry->merkle_leaf_count)
+    return 0;
+  size_t n = entry->merkle_leaf_count - first;
+  if (n > max)
+    n = max;
+  // hash any of the requested leaves, and the ones before them, that haven't been asked for yet
+  while (entry->merkle_leaves_built < first + n){
+    size_t i = entry->merkle_leaves_built;
+    entry->read_state.offset = (uint64_t)i * RHIZOME_MERKLE_BLOCK_SIZE;
+    ssize_t r = rhizome_read(&entry->read_state, buffer, sizeof buffer);
+    if (r <= 0)
+      return WHYF("Failed to read payload block %zu", i);
+    rhizome_merkle_leaf(buffer, (size_t) r, &entry->merkle_leaves[i * RHIZOME_MERKLE_HASH_BYTES]);
+    entry->merkle_leaves_built++;
+  }
+  bcopy(&entry->merkle_leaves[first * RHIZOME_MERKLE_HASH_BYTES], hashes, n * RHIZOME_MERKLE_HASH_BYTES);
+  return n;
 }
 
 /* Returns -1 on error, 0 on success.
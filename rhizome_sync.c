@@ -27,6 +27,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #define MSG_TYPE_BARS 0
 #define MSG_TYPE_REQ 1
+#define MSG_TYPE_RECONCILE 2
 
 #define CACHE_BARS 60
 #define MAX_OLD_BARS 40
@@ -34,6 +35,43 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #define HEAD_FLAG INT64_MAX
 
+/* Set reconciliation.  Instead of walking each other's MANIFESTS tables by rowid, two peers compare
+ * their sets of BARs, in BAR order, by range.  A MSG_TYPE_RECONCILE message starts with a lower
+ * bound, followed by any number of ranges, each of which is given by its upper bound and starts
+ * where the previous one ended.  A bound is the shortest BAR prefix that separates the last BAR
+ * before it from the first BAR after it, or RECONCILE_END for the end of the key space.  Each range
+ * is one of:
+ *  - RANGE_SKIP, nothing to say about it;
+ *  - RANGE_FINGERPRINT, the sender's count of BARs in it and the sum of their hashes.  If they don't
+ *    match the receiver's own, the receiver splits the range into RECONCILE_BRANCHES ranges with
+ *    fingerprints of its own, or sends a RANGE_BARS list if it has few BARs in the range;
+ *  - RANGE_BARS, every BAR the sender has in the range.  The receiver replies with a
+ *    RANGE_BARS_FINAL list of the BARs it has in the range that weren't in the list, or with
+ *    fingerprints if it has too many BARs in the range to list;
+ *  - RANGE_BARS_FINAL, BARs the receiver doesn't have, needing no reply.
+ * Ranges whose fingerprints match need no reply at all, so the bytes exchanged grow with the
+ * difference between the two stores and only logarithmically with their size.  A round ends when
+ * neither peer has sent anything for RECONCILE_QUIET_MS.
+ *
+ * The peer with the lower SID starts a round when it first hears from the other, and again every
+ * RECONCILE_INTERVAL_MS.  If a peer doesn't answer within RECONCILE_TIMEOUT_MS it is assumed to be
+ * too old to reconcile, and its BARs are synced by rowid windows instead.
+ */
+#define RANGE_SKIP 0
+#define RANGE_FINGERPRINT 1
+#define RANGE_BARS 2
+#define RANGE_BARS_FINAL 3
+
+#define RECONCILE_END 0xFF
+#define RECONCILE_BRANCHES 8
+#define RECONCILE_LIST_MAX 8
+#define RECONCILE_PAYLOAD_BYTES 400
+#define RECONCILE_TIMEOUT_MS 5000
+#define RECONCILE_QUIET_MS 2000
+#define RECONCILE_INTERVAL_MS 60000
+// a peer's BARs that are worth fetching, beyond the CACHE_BARS being requested
+#define RECONCILE_BACKLOG 4096
+
 struct bar_entry
 {
   unsigned char bar[RHIZOME_BAR_BYTES];
@@ -58,13 +96,70 @@ struct rhizome_sync
   struct bar_entry bars[CACHE_BARS];
   // how many bars are we interested in?
   int bar_count;
+  
+  // set reconciliation; 1 if the peer takes part, -1 if it doesn't answer, 0 if not known yet
+  signed char reconcile;
+  unsigned char reconcile_round;
+  // more BARs were found than the backlog could hold, so start another round once it has drained
+  unsigned char reconcile_more;
+  time_ms_t reconcile_started;
+  time_ms_t reconcile_last_rx;
+  time_ms_t reconcile_last_tx;
+  unsigned reconcile_rounds;
+  // interesting BARs found by reconciliation, waiting for room in bars[]
+  unsigned char *backlog;
+  unsigned backlog_count;
 };
 
+struct sync_bound
+{
+  unsigned char len;
+  unsigned char bytes[RHIZOME_BAR_COMPARE_BYTES];
+};
+
+// our own BARs in rowid order, for sync responses and announcements
+struct bar_index_entry
+{
+  uint64_t rowid;
+  unsigned char bar[RHIZOME_BAR_BYTES];
+};
+
+static struct bar_index_entry *bar_index = NULL;
+static unsigned bar_index_count = 0;
+static unsigned bar_index_alloc = 0;
+static int bar_index_loaded = 0;
+
+// the same BARs in BAR order, for reconciliation
+struct sync_item
+{
+  unsigned char bar[RHIZOME_BAR_BYTES];
+  uint64_t hash;
+  uint64_t rowid;
+};
+
+static struct sync_item *sync_items = NULL;
+static unsigned sync_item_count = 0;
+static unsigned sync_item_alloc = 0;
+
+// bytes of sync messages sent and received by each protocol
+static struct {
+  uint64_t announce_tx, announce_rx;
+  uint64_t rowid_tx, rowid_rx;
+  uint64_t reconcile_tx, reconcile_rx;
+} sync_stats;
+
 void rhizome_sync_status_html(struct strbuf *b, struct subscriber *subscriber)
 {
   if (!subscriber->sync_state)
     return;
   struct rhizome_sync *state=subscriber->sync_state;
+  if (state->reconcile > 0){
+    strbuf_sprintf(b, "Reconciled %u times, %d interesting, %u waiting<br>",
+      state->reconcile_rounds,
+      state->bar_count,
+      state->backlog_count);
+    return;
+  }
   strbuf_sprintf(b, "Seen %"PRId64" BARs [%"PRId64" to %"PRId64" of %"PRId64"], %d interesting<br>",
     state->bars_seen,
     state->sync_start,
@@ -73,28 +168,548 @@ void rhizome_sync_status_html(struct strbuf *b, struct subscriber *subscriber)
     state->bar_count);
 }
 
-static void rhizome_sync_request(struct subscriber *subscriber, uint64_t token, unsigned char forwards)
+void rhizome_sync_stats_json(struct strbuf *b)
+{
+  strbuf_sprintf(b, "{\"bars\":%u,\"announce_tx\":%"PRIu64",\"announce_rx\":%"PRIu64
+      ",\"rowid_tx\":%"PRIu64",\"rowid_rx\":%"PRIu64
+      ",\"reconcile_tx\":%"PRIu64",\"reconcile_rx\":%"PRIu64"}",
+      bar_index_count,
+      sync_stats.announce_tx, sync_stats.announce_rx,
+      sync_stats.rowid_tx, sync_stats.rowid_rx,
+      sync_stats.reconcile_tx, sync_stats.reconcile_rx);
+}
+
+static uint64_t sync_item_hash(const unsigned char *bar)
 {
-  overlay_mdp_frame mdp;
-  bzero(&mdp,sizeof(mdp));
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  int i;
+  for (i = 0; i < RHIZOME_BAR_COMPARE_BYTES; i++){
+    hash ^= bar[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
 
-  mdp.out.src.sid = my_subscriber->sid;
-  mdp.out.src.port=MDP_PORT_RHIZOME_SYNC;
-  mdp.out.dst.sid = subscriber->sid;
-  mdp.out.dst.port=MDP_PORT_RHIZOME_SYNC;
-  mdp.packetTypeAndFlags=MDP_TX;
-  mdp.out.queue=OQ_OPPORTUNISTIC;
+static int sync_item_cmp(const void *a, const void *b)
+{
+  return memcmp(((const struct sync_item *)a)->bar, ((const struct sync_item *)b)->bar, RHIZOME_BAR_COMPARE_BYTES);
+}
 
-  struct overlay_buffer *b = ob_static(mdp.out.payload, sizeof(mdp.out.payload));
+static int grow_array(void *array, unsigned *alloc, unsigned count, size_t size)
+{
+  if (count <= *alloc)
+    return 0;
+  unsigned new_alloc = *alloc ? *alloc : 256;
+  while (new_alloc < count)
+    new_alloc *= 2;
+  void *items = erealloc(*(void **)array, new_alloc * size);
+  if (!items)
+    return -1;
+  *(void **)array = items;
+  *alloc = new_alloc;
+  return 0;
+}
+
+// compare a BAR with a bound, <0 if the BAR is below it
+static int bound_cmp(const unsigned char *bar, const struct sync_bound *bound)
+{
+  if (bound->len == RECONCILE_END)
+    return -1;
+  return memcmp(bar, bound->bytes, bound->len);
+}
+
+// the index of the first BAR at or above a bound
+static unsigned sync_items_find(const struct sync_bound *bound)
+{
+  unsigned lo = 0, hi = sync_item_count;
+  while (lo < hi){
+    unsigned mid = (lo + hi) / 2;
+    if (bound_cmp(sync_items[mid].bar, bound) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// the index of the BAR with the given prefix, or sync_item_count
+static unsigned sync_items_find_prefix(const unsigned char *prefix)
+{
+  struct sync_bound bound;
+  bound.len = RHIZOME_BAR_PREFIX_BYTES;
+  bcopy(prefix, bound.bytes, RHIZOME_BAR_PREFIX_BYTES);
+  unsigned i = sync_items_find(&bound);
+  if (i < sync_item_count && memcmp(sync_items[i].bar, prefix, RHIZOME_BAR_PREFIX_BYTES) == 0)
+    return i;
+  return sync_item_count;
+}
+
+static int sync_items_contains(const unsigned char *bar)
+{
+  struct sync_bound bound;
+  bound.len = RHIZOME_BAR_COMPARE_BYTES;
+  bcopy(bar, bound.bytes, RHIZOME_BAR_COMPARE_BYTES);
+  unsigned i = sync_items_find(&bound);
+  return i < sync_item_count && memcmp(sync_items[i].bar, bar, RHIZOME_BAR_COMPARE_BYTES) == 0;
+}
+
+// the index of the first BAR stored at or after a rowid
+static unsigned bar_index_find(uint64_t rowid)
+{
+  unsigned lo = 0, hi = bar_index_count;
+  while (lo < hi){
+    unsigned mid = (lo + hi) / 2;
+    if (bar_index[mid].rowid < rowid)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void bar_index_remove(const unsigned char *prefix)
+{
+  unsigned i = sync_items_find_prefix(prefix);
+  if (i == sync_item_count)
+    return;
+  uint64_t rowid = sync_items[i].rowid;
+  unsigned j = bar_index_find(rowid);
+  sync_item_count--;
+  memmove(&sync_items[i], &sync_items[i + 1], (sync_item_count - i) * sizeof *sync_items);
+  if (j < bar_index_count && bar_index[j].rowid == rowid){
+    bar_index_count--;
+    memmove(&bar_index[j], &bar_index[j + 1], (bar_index_count - j) * sizeof *bar_index);
+  }
+}
+
+static void bar_index_add(uint64_t rowid, const unsigned char *bar)
+{
+  // a new version replaces the old one
+  bar_index_remove(&bar[RHIZOME_BAR_PREFIX_OFFSET]);
+  unsigned j = bar_index_find(rowid);
+  if (j < bar_index_count && bar_index[j].rowid == rowid){
+    bar_index_remove(&bar_index[j].bar[RHIZOME_BAR_PREFIX_OFFSET]);
+    j = bar_index_find(rowid);
+  }
+  struct sync_bound bound;
+  bound.len = RHIZOME_BAR_COMPARE_BYTES;
+  bcopy(bar, bound.bytes, RHIZOME_BAR_COMPARE_BYTES);
+  unsigned i = sync_items_find(&bound);
+  if (grow_array(&bar_index, &bar_index_alloc, bar_index_count + 1, sizeof *bar_index) == -1
+    || grow_array(&sync_items, &sync_item_alloc, sync_item_count + 1, sizeof *sync_items) == -1)
+    return;
+
+  memmove(&bar_index[j + 1], &bar_index[j], (bar_index_count - j) * sizeof *bar_index);
+  bar_index[j].rowid = rowid;
+  bcopy(bar, bar_index[j].bar, RHIZOME_BAR_BYTES);
+  bar_index_count++;
+
+  memmove(&sync_items[i + 1], &sync_items[i], (sync_item_count - i) * sizeof *sync_items);
+  bcopy(bar, sync_items[i].bar, RHIZOME_BAR_BYTES);
+  sync_items[i].hash = sync_item_hash(bar);
+  sync_items[i].rowid = rowid;
+  sync_item_count++;
+}
+
+/* Read every BAR from the MANIFESTS table, the first time they are needed.  From then on the index
+ * is kept up to date as bundles are stored and deleted by this process, and bar_index_refresh()
+ * picks up any stored by other processes.
+ */
+static void bar_index_load()
+{
+  if (bar_index_loaded)
+    return;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare(&retry, "SELECT rowid, bar FROM manifests ORDER BY rowid");
+  if (!statement)
+    return;
+  bar_index_count = 0;
+  while(sqlite_step_retry(&retry, statement)==SQLITE_ROW){
+    const unsigned char *bar = sqlite3_column_blob(statement, 1);
+    if (sqlite3_column_bytes(statement, 1) != RHIZOME_BAR_BYTES)
+      continue;
+    if (grow_array(&bar_index, &bar_index_alloc, bar_index_count + 1, sizeof *bar_index) == -1)
+      break;
+    bar_index[bar_index_count].rowid = sqlite3_column_int64(statement, 0);
+    bcopy(bar, bar_index[bar_index_count].bar, RHIZOME_BAR_BYTES);
+    bar_index_count++;
+  }
+  sqlite_finalize(statement);
+
+  sync_item_count = 0;
+  if (grow_array(&sync_items, &sync_item_alloc, bar_index_count, sizeof *sync_items) == -1){
+    bar_index_count = 0;
+    return;
+  }
+  unsigned i;
+  for (i = 0; i < bar_index_count; i++){
+    bcopy(bar_index[i].bar, sync_items[i].bar, RHIZOME_BAR_BYTES);
+    sync_items[i].hash = sync_item_hash(bar_index[i].bar);
+    sync_items[i].rowid = bar_index[i].rowid;
+  }
+  sync_item_count = bar_index_count;
+  qsort(sync_items, sync_item_count, sizeof *sync_items, sync_item_cmp);
+  bar_index_loaded = 1;
+
+  // keep only the newest of any BARs that share a prefix
+  for (i = 1; i < sync_item_count; ){
+    if (memcmp(sync_items[i - 1].bar, sync_items[i].bar, RHIZOME_BAR_PREFIX_BYTES) != 0){
+      i++;
+      continue;
+    }
+    unsigned older = sync_items[i - 1].rowid < sync_items[i].rowid ? i - 1 : i;
+    unsigned j = bar_index_find(sync_items[older].rowid);
+    bar_index_count--;
+    memmove(&bar_index[j], &bar_index[j + 1], (bar_index_count - j) * sizeof *bar_index);
+    sync_item_count--;
+    memmove(&sync_items[older], &sync_items[older + 1], (sync_item_count - older) * sizeof *sync_items);
+  }
+  if (config.debug.rhizome)
+    DEBUGF("Loaded %u BARs", bar_index_count);
+}
+
+static uint64_t sync_items_fingerprint(unsigned first, unsigned last)
+{
+  uint64_t fingerprint = 0;
+  unsigned i;
+  for (i = first; i < last; i++)
+    fingerprint += sync_items[i].hash;
+  return fingerprint;
+}
+
+// the shortest bound that is above one BAR and at or below the next
+static void bound_between(struct sync_bound *bound, const unsigned char *below, const unsigned char *above)
+{
+  unsigned char len = 0;
+  while (len < RHIZOME_BAR_COMPARE_BYTES - 1 && below[len] == above[len])
+    len++;
+  bound->len = len + 1;
+  bcopy(above, bound->bytes, bound->len);
+}
+
+static int bound_equal(const struct sync_bound *a, const struct sync_bound *b)
+{
+  return a->len == b->len && (a->len == RECONCILE_END || memcmp(a->bytes, b->bytes, a->len) == 0);
+}
+
+static int bound_length(const struct sync_bound *bound)
+{
+  return 1 + (bound->len == RECONCILE_END ? 0 : bound->len);
+}
+
+static int append_bound(struct overlay_buffer *b, const struct sync_bound *bound)
+{
+  if (ob_append_byte(b, bound->len))
+    return -1;
+  if (bound->len != RECONCILE_END && bound->len > 0 && ob_append_bytes(b, bound->bytes, bound->len))
+    return -1;
+  return 0;
+}
+
+static int get_bound(struct overlay_buffer *b, struct sync_bound *bound)
+{
+  int len = ob_get(b);
+  if (len < 0)
+    return -1;
+  bound->len = len;
+  if (len == RECONCILE_END || len == 0)
+    return 0;
+  if (len > RHIZOME_BAR_COMPARE_BYTES)
+    return -1;
+  return ob_get_bytes(b, bound->bytes, len);
+}
+
+// a MSG_TYPE_RECONCILE message being built for a peer
+struct reconcile_out
+{
+  struct subscriber *dest;
+  struct rhizome_sync *state;
+  struct internal_mdp_header header;
+  struct overlay_buffer *b;
+  // where the message starts, after the port numbers
+  int start;
+  // upper bound of the last range in the message
+  struct sync_bound upper;
+  int ranges;
+  int sent;
+};
+
+static void reconcile_out_init(struct reconcile_out *out, struct subscriber *dest, struct rhizome_sync *state)
+{
+  out->dest = dest;
+  out->state = state;
+  out->b = NULL;
+  out->ranges = 0;
+  out->sent = 0;
+}
+
+static void reconcile_out_begin(struct reconcile_out *out, const struct sync_bound *lower)
+{
+  bzero(&out->header, sizeof out->header);
+  out->header.source = my_subscriber;
+  out->header.source_port = MDP_PORT_RHIZOME_SYNC;
+  out->header.destination = out->dest;
+  out->header.destination_port = MDP_PORT_RHIZOME_SYNC;
+  out->header.queue = OQ_OPPORTUNISTIC;
+  out->b = overlay_mdp_payload(&out->header);
+  if (!out->b)
+    return;
+  out->start = ob_position(out->b);
+  ob_limitsize(out->b, out->start + RECONCILE_PAYLOAD_BYTES);
+  ob_append_byte(out->b, MSG_TYPE_RECONCILE);
+  append_bound(out->b, lower);
+  out->upper = *lower;
+  out->ranges = 0;
+}
+
+// send the message, if it says anything or if the peer is waiting for an answer anyway
+static void reconcile_flush(struct reconcile_out *out, int force)
+{
+  if (!out->b)
+    return;
+  if (out->ranges || force){
+    sync_stats.reconcile_tx += ob_position(out->b) - out->start;
+    out->state->reconcile_last_tx = gettime_ms();
+    if (config.debug.rhizome)
+      DEBUGF("Sending %d ranges to %s to reconcile BARs", out->ranges, alloca_tohex_sid_t(out->dest->sid));
+    overlay_mdp_send_payload(&out->header, out->b);
+    out->sent++;
+  }else
+    ob_free(out->b);
+  out->b = NULL;
+}
+
+/* Append a range to the message, sending it first if the range won't fit.  Fingerprints cover
+ * sync_items[first..last), lists are given by bars[0..count).
+ */
+static int reconcile_append(struct reconcile_out *out, const struct sync_bound *lower, const struct sync_bound *upper,
+  unsigned char mode, unsigned first, unsigned last, const unsigned char **bars, unsigned count)
+{
+  int length = bound_length(upper) + 1 + 5 + (mode == RANGE_FINGERPRINT ? 8 : count * RHIZOME_BAR_BYTES);
+  if (out->b && !bound_equal(&out->upper, lower))
+    length += bound_length(lower) + 1;
+  if (out->b && ob_position(out->b) - out->start + length > RECONCILE_PAYLOAD_BYTES)
+    reconcile_flush(out, 0);
+  if (!out->b)
+    reconcile_out_begin(out, lower);
+  if (!out->b)
+    return -1;
+
+  ob_checkpoint(out->b);
+  int ret = 0;
+  // ranges in a message are contiguous, so skip over any gap since the last one
+  if (!bound_equal(&out->upper, lower))
+    ret = append_bound(out->b, lower) || ob_append_byte(out->b, RANGE_SKIP);
+  if (!ret)
+    ret = append_bound(out->b, upper) || ob_append_byte(out->b, mode);
+  if (!ret && mode == RANGE_FINGERPRINT)
+    ret = ob_append_packed_ui32(out->b, last - first) || ob_append_ui64(out->b, sync_items_fingerprint(first, last));
+  else if (!ret){
+    ret = ob_append_packed_ui32(out->b, count);
+    unsigned i;
+    for (i = 0; !ret && i < count; i++)
+      ret = ob_append_bytes(out->b, bars[i], RHIZOME_BAR_BYTES);
+  }
+  if (ret){
+    ob_rewind(out->b);
+    return -1;
+  }
+  out->upper = *upper;
+  out->ranges++;
+  return 0;
+}
+
+/* Describe our BARs in sync_items[first..last), which lie between lower and upper; with a list if
+ * there are only a few of them, otherwise with the fingerprints of that many branches.
+ */
+static void reconcile_describe(struct reconcile_out *out, const struct sync_bound *lower, const struct sync_bound *upper,
+  unsigned first, unsigned last, unsigned branches)
+{
+  unsigned count = last - first;
+  if (count <= RECONCILE_LIST_MAX){
+    const unsigned char *bars[RECONCILE_LIST_MAX];
+    unsigned i;
+    for (i = 0; i < count; i++)
+      bars[i] = sync_items[first + i].bar;
+    reconcile_append(out, lower, upper, RANGE_BARS, 0, 0, bars, count);
+    return;
+  }
+  if (branches < 2){
+    reconcile_append(out, lower, upper, RANGE_FINGERPRINT, first, last, NULL, 0);
+    return;
+  }
+  struct sync_bound from = *lower, to;
+  unsigned i, start = first;
+  for (i = 1; i <= branches; i++){
+    unsigned end = first + count * i / branches;
+    if (i == branches)
+      to = *upper;
+    else
+      bound_between(&to, sync_items[end - 1].bar, sync_items[end].bar);
+    reconcile_append(out, &from, &to, RANGE_FINGERPRINT, start, end, NULL, 0);
+    from = to;
+    start = end;
+  }
+}
+
+// send our BARs in sync_items[first..last) that weren't in the peer's list
+static void reconcile_send_missing(struct reconcile_out *out, const struct sync_bound *lower, const struct sync_bound *upper,
+  unsigned first, unsigned last, const unsigned char **theirs, unsigned their_count)
+{
+  const unsigned char *bars[RECONCILE_LIST_MAX];
+  struct sync_bound from = *lower, to;
+  unsigned i, j = 0, count = 0;
+  for (i = first; i < last; i++){
+    // both lists are in BAR order
+    while (j < their_count && memcmp(theirs[j], sync_items[i].bar, RHIZOME_BAR_COMPARE_BYTES) < 0)
+      j++;
+    if (j < their_count && memcmp(theirs[j], sync_items[i].bar, RHIZOME_BAR_COMPARE_BYTES) == 0)
+      continue;
+    if (count == RECONCILE_LIST_MAX){
+      bound_between(&to, bars[count - 1], sync_items[i].bar);
+      reconcile_append(out, &from, &to, RANGE_BARS_FINAL, 0, 0, bars, count);
+      from = to;
+      count = 0;
+    }
+    bars[count++] = sync_items[i].bar;
+  }
+  if (count)
+    reconcile_append(out, &from, upper, RANGE_BARS_FINAL, 0, 0, bars, count);
+}
+
+static int sync_bar_queued(struct rhizome_sync *state, const unsigned char *bar)
+{
+  int i;
+  for (i = 0; i < state->bar_count; i++)
+    if (memcmp(state->bars[i].bar, bar, RHIZOME_BAR_COMPARE_BYTES) == 0)
+      return 1;
+  return 0;
+}
+
+static void sync_queue_bar(struct rhizome_sync *state, const unsigned char *bar)
+{
+  bcopy(bar, state->bars[state->bar_count].bar, RHIZOME_BAR_BYTES);
+  state->bars[state->bar_count].next_request = gettime_ms();
+  state->bar_count++;
+}
+
+// remember a BAR the peer has, if we want it
+static void reconcile_learn(struct rhizome_sync *state, const unsigned char *bar)
+{
+  if (sync_items_contains(bar) || sync_bar_queued(state, bar))
+    return;
+  if (rhizome_is_bar_interesting((unsigned char *)bar) == 0)
+    return;
+  if (state->bar_count < CACHE_BARS){
+    sync_queue_bar(state, bar);
+    return;
+  }
+  if (state->backlog_count >= RECONCILE_BACKLOG){
+    state->reconcile_more = 1;
+    return;
+  }
+  if (!state->backlog && !(state->backlog = emalloc(RECONCILE_BACKLOG * RHIZOME_BAR_BYTES)))
+    return;
+  bcopy(bar, &state->backlog[state->backlog_count++ * RHIZOME_BAR_BYTES], RHIZOME_BAR_BYTES);
+}
+
+static void reconcile_refill(struct rhizome_sync *state)
+{
+  while (state->bar_count < CACHE_BARS && state->backlog_count > 0){
+    unsigned char *bar = &state->backlog[--state->backlog_count * RHIZOME_BAR_BYTES];
+    if (!sync_bar_queued(state, bar) && rhizome_is_bar_interesting(bar) != 0)
+      sync_queue_bar(state, bar);
+  }
+}
+
+static void reconcile_round_begin(struct rhizome_sync *state, time_ms_t now)
+{
+  state->reconcile_round = 1;
+  state->reconcile_started = now;
+  state->reconcile_last_rx = state->reconcile_last_tx = now;
+  state->reconcile_more = 0;
+  state->backlog_count = 0;
+}
+
+static void reconcile_start(struct subscriber *subscriber, struct rhizome_sync *state)
+{
+  if (config.debug.rhizome)
+    DEBUGF("Starting to reconcile BARs with %s", alloca_tohex_sid_t(subscriber->sid));
+  reconcile_round_begin(state, gettime_ms());
+  bar_index_load();
+  struct reconcile_out out;
+  reconcile_out_init(&out, subscriber, state);
+  struct sync_bound lower, upper;
+  lower.len = 0;
+  upper.len = RECONCILE_END;
+  reconcile_describe(&out, &lower, &upper, 0, sync_item_count, 1);
+  reconcile_flush(&out, 0);
+}
+
+/* Start, time out and finish rounds of reconciliation with this peer.  Returns 1 while BARs are
+ * synced by reconciliation, or 0 if they should be synced by rowid instead.
+ */
+static int reconcile_tick(struct subscriber *subscriber, struct rhizome_sync *state)
+{
+  if (!config.rhizome.reconcile || state->reconcile < 0)
+    return 0;
+  time_ms_t now = gettime_ms();
+  if (state->reconcile_round){
+    if (state->reconcile == 0){
+      if (now - state->reconcile_started < RECONCILE_TIMEOUT_MS)
+	return 1;
+      state->reconcile = -1;
+      state->reconcile_round = 0;
+      if (config.debug.rhizome)
+	DEBUGF("%s did not answer, syncing BARs by rowid", alloca_tohex_sid_t(subscriber->sid));
+      return 0;
+    }
+    time_ms_t last = state->reconcile_last_rx > state->reconcile_last_tx ? state->reconcile_last_rx : state->reconcile_last_tx;
+    if (now - last < RECONCILE_QUIET_MS)
+      return 1;
+    state->reconcile_round = 0;
+    state->reconcile_rounds++;
+    state->completed = now;
+    if (config.debug.rhizome)
+      DEBUGF("Reconciled BARs with %s, %d interesting, %u waiting", alloca_tohex_sid_t(subscriber->sid), state->bar_count, state->backlog_count);
+  }
+  // the peer with the lower SID starts each round, the other waits in case it doesn't
+  time_ms_t delay = cmp_sid_t(&my_subscriber->sid, &subscriber->sid) < 0 ? 0 : RECONCILE_TIMEOUT_MS;
+  time_ms_t due;
+  if (state->reconcile_more && state->backlog_count == 0 && state->bar_count < CACHE_BARS / 2)
+    due = now;
+  else if (state->reconcile_started == 0)
+    due = state->start_time + delay;
+  else
+    due = state->reconcile_started + RECONCILE_INTERVAL_MS + delay;
+  if (now >= due)
+    reconcile_start(subscriber, state);
+  return 1;
+}
+
+static void rhizome_sync_request(struct subscriber *subscriber, uint64_t token, unsigned char forwards)
+{
+  struct internal_mdp_header header;
+  bzero(&header, sizeof header);
+  header.source = my_subscriber;
+  header.source_port = MDP_PORT_RHIZOME_SYNC;
+  header.destination = subscriber;
+  header.destination_port = MDP_PORT_RHIZOME_SYNC;
+  header.queue = OQ_OPPORTUNISTIC;
+
+  struct overlay_buffer *b = overlay_mdp_payload(&header);
+  if (!b)
+    return;
+  int start = ob_position(b);
   ob_append_byte(b, MSG_TYPE_REQ);
   ob_append_byte(b, forwards);
   ob_append_packed_ui64(b, token);
 
-  mdp.out.payload_length = ob_position(b);
+  sync_stats.rowid_tx += ob_position(b) - start;
   if (config.debug.rhizome)
     DEBUGF("Sending request to %s for BARs from %"PRIu64" %s", alloca_tohex_sid_t(subscriber->sid), token, forwards?"forwards":"backwards");
-  overlay_mdp_dispatch(&mdp,0,NULL,0);
-  ob_free(b);
+  overlay_mdp_send_payload(&header, b);
 }
 
 static void rhizome_sync_send_requests(struct subscriber *subscriber, struct rhizome_sync *state)
@@ -102,9 +717,17 @@ static void rhizome_sync_send_requests(struct subscriber *subscriber, struct rhi
   int i, requests=0;
   time_ms_t now = gettime_ms();
 
+  reconcile_refill(state);
+
   // send requests for manifests that we have room to fetch
-  overlay_mdp_frame mdp;
-  bzero(&mdp,sizeof(mdp));
+  struct internal_mdp_header header;
+  bzero(&header, sizeof header);
+  header.source = my_subscriber;
+  header.source_port = MDP_PORT_RHIZOME_RESPONSE;
+  header.destination = subscriber;
+  header.destination_port = MDP_PORT_RHIZOME_MANIFEST_REQUEST;
+  header.queue = OQ_OPPORTUNISTIC;
+  struct overlay_buffer *b = NULL;
 
   for (i=0;i < state->bar_count;i++){
     if (state->bars[i].next_request > now)
@@ -123,31 +746,31 @@ static void rhizome_sync_send_requests(struct subscriber *subscriber, struct rhi
     int64_t version = rhizome_bar_version(state->bars[i].bar);
     // are we already fetching this bundle [or later]?
     rhizome_manifest *m=rhizome_fetch_search(prefix, RHIZOME_BAR_PREFIX_BYTES);
-    if (m && m->version >= version)
+    if (m && m->version >= version){
+      // this peer can help with the fetch
+      if (m->version == version)
+	rhizome_fetch_add_source(prefix, RHIZOME_BAR_PREFIX_BYTES, version, &subscriber->sid);
       continue;
-
-    if (mdp.out.payload_length==0){
-      mdp.out.src.sid = my_subscriber->sid;
-      mdp.out.src.port=MDP_PORT_RHIZOME_RESPONSE;
-      mdp.out.dst.sid = subscriber->sid;
-      mdp.out.dst.port=MDP_PORT_RHIZOME_MANIFEST_REQUEST;
-      mdp.packetTypeAndFlags=MDP_TX;
-
-      mdp.out.queue=OQ_OPPORTUNISTIC;
     }
-    if (mdp.out.payload_length + RHIZOME_BAR_BYTES>MDP_MTU)
+
+    if (!b && !(b = overlay_mdp_payload(&header)))
+      break;
+    if (ob_append_bytes(b, state->bars[i].bar, RHIZOME_BAR_BYTES))
       break;
     if (config.debug.rhizome)
       DEBUGF("Requesting manifest for BAR %s", alloca_tohex(state->bars[i].bar, RHIZOME_BAR_BYTES));
-    bcopy(state->bars[i].bar, &mdp.out.payload[mdp.out.payload_length], RHIZOME_BAR_BYTES);
-    mdp.out.payload_length+=RHIZOME_BAR_BYTES;
     state->bars[i].next_request = now+1000;
     requests++;
     if (requests>=BARS_PER_RESPONSE)
       break;
   }
-  if (mdp.out.payload_length!=0)
-    overlay_mdp_dispatch(&mdp,0,NULL,0);
+  if (requests)
+    overlay_mdp_send_payload(&header, b);
+  else if (b)
+    ob_free(b);
+
+  if (reconcile_tick(subscriber, state))
+    return;
 
   // send request for more bars if we have room to cache them
   if (state->bar_count >= CACHE_BARS)
@@ -198,12 +821,45 @@ static int sync_bundle_inserted(struct subscriber *subscriber, void *context)
   return 0;
 }
 
-int rhizome_sync_bundle_inserted(const unsigned char *bar)
+int rhizome_sync_bundle_inserted(uint64_t rowid, const unsigned char *bar)
 {
+  if (bar_index_loaded)
+    bar_index_add(rowid, bar);
   enum_subscribers(NULL, sync_bundle_inserted, (void *)bar);
   return 0;
 }
 
+void rhizome_sync_bundle_deleted(const unsigned char *prefix)
+{
+  if (bar_index_loaded)
+    bar_index_remove(prefix);
+}
+
+/* Bundles may also be stored by other processes sharing the database, eg "servald rhizome add file".
+ * Any rows above the newest one we know about are added to the index and announced to our peers.
+ * Bundles deleted by other processes stay in the index until the daemon restarts.
+ */
+static void bar_index_refresh()
+{
+  if (!bar_index_loaded){
+    bar_index_load();
+    return;
+  }
+  uint64_t newest = bar_index_count ? bar_index[bar_index_count - 1].rowid : 0;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare(&retry, "SELECT rowid, bar FROM manifests WHERE rowid > ? ORDER BY rowid");
+  if (!statement)
+    return;
+  sqlite3_bind_int64(statement, 1, newest);
+  while(sqlite_step_retry(&retry, statement)==SQLITE_ROW){
+    const unsigned char *bar = sqlite3_column_blob(statement, 1);
+    if (sqlite3_column_bytes(statement, 1) != RHIZOME_BAR_BYTES)
+      continue;
+    rhizome_sync_bundle_inserted(sqlite3_column_int64(statement, 0), bar);
+  }
+  sqlite_finalize(statement);
+}
+
 static int sync_cache_bar(struct rhizome_sync *state, unsigned char *bar, uint64_t token)
 {
   int ret=0;
@@ -246,6 +902,8 @@ static void sync_process_bar_list(struct subscriber *subscriber, struct rhizome_
   
   if (now - state->start_time > (60*60*1000)){
     // restart rhizome sync every hour, no matter what state it is in
+    if (state->backlog)
+      free(state->backlog);
     bzero(state, sizeof(struct rhizome_sync));
     state->start_time = now;
   }
@@ -338,93 +996,70 @@ static int append_response(struct overlay_buffer *b, uint64_t token, const unsig
   return 0;
 }
 
-static uint64_t max_token=0;
 static void sync_send_response(struct subscriber *dest, int forwards, uint64_t token, int max_count)
 {
   IN();
   if (max_count == 0 || max_count > BARS_PER_RESPONSE)
     max_count = BARS_PER_RESPONSE;
     
-  overlay_mdp_frame mdp;
-  bzero(&mdp,sizeof(mdp));
-
-  mdp.out.src.sid = my_subscriber->sid;
-  mdp.out.src.port=MDP_PORT_RHIZOME_SYNC;
-  mdp.out.dst.port=MDP_PORT_RHIZOME_SYNC;
-  mdp.packetTypeAndFlags=MDP_TX;
-  mdp.out.queue=OQ_OPPORTUNISTIC;
+  struct internal_mdp_header header;
+  bzero(&header, sizeof header);
+  header.source = my_subscriber;
+  header.source_port = MDP_PORT_RHIZOME_SYNC;
+  header.destination = dest;
+  header.destination_port = MDP_PORT_RHIZOME_SYNC;
+  header.queue = OQ_OPPORTUNISTIC;
 
-  if (dest){
-    mdp.out.dst.sid = dest->sid;
-  }else{
-    mdp.out.dst.sid = SID_BROADCAST;
-    mdp.packetTypeAndFlags|=(MDP_NOCRYPT|MDP_NOSIGN);
+  if (!dest){
+    header.crypt_flags = MDP_NOCRYPT|MDP_NOSIGN;
+    header.ttl = 1;
   }
 
-  if (!dest)
-    mdp.out.ttl=1;
-
-  struct overlay_buffer *b = ob_static(mdp.out.payload, sizeof(mdp.out.payload));
+  struct overlay_buffer *b = overlay_mdp_payload(&header);
+  if (!b)
+    RETURNVOID;
+  int start = ob_position(b);
   ob_append_byte(b, MSG_TYPE_BARS);
   ob_checkpoint(b);
 
-  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  sqlite3_stmt *statement;
-  if (forwards){
-    statement = sqlite_prepare(&retry, "SELECT rowid, bar FROM manifests WHERE rowid >= ? ORDER BY rowid ASC");
-  }else{
-    statement = sqlite_prepare(&retry, "SELECT rowid, bar FROM manifests WHERE rowid <= ? ORDER BY rowid DESC");
-  }
-
-  if (!statement)
-    return;
-
-  sqlite3_bind_int64(statement, 1, token);
+  bar_index_load();
   int count=0;
   uint64_t last=0;
+  unsigned i = bar_index_find(forwards ? token : token + 1);
 
-  while(sqlite_step_retry(&retry, statement)==SQLITE_ROW){
-    uint64_t rowid = sqlite3_column_int64(statement, 0);
-    const unsigned char *bar = sqlite3_column_blob(statement, 1);
-    size_t bar_size = sqlite3_column_bytes(statement, 1);
-
-    if (bar_size != RHIZOME_BAR_BYTES)
-      continue;
-
-    if (rowid>max_token){
-      // a new bundle has been imported
-      rhizome_sync_bundle_inserted(bar);
+  while (count < max_count){
+    const struct bar_index_entry *entry;
+    if (forwards){
+      if (i >= bar_index_count)
+	break;
+      entry = &bar_index[i++];
+    }else{
+      if (i == 0)
+	break;
+      entry = &bar_index[--i];
     }
 
-    if (count < max_count){
-      // make sure we include the exact rowid that was requested, even if we just deleted / replaced the manifest
-      if (count==0 && rowid!=token){
-        if (token!=HEAD_FLAG){
-          if (append_response(b, token, NULL))
-	    ob_rewind(b);
-	  else{
-            count++;
-            last = token;
-	  }
-        }else
-          token = rowid;
-      }
-
-      if (append_response(b, rowid, bar))
-	ob_rewind(b);
-      else {
-        last = rowid;
-        count++;
-      }
+    // make sure we include the exact rowid that was requested, even if we just deleted / replaced the manifest
+    if (count==0 && entry->rowid!=token){
+      if (token!=HEAD_FLAG){
+	if (append_response(b, token, NULL))
+	  ob_rewind(b);
+	else{
+	  count++;
+	  last = token;
+	}
+      }else
+	token = entry->rowid;
     }
 
-    if (count >= max_count && rowid <= max_token)
-      break;
+    if (append_response(b, entry->rowid, entry->bar))
+      ob_rewind(b);
+    else {
+      last = entry->rowid;
+      count++;
+    }
   }
 
-  if (token != HEAD_FLAG && token > max_token)
-    max_token = token;
-
   // send a zero lower bound if we reached the end of our manifest list
   if (count && count < max_count && !forwards){
     if (append_response(b, 0, NULL))
@@ -435,23 +1070,83 @@ static void sync_send_response(struct subscriber *dest, int forwards, uint64_t t
     }
   }
 
-  sqlite3_finalize(statement);
-
   if (count){
-    mdp.out.payload_length = ob_position(b);
+    if (dest)
+      sync_stats.rowid_tx += ob_position(b) - start;
+    else
+      sync_stats.announce_tx += ob_position(b) - start;
     if (config.debug.rhizome_ads)
       DEBUGF("Sending %d BARs from %"PRIu64" to %"PRIu64, count, token, last);
-    overlay_mdp_dispatch(&mdp,0,NULL,0);
-  }
-  ob_free(b);
+    overlay_mdp_send_payload(&header, b);
+  }else
+    ob_free(b);
   OUT();
 }
 
+static void sync_process_reconcile(struct subscriber *subscriber, struct rhizome_sync *state, struct overlay_buffer *b)
+{
+  time_ms_t now = gettime_ms();
+  int round_start = !state->reconcile_round;
+  state->reconcile = 1;
+  state->reconcile_last_rx = now;
+  if (round_start)
+    reconcile_round_begin(state, now);
+  bar_index_load();
+
+  struct reconcile_out out;
+  reconcile_out_init(&out, subscriber, state);
+  struct sync_bound lower, upper;
+  if (get_bound(b, &lower) == -1)
+    return;
+  while (ob_remaining(b) > 0){
+    if (get_bound(b, &upper) == -1)
+      break;
+    int mode = ob_get(b);
+    unsigned first = sync_items_find(&lower);
+    unsigned last = sync_items_find(&upper);
+    if (last < first)
+      last = first;
+    if (mode == RANGE_FINGERPRINT){
+      uint32_t count = ob_get_packed_ui32(b);
+      uint64_t fingerprint = ob_get_ui64(b);
+      if (count != last - first || fingerprint != sync_items_fingerprint(first, last))
+	reconcile_describe(&out, &lower, &upper, first, last, RECONCILE_BRANCHES);
+    }else if (mode == RANGE_BARS || mode == RANGE_BARS_FINAL){
+      const unsigned char *theirs[MDP_MTU / RHIZOME_BAR_BYTES];
+      uint32_t count = ob_get_packed_ui32(b);
+      unsigned i, their_count = 0;
+      for (i = 0; i < count; i++){
+	const unsigned char *bar = ob_get_bytes_ptr(b, RHIZOME_BAR_BYTES);
+	if (!bar)
+	  break;
+	reconcile_learn(state, bar);
+	if (their_count < NELS(theirs))
+	  theirs[their_count++] = bar;
+      }
+      if (i < count)
+	break;
+      if (mode == RANGE_BARS){
+	if (last - first <= RECONCILE_LIST_MAX * RECONCILE_BRANCHES)
+	  reconcile_send_missing(&out, &lower, &upper, first, last, theirs, their_count);
+	else
+	  reconcile_describe(&out, &lower, &upper, first, last, RECONCILE_BRANCHES);
+      }
+    }else if (mode != RANGE_SKIP)
+      break;
+    lower = upper;
+  }
+  // answer the first message of a round, even if we have nothing to add, so the peer knows we take part
+  if (round_start && !out.b && !out.sent)
+    reconcile_out_begin(&out, &lower);
+  reconcile_flush(&out, round_start);
+}
+
 int rhizome_sync_announce()
 {
   int (*oldfunc)() = sqlite_set_tracefunc(is_debug_rhizome_ads);
-  sync_send_response(NULL, 0, HEAD_FLAG, 5);
+  bar_index_refresh();
   sqlite_set_tracefunc(oldfunc);
+  sync_send_response(NULL, 0, HEAD_FLAG, 5);
   return 0;
 }
 
@@ -469,9 +1164,20 @@ int overlay_mdp_service_rhizome_sync(struct overlay_frame *frame, overlay_mdp_fr
   int type = ob_get(b);
   switch (type){
     case MSG_TYPE_BARS:
+      if (is_sid_t_broadcast(mdp->out.dst.sid))
+	sync_stats.announce_rx += mdp->out.payload_length;
+      else
+	sync_stats.rowid_rx += mdp->out.payload_length;
       sync_process_bar_list(frame->source, state, b);
       break;
+    case MSG_TYPE_RECONCILE:
+      if (!config.rhizome.reconcile)
+	break;
+      sync_stats.reconcile_rx += mdp->out.payload_length;
+      sync_process_reconcile(frame->source, state, b);
+      break;
     case MSG_TYPE_REQ:
+      sync_stats.rowid_rx += mdp->out.payload_length;
       {
         int forwards = ob_get(b);
         uint64_t token = ob_get_packed_ui64(b);
@@ -704,7 +704,7 @@ void link_neighbour_status_html(struct strbuf *b, struct subscriber *neighbour)
 
 
 static int send_legacy_self_announce_ack(struct neighbour *neighbour, struct link_in *link, time_ms_t now){
-  struct overlay_frame *frame=emalloc_zero(sizeof(struct overlay_frame));
+  struct overlay_frame *frame=op_new();
   frame->type = OF_TYPE_SELFANNOUNCE_ACK;
   frame->ttl = 6;
   frame->destination = neighbour->subscriber;
@@ -786,7 +786,7 @@ static int send_neighbour_link(struct neighbour *n)
     send_legacy_self_announce_ack(n, n->best_link, now);
     n->last_update = now;
   } else {
-    struct overlay_frame *frame=emalloc_zero(sizeof(struct overlay_frame));
+    struct overlay_frame *frame=op_new();
     frame->type=OF_TYPE_DATA;
     frame->source=my_subscriber;
     frame->ttl=1;
@@ -879,7 +879,7 @@ static void link_send(struct sched_ent *alarm)
   // TODO use a separate alarm
   link_send_neighbours();
 
-  struct overlay_frame *frame=emalloc_zero(sizeof(struct overlay_frame));
+  struct overlay_frame *frame=op_new();
   frame->type=OF_TYPE_DATA;
   frame->source=my_subscriber;
   frame->ttl=1;
@@ -368,6 +368,8 @@ extern int overlayMode;
 // This effectively sets the MRU for packet radio interfaces
 // where we have to buffer packets on the receive side
 #define OVERLAY_INTERFACE_RX_BUFFER_SIZE 2048
+// the most UDP packets read or written with one system call
+#define OVERLAY_INTERFACE_BATCH_MAX 16
 // TX buffer must handle FEC encoded and encapsulated data, so needs to be
 // larger.
 #define OVERLAY_INTERFACE_TX_BUFFER_SIZE (2+2048*2)
@@ -452,6 +454,10 @@ struct network_destination {
 
   // Number of milliseconds of no packets until we assume the link is dead.
   unsigned reachable_timeout_ms;
+
+  // queued frames that are waiting to be sent here, oldest first, one list per queue
+  struct packet_destination *queued_first[OQ_MAX];
+  struct packet_destination *queued_last[OQ_MAX];
 };
 
 struct network_destination * new_destination(struct overlay_interface *interface, char encapsulation);
@@ -469,6 +475,16 @@ typedef struct overlay_interface {
   
   int recv_count;
   int tx_count;
+  // system calls made to read and write those packets
+  int recv_calls;
+  int tx_calls;
+  
+  // dgram socket tx state; packets waiting to be sent together by overlay_broadcast_flush()
+  int batch;
+  int tx_batch_count;
+  struct overlay_buffer *tx_batch[OVERLAY_INTERFACE_BATCH_MAX];
+  struct sockaddr_in tx_batch_addr[OVERLAY_INTERFACE_BATCH_MAX];
+  char tx_batch_broadcast[OVERLAY_INTERFACE_BATCH_MAX];
   
   // stream socket tx state;
   struct overlay_buffer *tx_packet;
@@ -581,6 +597,7 @@ int rfs_decode(unsigned char *b,int *offset);
 int overlayServerMode(const struct cli_parsed *parsed);
 int overlay_payload_enqueue(struct overlay_frame *p);
 int overlay_queue_remaining(int queue);
+int overlay_queue_stats_json(struct strbuf *b);
 int overlay_queue_schedule_next(time_ms_t next_allowed_packet);
 int overlay_send_tick_packet(struct network_destination *destination);
 int overlay_queue_ack(struct subscriber *neighbour, struct network_destination *destination, uint32_t ack_mask, int ack_seq);
@@ -675,6 +692,23 @@ int overlay_mdp_reply(int sock,struct sockaddr_un *recvaddr, socklen_t recvaddrl
 int overlay_mdp_dispatch(overlay_mdp_frame *mdp,int userGeneratedFrameP,
 		     struct sockaddr_un *recvaddr, socklen_t recvaddrlen);
 int overlay_mdp_encode_ports(struct overlay_buffer *plaintext, mdp_port_t dst_port, mdp_port_t src_port);
+
+/* Addressing for MDP frames sent from within the daemon, whose payload is built straight into an
+ * overlay_buffer returned by overlay_mdp_payload() */
+struct internal_mdp_header {
+  struct subscriber *source;
+  mdp_port_t source_port;
+  // NULL to broadcast
+  struct subscriber *destination;
+  mdp_port_t destination_port;
+  // zero for the default ttl and queue
+  int ttl;
+  int queue;
+  // MDP_NOCRYPT and / or MDP_NOSIGN
+  int crypt_flags;
+};
+struct overlay_buffer *overlay_mdp_payload(const struct internal_mdp_header *header);
+int overlay_mdp_send_payload(const struct internal_mdp_header *header, struct overlay_buffer *payload);
 int overlay_mdp_dnalookup_reply(const sockaddr_mdp *dstaddr, const sid_t *resolved_sidp, const char *uri, const char *did, const char *name);
 
 struct vomp_call_state;
@@ -702,12 +736,18 @@ overlay_interface * overlay_interface_find(struct in_addr addr, int return_defau
 overlay_interface * overlay_interface_find_name(const char *name);
 int overlay_interface_compare(overlay_interface *one, overlay_interface *two);
 int overlay_broadcast_ensemble(struct network_destination *destination, struct overlay_buffer *buffer);
+void overlay_broadcast_flush();
+int overlay_interface_stats_json(struct strbuf *b);
 void interface_state_html(struct strbuf *b, struct overlay_interface *interface);
 
 int directory_registration();
 int directory_service_init();
 
 int app_nonce_test(const struct cli_parsed *parsed, struct cli_context *context);
+int app_scheduler_test(const struct cli_parsed *parsed, struct cli_context *context);
+int app_rhizome_db_test(const struct cli_parsed *parsed, struct cli_context *context);
+int app_overlay_pool_test(const struct cli_parsed *parsed, struct cli_context *context);
+int app_overlay_queue_test(const struct cli_parsed *parsed, struct cli_context *context);
 int app_rhizome_direct_sync(const struct cli_parsed *parsed, struct cli_context *context);
 int app_monitor_cli(const struct cli_parsed *parsed, struct cli_context *context);
 int app_vomp_console(const struct cli_parsed *parsed, struct cli_context *context);
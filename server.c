@@ -243,6 +243,8 @@ void serverCleanUp()
     unlink(filename);
   }
   
+  if (rhizome_db)
+    rhizome_fetch_suspend_all();
   rhizome_close_db();
   
   dna_helper_shutdown();
@@ -54,6 +54,7 @@ SERVAL_SOURCES = \
 	$(SERVAL_BASE)rhizome_direct_http.c \
 	$(SERVAL_BASE)rhizome_fetch.c \
 	$(SERVAL_BASE)rhizome_http.c \
+	$(SERVAL_BASE)rhizome_merkle.c \
 	$(SERVAL_BASE)rhizome_packetformats.c \
 	$(SERVAL_BASE)rhizome_store.c \
 	$(SERVAL_BASE)rhizome_sync.c \
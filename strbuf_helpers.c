@@ -414,6 +414,30 @@ strbuf strbuf_append_quoted_string(strbuf sb, const char *str)
   return sb;
 }
 
+strbuf strbuf_json_string(strbuf sb, const char *str)
+{
+  strbuf_putc(sb, '"');
+  for (; *str; ++str) {
+    switch (*str) {
+    case '"':  strbuf_puts(sb, "\\\""); break;
+    case '\\': strbuf_puts(sb, "\\\\"); break;
+    case '\b': strbuf_puts(sb, "\\b"); break;
+    case '\f': strbuf_puts(sb, "\\f"); break;
+    case '\n': strbuf_puts(sb, "\\n"); break;
+    case '\r': strbuf_puts(sb, "\\r"); break;
+    case '\t': strbuf_puts(sb, "\\t"); break;
+    default:
+      if ((unsigned char)*str < ' ')
+	strbuf_sprintf(sb, "\\u%04X", (unsigned char)*str);
+      else
+	strbuf_putc(sb, *str);
+      break;
+    }
+  }
+  strbuf_putc(sb, '"');
+  return sb;
+}
+
 strbuf strbuf_append_http_ranges(strbuf sb, const struct http_range *ranges, unsigned nels)
 {
   unsigned i;
@@ -151,6 +151,11 @@ strbuf strbuf_append_iovec(strbuf sb, const struct iovec *iov, int iovcnt);
  */
 strbuf strbuf_append_quoted_string(strbuf sb, const char *str);
 
+/* Append a string as a JSON string literal: delimited by double quotes (") with
+ * internal double quotes, backslashes and control characters escaped.
+ */
+strbuf strbuf_json_string(strbuf sb, const char *str);
+
 /* Append a representation of a struct http_range[] array.
  * @author Andrew Bettison <andrew@servalproject.com>
  */
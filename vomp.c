@@ -30,6 +30,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "strbuf.h"
 #include "strlcpy.h"
 #include "overlay_address.h"
+#include "overlay_buffer.h"
 
 /*
  Typical call state lifecycle between 2 parties.
@@ -461,26 +462,28 @@ static struct vomp_call_state *vomp_find_or_create_call(struct subscriber *remot
   return NULL;
 }
 
-static void prepare_vomp_header(struct vomp_call_state *call, overlay_mdp_frame *mdp){
-  mdp->packetTypeAndFlags=MDP_TX;
-  mdp->out.src.sid = call->local.subscriber->sid;
-  mdp->out.src.port=MDP_PORT_VOMP;
-  mdp->out.dst.sid = call->remote.subscriber->sid;
-  mdp->out.dst.port=MDP_PORT_VOMP;
-  
-  mdp->out.payload[0]=VOMP_VERSION;
-  mdp->out.payload[1]=(call->local.session>>8)&0xff;
-  mdp->out.payload[2]=(call->local.session>>0)&0xff;
-  mdp->out.payload[3]=(call->remote.session>>8)&0xff;
-  mdp->out.payload[4]=(call->remote.session>>0)&0xff;
-  mdp->out.payload[5]=(call->remote.state<<4)|call->local.state;
-  mdp->out.payload_length=6;
+static struct overlay_buffer *prepare_vomp_header(struct vomp_call_state *call, struct internal_mdp_header *header, int queue){
+  bzero(header, sizeof *header);
+  header->source = call->local.subscriber;
+  header->source_port = MDP_PORT_VOMP;
+  header->destination = call->remote.subscriber;
+  header->destination_port = MDP_PORT_VOMP;
+  header->queue = queue;
+  
+  struct overlay_buffer *payload = overlay_mdp_payload(header);
+  if (!payload)
+    return NULL;
+  ob_append_byte(payload, VOMP_VERSION);
+  ob_append_ui16(payload, call->local.session);
+  ob_append_ui16(payload, call->remote.session);
+  ob_append_byte(payload, (call->remote.state<<4)|call->local.state);
   
   // keep trying to punch a NAT tunnel for 10s
   // note that requests are rate limited internally to one packet per second
   time_ms_t now = gettime_ms();
   if (call->local.state < VOMP_STATE_CALLENDED && call->create_time + 10000 >now)
     overlay_send_stun_request(directory_service, call->remote.subscriber);
+  return payload;
 }
 
 /* send updated call status to end-point and to any interested listeners as
@@ -488,14 +491,11 @@ static void prepare_vomp_header(struct vomp_call_state *call, overlay_mdp_frame
 
 static int vomp_send_status_remote(struct vomp_call_state *call)
 {
-  overlay_mdp_frame mdp;
-  unsigned short  *len=&mdp.out.payload_length;
-  
-  bzero(&mdp,sizeof(mdp));
-  prepare_vomp_header(call, &mdp);
-  mdp.out.queue=OQ_ORDINARY;
+  struct internal_mdp_header header;
+  struct overlay_buffer *payload = prepare_vomp_header(call, &header, OQ_ORDINARY);
+  if (!payload)
+    return -1;
   if (call->local.state < VOMP_STATE_RINGINGOUT && call->remote.state < VOMP_STATE_RINGINGOUT) {
-    int didLen;
     unsigned char codecs[CODEC_FLAGS_LENGTH];
     
     /* Include the list of supported codecs */
@@ -504,26 +504,24 @@ static int vomp_send_status_remote(struct vomp_call_state *call)
     int i;
     for (i = 0; i < 256; ++i)
       if (is_codec_set(i,codecs)) {
-	mdp.out.payload[(*len)++]=i;
+	ob_append_byte(payload, i);
       }
-    mdp.out.payload[(*len)++]=0;
+    ob_append_byte(payload, 0);
     
     /* Include src and dst phone numbers */
     if (call->initiated_call){
       DEBUGF("Sending phone numbers %s, %s",call->local.did,call->remote.did);
-      didLen = snprintf((char *)(mdp.out.payload + *len), sizeof(mdp.out.payload) - *len, "%s", call->local.did);
-      *len+=didLen+1;
-      didLen = snprintf((char *)(mdp.out.payload + *len), sizeof(mdp.out.payload) - *len, "%s", call->remote.did);
-      *len+=didLen+1;
+      ob_append_bytes(payload, (unsigned char *)call->local.did, strlen(call->local.did)+1);
+      ob_append_bytes(payload, (unsigned char *)call->remote.did, strlen(call->remote.did)+1);
     }
     
     if (config.debug.vomp)
-      DEBUGF("mdp frame with codec list is %d bytes", mdp.out.payload_length);
+      DEBUGF("mdp frame with codec list is %d bytes", ob_position(payload));
   }
 
   call->local.sequence++;
   
-  overlay_mdp_dispatch(&mdp,0,NULL,0);
+  overlay_mdp_send_payload(&header, payload);
   
   return 0;
 }
@@ -543,25 +541,21 @@ int vomp_received_audio(struct vomp_call_state *call, int audio_codec, int time,
   if (sequence==-1)
     sequence = call->local.sequence++;
   
-  overlay_mdp_frame mdp;
-  unsigned short  *len=&mdp.out.payload_length;
-  
-  bzero(&mdp,sizeof(mdp));
-  prepare_vomp_header(call, &mdp);
+  struct internal_mdp_header header;
+  struct overlay_buffer *payload = prepare_vomp_header(call, &header, OQ_ISOCHRONOUS_VOICE);
+  if (!payload)
+    return -1;
   
-  mdp.out.payload[(*len)++]=audio_codec;
+  ob_append_byte(payload, audio_codec);
   time = time / 20;
-  mdp.out.payload[(*len)++]=(time>>8)&0xff;
-  mdp.out.payload[(*len)++]=(time>>0)&0xff;
-  mdp.out.payload[(*len)++]=(sequence>>8)&0xff;
-  mdp.out.payload[(*len)++]=(sequence>>0)&0xff;
-  
-  bcopy(audio,&mdp.out.payload[(*len)],audio_length);
-  (*len)+=audio_length;
-    
-  mdp.out.queue=OQ_ISOCHRONOUS_VOICE;
+  ob_append_ui16(payload, time);
+  ob_append_ui16(payload, sequence);
+  if (ob_append_bytes(payload, audio, audio_length)){
+    ob_free(payload);
+    return -1;
+  }
   
-  overlay_mdp_dispatch(&mdp,0,NULL,0);
+  overlay_mdp_send_payload(&header, payload);
   
   return 0;
 }
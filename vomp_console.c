@@ -289,9 +289,8 @@ static void console_command(char *line){
 
 static void read_lines(struct sched_ent *alarm){
   struct line_state *state=(struct line_state *)alarm;
-  set_nonblock(STDIN_FILENO);
+  // the main loop calls this with the descriptor non-blocking
   int bytes = read(state->alarm.poll.fd, state->line_buff + state->line_pos, sizeof(state->line_buff) - state->line_pos);
-  set_block(STDIN_FILENO);
   int i = state->line_pos;
   int processed=0;
   state->line_pos+=bytes;